@@ -23,13 +23,15 @@
 #include <pipewire/pipewire.h>
 #include <spa/param/audio/raw-utils.h>
 #include <spa/utils/result.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-#include "buffer_queue.h"
+#include "audio_encode.h"
+#include "ring_buffer.h"
 #include "toolbox/utils.h"
 
 #define STATUS_OK 0
@@ -41,7 +43,11 @@ struct AudioContext {
   void* user;
 
   int waker[2];
-  struct BufferQueue* buffer_queue;
+  struct RingBuffer* ring_buffer;
+  atomic_size_t dropped_size;
+  struct AudioEncoder* audio_encoder;
+  void* buffer;
+  size_t buffer_size;
   struct pw_thread_loop* pw_thread_loop;
   struct pw_stream* pw_stream;
 };
@@ -183,16 +189,12 @@ static void OnStreamProcess(void* data) {
     const void* buffer = (const uint8_t*)spa_data->data +
                          spa_data->chunk->offset % spa_data->maxsize;
     uint32_t size = MIN(spa_data->chunk->size, spa_data->maxsize);
-    struct BufferQueueItem* buffer_queue_item =
-        BufferQueueItemCreate(buffer, size);
-    if (!buffer_queue_item) {
-      LOG("Failed to copy stream buffer");
-      goto failure;
-    }
-    if (!BufferQueueQueue(audio_context->buffer_queue, buffer_queue_item)) {
-      LOG("Failed to queue stream buffer copy");
-      BufferQueueItemDestroy(buffer_queue_item);
-      goto failure;
+    if (!RingBufferWrite(audio_context->ring_buffer, buffer, size)) {
+      // mburakov: Main thread did not drain the ring for a whole second. Drop
+      // the complete period, so that the stream stays aligned to frames.
+      // Logging is not realtime-safe, so it is left to the main thread.
+      atomic_fetch_add_explicit(&audio_context->dropped_size, size,
+                                memory_order_relaxed);
     }
   }
 
@@ -206,8 +208,8 @@ failure:
 }
 
 struct AudioContext* AudioContextCreate(
-    const char* audio_config, const struct AudioContextCallbacks* callbacks,
-    void* user) {
+    const char* audio_config, const char* opus_config,
+    const struct AudioContextCallbacks* callbacks, void* user) {
   const char* channel_map;
   struct spa_audio_info_raw audio_info;
   if (!ParseAudioConfig(audio_config, &channel_map, &audio_info)) {
@@ -228,21 +230,39 @@ struct AudioContext* AudioContextCreate(
       .user = user,
   };
 
+  atomic_init(&audio_context->dropped_size, 0);
   if (pipe(audio_context->waker)) {
     LOG("Failed to create pipe (%s)", strerror(errno));
     goto rollback_audio_context;
   }
 
-  audio_context->buffer_queue = BufferQueueCreate();
-  if (!audio_context->buffer_queue) {
-    LOG("Failed to create buffer queue (%s)", strerror(errno));
+  audio_context->ring_buffer =
+      RingBufferCreate(audio_context->one_second_size);
+  if (!audio_context->ring_buffer) {
+    LOG("Failed to create ring buffer (%s)", strerror(errno));
     goto rollback_waker;
   }
 
+  audio_context->buffer =
+      malloc(RingBufferGetCapacity(audio_context->ring_buffer));
+  if (!audio_context->buffer) {
+    LOG("Failed to allocate audio buffer (%s)", strerror(errno));
+    goto rollback_ring_buffer;
+  }
+
+  if (opus_config) {
+    audio_context->audio_encoder = AudioEncoderCreate(
+        opus_config, audio_info.rate, audio_info.channels);
+    if (!audio_context->audio_encoder) {
+      LOG("Failed to create audio encoder");
+      goto rollback_buffer;
+    }
+  }
+
   audio_context->pw_thread_loop = pw_thread_loop_new("audio-capture", NULL);
   if (!audio_context->pw_thread_loop) {
     LOG("Failed to create pipewire thread loop");
-    goto rollback_buffer_queue;
+    goto rollback_audio_encoder;
   }
 
   pw_thread_loop_lock(audio_context->pw_thread_loop);
@@ -305,8 +325,13 @@ struct AudioContext* AudioContextCreate(
 
 rollback_thread_loop:
   pw_thread_loop_destroy(audio_context->pw_thread_loop);
-rollback_buffer_queue:
-  BufferQueueDestroy(audio_context->buffer_queue);
+rollback_audio_encoder:
+  if (audio_context->audio_encoder)
+    AudioEncoderDestroy(audio_context->audio_encoder);
+rollback_buffer:
+  free(audio_context->buffer);
+rollback_ring_buffer:
+  RingBufferDestroy(audio_context->ring_buffer);
 rollback_waker:
   close(audio_context->waker[1]);
   close(audio_context->waker[0]);
@@ -320,6 +345,32 @@ int AudioContextGetEventsFd(struct AudioContext* audio_context) {
   return audio_context->waker[0];
 }
 
+static bool EncodeAudio(struct AudioContext* audio_context,
+                        struct AudioEncoder* audio_encoder) {
+  // mburakov: Opus consumes fixed-size frames, while pipewire periods are
+  // arbitrary. Accumulate samples across wakeups until a frame is complete.
+  size_t frame_size = AudioEncoderGetFrameSize(audio_encoder);
+  for (;;) {
+    audio_context->buffer_size += RingBufferRead(
+        audio_context->ring_buffer,
+        (uint8_t*)audio_context->buffer + audio_context->buffer_size,
+        frame_size - audio_context->buffer_size);
+    if (audio_context->buffer_size < frame_size) return true;
+    audio_context->buffer_size = 0;
+
+    size_t size;
+    const void* packet =
+        AudioEncoderEncode(audio_encoder, audio_context->buffer, &size);
+    if (!packet) {
+      LOG("Failed to encode audio frame");
+      return false;
+    }
+    audio_context->callbacks->OnAudioReady(
+        audio_context->user, packet, size,
+        AudioEncoderGetFrameDuration(audio_encoder));
+  }
+}
+
 bool AudioContextProcessEvents(struct AudioContext* audio_context) {
   char status;
   if (read(audio_context->waker[0], &status, sizeof(status)) !=
@@ -338,18 +389,24 @@ bool AudioContextProcessEvents(struct AudioContext* audio_context) {
       __builtin_unreachable();
   }
 
-  for (;;) {
-    struct BufferQueueItem* buffer_queue_item;
-    if (!BufferQueueDequeue(audio_context->buffer_queue, &buffer_queue_item)) {
-      LOG("Failed to dequeue stream buffer copy");
-      return false;
-    }
-    if (!buffer_queue_item) return true;
-    audio_context->callbacks->OnAudioReady(
-        audio_context->user, buffer_queue_item->data, buffer_queue_item->size,
-        buffer_queue_item->size * 1000000 / audio_context->one_second_size);
-    BufferQueueItemDestroy(buffer_queue_item);
-  }
+  size_t dropped_size = atomic_exchange_explicit(&audio_context->dropped_size,
+                                                 0, memory_order_relaxed);
+  if (dropped_size)
+    LOG("Audio ring buffer overflow, dropped %zu bytes", dropped_size);
+
+  if (audio_context->audio_encoder)
+    return EncodeAudio(audio_context, audio_context->audio_encoder);
+
+  // mburakov: Audio thread wakes main thread once per period, so there might
+  // be nothing left if the previous wakeup already drained everything.
+  size_t size =
+      RingBufferRead(audio_context->ring_buffer, audio_context->buffer,
+                     RingBufferGetCapacity(audio_context->ring_buffer));
+  if (!size) return true;
+  audio_context->callbacks->OnAudioReady(
+      audio_context->user, audio_context->buffer, size,
+      size * 1000000 / audio_context->one_second_size);
+  return true;
 }
 
 void AudioContextDestroy(struct AudioContext* audio_context) {
@@ -357,7 +414,10 @@ void AudioContextDestroy(struct AudioContext* audio_context) {
   pw_stream_destroy(audio_context->pw_stream);
   pw_thread_loop_unlock(audio_context->pw_thread_loop);
   pw_thread_loop_destroy(audio_context->pw_thread_loop);
-  BufferQueueDestroy(audio_context->buffer_queue);
+  if (audio_context->audio_encoder)
+    AudioEncoderDestroy(audio_context->audio_encoder);
+  free(audio_context->buffer);
+  RingBufferDestroy(audio_context->ring_buffer);
   close(audio_context->waker[1]);
   close(audio_context->waker[0]);
   free(audio_context);
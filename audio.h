@@ -30,8 +30,8 @@ struct AudioContextCallbacks {
 
 #ifdef USE_PIPEWIRE
 struct AudioContext* AudioContextCreate(
-    const char* audio_config, const struct AudioContextCallbacks* callbacks,
-    void* user);
+    const char* audio_config, const char* opus_config,
+    const struct AudioContextCallbacks* callbacks, void* user);
 int AudioContextGetEventsFd(struct AudioContext* audio_context);
 bool AudioContextProcessEvents(struct AudioContext* audio_context);
 void AudioContextDestroy(struct AudioContext* audio_context);
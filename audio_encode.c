@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef USE_OPUS
+
+#include "audio_encode.h"
+
+#include <errno.h>
+#include <opus.h>
+#include <opus_multistream.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "toolbox/utils.h"
+
+// mburakov: Opus does not specify any limit for multistream packets, but
+// recommends 1275 bytes per stream plus framing overhead.
+#define MAX_STREAM_PACKET_SIZE 1280
+
+struct AudioEncoder {
+  size_t frame_samples;
+  size_t frame_size;
+  size_t frame_duration;
+  OpusMSEncoder* opus_encoder;
+  size_t packet_size;
+  uint8_t packet[];
+};
+
+static bool ParseOpusConfig(const char* opus_config, opus_int32* out_bitrate,
+                            size_t* out_duration) {
+  int bitrate = atoi(opus_config);
+  if (bitrate < 500 || bitrate > 512000) {
+    LOG("Invalid opus bitrate requested");
+    return false;
+  }
+  const char* duration = strchr(opus_config, ':');
+  if (!duration) {
+    LOG("Invalid opus config requested");
+    return false;
+  }
+
+  static const struct {
+    const char* name;
+    size_t value;
+  } kDurations[] = {
+      {"2.5", 2500},
+      {"5", 5000},
+      {"10", 10000},
+      {"20", 20000},
+  };
+  for (size_t i = 0; i < LENGTH(kDurations); i++) {
+    if (!strcmp(kDurations[i].name, duration + 1)) {
+      *out_bitrate = bitrate;
+      *out_duration = kDurations[i].value;
+      return true;
+    }
+  }
+  LOG("Invalid opus frame duration requested");
+  return false;
+}
+
+struct AudioEncoder* AudioEncoderCreate(const char* opus_config, uint32_t rate,
+                                        uint32_t channels) {
+  opus_int32 bitrate;
+  size_t frame_duration;
+  if (!ParseOpusConfig(opus_config, &bitrate, &frame_duration)) {
+    LOG("Failed to parse opus config argument");
+    return NULL;
+  }
+  if (rate != 48000) {
+    // mburakov: Opus does not support 44100, and the other rates it supports
+    // are not accepted by audio context anyway.
+    LOG("Opus requires 48000 sample rate");
+    return NULL;
+  }
+
+  // mburakov: Channels are paired in the order they are configured, so the
+  // client can reconstruct the mapping from the channels count alone.
+  int coupled_streams = (int)channels / 2;
+  int streams = (int)channels - coupled_streams;
+  unsigned char mapping[256];
+  for (uint32_t i = 0; i < channels; i++) mapping[i] = (unsigned char)i;
+
+  size_t packet_size = (size_t)streams * MAX_STREAM_PACKET_SIZE;
+  struct AudioEncoder* audio_encoder =
+      malloc(sizeof(struct AudioEncoder) + packet_size);
+  if (!audio_encoder) {
+    LOG("Failed to allocate audio encoder (%s)", strerror(errno));
+    return NULL;
+  }
+  size_t frame_samples = rate * frame_duration / 1000000;
+  *audio_encoder = (struct AudioEncoder){
+      .frame_samples = frame_samples,
+      .frame_size = frame_samples * channels * sizeof(int16_t),
+      .frame_duration = frame_duration,
+      .packet_size = packet_size,
+  };
+
+  int error;
+  audio_encoder->opus_encoder = opus_multistream_encoder_create(
+      (opus_int32)rate, (int)channels, streams, coupled_streams, mapping,
+      OPUS_APPLICATION_RESTRICTED_LOWDELAY, &error);
+  if (!audio_encoder->opus_encoder) {
+    LOG("Failed to create opus encoder (%s)", opus_strerror(error));
+    goto rollback_audio_encoder;
+  }
+  error = opus_multistream_encoder_ctl(audio_encoder->opus_encoder,
+                                       OPUS_SET_BITRATE(bitrate));
+  if (error != OPUS_OK) {
+    LOG("Failed to set opus bitrate (%s)", opus_strerror(error));
+    goto rollback_opus_encoder;
+  }
+
+  LOG("Opus bitrate: %d, frame duration: %zu us", bitrate, frame_duration);
+  return audio_encoder;
+
+rollback_opus_encoder:
+  opus_multistream_encoder_destroy(audio_encoder->opus_encoder);
+rollback_audio_encoder:
+  free(audio_encoder);
+  return NULL;
+}
+
+size_t AudioEncoderGetFrameSize(const struct AudioEncoder* audio_encoder) {
+  return audio_encoder->frame_size;
+}
+
+size_t AudioEncoderGetFrameDuration(const struct AudioEncoder* audio_encoder) {
+  return audio_encoder->frame_duration;
+}
+
+const void* AudioEncoderEncode(struct AudioEncoder* audio_encoder,
+                               const void* buffer, size_t* size) {
+  opus_int32 result = opus_multistream_encode(
+      audio_encoder->opus_encoder, buffer, (int)audio_encoder->frame_samples,
+      audio_encoder->packet, (opus_int32)audio_encoder->packet_size);
+  if (result < 0) {
+    LOG("Failed to encode opus frame (%s)", opus_strerror(result));
+    return NULL;
+  }
+  *size = (size_t)result;
+  return audio_encoder->packet;
+}
+
+void AudioEncoderDestroy(struct AudioEncoder* audio_encoder) {
+  opus_multistream_encoder_destroy(audio_encoder->opus_encoder);
+  free(audio_encoder);
+}
+
+#endif  // USE_OPUS
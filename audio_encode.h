@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_AUDIO_ENCODE_H_
+#define STREAMER_AUDIO_ENCODE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct AudioEncoder;
+
+#ifdef USE_OPUS
+struct AudioEncoder* AudioEncoderCreate(const char* opus_config, uint32_t rate,
+                                        uint32_t channels);
+size_t AudioEncoderGetFrameSize(const struct AudioEncoder* audio_encoder);
+size_t AudioEncoderGetFrameDuration(const struct AudioEncoder* audio_encoder);
+const void* AudioEncoderEncode(struct AudioEncoder* audio_encoder,
+                               const void* buffer, size_t* size);
+void AudioEncoderDestroy(struct AudioEncoder* audio_encoder);
+#else  // USE_OPUS
+#define AudioEncoderCreate(...) NULL
+#define AudioEncoderGetFrameSize(...) 0
+#define AudioEncoderGetFrameDuration(...) 0
+#define AudioEncoderEncode(...) NULL
+#define AudioEncoderDestroy(...)
+#endif  // USE_OPUS
+
+#endif  // STREAMER_AUDIO_ENCODE_H_
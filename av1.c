@@ -0,0 +1,471 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "av1.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitstream.h"
+
+// mburakov: Below entries are hardcoded by ffmpeg:
+static const bool reduced_still_picture_header = 0;
+static const bool timing_info_present_flag = 0;
+static const bool initial_display_delay_present_flag = 0;
+static const uint8_t operating_points_cnt_minus_1 = 0;
+static const uint16_t operating_point_idc = 0;
+static const bool frame_id_numbers_present_flag = 0;
+static const bool seq_choose_screen_content_tools = 0;
+static const uint8_t seq_force_screen_content_tools = 0;
+static const bool film_grain_params_present = 0;
+static const bool show_existing_frame = 0;
+static const bool show_frame = 1;
+static const bool frame_size_override_flag = 0;
+static const bool frame_refs_short_signaling = 0;
+static const bool render_and_frame_size_different = 0;
+static const bool is_motion_mode_switchable = 1;
+static const bool uniform_tile_spacing_flag = 1;
+static const bool segmentation_enabled = 0;
+
+// mburakov: Below entries are defaulted by ffmpeg:
+static const uint8_t chroma_sample_position = 0;  // CSP_UNKNOWN
+static const bool separate_uv_delta_q = 0;
+static const bool allow_warped_motion = 0;
+static const bool is_global = 0;
+
+// Section 3 constants
+#define REFS_PER_FRAME 7
+#define MAX_TILE_WIDTH 4096
+#define MAX_TILE_AREA (4096 * 2304)
+#define MAX_TILE_ROWS 64
+#define MAX_TILE_COLS 64
+#define SWITCHABLE 4
+#define TX_MODE_SELECT 2
+
+// 5.9.15 Tile info syntax, tile_log2 function
+static uint32_t TileLog2(uint32_t blk_size, uint32_t target) {
+  uint32_t k = 0;
+  while ((blk_size << k) < target) k++;
+  return k;
+}
+
+// 5.3.1 General OBU syntax
+static void PackObu(struct Bitstream* bitstream, enum Av1ObuType obu_type,
+                    const struct Bitstream* payload, size_t obu_size_length) {
+  BitstreamAppend(bitstream, 1, 0);  // obu_forbidden_bit
+  BitstreamAppend(bitstream, 4, obu_type);
+  BitstreamAppend(bitstream, 1, 0);  // obu_extension_flag
+  BitstreamAppend(bitstream, 1, 1);  // obu_has_size_field
+  BitstreamAppend(bitstream, 1, 0);  // obu_reserved_1bit
+
+  // mburakov: Zero length stands for the shortest leb128 encoding, otherwise
+  // the value is padded with continuation bits up to the requested length.
+  size_t obu_size = payload->size / 8;
+  if (!obu_size_length) {
+    do obu_size_length++;
+    while (obu_size >> (obu_size_length * 7));
+  }
+  for (size_t i = 0; i < obu_size_length; i++) {
+    BitstreamAppend(bitstream, 1, i + 1 < obu_size_length);
+    BitstreamAppend(bitstream, 7, (uint32_t)(obu_size >> (i * 7)));
+  }
+
+  // mburakov: Unlike H.26x, there are no start codes in AV1, so the payload
+  // does not need emulation prevention, and is copied as is.
+  memcpy((uint8_t*)bitstream->data + bitstream->size / 8, payload->data,
+         obu_size);
+  bitstream->size += obu_size * 8;
+}
+
+// 5.3.4 Trailing bits syntax
+static void PackTrailingBits(struct Bitstream* bitstream) {
+  BitstreamAppend(bitstream, 1, 1);  // trailing_one_bit
+  BitstreamByteAlign(bitstream);     // trailing_zero_bit
+}
+
+// 5.5.2 Color config syntax
+static void PackColorConfig(struct Bitstream* bitstream,
+                            const VAEncSequenceParameterBufferAV1* seq,
+                            const struct MoreAv1SeqParameters* msp) {
+  const typeof(seq->seq_fields.bits)* seq_bits = &seq->seq_fields.bits;
+
+  BitstreamAppend(bitstream, 1, seq_bits->bit_depth_minus8 > 0);
+  if (seq->seq_profile == 2 && seq_bits->bit_depth_minus8 > 0) {
+    // TODO(mburakov): Implement this!
+    abort();
+  }
+  if (seq->seq_profile != 1)
+    BitstreamAppend(bitstream, 1, seq_bits->mono_chrome);
+  BitstreamAppend(bitstream, 1, msp->color_description_present_flag);
+  if (msp->color_description_present_flag) {
+    BitstreamAppend(bitstream, 8, msp->color_primaries);
+    BitstreamAppend(bitstream, 8, msp->transfer_characteristics);
+    BitstreamAppend(bitstream, 8, msp->matrix_coefficients);
+  }
+
+  if (seq_bits->mono_chrome) {
+    // TODO(mburakov): Implement this!
+    abort();
+  }
+  if (msp->color_primaries == 1 && msp->transfer_characteristics == 13 &&
+      msp->matrix_coefficients == 0) {
+    // TODO(mburakov): Implement this!
+    abort();
+  }
+
+  BitstreamAppend(bitstream, 1, msp->color_range);
+  if (seq->seq_profile != 0) {
+    // TODO(mburakov): Implement this!
+    abort();
+  }
+  BitstreamAppend(bitstream, 2, chroma_sample_position);
+  BitstreamAppend(bitstream, 1, separate_uv_delta_q);
+}
+
+// 5.5.1 General sequence header OBU syntax
+void PackAv1SequenceHeaderObu(struct Bitstream* bitstream,
+                              const VAEncSequenceParameterBufferAV1* seq,
+                              const struct MoreAv1SeqParameters* msp) {
+  const typeof(seq->seq_fields.bits)* seq_bits = &seq->seq_fields.bits;
+
+  char buffer_on_the_stack[64];
+  struct Bitstream obu = {
+      .data = buffer_on_the_stack,
+      .size = 0,
+  };
+
+  BitstreamAppend(&obu, 3, seq->seq_profile);
+  BitstreamAppend(&obu, 1, seq_bits->still_picture);
+  BitstreamAppend(&obu, 1, reduced_still_picture_header);
+  if (reduced_still_picture_header) {
+    // TODO(mburakov): Implement this!
+    abort();
+  }
+
+  BitstreamAppend(&obu, 1, timing_info_present_flag);
+  if (timing_info_present_flag) {
+    // TODO(mburakov): Implement this!
+    abort();
+  }
+  BitstreamAppend(&obu, 1, initial_display_delay_present_flag);
+  BitstreamAppend(&obu, 5, operating_points_cnt_minus_1);
+  for (uint8_t i = 0; i <= operating_points_cnt_minus_1; i++) {
+    BitstreamAppend(&obu, 12, operating_point_idc);
+    BitstreamAppend(&obu, 5, seq->seq_level_idx);
+    if (seq->seq_level_idx > 7) BitstreamAppend(&obu, 1, seq->seq_tier);
+  }
+
+  uint8_t frame_width_bits =
+      32 - (uint8_t)__builtin_clz(msp->max_frame_width_minus_1 | 1u);
+  uint8_t frame_height_bits =
+      32 - (uint8_t)__builtin_clz(msp->max_frame_height_minus_1 | 1u);
+  BitstreamAppend(&obu, 4, frame_width_bits - 1u);
+  BitstreamAppend(&obu, 4, frame_height_bits - 1u);
+  BitstreamAppend(&obu, frame_width_bits, msp->max_frame_width_minus_1);
+  BitstreamAppend(&obu, frame_height_bits, msp->max_frame_height_minus_1);
+  BitstreamAppend(&obu, 1, frame_id_numbers_present_flag);
+  if (frame_id_numbers_present_flag) {
+    // TODO(mburakov): Implement this!
+    abort();
+  }
+
+  BitstreamAppend(&obu, 1, seq_bits->use_128x128_superblock);
+  BitstreamAppend(&obu, 1, seq_bits->enable_filter_intra);
+  BitstreamAppend(&obu, 1, seq_bits->enable_intra_edge_filter);
+  BitstreamAppend(&obu, 1, seq_bits->enable_interintra_compound);
+  BitstreamAppend(&obu, 1, seq_bits->enable_masked_compound);
+  BitstreamAppend(&obu, 1, seq_bits->enable_warped_motion);
+  BitstreamAppend(&obu, 1, seq_bits->enable_dual_filter);
+  BitstreamAppend(&obu, 1, seq_bits->enable_order_hint);
+  if (seq_bits->enable_order_hint) {
+    BitstreamAppend(&obu, 1, seq_bits->enable_jnt_comp);
+    BitstreamAppend(&obu, 1, seq_bits->enable_ref_frame_mvs);
+  }
+  BitstreamAppend(&obu, 1, seq_choose_screen_content_tools);
+  if (seq_choose_screen_content_tools) {
+    // TODO(mburakov): Implement this!
+    abort();
+  }
+  BitstreamAppend(&obu, 1, seq_force_screen_content_tools);
+  if (seq_force_screen_content_tools) {
+    // TODO(mburakov): Implement this!
+    abort();
+  }
+  if (seq_bits->enable_order_hint)
+    BitstreamAppend(&obu, 3, seq->order_hint_bits_minus_1);
+
+  BitstreamAppend(&obu, 1, seq_bits->enable_superres);
+  BitstreamAppend(&obu, 1, seq_bits->enable_cdef);
+  BitstreamAppend(&obu, 1, seq_bits->enable_restoration);
+  PackColorConfig(&obu, seq, msp);
+  BitstreamAppend(&obu, 1, film_grain_params_present);
+
+  PackTrailingBits(&obu);
+  PackObu(bitstream, AV1_OBU_SEQUENCE_HEADER, &obu, 0);
+}
+
+// 5.9.12 Quantizer index delta parameters syntax
+static void PackDeltaQ(struct Bitstream* bitstream, int8_t delta_q) {
+  BitstreamAppend(bitstream, 1, delta_q != 0);  // delta_coded
+  if (delta_q) BitstreamAppend(bitstream, 7, (uint32_t)delta_q);
+}
+
+// 5.9.15 Tile info syntax
+static void PackTileInfo(struct Bitstream* bitstream,
+                         const VAEncSequenceParameterBufferAV1* seq,
+                         const VAEncPictureParameterBufferAV1* pic) {
+  // mburakov: Only a single tile is supported, which is only possible when
+  // the smallest tile count allowed for the frame size is one.
+  if (pic->tile_cols != 1 || pic->tile_rows != 1) {
+    // TODO(mburakov): Implement this!
+    abort();
+  }
+
+  uint32_t mi_cols = 2 * ((pic->frame_width_minus_1 + 1u + 7) >> 3);
+  uint32_t mi_rows = 2 * ((pic->frame_height_minus_1 + 1u + 7) >> 3);
+  uint32_t sb_shift = seq->seq_fields.bits.use_128x128_superblock ? 5 : 4;
+  uint32_t sb_cols = (mi_cols + (1u << sb_shift) - 1) >> sb_shift;
+  uint32_t sb_rows = (mi_rows + (1u << sb_shift) - 1) >> sb_shift;
+  uint32_t sb_size = sb_shift + 2;
+  uint32_t max_tile_width_sb = MAX_TILE_WIDTH >> sb_size;
+  uint32_t max_tile_area_sb = MAX_TILE_AREA >> (2 * sb_size);
+  uint32_t min_log2_tile_cols = TileLog2(max_tile_width_sb, sb_cols);
+  uint32_t max_log2_tile_cols =
+      TileLog2(1, sb_cols < MAX_TILE_COLS ? sb_cols : MAX_TILE_COLS);
+  uint32_t max_log2_tile_rows =
+      TileLog2(1, sb_rows < MAX_TILE_ROWS ? sb_rows : MAX_TILE_ROWS);
+  uint32_t min_log2_tiles =
+      TileLog2(max_tile_area_sb, sb_rows * sb_cols) > min_log2_tile_cols
+          ? TileLog2(max_tile_area_sb, sb_rows * sb_cols)
+          : min_log2_tile_cols;
+  if (min_log2_tiles) {
+    // TODO(mburakov): Implement this!
+    abort();
+  }
+
+  BitstreamAppend(bitstream, 1, uniform_tile_spacing_flag);
+  if (max_log2_tile_cols)
+    BitstreamAppend(bitstream, 1, 0);  // increment_tile_cols_log2
+  if (max_log2_tile_rows)
+    BitstreamAppend(bitstream, 1, 0);  // increment_tile_rows_log2
+}
+
+// 5.9.2 Uncompressed header syntax
+static void PackUncompressedHeader(struct Bitstream* bitstream,
+                                   const VAEncSequenceParameterBufferAV1* seq,
+                                   VAEncPictureParameterBufferAV1* pic,
+                                   size_t header_size) {
+  const typeof(seq->seq_fields.bits)* seq_bits = &seq->seq_fields.bits;
+  const typeof(pic->picture_flags.bits)* pic_bits = &pic->picture_flags.bits;
+  const typeof(pic->mode_control_flags.bits)* mode_bits =
+      &pic->mode_control_flags.bits;
+  uint8_t num_planes = seq_bits->mono_chrome ? 1 : 3;
+
+  uint8_t frame_type = pic_bits->frame_type;
+  if (frame_type != AV1_KEY_FRAME && frame_type != AV1_INTER_FRAME) {
+    // TODO(mburakov): Implement this!
+    abort();
+  }
+  bool frame_is_intra = frame_type == AV1_KEY_FRAME;
+
+  BitstreamAppend(bitstream, 1, show_existing_frame);
+  BitstreamAppend(bitstream, 2, frame_type);
+  BitstreamAppend(bitstream, 1, show_frame);
+  bool error_resilient_mode = frame_is_intra;
+  if (!frame_is_intra) {
+    error_resilient_mode = pic_bits->error_resilient_mode;
+    BitstreamAppend(bitstream, 1, error_resilient_mode);
+  }
+  BitstreamAppend(bitstream, 1, pic_bits->disable_cdf_update);
+  BitstreamAppend(bitstream, 1, frame_size_override_flag);
+  if (seq_bits->enable_order_hint) {
+    BitstreamAppend(bitstream, seq->order_hint_bits_minus_1 + 1u,
+                    pic->order_hint);
+  }
+  if (!frame_is_intra && !error_resilient_mode)
+    BitstreamAppend(bitstream, 3, pic->primary_ref_frame);
+
+  if (!frame_is_intra) {
+    BitstreamAppend(bitstream, 8, pic->refresh_frame_flags);
+    if (error_resilient_mode && seq_bits->enable_order_hint) {
+      // TODO(mburakov): Implement this!
+      abort();
+    }
+  }
+
+  // 5.9.5 Frame size syntax, 5.9.8 Superres params syntax
+  // 5.9.6 Render size syntax
+  if (frame_is_intra) {
+    if (seq_bits->enable_superres)
+      BitstreamAppend(bitstream, 1, pic_bits->use_superres);
+    BitstreamAppend(bitstream, 1, render_and_frame_size_different);
+  } else {
+    if (seq_bits->enable_order_hint)
+      BitstreamAppend(bitstream, 1, frame_refs_short_signaling);
+    for (size_t i = 0; i < REFS_PER_FRAME; i++)
+      BitstreamAppend(bitstream, 3, pic->ref_frame_idx[i]);
+    if (seq_bits->enable_superres)
+      BitstreamAppend(bitstream, 1, pic_bits->use_superres);
+    BitstreamAppend(bitstream, 1, render_and_frame_size_different);
+    BitstreamAppend(bitstream, 1, pic_bits->allow_high_precision_mv);
+
+    // 5.9.10 Interpolation filter syntax
+    BitstreamAppend(bitstream, 1, pic->interpolation_filter == SWITCHABLE);
+    if (pic->interpolation_filter != SWITCHABLE)
+      BitstreamAppend(bitstream, 2, pic->interpolation_filter);
+    BitstreamAppend(bitstream, 1, is_motion_mode_switchable);
+    if (!error_resilient_mode && seq_bits->enable_ref_frame_mvs)
+      BitstreamAppend(bitstream, 1, pic_bits->use_ref_frame_mvs);
+  }
+
+  if (!pic_bits->disable_cdf_update)
+    BitstreamAppend(bitstream, 1, pic_bits->disable_frame_end_update_cdf);
+  PackTileInfo(bitstream, seq, pic);
+
+  // 5.9.12 Quantization params syntax
+  pic->bit_offset_qindex = (uint32_t)(header_size + bitstream->size);
+  BitstreamAppend(bitstream, 8, pic->base_qindex);
+  PackDeltaQ(bitstream, pic->y_dc_delta_q);
+  if (num_planes > 1) {
+    if (separate_uv_delta_q) {
+      // TODO(mburakov): Implement this!
+      abort();
+    }
+    PackDeltaQ(bitstream, pic->u_dc_delta_q);
+    PackDeltaQ(bitstream, pic->u_ac_delta_q);
+  }
+  BitstreamAppend(bitstream, 1, pic->qmatrix_flags.bits.using_qmatrix);
+  if (pic->qmatrix_flags.bits.using_qmatrix) {
+    // TODO(mburakov): Implement this!
+    abort();
+  }
+
+  // 5.9.14 Segmentation params syntax
+  pic->bit_offset_segmentation = (uint32_t)(header_size + bitstream->size);
+  BitstreamAppend(bitstream, 1, segmentation_enabled);
+
+  // 5.9.17 Quantizer index delta parameters syntax
+  // 5.9.18 Loop filter delta parameters syntax
+  if (pic->base_qindex) {
+    BitstreamAppend(bitstream, 1, mode_bits->delta_q_present);
+    if (mode_bits->delta_q_present) {
+      BitstreamAppend(bitstream, 2, mode_bits->delta_q_res);
+      BitstreamAppend(bitstream, 1, mode_bits->delta_lf_present);
+      if (mode_bits->delta_lf_present) {
+        BitstreamAppend(bitstream, 2, mode_bits->delta_lf_res);
+        BitstreamAppend(bitstream, 1, mode_bits->delta_lf_multi);
+      }
+    }
+  }
+
+  // mburakov: Segmentation is never enabled, so lossless mode only depends
+  // on the quantizer values of the frame itself.
+  bool coded_lossless = !pic->base_qindex && !pic->y_dc_delta_q &&
+                        !pic->u_dc_delta_q && !pic->u_ac_delta_q;
+
+  // 5.9.11 Loop filter params syntax
+  pic->bit_offset_loopfilter_params = (uint32_t)(header_size + bitstream->size);
+  if (!coded_lossless) {
+    BitstreamAppend(bitstream, 6, pic->filter_level[0]);
+    BitstreamAppend(bitstream, 6, pic->filter_level[1]);
+    if (num_planes > 1 && (pic->filter_level[0] || pic->filter_level[1])) {
+      BitstreamAppend(bitstream, 6, pic->filter_level_u);
+      BitstreamAppend(bitstream, 6, pic->filter_level_v);
+    }
+    BitstreamAppend(bitstream, 3, pic->loop_filter_flags.bits.sharpness_level);
+    BitstreamAppend(bitstream, 1,
+                    pic->loop_filter_flags.bits.mode_ref_delta_enabled);
+    if (pic->loop_filter_flags.bits.mode_ref_delta_enabled) {
+      BitstreamAppend(bitstream, 1,
+                      pic->loop_filter_flags.bits.mode_ref_delta_update);
+      if (pic->loop_filter_flags.bits.mode_ref_delta_update) {
+        // TODO(mburakov): Implement this!
+        abort();
+      }
+    }
+  }
+
+  // 5.9.19 CDEF params syntax
+  pic->bit_offset_cdef_params = (uint32_t)(header_size + bitstream->size);
+  if (!coded_lossless && seq_bits->enable_cdef) {
+    BitstreamAppend(bitstream, 2, pic->cdef_damping_minus_3);
+    BitstreamAppend(bitstream, 2, pic->cdef_bits);
+    for (size_t i = 0; i < 1u << pic->cdef_bits; i++) {
+      // mburakov: VA-API combines primary and secondary strengths in one
+      // value, which is exactly how these appear in the bitstream.
+      BitstreamAppend(bitstream, 6, pic->cdef_y_strengths[i]);
+      if (num_planes > 1)
+        BitstreamAppend(bitstream, 6, pic->cdef_uv_strengths[i]);
+    }
+  }
+  pic->size_in_bits_cdef_params =
+      (uint32_t)(header_size + bitstream->size) - pic->bit_offset_cdef_params;
+
+  // 5.9.20 Loop restoration params syntax
+  if (!coded_lossless && seq_bits->enable_restoration) {
+    // TODO(mburakov): Implement this!
+    abort();
+  }
+
+  // 5.9.21 TX mode syntax
+  if (!coded_lossless)
+    BitstreamAppend(bitstream, 1, mode_bits->tx_mode == TX_MODE_SELECT);
+
+  // 5.9.23 Frame reference mode syntax
+  if (!frame_is_intra) {
+    BitstreamAppend(bitstream, 1, mode_bits->reference_select);
+    if (mode_bits->reference_select) {
+      // TODO(mburakov): Implement this!
+      abort();
+    }
+  }
+
+  if (!frame_is_intra && !error_resilient_mode &&
+      seq_bits->enable_warped_motion)
+    BitstreamAppend(bitstream, 1, allow_warped_motion);
+  BitstreamAppend(bitstream, 1, pic_bits->reduced_tx_set);
+
+  // 5.9.24 Global motion params syntax
+  if (!frame_is_intra) {
+    for (size_t i = 0; i < REFS_PER_FRAME; i++)
+      BitstreamAppend(bitstream, 1, is_global);
+  }
+}
+
+// 5.9.1 General frame header OBU syntax
+void PackAv1FrameHeaderObu(struct Bitstream* bitstream,
+                           const VAEncSequenceParameterBufferAV1* seq,
+                           VAEncPictureParameterBufferAV1* pic,
+                           const struct MoreAv1FrameParameters* mfp) {
+  char buffer_on_the_stack[128];
+  struct Bitstream obu = {
+      .data = buffer_on_the_stack,
+      .size = 0,
+  };
+
+  // mburakov: Bit offsets reported to the driver are counted from the start
+  // of the OBU, i.e. these include the header and the obu_size field.
+  size_t header_size = 8 + mfp->obu_size_length * 8u;
+  PackUncompressedHeader(&obu, seq, pic, header_size);
+  PackTrailingBits(&obu);
+
+  pic->byte_offset_frame_hdr_obu_size = (uint32_t)(bitstream->size / 8 + 1);
+  pic->size_in_bits_frame_hdr_obu = (uint32_t)(header_size + obu.size);
+  PackObu(bitstream, AV1_OBU_FRAME_HEADER, &obu, mfp->obu_size_length);
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_AV1_H_
+#define STREAMER_AV1_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <va/va.h>
+
+// 6.2.2 OBU header semantics
+enum Av1ObuType {
+  AV1_OBU_SEQUENCE_HEADER = 1,
+  AV1_OBU_TEMPORAL_DELIMITER = 2,
+  AV1_OBU_FRAME_HEADER = 3,
+  AV1_OBU_TILE_GROUP = 4,
+};
+
+// 6.8.2 Uncompressed header semantics
+enum Av1FrameType {
+  AV1_KEY_FRAME = 0,
+  AV1_INTER_FRAME = 1,
+  AV1_INTRA_ONLY_FRAME = 2,
+  AV1_SWITCH_FRAME = 3,
+};
+
+struct Bitstream;
+
+struct MoreAv1SeqParameters {
+  uint16_t max_frame_width_minus_1;
+  uint16_t max_frame_height_minus_1;
+  bool color_description_present_flag;
+  uint8_t color_primaries;
+  uint8_t transfer_characteristics;
+  uint8_t matrix_coefficients;
+  bool color_range;
+};
+
+struct MoreAv1FrameParameters {
+  // mburakov: Drivers rewrite obu_size of the frame header after patching it,
+  // and expect the field to have the fixed length they advertise.
+  uint8_t obu_size_length;
+};
+
+void PackAv1SequenceHeaderObu(struct Bitstream* bitstream,
+                              const VAEncSequenceParameterBufferAV1* seq,
+                              const struct MoreAv1SeqParameters* msp);
+void PackAv1FrameHeaderObu(struct Bitstream* bitstream,
+                           const VAEncSequenceParameterBufferAV1* seq,
+                           VAEncPictureParameterBufferAV1* pic,
+                           const struct MoreAv1FrameParameters* mfp);
+
+#endif  // STREAMER_AV1_H_
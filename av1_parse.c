@@ -0,0 +1,459 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "av1_parse.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bitstream.h"
+#include "toolbox/utils.h"
+
+#define UNSUPPORTED(what)                \
+  do {                                   \
+    LOG("Unsupported syntax: %s", what); \
+    return false;                        \
+  } while (0)
+
+// Section 3 constants
+#define REFS_PER_FRAME 7
+#define MAX_TILE_WIDTH 4096
+#define MAX_TILE_AREA (4096 * 2304)
+#define MAX_TILE_ROWS 64
+#define MAX_TILE_COLS 64
+#define PRIMARY_REF_NONE 7
+#define SWITCHABLE 4
+
+// 6.4.2 Color config semantics
+#define CP_BT_709 1
+#define CP_UNSPECIFIED 2
+#define TC_UNSPECIFIED 2
+#define TC_SRGB 13
+#define MC_IDENTITY 0
+#define MC_UNSPECIFIED 2
+
+// 6.8.21 TX mode semantics
+#define ONLY_4X4 0
+#define TX_MODE_LARGEST 1
+#define TX_MODE_SELECT 2
+
+static struct BitstreamReader ObuReader(const struct Av1Obu* obu) {
+  return (struct BitstreamReader){
+      .data = obu->payload,
+      .size = obu->obu_size * 8,
+      .offset = 0,
+      .overflow = false,
+  };
+}
+
+// 5.3.4 Trailing bits syntax
+static bool ReadTrailingBits(struct BitstreamReader* reader) {
+  if (!BitstreamRead(reader, 1)) return false;  // trailing_one_bit
+  while (!BitstreamIsByteAligned(reader)) {
+    if (BitstreamRead(reader, 1)) return false;  // trailing_zero_bit
+  }
+  return !reader->overflow && reader->offset == reader->size;
+}
+
+// 5.9.15 Tile info syntax, tile_log2 function
+static uint32_t TileLog2(uint32_t blk_size, uint32_t target) {
+  uint32_t k = 0;
+  while ((blk_size << k) < target) k++;
+  return k;
+}
+
+// 5.3.1 General OBU syntax
+bool ParseAv1Obu(const void** data, size_t* size, struct Av1Obu* obu) {
+  const uint8_t* begin = *data;
+  const uint8_t* end = begin + *size;
+  if (begin == end) {
+    LOG("Missing obu_header");
+    return false;
+  }
+
+  // 5.3.2 OBU header syntax
+  if (*begin & 0x80) {
+    LOG("Invalid obu_forbidden_bit");
+    return false;
+  }
+  obu->obu_type = *begin >> 3 & 0xf;
+  if (*begin & 0x04) UNSUPPORTED("obu_extension_flag");
+  if (!(*begin & 0x02)) UNSUPPORTED("obu_has_size_field");
+  begin++;
+
+  // 4.10.5 leb128
+  obu->obu_size = 0;
+  obu->obu_size_length = 0;
+  for (;;) {
+    if (begin == end || obu->obu_size_length == 8) {
+      LOG("Invalid obu_size");
+      return false;
+    }
+    uint8_t leb128_byte = *begin++;
+    obu->obu_size |= (size_t)(leb128_byte & 0x7f)
+                     << (obu->obu_size_length++ * 7);
+    if (!(leb128_byte & 0x80)) break;
+  }
+
+  if (obu->obu_size > (size_t)(end - begin)) {
+    LOG("OBU is truncated (%zu)", obu->obu_size);
+    return false;
+  }
+  if (obu->obu_size > sizeof(obu->payload)) {
+    LOG("OBU is too large (%zu)", obu->obu_size);
+    return false;
+  }
+  memcpy(obu->payload, begin, obu->obu_size);
+  begin += obu->obu_size;
+
+  *size = (size_t)(end - begin);
+  *data = begin;
+  return true;
+}
+
+// 5.5.2 Color config syntax
+static bool ReadColorConfig(struct BitstreamReader* reader,
+                            struct Av1SequenceHeader* sh) {
+  sh->high_bitdepth = BitstreamRead(reader, 1);
+  if (sh->seq_profile == 2 && sh->high_bitdepth) UNSUPPORTED("twelve_bit");
+  if (sh->seq_profile != 1) sh->mono_chrome = BitstreamRead(reader, 1);
+  sh->color_description_present_flag = BitstreamRead(reader, 1);
+  if (sh->color_description_present_flag) {
+    sh->color_primaries = (uint8_t)BitstreamRead(reader, 8);
+    sh->transfer_characteristics = (uint8_t)BitstreamRead(reader, 8);
+    sh->matrix_coefficients = (uint8_t)BitstreamRead(reader, 8);
+  } else {
+    sh->color_primaries = CP_UNSPECIFIED;
+    sh->transfer_characteristics = TC_UNSPECIFIED;
+    sh->matrix_coefficients = MC_UNSPECIFIED;
+  }
+
+  if (sh->mono_chrome) UNSUPPORTED("mono_chrome");
+  if (sh->color_primaries == CP_BT_709 &&
+      sh->transfer_characteristics == TC_SRGB &&
+      sh->matrix_coefficients == MC_IDENTITY)
+    UNSUPPORTED("sRGB color config");
+
+  sh->color_range = BitstreamRead(reader, 1);
+  if (sh->seq_profile != 0) UNSUPPORTED("seq_profile");
+  sh->subsampling_x = 1;
+  sh->subsampling_y = 1;
+  sh->chroma_sample_position = (uint8_t)BitstreamRead(reader, 2);
+  sh->separate_uv_delta_q = BitstreamRead(reader, 1);
+  if (sh->separate_uv_delta_q) UNSUPPORTED("separate_uv_delta_q");
+  return true;
+}
+
+// 5.5.1 General sequence header OBU syntax
+bool ParseAv1SequenceHeader(const struct Av1Obu* obu,
+                            struct Av1SequenceHeader* sh) {
+  memset(sh, 0, sizeof(*sh));
+  if (obu->obu_type != AV1_OBU_SEQUENCE_HEADER) {
+    LOG("Not a sequence header (%u)", obu->obu_type);
+    return false;
+  }
+
+  struct BitstreamReader reader = ObuReader(obu);
+  sh->seq_profile = (uint8_t)BitstreamRead(&reader, 3);
+  sh->still_picture = BitstreamRead(&reader, 1);
+  sh->reduced_still_picture_header = BitstreamRead(&reader, 1);
+  if (sh->reduced_still_picture_header)
+    UNSUPPORTED("reduced_still_picture_header");
+
+  sh->timing_info_present_flag = BitstreamRead(&reader, 1);
+  if (sh->timing_info_present_flag) UNSUPPORTED("timing_info_present_flag");
+  sh->initial_display_delay_present_flag = BitstreamRead(&reader, 1);
+  if (sh->initial_display_delay_present_flag)
+    UNSUPPORTED("initial_display_delay_present_flag");
+  sh->operating_points_cnt_minus_1 = (uint8_t)BitstreamRead(&reader, 5);
+  for (uint8_t i = 0; i <= sh->operating_points_cnt_minus_1; i++) {
+    sh->operating_point_idc[i] = (uint16_t)BitstreamRead(&reader, 12);
+    sh->seq_level_idx[i] = (uint8_t)BitstreamRead(&reader, 5);
+    if (sh->seq_level_idx[i] > 7) sh->seq_tier[i] = BitstreamRead(&reader, 1);
+  }
+
+  sh->frame_width_bits_minus_1 = (uint8_t)BitstreamRead(&reader, 4);
+  sh->frame_height_bits_minus_1 = (uint8_t)BitstreamRead(&reader, 4);
+  sh->max_frame_width_minus_1 =
+      BitstreamRead(&reader, sh->frame_width_bits_minus_1 + 1u);
+  sh->max_frame_height_minus_1 =
+      BitstreamRead(&reader, sh->frame_height_bits_minus_1 + 1u);
+  sh->frame_id_numbers_present_flag = BitstreamRead(&reader, 1);
+  if (sh->frame_id_numbers_present_flag)
+    UNSUPPORTED("frame_id_numbers_present_flag");
+
+  sh->use_128x128_superblock = BitstreamRead(&reader, 1);
+  sh->enable_filter_intra = BitstreamRead(&reader, 1);
+  sh->enable_intra_edge_filter = BitstreamRead(&reader, 1);
+  sh->enable_interintra_compound = BitstreamRead(&reader, 1);
+  sh->enable_masked_compound = BitstreamRead(&reader, 1);
+  sh->enable_warped_motion = BitstreamRead(&reader, 1);
+  sh->enable_dual_filter = BitstreamRead(&reader, 1);
+  sh->enable_order_hint = BitstreamRead(&reader, 1);
+  if (sh->enable_order_hint) {
+    sh->enable_jnt_comp = BitstreamRead(&reader, 1);
+    sh->enable_ref_frame_mvs = BitstreamRead(&reader, 1);
+  }
+  sh->seq_choose_screen_content_tools = BitstreamRead(&reader, 1);
+  if (sh->seq_choose_screen_content_tools)
+    UNSUPPORTED("seq_choose_screen_content_tools");
+  sh->seq_force_screen_content_tools = (uint8_t)BitstreamRead(&reader, 1);
+  if (sh->seq_force_screen_content_tools)
+    UNSUPPORTED("seq_force_screen_content_tools");
+  if (sh->enable_order_hint)
+    sh->order_hint_bits_minus_1 = (uint8_t)BitstreamRead(&reader, 3);
+
+  sh->enable_superres = BitstreamRead(&reader, 1);
+  sh->enable_cdef = BitstreamRead(&reader, 1);
+  sh->enable_restoration = BitstreamRead(&reader, 1);
+  if (!ReadColorConfig(&reader, sh)) return false;
+  sh->film_grain_params_present = BitstreamRead(&reader, 1);
+  if (sh->film_grain_params_present) UNSUPPORTED("film_grain_params_present");
+  return ReadTrailingBits(&reader);
+}
+
+// 5.9.15 Tile info syntax
+static bool ReadTileInfo(struct BitstreamReader* reader,
+                         const struct Av1SequenceHeader* sh,
+                         struct Av1FrameHeader* fh) {
+  // mburakov: Frame size always matches the maximum one from the sequence
+  // header, because frame_size_override_flag is rejected.
+  uint32_t mi_cols = 2 * ((sh->max_frame_width_minus_1 + 1 + 7) >> 3);
+  uint32_t mi_rows = 2 * ((sh->max_frame_height_minus_1 + 1 + 7) >> 3);
+  uint32_t sb_shift = sh->use_128x128_superblock ? 5 : 4;
+  uint32_t sb_cols = (mi_cols + (1u << sb_shift) - 1) >> sb_shift;
+  uint32_t sb_rows = (mi_rows + (1u << sb_shift) - 1) >> sb_shift;
+  uint32_t sb_size = sb_shift + 2;
+  uint32_t max_tile_width_sb = MAX_TILE_WIDTH >> sb_size;
+  uint32_t max_tile_area_sb = MAX_TILE_AREA >> (2 * sb_size);
+  uint32_t min_log2_tile_cols = TileLog2(max_tile_width_sb, sb_cols);
+  uint32_t max_log2_tile_cols = TileLog2(1, MIN(sb_cols, MAX_TILE_COLS));
+  uint32_t max_log2_tile_rows = TileLog2(1, MIN(sb_rows, MAX_TILE_ROWS));
+  uint32_t min_log2_tiles =
+      MAX(min_log2_tile_cols, TileLog2(max_tile_area_sb, sb_rows * sb_cols));
+
+  fh->uniform_tile_spacing_flag = BitstreamRead(reader, 1);
+  if (!fh->uniform_tile_spacing_flag)
+    UNSUPPORTED("uniform_tile_spacing_flag");
+  fh->tile_cols_log2 = min_log2_tile_cols;
+  while (fh->tile_cols_log2 < max_log2_tile_cols) {
+    if (!BitstreamRead(reader, 1)) break;  // increment_tile_cols_log2
+    fh->tile_cols_log2++;
+  }
+  fh->tile_rows_log2 = min_log2_tiles > fh->tile_cols_log2
+                           ? min_log2_tiles - fh->tile_cols_log2
+                           : 0;
+  while (fh->tile_rows_log2 < max_log2_tile_rows) {
+    if (!BitstreamRead(reader, 1)) break;  // increment_tile_rows_log2
+    fh->tile_rows_log2++;
+  }
+  if (fh->tile_cols_log2 || fh->tile_rows_log2) UNSUPPORTED("multiple tiles");
+  return true;
+}
+
+// 5.9.13 Delta quantizer syntax
+static int8_t ReadDeltaQ(struct BitstreamReader* reader) {
+  if (!BitstreamRead(reader, 1)) return 0;  // delta_coded
+  uint32_t delta_q = BitstreamRead(reader, 7);
+  return (int8_t)(delta_q & 0x40 ? (int32_t)delta_q - 0x80 : (int32_t)delta_q);
+}
+
+// 5.9.12 Quantization params syntax
+static bool ReadQuantizationParams(struct BitstreamReader* reader,
+                                   struct Av1FrameHeader* fh) {
+  fh->base_q_idx = (uint8_t)BitstreamRead(reader, 8);
+  fh->delta_q_y_dc = ReadDeltaQ(reader);
+  // mburakov: Monochrome and separate uv delta q are rejected in the sequence
+  // header, so there are always three planes sharing the same deltas.
+  fh->delta_q_u_dc = ReadDeltaQ(reader);
+  fh->delta_q_u_ac = ReadDeltaQ(reader);
+  fh->using_qmatrix = BitstreamRead(reader, 1);
+  if (fh->using_qmatrix) UNSUPPORTED("using_qmatrix");
+  return true;
+}
+
+// 5.9.11 Loop filter params syntax
+static bool ReadLoopFilterParams(struct BitstreamReader* reader,
+                                 struct Av1FrameHeader* fh) {
+  fh->loop_filter_level[0] = (uint8_t)BitstreamRead(reader, 6);
+  fh->loop_filter_level[1] = (uint8_t)BitstreamRead(reader, 6);
+  if (fh->loop_filter_level[0] || fh->loop_filter_level[1]) {
+    fh->loop_filter_level[2] = (uint8_t)BitstreamRead(reader, 6);
+    fh->loop_filter_level[3] = (uint8_t)BitstreamRead(reader, 6);
+  }
+  fh->loop_filter_sharpness = (uint8_t)BitstreamRead(reader, 3);
+  fh->loop_filter_delta_enabled = BitstreamRead(reader, 1);
+  if (fh->loop_filter_delta_enabled) {
+    fh->loop_filter_delta_update = BitstreamRead(reader, 1);
+    if (fh->loop_filter_delta_update) UNSUPPORTED("loop_filter_delta_update");
+  }
+  return true;
+}
+
+// 5.9.19 CDEF params syntax
+static void ReadCdefParams(struct BitstreamReader* reader,
+                           struct Av1FrameHeader* fh) {
+  fh->cdef_damping_minus_3 = (uint8_t)BitstreamRead(reader, 2);
+  fh->cdef_bits = (uint8_t)BitstreamRead(reader, 2);
+  for (size_t i = 0; i < 1u << fh->cdef_bits; i++) {
+    fh->cdef_y_pri_strength[i] = (uint8_t)BitstreamRead(reader, 4);
+    fh->cdef_y_sec_strength[i] = (uint8_t)BitstreamRead(reader, 2);
+    fh->cdef_uv_pri_strength[i] = (uint8_t)BitstreamRead(reader, 4);
+    fh->cdef_uv_sec_strength[i] = (uint8_t)BitstreamRead(reader, 2);
+  }
+}
+
+// 5.9.2 Uncompressed header syntax
+static bool ReadUncompressedHeader(struct BitstreamReader* reader,
+                                   const struct Av1SequenceHeader* sh,
+                                   size_t header_size,
+                                   struct Av1FrameHeader* fh) {
+  fh->show_existing_frame = BitstreamRead(reader, 1);
+  if (fh->show_existing_frame) UNSUPPORTED("show_existing_frame");
+  fh->frame_type = (uint8_t)BitstreamRead(reader, 2);
+  if (fh->frame_type != AV1_KEY_FRAME && fh->frame_type != AV1_INTER_FRAME)
+    UNSUPPORTED("frame_type");
+  bool frame_is_intra = fh->frame_type == AV1_KEY_FRAME;
+  fh->show_frame = BitstreamRead(reader, 1);
+  if (!fh->show_frame) UNSUPPORTED("show_frame");
+
+  fh->error_resilient_mode =
+      frame_is_intra ? true : BitstreamRead(reader, 1);
+  fh->disable_cdf_update = BitstreamRead(reader, 1);
+  fh->frame_size_override_flag = BitstreamRead(reader, 1);
+  if (fh->frame_size_override_flag) UNSUPPORTED("frame_size_override_flag");
+  if (sh->enable_order_hint)
+    fh->order_hint = BitstreamRead(reader, sh->order_hint_bits_minus_1 + 1u);
+  fh->primary_ref_frame = frame_is_intra || fh->error_resilient_mode
+                              ? PRIMARY_REF_NONE
+                              : (uint8_t)BitstreamRead(reader, 3);
+
+  fh->refresh_frame_flags =
+      frame_is_intra ? 0xff : (uint8_t)BitstreamRead(reader, 8);
+  if (!frame_is_intra && fh->error_resilient_mode && sh->enable_order_hint)
+    UNSUPPORTED("ref_order_hint");
+
+  // 5.9.5 Frame size syntax, 5.9.8 Superres params syntax
+  // 5.9.6 Render size syntax
+  if (!frame_is_intra) {
+    if (sh->enable_order_hint)
+      fh->frame_refs_short_signaling = BitstreamRead(reader, 1);
+    if (fh->frame_refs_short_signaling)
+      UNSUPPORTED("frame_refs_short_signaling");
+    for (size_t i = 0; i < REFS_PER_FRAME; i++)
+      fh->ref_frame_idx[i] = (uint8_t)BitstreamRead(reader, 3);
+  }
+  if (sh->enable_superres) fh->use_superres = BitstreamRead(reader, 1);
+  fh->render_and_frame_size_different = BitstreamRead(reader, 1);
+  if (fh->render_and_frame_size_different)
+    UNSUPPORTED("render_and_frame_size_different");
+  if (!frame_is_intra) {
+    fh->allow_high_precision_mv = BitstreamRead(reader, 1);
+
+    // 5.9.10 Interpolation filter syntax
+    bool is_filter_switchable = BitstreamRead(reader, 1);
+    fh->interpolation_filter = is_filter_switchable
+                                   ? SWITCHABLE
+                                   : (uint8_t)BitstreamRead(reader, 2);
+    fh->is_motion_mode_switchable = BitstreamRead(reader, 1);
+    if (!fh->error_resilient_mode && sh->enable_ref_frame_mvs)
+      fh->use_ref_frame_mvs = BitstreamRead(reader, 1);
+  }
+
+  fh->disable_frame_end_update_cdf =
+      fh->disable_cdf_update ? true : BitstreamRead(reader, 1);
+  if (!ReadTileInfo(reader, sh, fh)) return false;
+
+  fh->qindex_offset = header_size + reader->offset;
+  if (!ReadQuantizationParams(reader, fh)) return false;
+
+  // 5.9.14 Segmentation params syntax
+  fh->segmentation_offset = header_size + reader->offset;
+  fh->segmentation_enabled = BitstreamRead(reader, 1);
+  if (fh->segmentation_enabled) UNSUPPORTED("segmentation_enabled");
+
+  // 5.9.17 Quantizer index delta parameters syntax
+  // 5.9.18 Loop filter delta parameters syntax
+  if (fh->base_q_idx) fh->delta_q_present = BitstreamRead(reader, 1);
+  if (fh->delta_q_present) {
+    fh->delta_q_res = (uint8_t)BitstreamRead(reader, 2);
+    fh->delta_lf_present = BitstreamRead(reader, 1);
+    if (fh->delta_lf_present) {
+      fh->delta_lf_res = (uint8_t)BitstreamRead(reader, 2);
+      fh->delta_lf_multi = BitstreamRead(reader, 1);
+    }
+  }
+
+  bool coded_lossless = !fh->base_q_idx && !fh->delta_q_y_dc &&
+                        !fh->delta_q_u_dc && !fh->delta_q_u_ac;
+  fh->loop_filter_params_offset = header_size + reader->offset;
+  if (!coded_lossless && !ReadLoopFilterParams(reader, fh)) return false;
+
+  fh->cdef_params_offset = header_size + reader->offset;
+  if (!coded_lossless && sh->enable_cdef) ReadCdefParams(reader, fh);
+  fh->cdef_params_size =
+      header_size + reader->offset - fh->cdef_params_offset;
+
+  // 5.9.20 Loop restoration params syntax
+  if (!coded_lossless && sh->enable_restoration)
+    UNSUPPORTED("enable_restoration");
+
+  // 5.9.21 TX mode syntax
+  if (coded_lossless) {
+    fh->tx_mode = ONLY_4X4;
+  } else {
+    fh->tx_mode = BitstreamRead(reader, 1) ? TX_MODE_SELECT : TX_MODE_LARGEST;
+  }
+
+  // 5.9.23 Frame reference mode syntax
+  if (!frame_is_intra) {
+    fh->reference_select = BitstreamRead(reader, 1);
+    if (fh->reference_select) UNSUPPORTED("reference_select");
+  }
+
+  if (!frame_is_intra && !fh->error_resilient_mode &&
+      sh->enable_warped_motion)
+    fh->allow_warped_motion = BitstreamRead(reader, 1);
+  fh->reduced_tx_set = BitstreamRead(reader, 1);
+
+  // 5.9.24 Global motion params syntax
+  if (!frame_is_intra) {
+    for (size_t i = 0; i < REFS_PER_FRAME; i++) {
+      fh->is_global[i] = BitstreamRead(reader, 1);
+      if (fh->is_global[i]) UNSUPPORTED("is_global");
+    }
+  }
+  return true;
+}
+
+// 5.9.1 General frame header OBU syntax
+bool ParseAv1FrameHeader(const struct Av1Obu* obu,
+                         const struct Av1SequenceHeader* sh,
+                         struct Av1FrameHeader* fh) {
+  memset(fh, 0, sizeof(*fh));
+  if (obu->obu_type != AV1_OBU_FRAME_HEADER) {
+    LOG("Not a frame header (%u)", obu->obu_type);
+    return false;
+  }
+
+  // mburakov: Same as the writer, bit offsets are counted from the start of
+  // the OBU, i.e. these include the header and the obu_size field.
+  size_t header_size = 8 + obu->obu_size_length * 8;
+  struct BitstreamReader reader = ObuReader(obu);
+  if (!ReadUncompressedHeader(&reader, sh, header_size, fh)) return false;
+  return ReadTrailingBits(&reader);
+}
@@ -0,0 +1,154 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_AV1_PARSE_H_
+#define STREAMER_AV1_PARSE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "av1.h"
+
+// mburakov: Same as hevc_parse.h, parsed syntax only covers what the writers
+// in av1.c are able to produce, and everything else is rejected.
+
+struct Av1Obu {
+  uint8_t obu_type;
+  size_t obu_size;
+  // mburakov: Number of bytes taken by the leb128 obu_size field, which is
+  // not necessarily the shortest encoding of the value.
+  size_t obu_size_length;
+  uint8_t payload[256];
+};
+
+struct Av1SequenceHeader {
+  uint8_t seq_profile;
+  bool still_picture;
+  bool reduced_still_picture_header;
+  bool timing_info_present_flag;
+  bool initial_display_delay_present_flag;
+  uint8_t operating_points_cnt_minus_1;
+  uint16_t operating_point_idc[32];
+  uint8_t seq_level_idx[32];
+  bool seq_tier[32];
+  uint8_t frame_width_bits_minus_1;
+  uint8_t frame_height_bits_minus_1;
+  uint32_t max_frame_width_minus_1;
+  uint32_t max_frame_height_minus_1;
+  bool frame_id_numbers_present_flag;
+  bool use_128x128_superblock;
+  bool enable_filter_intra;
+  bool enable_intra_edge_filter;
+  bool enable_interintra_compound;
+  bool enable_masked_compound;
+  bool enable_warped_motion;
+  bool enable_dual_filter;
+  bool enable_order_hint;
+  bool enable_jnt_comp;
+  bool enable_ref_frame_mvs;
+  bool seq_choose_screen_content_tools;
+  uint8_t seq_force_screen_content_tools;
+  uint8_t order_hint_bits_minus_1;
+  bool enable_superres;
+  bool enable_cdef;
+  bool enable_restoration;
+  // 5.5.2 Color config syntax
+  bool high_bitdepth;
+  bool mono_chrome;
+  bool color_description_present_flag;
+  uint8_t color_primaries;
+  uint8_t transfer_characteristics;
+  uint8_t matrix_coefficients;
+  bool color_range;
+  bool subsampling_x;
+  bool subsampling_y;
+  uint8_t chroma_sample_position;
+  bool separate_uv_delta_q;
+  bool film_grain_params_present;
+};
+
+struct Av1FrameHeader {
+  bool show_existing_frame;
+  uint8_t frame_type;
+  bool show_frame;
+  bool error_resilient_mode;
+  bool disable_cdf_update;
+  bool frame_size_override_flag;
+  uint32_t order_hint;
+  uint8_t primary_ref_frame;
+  uint8_t refresh_frame_flags;
+  bool frame_refs_short_signaling;
+  uint8_t ref_frame_idx[7];
+  bool use_superres;
+  bool render_and_frame_size_different;
+  bool allow_high_precision_mv;
+  uint8_t interpolation_filter;
+  bool is_motion_mode_switchable;
+  bool use_ref_frame_mvs;
+  bool disable_frame_end_update_cdf;
+  // 5.9.15 Tile info syntax
+  bool uniform_tile_spacing_flag;
+  uint32_t tile_cols_log2;
+  uint32_t tile_rows_log2;
+  // 5.9.12 Quantization params syntax
+  uint8_t base_q_idx;
+  int8_t delta_q_y_dc;
+  int8_t delta_q_u_dc;
+  int8_t delta_q_u_ac;
+  bool using_qmatrix;
+  bool segmentation_enabled;
+  bool delta_q_present;
+  uint8_t delta_q_res;
+  bool delta_lf_present;
+  uint8_t delta_lf_res;
+  bool delta_lf_multi;
+  // 5.9.11 Loop filter params syntax
+  uint8_t loop_filter_level[4];
+  uint8_t loop_filter_sharpness;
+  bool loop_filter_delta_enabled;
+  bool loop_filter_delta_update;
+  // 5.9.19 CDEF params syntax
+  uint8_t cdef_damping_minus_3;
+  uint8_t cdef_bits;
+  uint8_t cdef_y_pri_strength[8];
+  uint8_t cdef_y_sec_strength[8];
+  uint8_t cdef_uv_pri_strength[8];
+  uint8_t cdef_uv_sec_strength[8];
+  // 5.9.21 TX mode syntax
+  uint8_t tx_mode;
+  bool reference_select;
+  bool allow_warped_motion;
+  bool reduced_tx_set;
+  bool is_global[7];
+  // mburakov: Offsets of the fields patched by drivers, counted in bits from
+  // the start of the OBU, same as VAEncPictureParameterBufferAV1 does.
+  size_t qindex_offset;
+  size_t segmentation_offset;
+  size_t loop_filter_params_offset;
+  size_t cdef_params_offset;
+  size_t cdef_params_size;
+};
+
+bool ParseAv1Obu(const void** data, size_t* size, struct Av1Obu* obu);
+bool ParseAv1SequenceHeader(const struct Av1Obu* obu,
+                            struct Av1SequenceHeader* sh);
+bool ParseAv1FrameHeader(const struct Av1Obu* obu,
+                         const struct Av1SequenceHeader* sh,
+                         struct Av1FrameHeader* fh);
+
+#endif  // STREAMER_AV1_PARSE_H_
@@ -0,0 +1,301 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "bench.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "proto.h"
+#include "toolbox/perf.h"
+#include "toolbox/utils.h"
+
+// mburakov: Benchmark connects to the server socket as a local sink, so that
+// frames go through the very same path as with the real client. Frames are
+// tracked through the pipeline in order, and every stage is measured
+// separately. Sink only counts complete frames, and discards everything else.
+
+enum BenchStage {
+  kBenchStageCapture = 0,
+  kBenchStageConvert,
+  kBenchStageEncode,
+  kBenchStageSend,
+  kBenchStageTotal,
+  kBenchStageCount,
+};
+
+struct BenchFrame {
+  unsigned long long started;
+  unsigned long long converted;
+  unsigned long long encoded;
+};
+
+struct Bench {
+  int sink_fd;
+  size_t frames;
+  unsigned long long* samples[kBenchStageCount];
+  size_t counts[kBenchStageCount];
+
+  unsigned long long capture_started;
+  unsigned long long capture_finished;
+  unsigned long long convert_finished;
+  size_t captured;
+  struct BenchFrame in_flight[64];
+  size_t submitted;
+  size_t encoded;
+  size_t received;
+
+  struct Proto header;
+  size_t header_size;
+  size_t payload_left;
+  size_t payload_bytes;
+
+  unsigned long long begin_time;
+  unsigned long long end_time;
+  struct rusage begin_usage;
+  struct rusage end_usage;
+};
+
+static int ConnectSink(int server_fd) {
+  struct sockaddr_in addr;
+  socklen_t addr_size = sizeof(addr);
+  if (getsockname(server_fd, (struct sockaddr*)&addr, &addr_size)) {
+    LOG("Failed to get server address (%s)", strerror(errno));
+    return -1;
+  }
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) {
+    LOG("Failed to create socket (%s)", strerror(errno));
+    return -1;
+  }
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(sock, (const struct sockaddr*)&addr, sizeof(addr))) {
+    LOG("Failed to connect socket (%s)", strerror(errno));
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+struct Bench* BenchCreate(int server_fd, size_t frames) {
+  struct Bench* bench = calloc(1, sizeof(struct Bench));
+  if (!bench) {
+    LOG("Failed to allocate bench (%s)", strerror(errno));
+    return NULL;
+  }
+  bench->frames = frames;
+
+  size_t nstages = 0;
+  for (; nstages < LENGTH(bench->samples); nstages++) {
+    bench->samples[nstages] = malloc(frames * sizeof(unsigned long long));
+    if (!bench->samples[nstages]) {
+      LOG("Failed to allocate samples (%s)", strerror(errno));
+      goto rollback_samples;
+    }
+  }
+
+  bench->sink_fd = ConnectSink(server_fd);
+  if (bench->sink_fd == -1) {
+    LOG("Failed to connect sink");
+    goto rollback_samples;
+  }
+  return bench;
+
+rollback_samples:
+  for (; nstages; nstages--) free(bench->samples[nstages - 1]);
+  free(bench);
+  return NULL;
+}
+
+int BenchGetEventsFd(struct Bench* bench) { return bench->sink_fd; }
+
+static void AddSample(struct Bench* bench, enum BenchStage stage,
+                      unsigned long long value) {
+  if (bench->counts[stage] < bench->frames)
+    bench->samples[stage][bench->counts[stage]++] = value;
+}
+
+void BenchCaptureStarted(struct Bench* bench) {
+  bench->capture_started = MicrosNow();
+}
+
+void BenchFrameCaptured(struct Bench* bench) {
+  bench->capture_finished = MicrosNow();
+  if (!bench->captured++) {
+    bench->begin_time = bench->capture_finished;
+    getrusage(RUSAGE_SELF, &bench->begin_usage);
+  }
+  AddSample(bench, kBenchStageCapture,
+            bench->capture_finished - bench->capture_started);
+}
+
+void BenchFrameConverted(struct Bench* bench) {
+  bench->convert_finished = MicrosNow();
+  AddSample(bench, kBenchStageConvert,
+            bench->convert_finished - bench->capture_finished);
+}
+
+bool BenchFrameSubmitted(struct Bench* bench) {
+  if (bench->submitted - bench->received == LENGTH(bench->in_flight)) {
+    LOG("Too many frames in flight");
+    return false;
+  }
+  bench->in_flight[bench->submitted++ % LENGTH(bench->in_flight)] =
+      (struct BenchFrame){
+          .started = bench->capture_started,
+          .converted = bench->convert_finished,
+      };
+  return true;
+}
+
+bool BenchFrameEncoded(struct Bench* bench) {
+  if (bench->encoded == bench->submitted) {
+    LOG("Encoded frame was never submitted");
+    return false;
+  }
+  struct BenchFrame* frame =
+      &bench->in_flight[bench->encoded++ % LENGTH(bench->in_flight)];
+  frame->encoded = MicrosNow();
+  AddSample(bench, kBenchStageEncode, frame->encoded - frame->converted);
+  return true;
+}
+
+static bool OnSinkFrame(struct Bench* bench) {
+  if (bench->received == bench->encoded) {
+    LOG("Received frame was never encoded");
+    return false;
+  }
+  unsigned long long now = MicrosNow();
+  const struct BenchFrame* frame =
+      &bench->in_flight[bench->received++ % LENGTH(bench->in_flight)];
+  AddSample(bench, kBenchStageSend, now - frame->encoded);
+  AddSample(bench, kBenchStageTotal, now - frame->started);
+  if (BenchIsComplete(bench)) {
+    bench->end_time = now;
+    getrusage(RUSAGE_SELF, &bench->end_usage);
+  }
+  return true;
+}
+
+bool BenchProcessEvents(struct Bench* bench) {
+  uint8_t buffer[65536];
+  ssize_t result = read(bench->sink_fd, buffer, sizeof(buffer));
+  if (result <= 0) {
+    LOG("Failed to read sink (%s)", result ? strerror(errno) : "EOF");
+    return false;
+  }
+
+  // mburakov: Video frame is complete with the last of its slices, while
+  // configuration and audio messages are not frames at all.
+  for (const uint8_t* it = buffer; it < buffer + result;) {
+    size_t left = (size_t)(buffer + result - it);
+    if (bench->header_size < sizeof(bench->header)) {
+      size_t size = MIN(left, sizeof(bench->header) - bench->header_size);
+      memcpy((uint8_t*)&bench->header + bench->header_size, it, size);
+      bench->header_size += size;
+      bench->payload_left = bench->header.size;
+      it += size;
+    } else {
+      size_t size = MIN(left, bench->payload_left);
+      bench->payload_left -= size;
+      it += size;
+    }
+    if (bench->header_size < sizeof(bench->header) || bench->payload_left)
+      continue;
+
+    bench->header_size = 0;
+    if (bench->header.type != PROTO_TYPE_VIDEO ||
+        bench->header.flags & PROTO_FLAG_CONFIG || BenchIsComplete(bench)) {
+      continue;
+    }
+    bench->payload_bytes += bench->header.size;
+    if (bench->header.flags & PROTO_FLAG_MORE_SLICES) continue;
+    if (!OnSinkFrame(bench)) return false;
+  }
+  return true;
+}
+
+bool BenchIsComplete(const struct Bench* bench) {
+  return bench->counts[kBenchStageTotal] == bench->frames;
+}
+
+static int CompareSamples(const void* a, const void* b) {
+  unsigned long long lhs = *(const unsigned long long*)a;
+  unsigned long long rhs = *(const unsigned long long*)b;
+  return (lhs > rhs) - (lhs < rhs);
+}
+
+// mburakov: Nearest-rank percentile, with rank given in tenths of percent.
+static unsigned long long Percentile(const unsigned long long* samples,
+                                     size_t count, size_t rank) {
+  if (!count) return 0;
+  size_t index = (count * rank + 999) / 1000;
+  return samples[index ? index - 1 : 0];
+}
+
+static unsigned long long UsageMicros(const struct rusage* rusage) {
+  return (unsigned long long)(rusage->ru_utime.tv_sec +
+                              rusage->ru_stime.tv_sec) *
+             1000000 +
+         (unsigned long long)(rusage->ru_utime.tv_usec +
+                              rusage->ru_stime.tv_usec);
+}
+
+void BenchDump(struct Bench* bench) {
+  static const char* const kStageNames[] = {
+      [kBenchStageCapture] = "capture", [kBenchStageConvert] = "convert",
+      [kBenchStageEncode] = "encode",   [kBenchStageSend] = "send",
+      [kBenchStageTotal] = "total",
+  };
+
+  // mburakov: Frames are counted from the first captured one, so neither the
+  // duration nor the cpu usage include the startup costs.
+  size_t frames = bench->counts[kBenchStageTotal];
+  double duration = (double)(bench->end_time - bench->begin_time) / 1e6;
+  double cpu_time = (double)(UsageMicros(&bench->end_usage) -
+                             UsageMicros(&bench->begin_usage));
+  printf("{\"frames\": %zu, \"dropped\": %zu, \"duration_sec\": %.3f, ",
+         frames, bench->captured - bench->submitted, duration);
+  printf("\"fps\": %.2f, \"bitrate_bps\": %.0f, \"cpu_per_frame_us\": %.0f, ",
+         duration > 0 ? (double)frames / duration : 0,
+         duration > 0 ? (double)bench->payload_bytes * 8 / duration : 0,
+         frames ? cpu_time / (double)frames : 0);
+  printf("\"stages_us\": {");
+  for (size_t i = 0; i < kBenchStageCount; i++) {
+    unsigned long long* samples = bench->samples[i];
+    size_t count = bench->counts[i];
+    qsort(samples, count, sizeof(unsigned long long), CompareSamples);
+    printf("%s\"%s\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu}",
+           i ? ", " : "", kStageNames[i], Percentile(samples, count, 500),
+           Percentile(samples, count, 990), Percentile(samples, count, 999));
+  }
+  printf("}}\n");
+  fflush(stdout);
+}
+
+void BenchDestroy(struct Bench* bench) {
+  close(bench->sink_fd);
+  for (size_t i = LENGTH(bench->samples); i; i--) free(bench->samples[i - 1]);
+  free(bench);
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_BENCH_H_
+#define STREAMER_BENCH_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct Bench;
+
+struct Bench* BenchCreate(int server_fd, size_t frames);
+int BenchGetEventsFd(struct Bench* bench);
+void BenchCaptureStarted(struct Bench* bench);
+void BenchFrameCaptured(struct Bench* bench);
+void BenchFrameConverted(struct Bench* bench);
+bool BenchFrameSubmitted(struct Bench* bench);
+bool BenchFrameEncoded(struct Bench* bench);
+bool BenchProcessEvents(struct Bench* bench);
+bool BenchIsComplete(const struct Bench* bench);
+void BenchDump(struct Bench* bench);
+void BenchDestroy(struct Bench* bench);
+
+#endif  // STREAMER_BENCH_H_
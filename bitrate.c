@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "bitrate.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include "toolbox/perf.h"
+#include "toolbox/utils.h"
+
+// mburakov: Estimations are noisy on a per-frame basis, and encoder needs a
+// few frames to settle on a new bitrate anyway.
+#define UPDATE_INTERVAL_US 250000
+
+// mburakov: Anything queued beyond a couple of frames at 60 fps, or round
+// trip growing that much above the observed minimum means the link is
+// congested.
+#define MAX_QUEUE_DELAY_US 33333
+#define MAX_RTT_GROWTH_US 33333
+
+// mburakov: Minimal round trip is only tracked over a limited window, so that
+// a permanent change of the path (i.e. after roaming) is eventually accepted
+// as the new baseline instead of being treated as congestion forever. Window
+// is made of two halves, and the minimum is taken over both of them, so that
+// it always covers at least a half of the window worth of samples.
+#define MIN_RTT_WINDOW_US 10000000
+
+struct BitrateController {
+  int fd;
+  uint32_t min_bitrate;
+  uint32_t max_bitrate;
+  uint32_t bitrate;
+  uint32_t min_rtt[2];
+  unsigned long long min_rtt_time;
+  unsigned long long last_update;
+};
+
+struct BitrateController* BitrateControllerCreate(int fd,
+                                                  uint32_t max_bitrate) {
+  struct BitrateController* bitrate_controller =
+      malloc(sizeof(struct BitrateController));
+  if (!bitrate_controller) {
+    LOG("Failed to allocate bitrate controller (%s)", strerror(errno));
+    return NULL;
+  }
+  // mburakov: Bitrate must never reach zero, because it is used as a divisor
+  // both here and in the encoders.
+  unsigned long long now = MicrosNow();
+  *bitrate_controller = (struct BitrateController){
+      .fd = fd,
+      .min_bitrate = max_bitrate < 10 ? 1 : max_bitrate / 10,
+      .max_bitrate = max_bitrate,
+      .bitrate = max_bitrate,
+      .min_rtt = {UINT32_MAX, UINT32_MAX},
+      .min_rtt_time = now,
+      .last_update = now,
+  };
+  return bitrate_controller;
+}
+
+static uint32_t UpdateMinRtt(struct BitrateController* bitrate_controller,
+                             unsigned long long now, uint32_t rtt) {
+  unsigned long long age = now - bitrate_controller->min_rtt_time;
+  if (age > MIN_RTT_WINDOW_US / 2) {
+    // mburakov: Current half becomes the previous one, unless updates stalled
+    // for long enough that it is out of the window as well.
+    bitrate_controller->min_rtt[0] = age > MIN_RTT_WINDOW_US
+                                         ? UINT32_MAX
+                                         : bitrate_controller->min_rtt[1];
+    bitrate_controller->min_rtt[1] = UINT32_MAX;
+    bitrate_controller->min_rtt_time = now;
+  }
+  if (rtt < bitrate_controller->min_rtt[1])
+    bitrate_controller->min_rtt[1] = rtt;
+  return MIN(bitrate_controller->min_rtt[0], bitrate_controller->min_rtt[1]);
+}
+
+bool BitrateControllerUpdate(struct BitrateController* bitrate_controller,
+                             size_t pending_size, uint32_t* bitrate) {
+  unsigned long long now = MicrosNow();
+  if (now - bitrate_controller->last_update < UPDATE_INTERVAL_US) {
+    *bitrate = bitrate_controller->bitrate;
+    return true;
+  }
+  bitrate_controller->last_update = now;
+
+  struct tcp_info tcp_info;
+  socklen_t tcp_info_size = sizeof(tcp_info);
+  if (getsockopt(bitrate_controller->fd, IPPROTO_TCP, TCP_INFO, &tcp_info,
+                 &tcp_info_size)) {
+    LOG("Failed to get tcp info (%s)", strerror(errno));
+    return false;
+  }
+  int outq;
+  if (ioctl(bitrate_controller->fd, TIOCOUTQ, &outq)) {
+    LOG("Failed to get socket output queue size (%s)", strerror(errno));
+    return false;
+  }
+
+  // mburakov: Pings carry client timestamps that are echoed back verbatim,
+  // so their round trip is only known to the client. Kernel rtt is measured
+  // on the same socket and is already smoothed, so it is used instead.
+  uint32_t rtt = tcp_info.tcpi_rtt;
+  uint32_t min_rtt = UpdateMinRtt(bitrate_controller, now, rtt);
+  uint64_t queued_bits = ((uint64_t)outq + pending_size) * 8;
+  uint64_t queue_delay = queued_bits * 1000000 / bitrate_controller->bitrate;
+  uint64_t congestion_window_bitrate =
+      (uint64_t)tcp_info.tcpi_snd_cwnd * tcp_info.tcpi_snd_mss * 8 * 1000000 /
+      (rtt ? rtt : 1);
+
+  uint64_t result = bitrate_controller->bitrate;
+  if (queue_delay > MAX_QUEUE_DELAY_US ||
+      rtt - min_rtt > MAX_RTT_GROWTH_US) {
+    result = MIN(result, congestion_window_bitrate) * 85 / 100;
+  } else {
+    result += bitrate_controller->max_bitrate / 20;
+  }
+  if (result < bitrate_controller->min_bitrate)
+    result = bitrate_controller->min_bitrate;
+  if (result > bitrate_controller->max_bitrate)
+    result = bitrate_controller->max_bitrate;
+
+#ifndef NDEBUG
+  if (result != bitrate_controller->bitrate) {
+    LOG("Bitrate %u -> %u (rtt %u us, queued %zu bytes)",
+        bitrate_controller->bitrate, (uint32_t)result, rtt,
+        (size_t)(queued_bits / 8));
+  }
+#endif  // NDEBUG
+
+  bitrate_controller->bitrate = (uint32_t)result;
+  *bitrate = bitrate_controller->bitrate;
+  return true;
+}
+
+void BitrateControllerDestroy(struct BitrateController* bitrate_controller) {
+  free(bitrate_controller);
+}
@@ -15,28 +15,18 @@
  * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#ifndef STREAMER_BUFFER_QUEUE_H_
-#define STREAMER_BUFFER_QUEUE_H_
+#ifndef STREAMER_BITRATE_H_
+#define STREAMER_BITRATE_H_
 
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
-struct BufferQueue;
+struct BitrateController;
 
-struct BufferQueueItem {
-  size_t size;
-  uint8_t data[];
-};
+struct BitrateController* BitrateControllerCreate(int fd, uint32_t max_bitrate);
+bool BitrateControllerUpdate(struct BitrateController* bitrate_controller,
+                             size_t pending_size, uint32_t* bitrate);
+void BitrateControllerDestroy(struct BitrateController* bitrate_controller);
 
-struct BufferQueueItem* BufferQueueItemCreate(const void* data, size_t size);
-void BufferQueueItemDestroy(struct BufferQueueItem* buffer_queue_item);
-
-struct BufferQueue* BufferQueueCreate(void);
-bool BufferQueueQueue(struct BufferQueue* buffer_queue,
-                      struct BufferQueueItem* buffer_queue_item);
-bool BufferQueueDequeue(struct BufferQueue* buffer_queue,
-                        struct BufferQueueItem** buffer_queue_item);
-void BufferQueueDestroy(struct BufferQueue* buffer_queue);
-
-#endif  // STREAMER_BUFFER_QUEUE_H_
+#endif  // STREAMER_BITRATE_H_
@@ -17,31 +17,41 @@
 
 #include "bitstream.h"
 
-void BitstreamAppend(struct Bitstream* bitstream, size_t size, uint32_t bits) {
+#include <string.h>
+
+// mburakov: Appends up to 56 bits in one go. Partial byte at the tail of the
+// bitstream is merged with the new bits in a 64-bit accumulator, which is
+// then flushed bytewise, so that nothing is written past the last touched
+// byte.
+static void AppendWord(struct Bitstream* bitstream, size_t size,
+                       uint64_t bits) {
   uint8_t* ptr = (uint8_t*)bitstream->data + bitstream->size / 8;
-  size_t vacant_bits = 8 - bitstream->size % 8;
-  *ptr &= ~0 << vacant_bits;
+  size_t used_bits = bitstream->size % 8;
+  uint64_t word = used_bits ? *ptr >> (8 - used_bits) : 0;
+  word = word << size | (bits & ((UINT64_C(1) << size) - 1));
 
-  if (vacant_bits >= size) {
-    *ptr |= bits << (vacant_bits - size);
-    bitstream->size += size;
-    return;
-  }
+  size_t total_bits = used_bits + size;
+  size_t total_bytes = (total_bits + 7) / 8;
+  word <<= total_bytes * 8 - total_bits;
+  for (size_t i = total_bytes; i--; word >>= 8) ptr[i] = (uint8_t)word;
+  bitstream->size += size;
+}
 
-  *ptr |= bits >> (size - vacant_bits);
-  bitstream->size += vacant_bits;
-  BitstreamAppend(bitstream, size - vacant_bits, bits);
+void BitstreamAppend(struct Bitstream* bitstream, size_t size, uint32_t bits) {
+  AppendWord(bitstream, size, bits);
 }
 
 void BitstreamAppendUE(struct Bitstream* bitstream, uint32_t bits) {
-  size_t size = 0;
-  uint32_t dummy = ++bits;
-  while (dummy) {
-    dummy >>= 1;
-    size++;
+  // mburakov: Leading zeros of exp-golomb code are implicit when appending
+  // the incremented value with the doubled width, as long as it fits.
+  uint32_t value = bits + 1;
+  size_t size = 32 - (size_t)__builtin_clz(value);
+  if (size * 2 - 1 <= 56) {
+    AppendWord(bitstream, size * 2 - 1, value);
+    return;
   }
-  BitstreamAppend(bitstream, size - 1, 0);
-  BitstreamAppend(bitstream, size, bits);
+  AppendWord(bitstream, size - 1, 0);
+  AppendWord(bitstream, size, value);
 }
 
 void BitstreamAppendSE(struct Bitstream* bitstream, int32_t bits) {
@@ -61,17 +71,95 @@ void BitstreamByteAlign(struct Bitstream* bitstream) {
 void BitstreamInflate(struct Bitstream* bitstream,
                       const struct Bitstream* source) {
   uint8_t* dst_data = (uint8_t*)bitstream->data + (bitstream->size + 7) / 8;
-  uint8_t* src_data = source->data;
-  size_t src_size = (source->size + 7) / 8;
+  const uint8_t* src_data = source->data;
+  const uint8_t* src_end = src_data + (source->size + 7) / 8;
 
-  if (src_size > 0) *dst_data++ = *src_data++;
-  if (src_size > 1) *dst_data++ = *src_data++;
+  size_t zeros = 0;
+  for (size_t i = 0; i < 2 && src_data < src_end; i++) {
+    zeros = *src_data ? 0 : zeros + 1;
+    *dst_data++ = *src_data++;
+  }
 
-  for (size_t i = 2; i < src_size; i++) {
+  // mburakov: Only bytes following two zeros need an attention, so skip over
+  // everything else with memchr, and copy the non-zero runs at once.
+  while (src_data < src_end) {
     // mburakov: emulation_prevention_three_byte
-    if (!dst_data[-2] && !dst_data[-1] && !src_data[0]) *dst_data++ = 3;
+    if (zeros == 2 && *src_data <= 3) {
+      *dst_data++ = 3;
+      zeros = 0;
+    }
+    if (*src_data) {
+      const uint8_t* zero = memchr(src_data, 0, (size_t)(src_end - src_data));
+      size_t size = (size_t)((zero ? zero : src_end) - src_data);
+      memcpy(dst_data, src_data, size);
+      dst_data += size;
+      src_data += size;
+      zeros = 0;
+      continue;
+    }
     *dst_data++ = *src_data++;
+    zeros++;
   }
 
   bitstream->size = (size_t)(dst_data - (uint8_t*)bitstream->data) * 8;
 }
+
+void BitstreamDeflate(struct Bitstream* bitstream,
+                      const struct Bitstream* source) {
+  uint8_t* dst_data = (uint8_t*)bitstream->data + (bitstream->size + 7) / 8;
+  const uint8_t* src_data = source->data;
+  const uint8_t* src_end = src_data + (source->size + 7) / 8;
+
+  size_t zeros = 0;
+  while (src_data < src_end) {
+    // mburakov: emulation_prevention_three_byte
+    if (zeros == 2 && *src_data == 3) {
+      src_data++;
+      zeros = 0;
+      continue;
+    }
+    zeros = *src_data ? 0 : zeros + 1;
+    *dst_data++ = *src_data++;
+  }
+
+  bitstream->size = (size_t)(dst_data - (uint8_t*)bitstream->data) * 8;
+}
+
+uint32_t BitstreamRead(struct BitstreamReader* reader, size_t size) {
+  if (reader->overflow || reader->size - reader->offset < size) {
+    reader->overflow = true;
+    return 0;
+  }
+
+  // mburakov: Mirrors the writer, at most five bytes are touched by a single
+  // read of up to 32 bits, so these fit into a 64-bit accumulator.
+  const uint8_t* ptr = (const uint8_t*)reader->data + reader->offset / 8;
+  size_t total_bits = reader->offset % 8 + size;
+  size_t total_bytes = (total_bits + 7) / 8;
+  uint64_t word = 0;
+  for (size_t i = 0; i < total_bytes; i++) word = word << 8 | ptr[i];
+  word >>= total_bytes * 8 - total_bits;
+  reader->offset += size;
+  return (uint32_t)(word & ((UINT64_C(1) << size) - 1));
+}
+
+uint32_t BitstreamReadUE(struct BitstreamReader* reader) {
+  size_t leading_zero_bits = 0;
+  while (!BitstreamRead(reader, 1)) {
+    if (reader->overflow || ++leading_zero_bits > 31) {
+      reader->overflow = true;
+      return 0;
+    }
+  }
+  return ((UINT32_C(1) << leading_zero_bits) - 1) +
+         BitstreamRead(reader, leading_zero_bits);
+}
+
+int32_t BitstreamReadSE(struct BitstreamReader* reader) {
+  uint32_t bits = BitstreamReadUE(reader);
+  return bits & 1 ? (int32_t)(bits / 2 + 1) : -(int32_t)(bits / 2);
+}
+
+bool BitstreamIsByteAligned(const struct BitstreamReader* reader) {
+  return !(reader->offset % 8);
+}
@@ -18,6 +18,7 @@
 #ifndef STREAMER_BITSTREAM_H_
 #define STREAMER_BITSTREAM_H_
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -26,6 +27,13 @@ struct Bitstream {
   size_t size;
 };
 
+struct BitstreamReader {
+  const void* data;
+  size_t size;
+  size_t offset;
+  bool overflow;
+};
+
 void BitstreamAppend(struct Bitstream* bitstream, size_t size, uint32_t bits);
 void BitstreamAppendUE(struct Bitstream* bitstream, uint32_t bits);
 void BitstreamAppendSE(struct Bitstream* bitstream, int32_t bits);
@@ -33,5 +41,12 @@ void BitstreamByteAlign(struct Bitstream* bitstream);
 
 void BitstreamInflate(struct Bitstream* bitstream,
                       const struct Bitstream* source);
+void BitstreamDeflate(struct Bitstream* bitstream,
+                      const struct Bitstream* source);
+
+uint32_t BitstreamRead(struct BitstreamReader* reader, size_t size);
+uint32_t BitstreamReadUE(struct BitstreamReader* reader);
+int32_t BitstreamReadSE(struct BitstreamReader* reader);
+bool BitstreamIsByteAligned(const struct BitstreamReader* reader);
 
 #endif  // STREAMER_BITSTREAM_H_
@@ -24,16 +24,18 @@
 #include <string.h>
 
 #include "capture_kms.h"
+#include "capture_synth.h"
 #include "capture_wlr.h"
 #include "toolbox/utils.h"
 
 struct CaptureContext {
   struct CaptureContextKms* kms;
   struct CaptureContextWlr* wlr;
+  struct CaptureContextSynth* synth;
 };
 
 struct CaptureContext* CaptureContextCreate(
-    struct GpuContext* gpu_context,
+    struct GpuContext* gpu_context, const struct CaptureConfig* config,
     const struct CaptureContextCallbacks* callbacks, void* user) {
   struct CaptureContext* capture_context =
       calloc(1, sizeof(struct CaptureContext));
@@ -42,7 +44,20 @@ struct CaptureContext* CaptureContextCreate(
     return NULL;
   }
 
-  capture_context->kms = CaptureContextKmsCreate(gpu_context, callbacks, user);
+  // mburakov: Synthetic capturing is only used when explicitly requested, and
+  // there is no fallback to the real capturing in this case.
+  if (config->synth_config) {
+    capture_context->synth = CaptureContextSynthCreate(
+        gpu_context, config->synth_config, callbacks, user);
+    if (capture_context->synth) return capture_context;
+
+    LOG("Failed to create synth capture context");
+    free(capture_context);
+    return NULL;
+  }
+
+  capture_context->kms =
+      CaptureContextKmsCreate(gpu_context, config, callbacks, user);
   if (capture_context->kms) return capture_context;
 
   LOG("Failed to create kms capture context");
@@ -59,6 +74,8 @@ int CaptureContextGetEventsFd(struct CaptureContext* capture_context) {
     return CaptureContextKmsGetEventsFd(capture_context->kms);
   if (capture_context->wlr)
     return CaptureContextWlrGetEventsFd(capture_context->wlr);
+  if (capture_context->synth)
+    return CaptureContextSynthGetEventsFd(capture_context->synth);
   return -1;
 }
 
@@ -67,10 +84,14 @@ bool CaptureContextProcessEvents(struct CaptureContext* capture_context) {
     return CaptureContextKmsProcessEvents(capture_context->kms);
   if (capture_context->wlr)
     return CaptureContextWlrProcessEvents(capture_context->wlr);
+  if (capture_context->synth)
+    return CaptureContextSynthProcessEvents(capture_context->synth);
   return false;
 }
 
 void CaptureContextDestroy(struct CaptureContext* capture_context) {
+  if (capture_context->synth)
+    CaptureContextSynthDestroy(capture_context->synth);
   if (capture_context->wlr) CaptureContextWlrDestroy(capture_context->wlr);
   if (capture_context->kms) CaptureContextKmsDestroy(capture_context->kms);
   free(capture_context);
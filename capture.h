@@ -19,17 +19,24 @@
 #define STREAMER_CAPTURE_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 
 struct CaptureContext;
 struct GpuContext;
 struct GpuFrame;
 
+struct CaptureConfig {
+  const char* synth_config;
+  uint32_t vblank_divisor;
+  bool skip_unchanged;
+};
+
 struct CaptureContextCallbacks {
   void (*OnFrameReady)(void* user, const struct GpuFrame* gpu_frame);
 };
 
 struct CaptureContext* CaptureContextCreate(
-    struct GpuContext* gpu_context,
+    struct GpuContext* gpu_context, const struct CaptureConfig* config,
     const struct CaptureContextCallbacks* callbacks, void* user);
 int CaptureContextGetEventsFd(struct CaptureContext* capture_context);
 bool CaptureContextProcessEvents(struct CaptureContext* capture_context);
@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/timerfd.h>
 #include <time.h>
 #include <unistd.h>
@@ -33,6 +34,20 @@
 
 static const int kCapturePeriod = 1000000000 / 60;
 
+// mburakov: Unchanged framebuffer is still captured after this many ticks.
+#define KEEPALIVE_TICKS 60
+
+// mburakov: Compositors flip between two or three framebuffers, and a couple
+// of extra entries cover cursor or overlay transitions.
+#define FRAME_CACHE_SIZE 4
+
+struct CachedFrame {
+  struct drm_mode_fb_cmd2 fb;
+  ino_t dmabuf_ino;
+  struct GpuFrame* gpu_frame;
+  unsigned long long last_used;
+};
+
 struct CaptureContextKms {
   struct GpuContext* gpu_context;
   const struct CaptureContextCallbacks* callbacks;
@@ -40,6 +55,15 @@ struct CaptureContextKms {
 
   int drm_fd;
   uint32_t crtc_id;
+  uint32_t crtc_index;
+  uint32_t vblank_divisor;
+  bool skip_unchanged;
+  uint32_t fb_id;
+  uint32_t unchanged_ticks;
+  struct CachedFrame frame_cache[FRAME_CACHE_SIZE];
+  unsigned long long ticks;
+  bool vblank_received;
+  unsigned int vblank_sequence;
   int timer_fd;
 };
 
@@ -47,6 +71,8 @@ static int OpenAnyModule(void) {
   static const char* const modules[] = {
       "i915",
       "amdgpu",
+      // mburakov: Virtual KMS driver, useful for testing without hardware.
+      "vkms",
   };
   for (size_t i = 0; i < LENGTH(modules); i++) {
     int drm_fd = drmOpen(modules[i], NULL);
@@ -56,39 +82,191 @@ static int OpenAnyModule(void) {
   return -1;
 }
 
-static bool GetCrtcFb(int drm_fd, uint32_t crtc_id,
-                      struct drm_mode_fb_cmd2* drm_mode_fb_cmd2) {
+static uint32_t GetCrtcFbId(int drm_fd, uint32_t crtc_id) {
   struct drm_mode_crtc drm_mode_crtc = {
       .crtc_id = crtc_id,
   };
   if (drmIoctl(drm_fd, DRM_IOCTL_MODE_GETCRTC, &drm_mode_crtc)) {
     LOG("Failed to get crtc %u (%s)", crtc_id, strerror(errno));
-    return false;
+    return 0;
   }
   if (!drm_mode_crtc.fb_id) {
     LOG("Crtc %u has no framebuffer", crtc_id);
-    return false;
+    return 0;
   }
+  return drm_mode_crtc.fb_id;
+}
 
+// mburakov: Every GETFB2 call creates new gem handles, and these must be
+// closed explicitly. Planes might share the same handle.
+static void CloseHandles(int drm_fd,
+                         const struct drm_mode_fb_cmd2* drm_mode_fb_cmd2) {
+  const uint32_t* handles = drm_mode_fb_cmd2->handles;
+  for (size_t i = 0; i < LENGTH(drm_mode_fb_cmd2->handles); i++) {
+    if (!handles[i]) break;
+    bool seen = false;
+    for (size_t j = 0; j < i; j++) seen |= handles[j] == handles[i];
+    if (seen) continue;
+    struct drm_gem_close drm_gem_close = {.handle = handles[i]};
+    if (drmIoctl(drm_fd, DRM_IOCTL_GEM_CLOSE, &drm_gem_close))
+      LOG("Failed to close gem handle %u (%s)", handles[i], strerror(errno));
+  }
+}
+
+static bool GetFb(int drm_fd, uint32_t fb_id,
+                  struct drm_mode_fb_cmd2* drm_mode_fb_cmd2) {
   struct drm_mode_fb_cmd2 result = {
-      .fb_id = drm_mode_crtc.fb_id,
+      .fb_id = fb_id,
   };
   if (drmIoctl(drm_fd, DRM_IOCTL_MODE_GETFB2, &result)) {
-    LOG("Failed to get framebuffer %u (%s)", drm_mode_crtc.fb_id,
-        strerror(errno));
+    LOG("Failed to get framebuffer %u (%s)", fb_id, strerror(errno));
     return false;
   }
   if (!result.handles[0]) {
-    LOG("Framebuffer %u has no handles", drm_mode_crtc.fb_id);
+    LOG("Framebuffer %u has no handles", fb_id);
+    return false;
+  }
+
+  if (drm_mode_fb_cmd2)
+    *drm_mode_fb_cmd2 = result;
+  else
+    CloseHandles(drm_fd, &result);
+  return true;
+}
+
+// mburakov: Framebuffer ids are reused by the kernel after framebuffers are
+// destroyed, so everything except handles must match for a cache hit.
+static bool IsSameFb(const struct drm_mode_fb_cmd2* a,
+                     const struct drm_mode_fb_cmd2* b) {
+  return a->fb_id == b->fb_id && a->width == b->width &&
+         a->height == b->height && a->pixel_format == b->pixel_format &&
+         a->flags == b->flags && !memcmp(a->pitches, b->pitches,
+                                         sizeof(a->pitches)) &&
+         !memcmp(a->offsets, b->offsets, sizeof(a->offsets)) &&
+         !memcmp(a->modifier, b->modifier, sizeof(a->modifier));
+}
+
+// mburakov: Metadata alone does not tell whether a reused framebuffer id got
+// backed by another buffer with the same layout, i.e. after a mode change to
+// the same size. Exporting a gem handle returns the same dmabuf every time,
+// so its inode identifies the buffer, and only the first plane is checked.
+static ino_t GetDmabufIno(int drm_fd, uint32_t handle) {
+  int dmabuf_fd;
+  int status = drmPrimeHandleToFD(drm_fd, handle, 0, &dmabuf_fd);
+  if (status) {
+    LOG("Failed to get dmabuf fd (%d)", status);
+    return 0;
+  }
+  struct stat stat;
+  ino_t result = 0;
+  if (fstat(dmabuf_fd, &stat))
+    LOG("Failed to stat dmabuf (%s)", strerror(errno));
+  else
+    result = stat.st_ino;
+  close(dmabuf_fd);
+  return result;
+}
+
+static void EvictCachedFrame(struct CaptureContextKms* capture_context,
+                             struct CachedFrame* cached_frame) {
+  GpuContextDestroyFrame(capture_context->gpu_context, cached_frame->gpu_frame);
+  *cached_frame = (struct CachedFrame){0};
+}
+
+// mburakov: Whenever a new framebuffer shows up on the crtc, the compositor
+// might have destroyed some of the old ones, i.e. on resize. Those are found
+// by failing GETFB2, and evicted right away so that dmabufs are released.
+static void EvictStaleFrames(struct CaptureContextKms* capture_context,
+                             uint32_t fb_id) {
+  for (size_t i = 0; i < LENGTH(capture_context->frame_cache); i++) {
+    struct CachedFrame* cached_frame = &capture_context->frame_cache[i];
+    if (!cached_frame->gpu_frame || cached_frame->fb.fb_id == fb_id) continue;
+    struct drm_mode_fb_cmd2 drm_mode_fb_cmd2 = {
+        .fb_id = cached_frame->fb.fb_id,
+    };
+    if (drmIoctl(capture_context->drm_fd, DRM_IOCTL_MODE_GETFB2,
+                 &drm_mode_fb_cmd2)) {
+      EvictCachedFrame(capture_context, cached_frame);
+      continue;
+    }
+    CloseHandles(capture_context->drm_fd, &drm_mode_fb_cmd2);
+    if (!IsSameFb(&cached_frame->fb, &drm_mode_fb_cmd2))
+      EvictCachedFrame(capture_context, cached_frame);
+  }
+}
+
+static struct CachedFrame* LookupCachedFrame(
+    struct CaptureContextKms* capture_context,
+    const struct drm_mode_fb_cmd2* drm_mode_fb_cmd2) {
+  struct CachedFrame* lru = &capture_context->frame_cache[0];
+  for (size_t i = 0; i < LENGTH(capture_context->frame_cache); i++) {
+    struct CachedFrame* cached_frame = &capture_context->frame_cache[i];
+    if (cached_frame->gpu_frame &&
+        IsSameFb(&cached_frame->fb, drm_mode_fb_cmd2)) {
+      return cached_frame;
+    }
+    if (cached_frame->last_used < lru->last_used) lru = cached_frame;
+  }
+  return lru;
+}
+
+// mburakov: Vblank events are requested for an absolute sequence number, so
+// that the capture rate is locked to the display refresh and does not drift.
+// In case processing took longer than a few vblanks, the next one is used.
+static bool RequestVblank(struct CaptureContextKms* capture_context,
+                          bool relative, unsigned int sequence) {
+  uint32_t type = DRM_VBLANK_EVENT |
+                  (relative ? DRM_VBLANK_RELATIVE
+                            : DRM_VBLANK_ABSOLUTE | DRM_VBLANK_NEXTONMISS);
+  if (capture_context->crtc_index == 1) {
+    type |= DRM_VBLANK_SECONDARY;
+  } else if (capture_context->crtc_index > 1) {
+    type |= capture_context->crtc_index << DRM_VBLANK_HIGH_CRTC_SHIFT &
+            DRM_VBLANK_HIGH_CRTC_MASK;
+  }
+  drmVBlank vblank = {
+      .request.type = (drmVBlankSeqType)type,
+      .request.sequence = sequence,
+      .request.signal = (unsigned long)capture_context,
+  };
+  if (drmWaitVBlank(capture_context->drm_fd, &vblank)) {
+    LOG("Failed to request vblank event (%s)", strerror(errno));
     return false;
   }
+  return true;
+}
+
+static void OnVblank(int fd, unsigned int sequence, unsigned int tv_sec,
+                     unsigned int tv_usec, void* user_data) {
+  (void)fd;
+  (void)tv_sec;
+  (void)tv_usec;
+  struct CaptureContextKms* capture_context = user_data;
+  capture_context->vblank_received = true;
+  capture_context->vblank_sequence = sequence;
+}
 
-  if (drm_mode_fb_cmd2) *drm_mode_fb_cmd2 = result;
+static bool ArmTimer(struct CaptureContextKms* capture_context) {
+  capture_context->timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+  if (capture_context->timer_fd == -1) {
+    LOG("Failed to create timer (%s)", strerror(errno));
+    return false;
+  }
+  static const struct itimerspec kTimerSpec = {
+      .it_interval.tv_nsec = kCapturePeriod,
+      .it_value.tv_nsec = kCapturePeriod,
+  };
+  if (timerfd_settime(capture_context->timer_fd, 0, &kTimerSpec, NULL)) {
+    LOG("Failed to arm timer (%s)", strerror(errno));
+    close(capture_context->timer_fd);
+    capture_context->timer_fd = -1;
+    return false;
+  }
   return true;
 }
 
 struct CaptureContextKms* CaptureContextKmsCreate(
-    struct GpuContext* gpu_context,
+    struct GpuContext* gpu_context, const struct CaptureConfig* config,
     const struct CaptureContextCallbacks* callbacks, void* user) {
   struct CaptureContextKms* capture_context =
       malloc(sizeof(struct CaptureContextKms));
@@ -101,6 +279,8 @@ struct CaptureContextKms* CaptureContextKmsCreate(
       .callbacks = callbacks,
       .user = user,
       .drm_fd = -1,
+      .vblank_divisor = config->vblank_divisor,
+      .skip_unchanged = config->skip_unchanged,
       .timer_fd = -1,
   };
 
@@ -121,9 +301,11 @@ struct CaptureContextKms* CaptureContextKmsCreate(
     goto rollback_drm_fd;
   }
   for (size_t i = 0; i < drm_mode_card_res.count_crtcs; i++) {
-    if (GetCrtcFb(capture_context->drm_fd, crtc_ids[i], NULL)) {
+    uint32_t fb_id = GetCrtcFbId(capture_context->drm_fd, crtc_ids[i]);
+    if (fb_id && GetFb(capture_context->drm_fd, fb_id, NULL)) {
       LOG("Capturing crtc %u", crtc_ids[i]);
       capture_context->crtc_id = crtc_ids[i];
+      capture_context->crtc_index = (uint32_t)i;
       break;
     }
   }
@@ -132,23 +314,20 @@ struct CaptureContextKms* CaptureContextKmsCreate(
     goto rollback_drm_fd;
   }
 
-  capture_context->timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
-  if (capture_context->timer_fd == -1) {
-    LOG("Failed to create timer (%s)", strerror(errno));
-    goto rollback_drm_fd;
+  // mburakov: Drivers without vblank support, or a crtc that is off, fail
+  // the very first request. Free-running timer is used in this case.
+  if (capture_context->vblank_divisor) {
+    if (RequestVblank(capture_context, true, capture_context->vblank_divisor))
+      return capture_context;
+    LOG("Falling back to timer-driven capturing");
+    capture_context->vblank_divisor = 0;
   }
-  static const struct itimerspec kTimerSpec = {
-      .it_interval.tv_nsec = kCapturePeriod,
-      .it_value.tv_nsec = kCapturePeriod,
-  };
-  if (timerfd_settime(capture_context->timer_fd, 0, &kTimerSpec, NULL)) {
-    LOG("Failed to arm timer (%s)", strerror(errno));
-    goto rollback_timer_fd;
+  if (!ArmTimer(capture_context)) {
+    LOG("Failed to arm capture timer");
+    goto rollback_drm_fd;
   }
   return capture_context;
 
-rollback_timer_fd:
-  close(capture_context->timer_fd);
 rollback_drm_fd:
   drmClose(capture_context->drm_fd);
 rollback_capture_context:
@@ -157,22 +336,88 @@ rollback_capture_context:
 }
 
 int CaptureContextKmsGetEventsFd(struct CaptureContextKms* capture_context) {
-  return capture_context->timer_fd;
+  return capture_context->vblank_divisor ? capture_context->drm_fd
+                                         : capture_context->timer_fd;
 }
 
-bool CaptureContextKmsProcessEvents(struct CaptureContextKms* capture_context) {
-  uint64_t expirations;
-  if (read(capture_context->timer_fd, &expirations, sizeof(expirations)) !=
-      sizeof(expirations)) {
-    LOG("Failed to read timer expirations (%s)", strerror(errno));
+static bool ReadTick(struct CaptureContextKms* capture_context) {
+  if (!capture_context->vblank_divisor) {
+    uint64_t expirations;
+    if (read(capture_context->timer_fd, &expirations, sizeof(expirations)) !=
+        sizeof(expirations)) {
+      LOG("Failed to read timer expirations (%s)", strerror(errno));
+      return false;
+    }
+    return true;
+  }
+
+  drmEventContext event_context = {
+      .version = 2,
+      .vblank_handler = OnVblank,
+  };
+  capture_context->vblank_received = false;
+  if (drmHandleEvent(capture_context->drm_fd, &event_context)) {
+    LOG("Failed to handle drm events (%s)", strerror(errno));
     return false;
   }
+  if (!capture_context->vblank_received) return true;
+  if (RequestVblank(
+          capture_context, false,
+          capture_context->vblank_sequence + capture_context->vblank_divisor))
+    return true;
 
-  struct drm_mode_fb_cmd2 drm_mode_fb_cmd2;
-  if (!GetCrtcFb(capture_context->drm_fd, capture_context->crtc_id,
-                 &drm_mode_fb_cmd2)) {
+  // mburakov: Vblank requests also start failing mid-stream, i.e. when the
+  // crtc is put to sleep by DPMS. Keep capturing on a timer in this case, and
+  // let the caller pick up the new events fd.
+  LOG("Falling back to timer-driven capturing");
+  capture_context->vblank_divisor = 0;
+  if (!ArmTimer(capture_context)) {
+    LOG("Failed to arm capture timer");
     return false;
   }
+  return true;
+}
+
+bool CaptureContextKmsProcessEvents(struct CaptureContextKms* capture_context) {
+  if (!ReadTick(capture_context)) return false;
+  if (capture_context->vblank_divisor && !capture_context->vblank_received)
+    return true;
+
+  uint32_t fb_id =
+      GetCrtcFbId(capture_context->drm_fd, capture_context->crtc_id);
+  if (!fb_id) return false;
+
+  // mburakov: Compositors flip between several framebuffers, so the same one
+  // still being scanned out means nothing changed on the screen. Frames are
+  // still captured once in a while, to cover compositors rendering into the
+  // front buffer, and to let the client recover from losses.
+  if (capture_context->skip_unchanged && fb_id == capture_context->fb_id &&
+      capture_context->unchanged_ticks < KEEPALIVE_TICKS) {
+    capture_context->unchanged_ticks++;
+    return true;
+  }
+  capture_context->fb_id = fb_id;
+  capture_context->unchanged_ticks = 0;
+
+  struct drm_mode_fb_cmd2 drm_mode_fb_cmd2;
+  if (!GetFb(capture_context->drm_fd, fb_id, &drm_mode_fb_cmd2)) return false;
+
+  // mburakov: Steady state is a cache hit, which costs a single dmabuf export
+  // to confirm the buffer identity, and no egl imports. Otherwise least
+  // recently used entry is replaced, and so is an entry with matching
+  // metadata but a different buffer behind it.
+  capture_context->ticks++;
+  struct CachedFrame* cached_frame =
+      LookupCachedFrame(capture_context, &drm_mode_fb_cmd2);
+  if (cached_frame->gpu_frame &&
+      IsSameFb(&cached_frame->fb, &drm_mode_fb_cmd2) &&
+      GetDmabufIno(capture_context->drm_fd, drm_mode_fb_cmd2.handles[0]) ==
+          cached_frame->dmabuf_ino) {
+    CloseHandles(capture_context->drm_fd, &drm_mode_fb_cmd2);
+    goto frame_ready;
+  }
+  EvictStaleFrames(capture_context, fb_id);
+  if (cached_frame->gpu_frame) EvictCachedFrame(capture_context, cached_frame);
 
   struct GpuFramePlane planes[] = {
       {.dmabuf_fd = -1},
@@ -198,6 +443,12 @@ bool CaptureContextKmsProcessEvents(struct CaptureContextKms* capture_context) {
     planes[nplanes].modifier = drm_mode_fb_cmd2.modifier[nplanes];
   }
 
+  struct stat stat;
+  if (fstat(planes[0].dmabuf_fd, &stat)) {
+    LOG("Failed to stat dmabuf (%s)", strerror(errno));
+    goto release_planes;
+  }
+
   struct GpuFrame* gpu_frame = GpuContextCreateFrame(
       capture_context->gpu_context, drm_mode_fb_cmd2.width,
       drm_mode_fb_cmd2.height, drm_mode_fb_cmd2.pixel_format, nplanes, planes);
@@ -205,21 +456,33 @@ bool CaptureContextKmsProcessEvents(struct CaptureContextKms* capture_context) {
     LOG("Failed to create gpu frame");
     goto release_planes;
   }
+  CloseHandles(capture_context->drm_fd, &drm_mode_fb_cmd2);
+  cached_frame->fb = drm_mode_fb_cmd2;
+  cached_frame->dmabuf_ino = stat.st_ino;
+  cached_frame->gpu_frame = gpu_frame;
 
-  // mburakov: Capture context might get destroyed in callback.
-  struct GpuContext* gpu_context = capture_context->gpu_context;
-  capture_context->callbacks->OnFrameReady(capture_context->user, gpu_frame);
-  GpuContextDestroyFrame(gpu_context, gpu_frame);
+frame_ready:
+  // mburakov: Capture context might get destroyed in callback, so it must not
+  // be touched after that.
+  cached_frame->last_used = capture_context->ticks;
+  capture_context->callbacks->OnFrameReady(capture_context->user,
+                                           cached_frame->gpu_frame);
   return true;
 
 release_planes:
   CloseUniqueFds((int[]){planes[0].dmabuf_fd, planes[1].dmabuf_fd,
                          planes[2].dmabuf_fd, planes[3].dmabuf_fd});
+  CloseHandles(capture_context->drm_fd, &drm_mode_fb_cmd2);
   return false;
 }
 
 void CaptureContextKmsDestroy(struct CaptureContextKms* capture_context) {
-  close(capture_context->timer_fd);
+  for (size_t i = LENGTH(capture_context->frame_cache); i; i--) {
+    struct CachedFrame* cached_frame = &capture_context->frame_cache[i - 1];
+    if (!cached_frame->gpu_frame) continue;
+    EvictCachedFrame(capture_context, cached_frame);
+  }
+  if (capture_context->timer_fd != -1) close(capture_context->timer_fd);
   drmClose(capture_context->drm_fd);
   free(capture_context);
 }
@@ -23,7 +23,7 @@
 struct CaptureContextKms;
 
 struct CaptureContextKms* CaptureContextKmsCreate(
-    struct GpuContext* gpu_context,
+    struct GpuContext* gpu_context, const struct CaptureConfig* config,
     const struct CaptureContextCallbacks* callbacks, void* user);
 int CaptureContextKmsGetEventsFd(struct CaptureContextKms* capture_context);
 bool CaptureContextKmsProcessEvents(struct CaptureContextKms* capture_context);
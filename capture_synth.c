@@ -0,0 +1,447 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "capture_synth.h"
+
+#include <drm_fourcc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gpu.h"
+#include "toolbox/utils.h"
+#include "trace.h"
+
+// mburakov: Synthetic capturing does not need any display, so the whole
+// pipeline could run headless, i.e. for benchmarking encoding and networking.
+// Frames are either generated, or replayed in a loop from a file of raw
+// tightly packed frames. Either way frames are uploaded to the gpu, and go
+// through the same colorspace conversion as the real captured ones.
+
+enum SynthSource {
+  kSynthSourceGradient = 0,
+  kSynthSourceText,
+  kSynthSourceDesktop,
+  kSynthSourceRgb,
+  kSynthSourceNv12,
+};
+
+// mburakov: Text glyphs are cells of this size, and the page scrolls by this
+// many rows every frame.
+#define GLYPH_WIDTH 8
+#define GLYPH_HEIGHT 16
+#define SCROLL_SPEED 2
+
+struct CaptureContextSynth {
+  struct GpuContext* gpu_context;
+  const struct CaptureContextCallbacks* callbacks;
+  void* user;
+
+  enum SynthSource source;
+  uint32_t width;
+  uint32_t height;
+  struct GpuFrame* gpu_frame;
+  uint32_t* pixels;
+  size_t frame_counter;
+
+  const uint8_t* file_data;
+  size_t file_size;
+  size_t frame_size;
+  size_t frames_count;
+
+  int timer_fd;
+};
+
+struct SynthConfig {
+  enum SynthSource source;
+  uint32_t width;
+  uint32_t height;
+  uint32_t fps;
+  uint32_t fourcc;
+  const char* path;
+};
+
+static const struct {
+  const char* name;
+  enum SynthSource source;
+  uint32_t fourcc;
+} kSynthSources[] = {
+    {"gradient", kSynthSourceGradient, DRM_FORMAT_XBGR8888},
+    {"text", kSynthSourceText, DRM_FORMAT_XBGR8888},
+    {"desktop", kSynthSourceDesktop, DRM_FORMAT_XBGR8888},
+    // mburakov: Little-endian BGR888 is the plain R, G, B byte order.
+    {"rgb", kSynthSourceRgb, DRM_FORMAT_BGR888},
+    {"nv12", kSynthSourceNv12, DRM_FORMAT_NV12},
+};
+
+static bool ParseSynthConfig(const char* synth_config,
+                             struct SynthConfig* out_config) {
+  const char* size = strchr(synth_config, ':');
+  if (!size) {
+    LOG("Invalid synthetic config requested");
+    return false;
+  }
+
+  size_t source = 0;
+  size_t length = (size_t)(size - synth_config);
+  for (; source < LENGTH(kSynthSources); source++) {
+    if (strlen(kSynthSources[source].name) == length &&
+        !strncmp(kSynthSources[source].name, synth_config, length))
+      break;
+  }
+  if (source == LENGTH(kSynthSources)) {
+    LOG("Invalid synthetic source requested");
+    return false;
+  }
+
+  char* end;
+  unsigned long width = strtoul(size + 1, &end, 10);
+  unsigned long height = *end == 'x' ? strtoul(end + 1, &end, 10) : 0;
+  unsigned long fps = *end == '@' ? strtoul(end + 1, &end, 10) : 0;
+  if (width < 64 || width > UINT16_MAX || width % 2 || height < 64 ||
+      height > UINT16_MAX || height % 2 || !fps || fps > 1000) {
+    LOG("Invalid synthetic size or rate requested");
+    return false;
+  }
+
+  const char* path = *end == ':' ? end + 1 : NULL;
+  bool needs_path = kSynthSources[source].source == kSynthSourceRgb ||
+                    kSynthSources[source].source == kSynthSourceNv12;
+  if ((*end && !path) || needs_path != !!path) {
+    LOG("Invalid synthetic file requested");
+    return false;
+  }
+
+  *out_config = (struct SynthConfig){
+      .source = kSynthSources[source].source,
+      .width = (uint32_t)width,
+      .height = (uint32_t)height,
+      .fps = (uint32_t)fps,
+      .fourcc = kSynthSources[source].fourcc,
+      .path = path,
+  };
+  return true;
+}
+
+static uint32_t Pixel(uint8_t r, uint8_t g, uint8_t b) {
+  // mburakov: XBGR8888 is R, G, B, X in memory order on little-endian.
+  return (uint32_t)r | (uint32_t)g << 8 | (uint32_t)b << 16;
+}
+
+static void FillRect(struct CaptureContextSynth* capture_context, uint32_t x,
+                     uint32_t y, uint32_t width, uint32_t height,
+                     uint32_t pixel) {
+  uint32_t right = MIN(x + width, capture_context->width);
+  uint32_t bottom = MIN(y + height, capture_context->height);
+  for (uint32_t row = y; row < bottom; row++) {
+    uint32_t* line = capture_context->pixels + row * capture_context->width;
+    for (uint32_t column = x; column < right; column++) line[column] = pixel;
+  }
+}
+
+static void GenerateGradient(struct CaptureContextSynth* capture_context) {
+  uint32_t shift = (uint32_t)capture_context->frame_counter;
+  uint32_t* pixel = capture_context->pixels;
+  for (uint32_t y = 0; y < capture_context->height; y++) {
+    for (uint32_t x = 0; x < capture_context->width; x++) {
+      *pixel++ = Pixel((uint8_t)(x + shift), (uint8_t)(y + shift * 2),
+                       (uint8_t)((x + y) / 2 - shift));
+    }
+  }
+}
+
+// mburakov: Text page is generated twice as high as the frame, with the lower
+// half repeating the upper one. This way any scrolled frame is a contiguous
+// piece of the page that could be uploaded as is.
+static void GenerateText(struct CaptureContextSynth* capture_context) {
+  uint32_t width = capture_context->width;
+  uint32_t height = capture_context->height;
+  FillRect(capture_context, 0, 0, width, height, Pixel(0xff, 0xff, 0xff));
+
+  uint32_t seed = 1;
+  for (uint32_t y = 0; y + GLYPH_HEIGHT <= height; y += GLYPH_HEIGHT) {
+    uint32_t x = GLYPH_WIDTH;
+    while (x + GLYPH_WIDTH * 2 <= width) {
+      seed = seed * 1103515245 + 12345;
+      uint32_t word = 2 + (seed >> 16) % 10;
+      for (; word && x + GLYPH_WIDTH * 2 <= width; word--) {
+        // mburakov: Glyph is a random bitmap of 5x8 dots, stretched
+        // vertically to 12 rows.
+        seed = seed * 1103515245 + 12345;
+        uint32_t bits = seed;
+        for (uint32_t gy = 0; gy < 12; gy++) {
+          uint32_t* line =
+              capture_context->pixels + (y + 2 + gy) * width + x + 1;
+          for (uint32_t gx = 0; gx < 5; gx++) {
+            if (bits >> ((gy * 2 / 3 * 4 + gx) % 32) & 1)
+              line[gx] = Pixel(0x20, 0x20, 0x20);
+          }
+        }
+        x += GLYPH_WIDTH;
+      }
+      x += GLYPH_WIDTH;
+    }
+  }
+  memcpy(capture_context->pixels + (size_t)width * height,
+         capture_context->pixels, (size_t)width * height * sizeof(uint32_t));
+}
+
+static void GenerateDesktop(struct CaptureContextSynth* capture_context) {
+  uint32_t width = capture_context->width;
+  uint32_t height = capture_context->height;
+  for (uint32_t y = 0; y < height; y++) {
+    uint8_t blue = (uint8_t)(0x60 + y * 0x60 / height);
+    FillRect(capture_context, 0, y, width, 1, Pixel(0x10, 0x30, blue));
+  }
+  FillRect(capture_context, 0, height - 32, width, 32,
+           Pixel(0x30, 0x30, 0x30));
+
+  static const struct {
+    uint32_t x, y, width, height;
+  } kWindows[] = {
+      {1, 1, 5, 5},
+      {4, 3, 5, 4},
+  };
+  for (size_t i = 0; i < LENGTH(kWindows); i++) {
+    uint32_t x = kWindows[i].x * width / 10;
+    uint32_t y = kWindows[i].y * height / 10;
+    uint32_t window_width = kWindows[i].width * width / 10;
+    uint32_t window_height = kWindows[i].height * height / 10;
+    FillRect(capture_context, x, y, window_width, window_height,
+             Pixel(0xe0, 0xe0, 0xe0));
+    FillRect(capture_context, x, y, window_width, 24, Pixel(0x40, 0x50, 0x70));
+  }
+}
+
+static bool MapFile(struct CaptureContextSynth* capture_context,
+                    const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    LOG("Failed to open %s (%s)", path, strerror(errno));
+    return false;
+  }
+
+  bool result = false;
+  struct stat stat;
+  if (fstat(fd, &stat)) {
+    LOG("Failed to stat %s (%s)", path, strerror(errno));
+    goto rollback_fd;
+  }
+  capture_context->file_size = (size_t)stat.st_size;
+  capture_context->frames_count =
+      capture_context->file_size / capture_context->frame_size;
+  if (!capture_context->frames_count) {
+    LOG("File %s is smaller than a single frame", path);
+    goto rollback_fd;
+  }
+
+  void* file_data =
+      mmap(NULL, capture_context->file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (file_data == MAP_FAILED) {
+    LOG("Failed to map %s (%s)", path, strerror(errno));
+    goto rollback_fd;
+  }
+  madvise(file_data, capture_context->file_size, MADV_SEQUENTIAL);
+  capture_context->file_data = file_data;
+  LOG("Replaying %zu frames from %s", capture_context->frames_count, path);
+  result = true;
+
+rollback_fd:
+  close(fd);
+  return result;
+}
+
+struct CaptureContextSynth* CaptureContextSynthCreate(
+    struct GpuContext* gpu_context, const char* synth_config,
+    const struct CaptureContextCallbacks* callbacks, void* user) {
+  struct SynthConfig config;
+  if (!ParseSynthConfig(synth_config, &config)) {
+    LOG("Failed to parse synthetic config");
+    return NULL;
+  }
+
+  struct CaptureContextSynth* capture_context =
+      malloc(sizeof(struct CaptureContextSynth));
+  if (!capture_context) {
+    LOG("Failed to allocate capture context (%s)", strerror(errno));
+    return NULL;
+  }
+  *capture_context = (struct CaptureContextSynth){
+      .gpu_context = gpu_context,
+      .callbacks = callbacks,
+      .user = user,
+      .source = config.source,
+      .width = config.width,
+      .height = config.height,
+      .timer_fd = -1,
+  };
+
+  size_t pixels_count = (size_t)config.width * config.height;
+  switch (config.source) {
+    case kSynthSourceGradient:
+    case kSynthSourceDesktop:
+      break;
+    case kSynthSourceText:
+      pixels_count *= 2;
+      break;
+    case kSynthSourceRgb:
+      pixels_count = 0;
+      capture_context->frame_size = (size_t)config.width * config.height * 3;
+      break;
+    case kSynthSourceNv12:
+      pixels_count = 0;
+      capture_context->frame_size =
+          (size_t)config.width * config.height / 2 * 3;
+      break;
+    default:
+      __builtin_unreachable();
+  }
+
+  if (pixels_count) {
+    capture_context->pixels = malloc(pixels_count * sizeof(uint32_t));
+    if (!capture_context->pixels) {
+      LOG("Failed to allocate pixels (%s)", strerror(errno));
+      goto rollback_capture_context;
+    }
+  } else if (!MapFile(capture_context, config.path)) {
+    LOG("Failed to map replayed file");
+    goto rollback_capture_context;
+  }
+
+  capture_context->gpu_frame = GpuContextAllocateFrame(
+      gpu_context, config.width, config.height, config.fourcc);
+  if (!capture_context->gpu_frame) {
+    LOG("Failed to allocate gpu frame");
+    goto rollback_contents;
+  }
+
+  // mburakov: Static sources are only uploaded once.
+  if (config.source == kSynthSourceDesktop) {
+    GenerateDesktop(capture_context);
+    if (!GpuContextWriteFrame(gpu_context, capture_context->gpu_frame,
+                              capture_context->pixels)) {
+      LOG("Failed to write desktop frame");
+      goto rollback_gpu_frame;
+    }
+  } else if (config.source == kSynthSourceText) {
+    GenerateText(capture_context);
+  }
+
+  capture_context->timer_fd = timerfd_create(CLOCK_MONOTONIC, 0);
+  if (capture_context->timer_fd == -1) {
+    LOG("Failed to create timer (%s)", strerror(errno));
+    goto rollback_gpu_frame;
+  }
+  long period = 1000000000 / (long)config.fps;
+  const struct itimerspec timer_spec = {
+      .it_interval.tv_sec = period / 1000000000,
+      .it_interval.tv_nsec = period % 1000000000,
+      .it_value.tv_sec = period / 1000000000,
+      .it_value.tv_nsec = period % 1000000000,
+  };
+  if (timerfd_settime(capture_context->timer_fd, 0, &timer_spec, NULL)) {
+    LOG("Failed to arm timer (%s)", strerror(errno));
+    goto rollback_timer_fd;
+  }
+  return capture_context;
+
+rollback_timer_fd:
+  close(capture_context->timer_fd);
+rollback_gpu_frame:
+  GpuContextDestroyFrame(gpu_context, capture_context->gpu_frame);
+rollback_contents:
+  if (capture_context->file_data)
+    munmap((void*)capture_context->file_data, capture_context->file_size);
+  free(capture_context->pixels);
+rollback_capture_context:
+  free(capture_context);
+  return NULL;
+}
+
+int CaptureContextSynthGetEventsFd(
+    struct CaptureContextSynth* capture_context) {
+  return capture_context->timer_fd;
+}
+
+bool CaptureContextSynthProcessEvents(
+    struct CaptureContextSynth* capture_context) {
+  uint64_t expirations;
+  if (read(capture_context->timer_fd, &expirations, sizeof(expirations)) !=
+      sizeof(expirations)) {
+    LOG("Failed to read timer expirations (%s)", strerror(errno));
+    return false;
+  }
+
+  const void* contents = NULL;
+  switch (capture_context->source) {
+    case kSynthSourceGradient:
+      GenerateGradient(capture_context);
+      contents = capture_context->pixels;
+      break;
+    case kSynthSourceText: {
+      size_t offset = capture_context->frame_counter * SCROLL_SPEED %
+                      capture_context->height;
+      contents = capture_context->pixels + offset * capture_context->width;
+      break;
+    }
+    case kSynthSourceDesktop:
+      break;
+    case kSynthSourceRgb:
+    case kSynthSourceNv12: {
+      size_t index =
+          capture_context->frame_counter % capture_context->frames_count;
+      contents =
+          capture_context->file_data + index * capture_context->frame_size;
+      break;
+    }
+    default:
+      __builtin_unreachable();
+  }
+  capture_context->frame_counter++;
+
+  unsigned long long trace = TraceBegin();
+  if (contents && !GpuContextWriteFrame(capture_context->gpu_context,
+                                        capture_context->gpu_frame, contents)) {
+    LOG("Failed to write gpu frame");
+    return false;
+  }
+  TraceEnd("frame_upload", trace);
+
+  // mburakov: Capture context might get destroyed in callback.
+  capture_context->callbacks->OnFrameReady(capture_context->user,
+                                           capture_context->gpu_frame);
+  return true;
+}
+
+void CaptureContextSynthDestroy(struct CaptureContextSynth* capture_context) {
+  close(capture_context->timer_fd);
+  GpuContextDestroyFrame(capture_context->gpu_context,
+                         capture_context->gpu_frame);
+  if (capture_context->file_data)
+    munmap((void*)capture_context->file_data, capture_context->file_size);
+  free(capture_context->pixels);
+  free(capture_context);
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_CAPTURE_SYNTH_H_
+#define STREAMER_CAPTURE_SYNTH_H_
+
+#include "capture.h"
+
+struct CaptureContextSynth;
+
+struct CaptureContextSynth* CaptureContextSynthCreate(
+    struct GpuContext* gpu_context, const char* synth_config,
+    const struct CaptureContextCallbacks* callbacks, void* user);
+int CaptureContextSynthGetEventsFd(struct CaptureContextSynth* capture_context);
+bool CaptureContextSynthProcessEvents(
+    struct CaptureContextSynth* capture_context);
+void CaptureContextSynthDestroy(struct CaptureContextSynth* capture_context);
+
+#endif  // STREAMER_CAPTURE_SYNTH_H_
@@ -19,22 +19,87 @@
 #define STREAMER_ENCODE_H_
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "colorspace.h"
 
+// mburakov: Capturing is expected to happen at the display refresh rate, and
+// rate control needs some estimation of that to distribute bits over frames.
+#define FRAME_RATE 60
+
+// mburakov: Initial quality, used in picture parameter sets and as a starting
+// point for rate control.
+#define INITIAL_QP 30
+
+// mburakov: Frames are split into at most this many slices. Every slice is
+// emitted as a separate message, and each message is sent with a single
+// writev, so this is bounded by the number of iovecs as well.
+#define MAX_SLICES 8
+
 struct EncodeContext;
 struct GpuContext;
 struct GpuFrame;
+struct ProtoQueue;
+
+enum RateControlMode {
+  kRateControlCqp = 0,
+  kRateControlCbr,
+  kRateControlVbr,
+};
+
+struct RateControl {
+  enum RateControlMode mode;
+  uint32_t bitrate;
+  uint32_t vbv_size;
+};
+
+enum IntraRefreshMode {
+  kIntraRefreshNone = 0,
+  kIntraRefreshColumn,
+  kIntraRefreshRow,
+};
+
+enum EncodeCodec {
+  kEncodeCodecAuto = 0,
+  kEncodeCodecHevc,
+  kEncodeCodecH264,
+  kEncodeCodecAv1,
+};
+
+enum EncodeBackend {
+  kEncodeBackendAuto = 0,
+  kEncodeBackendVa,
+  kEncodeBackendX264,
+};
+
+struct EncodeConfig {
+  enum EncodeBackend backend;
+  enum EncodeCodec codec;
+  struct RateControl rate_control;
+  uint32_t idr_period;
+  enum IntraRefreshMode intra_refresh;
+  uint32_t intra_refresh_period;
+  uint32_t slices;
+};
 
 struct EncodeContext* EncodeContextCreate(struct GpuContext* gpu_context,
                                           uint32_t width, uint32_t height,
                                           enum YuvColorspace colorspace,
-                                          enum YuvRange range);
+                                          enum YuvRange range,
+                                          const struct EncodeConfig* config);
+int EncodeContextGetEventsFd(struct EncodeContext* encode_context);
 const struct GpuFrame* EncodeContextGetFrame(
     struct EncodeContext* encode_context);
-bool EncodeContextEncodeFrame(struct EncodeContext* encode_context, int fd,
+bool EncodeContextEncodeFrame(struct EncodeContext* encode_context,
                               unsigned long long timestamp);
+enum EncodeCodec EncodeContextGetCodec(
+    const struct EncodeContext* encode_context);
+void EncodeContextRequestIdr(struct EncodeContext* encode_context);
+void EncodeContextSetBitrate(struct EncodeContext* encode_context,
+                             uint32_t bitrate);
+bool EncodeContextProcessEvents(struct EncodeContext* encode_context,
+                                struct ProtoQueue* proto_queue);
 void EncodeContextDestroy(struct EncodeContext* encode_context);
 
 #endif  // STREAMER_ENCODE_H_
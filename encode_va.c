@@ -0,0 +1,2456 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "encode_va.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <unistd.h>
+#include <va/va.h>
+#include <va/va_drm.h>
+#include <va/va_drmcommon.h>
+
+#include "av1.h"
+#include "bitstream.h"
+#include "gpu.h"
+#include "h264.h"
+#include "hevc.h"
+#include "proto.h"
+#include "toolbox/perf.h"
+#include "toolbox/utils.h"
+#include "trace.h"
+
+#define STATUS_OK 0
+#define STATUS_ERR 1
+
+// mburakov: Frame size and va call statistics are logged this often in debug
+// builds.
+#define STATS_PERIOD 600
+
+union MiscParameter {
+  VAEncMiscParameterRateControl rate_control;
+  VAEncMiscParameterHRD hrd;
+  VAEncMiscParameterFrameRate frame_rate;
+  VAEncMiscParameterRIR rir;
+};
+
+// mburakov: Parameter buffers are created once per slot and then updated in
+// place, so every kind of buffer submitted with a frame has its own entry.
+enum SlotBuffer {
+  kSlotBufferSeq = 0,
+  kSlotBufferPackedSeqParam,
+  kSlotBufferPackedSeqData,
+  kSlotBufferRateControl,
+  kSlotBufferHrd,
+  kSlotBufferFrameRate,
+  kSlotBufferIntraRefresh,
+  kSlotBufferPic,
+  kSlotBufferPackedPicParam,
+  kSlotBufferPackedPicData,
+  // mburakov: Packed slice header parameter and data buffers are followed by
+  // the slice parameter buffer, and this triple is repeated for every slice.
+  kSlotBufferSlices,
+  kSlotBufferCount = kSlotBufferSlices + MAX_SLICES * 3,
+};
+
+struct EncodeSlot {
+  VASurfaceID input_surface_id;
+  struct GpuFrame* gpu_frame;
+  VABufferID output_buffer_id;
+  VABufferID buffer_ids[kSlotBufferCount];
+  unsigned int buffer_sizes[kSlotBufferCount];
+  void* buffer_shadows[kSlotBufferCount];
+  unsigned int shadow_sizes[kSlotBufferCount];
+  unsigned long long timestamp;
+  bool idr;
+};
+
+struct EncodeContextVa {
+  struct GpuContext* gpu_context;
+  uint32_t width;
+  uint32_t height;
+  enum YuvColorspace colorspace;
+  enum YuvRange range;
+  struct EncodeConfig config;
+  bool rate_control_dirty;
+  bool idr_requested;
+
+  int render_node;
+  VADisplay va_display;
+  VAProfile va_profile;
+  VAConfigID va_config_id;
+
+  uint32_t va_rate_controls;
+  uint32_t va_intra_refresh;
+  uint32_t va_max_slices;
+  uint32_t va_packed_headers;
+  VAConfigAttribValEncHEVCFeatures va_hevc_features;
+  VAConfigAttribValEncHEVCBlockSizes va_hevc_block_sizes;
+  VAConfigAttribValEncAV1 va_av1_features;
+  VAConfigAttribValEncAV1Ext1 va_av1_features_ext1;
+  VAConfigAttribValEncAV1Ext2 va_av1_features_ext2;
+
+  VAContextID va_context_id;
+  struct EncodeSlot slots[3];
+  size_t submitted;
+  size_t retrieved;
+
+  // mburakov: One more than slots, so that frames in flight never overwrite
+  // reconstructed surface referenced by another frame in flight.
+  VASurfaceID recon_surface_ids[4];
+
+  int submitter[2];
+  int waker[2];
+  thrd_t sync_thread;
+
+  // mburakov: Only the member matching config.codec is ever used.
+  union {
+    struct {
+      VAEncSequenceParameterBufferHEVC seq;
+      VAEncPictureParameterBufferHEVC pic;
+      VAEncSliceParameterBufferHEVC slice;
+    } hevc;
+    struct {
+      VAEncSequenceParameterBufferH264 seq;
+      VAEncPictureParameterBufferH264 pic;
+      VAEncSliceParameterBufferH264 slice;
+      uint16_t idr_pic_id;
+    } h264;
+    struct {
+      VAEncSequenceParameterBufferAV1 seq;
+      VAEncPictureParameterBufferAV1 pic;
+      VAEncTileGroupBufferAV1 tile_group;
+    } av1;
+  };
+
+  // mburakov: Blocks are CTUs for HEVC, macroblocks for H.264 and
+  // superblocks for AV1.
+  uint32_t width_in_blocks;
+  uint32_t height_in_blocks;
+  uint8_t parameter_sets[256];
+  size_t parameter_sets_size;
+  size_t frame_counter;
+  size_t idr_frame_counter;
+
+#ifndef NDEBUG
+  size_t stats_counter;
+  size_t stats_va_calls;
+  double stats_mean;
+  double stats_m2;
+  uint32_t stats_max;
+#endif  // NDEBUG
+};
+
+static const char* VaErrorString(VAStatus error) {
+  static const char* va_error_strings[] = {
+      "VA_STATUS_SUCCESS",
+      "VA_STATUS_ERROR_OPERATION_FAILED",
+      "VA_STATUS_ERROR_ALLOCATION_FAILED",
+      "VA_STATUS_ERROR_INVALID_DISPLAY",
+      "VA_STATUS_ERROR_INVALID_CONFIG",
+      "VA_STATUS_ERROR_INVALID_CONTEXT",
+      "VA_STATUS_ERROR_INVALID_SURFACE",
+      "VA_STATUS_ERROR_INVALID_BUFFER",
+      "VA_STATUS_ERROR_INVALID_IMAGE",
+      "VA_STATUS_ERROR_INVALID_SUBPICTURE",
+      "VA_STATUS_ERROR_ATTR_NOT_SUPPORTED",
+      "VA_STATUS_ERROR_MAX_NUM_EXCEEDED",
+      "VA_STATUS_ERROR_UNSUPPORTED_PROFILE",
+      "VA_STATUS_ERROR_UNSUPPORTED_ENTRYPOINT",
+      "VA_STATUS_ERROR_UNSUPPORTED_RT_FORMAT",
+      "VA_STATUS_ERROR_UNSUPPORTED_BUFFERTYPE",
+      "VA_STATUS_ERROR_SURFACE_BUSY",
+      "VA_STATUS_ERROR_FLAG_NOT_SUPPORTED",
+      "VA_STATUS_ERROR_INVALID_PARAMETER",
+      "VA_STATUS_ERROR_RESOLUTION_NOT_SUPPORTED",
+      "VA_STATUS_ERROR_UNIMPLEMENTED",
+      "VA_STATUS_ERROR_SURFACE_IN_DISPLAYING",
+      "VA_STATUS_ERROR_INVALID_IMAGE_FORMAT",
+      "VA_STATUS_ERROR_DECODING_ERROR",
+      "VA_STATUS_ERROR_ENCODING_ERROR",
+      "VA_STATUS_ERROR_INVALID_VALUE",
+      "???",
+      "???",
+      "???",
+      "???",
+      "???",
+      "???",
+      "VA_STATUS_ERROR_UNSUPPORTED_FILTER",
+      "VA_STATUS_ERROR_INVALID_FILTER_CHAIN",
+      "VA_STATUS_ERROR_HW_BUSY",
+      "???",
+      "VA_STATUS_ERROR_UNSUPPORTED_MEMORY_TYPE",
+      "VA_STATUS_ERROR_NOT_ENOUGH_BUFFER",
+      "VA_STATUS_ERROR_TIMEDOUT",
+  };
+  return VA_STATUS_SUCCESS <= error && error <= VA_STATUS_ERROR_TIMEDOUT
+             ? va_error_strings[error - VA_STATUS_SUCCESS]
+             : "???";
+}
+
+static void OnVaLogMessage(void* context, const char* message) {
+  (void)context;
+  size_t len = strlen(message);
+  while (message[len - 1] == '\n') len--;
+  LOG("%.*s", (int)len, message);
+}
+
+static bool IsEncodeProfileSupported(VADisplay va_display, VAProfile profile) {
+  int num_entrypoints = vaMaxNumEntrypoints(va_display);
+  VAEntrypoint* entrypoints =
+      malloc((size_t)num_entrypoints * sizeof(VAEntrypoint));
+  if (!entrypoints) {
+    LOG("Failed to allocate va entrypoints (%s)", strerror(errno));
+    return false;
+  }
+
+  bool result = false;
+  VAStatus status = vaQueryConfigEntrypoints(va_display, profile, entrypoints,
+                                             &num_entrypoints);
+  for (int i = 0; status == VA_STATUS_SUCCESS && i < num_entrypoints; i++) {
+    if (entrypoints[i] == VAEntrypointEncSlice) {
+      result = true;
+      break;
+    }
+  }
+  free(entrypoints);
+  return result;
+}
+
+static bool SelectCodec(struct EncodeContextVa* encode_context) {
+  // mburakov: Ordered by preference, so that automatic selection picks HEVC
+  // whenever it is available, and falls back to H.264 otherwise. AV1 comes
+  // last, because older clients are not able to decode it.
+  static const struct {
+    enum EncodeCodec codec;
+    VAProfile va_profile;
+    const char* name;
+  } kProfiles[] = {
+      {kEncodeCodecHevc, VAProfileHEVCMain, "HEVC Main"},
+      {kEncodeCodecH264, VAProfileH264High, "H.264 High"},
+      {kEncodeCodecH264, VAProfileH264ConstrainedBaseline,
+       "H.264 Constrained Baseline"},
+      {kEncodeCodecAv1, VAProfileAV1Profile0, "AV1 Main"},
+  };
+  enum EncodeCodec codec = encode_context->config.codec;
+  for (size_t i = 0; i < LENGTH(kProfiles); i++) {
+    if ((codec != kEncodeCodecAuto && codec != kProfiles[i].codec) ||
+        !IsEncodeProfileSupported(encode_context->va_display,
+                                  kProfiles[i].va_profile)) {
+      continue;
+    }
+    LOG("Selected %s profile", kProfiles[i].name);
+    encode_context->config.codec = kProfiles[i].codec;
+    encode_context->va_profile = kProfiles[i].va_profile;
+    return true;
+  }
+  return false;
+}
+
+static bool InitializeCodecCaps(struct EncodeContextVa* encode_context) {
+  VAConfigAttrib attrib_list[] = {
+      {.type = VAConfigAttribEncPackedHeaders},
+      {.type = VAConfigAttribRateControl},
+      {.type = VAConfigAttribEncIntraRefresh},
+      {.type = VAConfigAttribEncMaxSlices},
+  };
+  VAStatus status = vaGetConfigAttributes(
+      encode_context->va_display, encode_context->va_profile,
+      VAEntrypointEncSlice, attrib_list, LENGTH(attrib_list));
+  if (status != VA_STATUS_SUCCESS) {
+    LOG("Failed to get va config attributes (%s)", VaErrorString(status));
+    return false;
+  }
+
+  if (attrib_list[0].value == VA_ATTRIB_NOT_SUPPORTED) {
+    LOG("VAConfigAttribEncPackedHeaders is not supported");
+  } else {
+    LOG("VAConfigAttribEncPackedHeaders is 0x%08x", attrib_list[0].value);
+    encode_context->va_packed_headers = attrib_list[0].value;
+  }
+
+  if (attrib_list[1].value == VA_ATTRIB_NOT_SUPPORTED) {
+    LOG("VAConfigAttribRateControl is not supported");
+  } else {
+    LOG("VAConfigAttribRateControl is 0x%08x", attrib_list[1].value);
+    encode_context->va_rate_controls = attrib_list[1].value;
+  }
+
+  if (attrib_list[2].value == VA_ATTRIB_NOT_SUPPORTED) {
+    LOG("VAConfigAttribEncIntraRefresh is not supported");
+  } else {
+    LOG("VAConfigAttribEncIntraRefresh is 0x%08x", attrib_list[2].value);
+    encode_context->va_intra_refresh = attrib_list[2].value;
+  }
+
+  if (attrib_list[3].value == VA_ATTRIB_NOT_SUPPORTED) {
+    LOG("VAConfigAttribEncMaxSlices is not supported");
+    encode_context->va_max_slices = 1;
+  } else {
+    LOG("VAConfigAttribEncMaxSlices is %u", attrib_list[3].value);
+    encode_context->va_max_slices = attrib_list[3].value;
+  }
+  return true;
+}
+
+static bool InitializeHevcCaps(struct EncodeContextVa* encode_context) {
+  VAConfigAttrib attrib_list[] = {
+      {.type = VAConfigAttribEncHEVCFeatures},
+      {.type = VAConfigAttribEncHEVCBlockSizes},
+  };
+  VAStatus status = vaGetConfigAttributes(
+      encode_context->va_display, encode_context->va_profile,
+      VAEntrypointEncSlice, attrib_list, LENGTH(attrib_list));
+  if (status != VA_STATUS_SUCCESS) {
+    LOG("Failed to get va config attributes (%s)", VaErrorString(status));
+    return false;
+  }
+
+  if (attrib_list[0].value == VA_ATTRIB_NOT_SUPPORTED) {
+    LOG("VAConfigAttribEncHEVCFeatures is not supported");
+    encode_context->va_hevc_features = (VAConfigAttribValEncHEVCFeatures){
+        .bits =
+            {
+                // mburakov: ffmpeg hardcodes these for i965 Skylake driver.
+                .separate_colour_planes = 0,     // Table 6-1
+                .scaling_lists = 0,              // No scaling lists
+                .amp = 1,                        // hardcoded
+                .sao = 0,                        // hardcoded
+                .pcm = 0,                        // hardcoded
+                .temporal_mvp = 0,               // hardcoded
+                .strong_intra_smoothing = 0,     // TODO
+                .dependent_slices = 0,           // No slice segments
+                .sign_data_hiding = 0,           // TODO
+                .constrained_intra_pred = 0,     // TODO
+                .transform_skip = 0,             // defaulted
+                .cu_qp_delta = 0,                // Fixed quality
+                .weighted_prediction = 0,        // TODO
+                .transquant_bypass = 0,          // TODO
+                .deblocking_filter_disable = 0,  // TODO
+            },
+    };
+  } else {
+    LOG("VAConfigAttribEncHEVCFeatures is 0x%08x", attrib_list[0].value);
+    encode_context->va_hevc_features.value = attrib_list[0].value;
+  }
+
+  if (attrib_list[1].value == VA_ATTRIB_NOT_SUPPORTED) {
+    LOG("VAConfigAttribEncHEVCBlockSizes is not supported");
+    encode_context->va_hevc_block_sizes = (VAConfigAttribValEncHEVCBlockSizes){
+        .bits =
+            {
+                // mburakov: ffmpeg hardcodes these for i965 Skylake driver.
+                .log2_max_coding_tree_block_size_minus3 = 2,     // hardcoded
+                .log2_min_coding_tree_block_size_minus3 = 0,     // TODO
+                .log2_min_luma_coding_block_size_minus3 = 0,     // hardcoded
+                .log2_max_luma_transform_block_size_minus2 = 3,  // hardcoded
+                .log2_min_luma_transform_block_size_minus2 = 0,  // hardcoded
+                .max_max_transform_hierarchy_depth_inter = 3,    // hardcoded
+                .min_max_transform_hierarchy_depth_inter = 0,    // defaulted
+                .max_max_transform_hierarchy_depth_intra = 3,    // hardcoded
+                .min_max_transform_hierarchy_depth_intra = 0,    // defaulted
+                .log2_max_pcm_coding_block_size_minus3 = 0,      // TODO
+                .log2_min_pcm_coding_block_size_minus3 = 0,      // TODO
+            },
+    };
+  } else {
+    LOG("VAConfigAttribEncHEVCBlockSizes is 0x%08x", attrib_list[1].value);
+    encode_context->va_hevc_block_sizes.value = attrib_list[1].value;
+  }
+
+#ifndef NDEBUG
+  const typeof(encode_context->va_hevc_features.bits)* features_bits =
+      &encode_context->va_hevc_features.bits;
+  const typeof(encode_context->va_hevc_block_sizes.bits)* block_sizes_bits =
+      &encode_context->va_hevc_block_sizes.bits;
+  LOG("VAConfigAttribEncHEVCFeatures dump:"
+      "\n\tseparate_colour_planes = %u"
+      "\n\tscaling_lists = %u"
+      "\n\tamp = %u"
+      "\n\tsao = %u"
+      "\n\tpcm = %u"
+      "\n\ttemporal_mvp = %u"
+      "\n\tstrong_intra_smoothing = %u"
+      "\n\tdependent_slices = %u"
+      "\n\tsign_data_hiding = %u"
+      "\n\tconstrained_intra_pred = %u"
+      "\n\ttransform_skip = %u"
+      "\n\tcu_qp_delta = %u"
+      "\n\tweighted_prediction = %u"
+      "\n\ttransquant_bypass = %u"
+      "\n\tdeblocking_filter_disable = %u",
+      features_bits->separate_colour_planes, features_bits->scaling_lists,
+      features_bits->amp, features_bits->sao, features_bits->pcm,
+      features_bits->temporal_mvp, features_bits->strong_intra_smoothing,
+      features_bits->dependent_slices, features_bits->sign_data_hiding,
+      features_bits->constrained_intra_pred, features_bits->transform_skip,
+      features_bits->cu_qp_delta, features_bits->weighted_prediction,
+      features_bits->transquant_bypass,
+      features_bits->deblocking_filter_disable);
+  LOG("VAConfigAttribEncHEVCBlockSizes dump:"
+      "\n\tlog2_max_coding_tree_block_size_minus3 = %u"
+      "\n\tlog2_min_coding_tree_block_size_minus3 = %u"
+      "\n\tlog2_min_luma_coding_block_size_minus3 = %u"
+      "\n\tlog2_max_luma_transform_block_size_minus2 = %u"
+      "\n\tlog2_min_luma_transform_block_size_minus2 = %u"
+      "\n\tmax_max_transform_hierarchy_depth_inter = %u"
+      "\n\tmin_max_transform_hierarchy_depth_inter = %u"
+      "\n\tmax_max_transform_hierarchy_depth_intra = %u"
+      "\n\tmin_max_transform_hierarchy_depth_intra = %u"
+      "\n\tlog2_max_pcm_coding_block_size_minus3 = %u"
+      "\n\tlog2_min_pcm_coding_block_size_minus3 = %u",
+      block_sizes_bits->log2_max_coding_tree_block_size_minus3,
+      block_sizes_bits->log2_min_coding_tree_block_size_minus3,
+      block_sizes_bits->log2_min_luma_coding_block_size_minus3,
+      block_sizes_bits->log2_max_luma_transform_block_size_minus2,
+      block_sizes_bits->log2_min_luma_transform_block_size_minus2,
+      block_sizes_bits->max_max_transform_hierarchy_depth_inter,
+      block_sizes_bits->min_max_transform_hierarchy_depth_inter,
+      block_sizes_bits->max_max_transform_hierarchy_depth_intra,
+      block_sizes_bits->min_max_transform_hierarchy_depth_intra,
+      block_sizes_bits->log2_max_pcm_coding_block_size_minus3,
+      block_sizes_bits->log2_min_pcm_coding_block_size_minus3);
+#endif
+
+  return true;
+}
+
+static bool InitializeAv1Caps(struct EncodeContextVa* encode_context) {
+  VAConfigAttrib attrib_list[] = {
+      {.type = VAConfigAttribEncAV1},
+      {.type = VAConfigAttribEncAV1Ext1},
+      {.type = VAConfigAttribEncAV1Ext2},
+  };
+  VAStatus status = vaGetConfigAttributes(
+      encode_context->va_display, encode_context->va_profile,
+      VAEntrypointEncSlice, attrib_list, LENGTH(attrib_list));
+  if (status != VA_STATUS_SUCCESS) {
+    LOG("Failed to get va config attributes (%s)", VaErrorString(status));
+    return false;
+  }
+
+  if (attrib_list[0].value == VA_ATTRIB_NOT_SUPPORTED) {
+    LOG("VAConfigAttribEncAV1 is not supported");
+  } else {
+    LOG("VAConfigAttribEncAV1 is 0x%08x", attrib_list[0].value);
+    encode_context->va_av1_features.value = attrib_list[0].value;
+  }
+
+  if (attrib_list[1].value == VA_ATTRIB_NOT_SUPPORTED) {
+    LOG("VAConfigAttribEncAV1Ext1 is not supported");
+  } else {
+    LOG("VAConfigAttribEncAV1Ext1 is 0x%08x", attrib_list[1].value);
+    encode_context->va_av1_features_ext1.value = attrib_list[1].value;
+  }
+
+  if (attrib_list[2].value == VA_ATTRIB_NOT_SUPPORTED) {
+    LOG("VAConfigAttribEncAV1Ext2 is not supported");
+    encode_context->va_av1_features_ext2 = (VAConfigAttribValEncAV1Ext2){
+        .bits =
+            {
+                .tile_size_bytes_minus1 = 3,  // defaulted
+                .obu_size_bytes_minus1 = 3,   // defaulted
+                .tx_mode_support = 2,         // TX_MODE_LARGEST
+                .max_tile_num_minus1 = 0,     // Single tile
+            },
+    };
+  } else {
+    LOG("VAConfigAttribEncAV1Ext2 is 0x%08x", attrib_list[2].value);
+    encode_context->va_av1_features_ext2.value = attrib_list[2].value;
+  }
+
+  // mburakov: AV1 has no slices, and the frame header writer only supports a
+  // single tile, which is limited both in width and in area by 5.9.15.
+  uint32_t sb_size =
+      encode_context->va_av1_features.bits.support_128x128_superblock == 2
+          ? 128
+          : 64;
+  uint32_t width_in_sbs = (encode_context->width + sb_size - 1) / sb_size;
+  uint32_t height_in_sbs = (encode_context->height + sb_size - 1) / sb_size;
+  if (width_in_sbs * sb_size > 4096 ||
+      width_in_sbs * height_in_sbs * sb_size * sb_size > 4096 * 2304) {
+    LOG("Resolution requires more than one AV1 tile");
+    return false;
+  }
+  encode_context->va_max_slices = 1;
+  return true;
+}
+
+static struct GpuFrame* VaSurfaceToGpuFrame(VADisplay va_display,
+                                            VASurfaceID va_surface_id,
+                                            struct GpuContext* gpu_context) {
+  VADRMPRIMESurfaceDescriptor prime;
+  VAStatus status = vaExportSurfaceHandle(
+      va_display, va_surface_id, VA_SURFACE_ATTRIB_MEM_TYPE_DRM_PRIME_2,
+      VA_EXPORT_SURFACE_WRITE_ONLY | VA_EXPORT_SURFACE_COMPOSED_LAYERS, &prime);
+  if (status != VA_STATUS_SUCCESS) {
+    LOG("Failed to export va surface (%s)", VaErrorString(status));
+    return NULL;
+  }
+
+  struct GpuFramePlane planes[] = {{.dmabuf_fd = -1},
+                                   {.dmabuf_fd = -1},
+                                   {.dmabuf_fd = -1},
+                                   {.dmabuf_fd = -1}};
+  static_assert(LENGTH(planes) == LENGTH(prime.layers[0].object_index),
+                "Suspicious VADRMPRIMESurfaceDescriptor structure");
+
+  for (size_t i = 0; i < prime.layers[0].num_planes; i++) {
+    uint32_t object_index = prime.layers[0].object_index[i];
+    planes[i] = (struct GpuFramePlane){
+        .dmabuf_fd = prime.objects[object_index].fd,
+        .pitch = prime.layers[0].pitch[i],
+        .offset = prime.layers[0].offset[i],
+        .modifier = prime.objects[object_index].drm_format_modifier,
+    };
+  }
+
+  struct GpuFrame* gpu_frame =
+      GpuContextCreateFrame(gpu_context, prime.width, prime.height,
+                            prime.fourcc, prime.layers[0].num_planes, planes);
+  if (!gpu_frame) {
+    LOG("Failed to create gpu frame");
+    goto release_planes;
+  }
+  return gpu_frame;
+
+release_planes:
+  CloseUniqueFds((int[]){planes[0].dmabuf_fd, planes[1].dmabuf_fd,
+                         planes[2].dmabuf_fd, planes[3].dmabuf_fd});
+  return NULL;
+}
+
+static void InitializeHevcSeqHeader(struct EncodeContextVa* encode_context,
+                                    uint16_t pic_width_in_luma_samples,
+                                    uint16_t pic_height_in_luma_samples) {
+  const typeof(encode_context->va_hevc_features.bits)* features_bits =
+      &encode_context->va_hevc_features.bits;
+  const typeof(encode_context->va_hevc_block_sizes.bits)* block_sizes_bits =
+      &encode_context->va_hevc_block_sizes.bits;
+
+  uint8_t log2_diff_max_min_luma_coding_block_size =
+      block_sizes_bits->log2_max_coding_tree_block_size_minus3 -
+      block_sizes_bits->log2_min_luma_coding_block_size_minus3;
+  uint8_t log2_diff_max_min_transform_block_size =
+      block_sizes_bits->log2_max_luma_transform_block_size_minus2 -
+      block_sizes_bits->log2_min_luma_transform_block_size_minus2;
+  uint32_t bits_per_second =
+      encode_context->config.rate_control.mode != kRateControlCqp
+          ? encode_context->config.rate_control.bitrate
+          : 0;
+
+  encode_context->hevc.seq = (VAEncSequenceParameterBufferHEVC){
+      .general_profile_idc = 1,  // Main profile
+      .general_level_idc = 120,  // Level 4
+      .general_tier_flag = 0,    // Main tier
+
+      .intra_period = encode_context->config.idr_period,  // Zero is infinite
+      .intra_idr_period = encode_context->config.idr_period,  // Only IDRs
+      .ip_period = 1,                                         // No B-frames
+      .bits_per_second = bits_per_second,
+
+      .pic_width_in_luma_samples = pic_width_in_luma_samples,
+      .pic_height_in_luma_samples = pic_height_in_luma_samples,
+
+      .seq_fields.bits =
+          {
+              .chroma_format_idc = 1,                    // 4:2:0
+              .separate_colour_plane_flag = 0,           // Table 6-1
+              .bit_depth_luma_minus8 = 0,                // 8 bpp luma
+              .bit_depth_chroma_minus8 = 0,              // 8 bpp chroma
+              .scaling_list_enabled_flag = 0,            // No scaling lists
+              .strong_intra_smoothing_enabled_flag = 0,  // defaulted
+
+              .amp_enabled_flag = features_bits->amp != 0,
+              .sample_adaptive_offset_enabled_flag = features_bits->sao,
+              .pcm_enabled_flag = features_bits->pcm,
+              .pcm_loop_filter_disabled_flag = 0,  // defaulted
+              .sps_temporal_mvp_enabled_flag = features_bits->temporal_mvp,
+
+              .low_delay_seq = 1,     // No B-frames
+              .hierachical_flag = 0,  // defaulted
+          },
+
+      .log2_min_luma_coding_block_size_minus3 =
+          block_sizes_bits->log2_min_luma_coding_block_size_minus3,
+      .log2_diff_max_min_luma_coding_block_size =
+          log2_diff_max_min_luma_coding_block_size,
+      .log2_min_transform_block_size_minus2 =
+          block_sizes_bits->log2_min_luma_transform_block_size_minus2,
+      .log2_diff_max_min_transform_block_size =
+          log2_diff_max_min_transform_block_size,
+      .max_transform_hierarchy_depth_inter =
+          block_sizes_bits->max_max_transform_hierarchy_depth_inter,
+      .max_transform_hierarchy_depth_intra =
+          block_sizes_bits->max_max_transform_hierarchy_depth_intra,
+
+      .pcm_sample_bit_depth_luma_minus1 = 0,            // defaulted
+      .pcm_sample_bit_depth_chroma_minus1 = 0,          // defaulted
+      .log2_min_pcm_luma_coding_block_size_minus3 = 0,  // defaulted
+      .log2_max_pcm_luma_coding_block_size_minus3 = 0,  // defaulted
+
+      .vui_parameters_present_flag = 1,
+      .vui_fields.bits =
+          {
+              .aspect_ratio_info_present_flag = 0,           // defaulted
+              .neutral_chroma_indication_flag = 0,           // defaulted
+              .field_seq_flag = 0,                           // defaulted
+              .vui_timing_info_present_flag = 0,             // No timing
+              .bitstream_restriction_flag = 1,               // hardcoded
+              .tiles_fixed_structure_flag = 0,               // defaulted
+              .motion_vectors_over_pic_boundaries_flag = 1,  // hardcoded
+              .restricted_ref_pic_lists_flag = 1,            // hardcoded
+              .log2_max_mv_length_horizontal = 15,           // hardcoded
+              .log2_max_mv_length_vertical = 15,             // hardcoded
+          },
+
+      .vui_num_units_in_tick = 0,         // No timing
+      .vui_time_scale = 0,                // No timing
+      .min_spatial_segmentation_idc = 0,  // defaulted
+      .max_bytes_per_pic_denom = 0,       // hardcoded
+      .max_bits_per_min_cu_denom = 0,     // hardcoded
+
+      .scc_fields.bits =
+          {
+              .palette_mode_enabled_flag = 0,  // defaulted
+          },
+  };
+}
+
+static void InitializeHevcPicHeader(struct EncodeContextVa* encode_context) {
+  const typeof(encode_context->hevc.seq.seq_fields.bits)* seq_bits =
+      &encode_context->hevc.seq.seq_fields.bits;
+  const typeof(encode_context->va_hevc_features.bits)* features_bits =
+      &encode_context->va_hevc_features.bits;
+
+  uint8_t collocated_ref_pic_index =
+      seq_bits->sps_temporal_mvp_enabled_flag ? 0 : 0xff;
+  bool cu_qp_delta_enabled_flag =
+      encode_context->config.rate_control.mode != kRateControlCqp;
+
+  encode_context->hevc.pic = (VAEncPictureParameterBufferHEVC){
+      .decoded_curr_pic =
+          {
+              .picture_id = VA_INVALID_ID,       // dynamic
+              .flags = VA_PICTURE_HEVC_INVALID,  // dynamic
+          },
+
+      // .reference_frames[15],
+
+      .coded_buf = VA_INVALID_ID,  // dynamic
+      .collocated_ref_pic_index = collocated_ref_pic_index,
+      .last_picture = 0,  // hardcoded
+
+      .pic_init_qp = INITIAL_QP,    // Initial quality
+      .diff_cu_qp_delta_depth = 0,  // Whole CTU
+      .pps_cb_qp_offset = 0,        // hardcoded
+      .pps_cr_qp_offset = 0,        // hardcoded
+
+      .num_tile_columns_minus1 = 0,  // No tiles
+      .num_tile_rows_minus1 = 0,     // No tiles
+      .column_width_minus1 = {0},    // No tiles
+      .row_height_minus1 = {0},      // No tiles
+
+      .log2_parallel_merge_level_minus2 = 0,      // defaulted
+      .ctu_max_bitsize_allowed = 0,               // hardcoded
+      .num_ref_idx_l0_default_active_minus1 = 0,  // hardcoded
+      .num_ref_idx_l1_default_active_minus1 = 0,  // hardcoded
+      .slice_pic_parameter_set_id = 0,            // hardcoded
+      .nal_unit_type = 0,                         // dynamic
+
+      .pic_fields.bits =
+          {
+              .idr_pic_flag = 0,        // dynamic
+              .coding_type = 0,         // dynamic
+              .reference_pic_flag = 1,  // No B-frames
+
+              .dependent_slice_segments_enabled_flag = 0,  // defaulted
+              .sign_data_hiding_enabled_flag = 0,          // defaulted
+              .constrained_intra_pred_flag = 0,            // defaulted
+              .transform_skip_enabled_flag = features_bits->transform_skip,
+              .cu_qp_delta_enabled_flag = cu_qp_delta_enabled_flag,
+              .weighted_pred_flag = 0,                     // defaulted
+              .weighted_bipred_flag = 0,                   // defaulted
+              .transquant_bypass_enabled_flag = 0,         // defaulted
+              .tiles_enabled_flag = 0,                     // No tiles
+              .entropy_coding_sync_enabled_flag = 0,       // defaulted
+              .loop_filter_across_tiles_enabled_flag = 0,  // No tiles
+
+              .pps_loop_filter_across_slices_enabled_flag = 1,  // hardcoded
+              .scaling_list_data_present_flag = 0,  // No scaling lists
+
+              .screen_content_flag = 0,             // TODO
+              .enable_gpu_weighted_prediction = 0,  // hardcoded
+              .no_output_of_prior_pics_flag = 0,    // hardcoded
+          },
+
+      .hierarchical_level_plus1 = 0,  // defaulted
+      .scc_fields.bits =
+          {
+              .pps_curr_pic_ref_enabled_flag = 0,  // defaulted
+          },
+  };
+
+  for (size_t i = 0; i < LENGTH(encode_context->hevc.pic.reference_frames);
+       i++) {
+    encode_context->hevc.pic.reference_frames[i] = (VAPictureHEVC){
+        .picture_id = VA_INVALID_ID,
+        .flags = VA_PICTURE_HEVC_INVALID,
+    };
+  }
+}
+
+static void InitializeHevcSliceHeader(struct EncodeContextVa* encode_context) {
+  const typeof(encode_context->hevc.seq.seq_fields.bits)* seq_bits =
+      &encode_context->hevc.seq.seq_fields.bits;
+  const typeof(encode_context->va_hevc_block_sizes.bits)* block_sizes_bits =
+      &encode_context->va_hevc_block_sizes.bits;
+
+  uint32_t ctu_size =
+      1 << (block_sizes_bits->log2_max_coding_tree_block_size_minus3 + 3);
+  encode_context->height_in_blocks =
+      (encode_context->height + ctu_size - 1) / ctu_size;
+  encode_context->width_in_blocks =
+      (encode_context->width + ctu_size - 1) / ctu_size;
+
+  encode_context->hevc.slice = (VAEncSliceParameterBufferHEVC){
+      .slice_segment_address = 0,  // dynamic
+      .num_ctu_in_slice = 0,       // dynamic
+
+      .slice_type = 0,  // dynamic
+      .slice_pic_parameter_set_id =
+          encode_context->hevc.pic.slice_pic_parameter_set_id,
+
+      .num_ref_idx_l0_active_minus1 =
+          encode_context->hevc.pic.num_ref_idx_l0_default_active_minus1,
+      .num_ref_idx_l1_active_minus1 =
+          encode_context->hevc.pic.num_ref_idx_l1_default_active_minus1,
+
+      .luma_log2_weight_denom = 0,          // defaulted
+      .delta_chroma_log2_weight_denom = 0,  // defaulted
+
+      // .delta_luma_weight_l0[15],
+      // .luma_offset_l0[15],
+      // .delta_chroma_weight_l0[15][2],
+      // .chroma_offset_l0[15][2],
+      // .delta_luma_weight_l1[15],
+      // .luma_offset_l1[15],
+      // .delta_chroma_weight_l1[15][2],
+      // .chroma_offset_l1[15][2],
+
+      .max_num_merge_cand = 5,  // defaulted
+      .slice_qp_delta = 0,      // Fixed quality
+      .slice_cb_qp_offset = 0,  // defaulted
+      .slice_cr_qp_offset = 0,  // defaulted
+
+      .slice_beta_offset_div2 = 0,  // defaulted
+      .slice_tc_offset_div2 = 0,    // defaulted
+
+      .slice_fields.bits =
+          {
+              .last_slice_of_pic_flag = 0,        // dynamic
+              .dependent_slice_segment_flag = 0,  // No slice segments
+              .colour_plane_id = 0,               // defaulted
+              .slice_temporal_mvp_enabled_flag =
+                  seq_bits->sps_temporal_mvp_enabled_flag,
+              .slice_sao_luma_flag =
+                  seq_bits->sample_adaptive_offset_enabled_flag,
+              .slice_sao_chroma_flag =
+                  seq_bits->sample_adaptive_offset_enabled_flag,
+              .num_ref_idx_active_override_flag = 0,              // hardcoded
+              .mvd_l1_zero_flag = 0,                              // defaulted
+              .cabac_init_flag = 0,                               // defaulted
+              .slice_deblocking_filter_disabled_flag = 0,         // defaulted
+              .slice_loop_filter_across_slices_enabled_flag = 0,  // defaulted
+              .collocated_from_l0_flag = 0,                       // No B-frames
+          },
+
+      .pred_weight_table_bit_offset = 0,  // defaulted
+      .pred_weight_table_bit_length = 0,  // defaulted
+  };
+
+  for (size_t i = 0; i < LENGTH(encode_context->hevc.slice.ref_pic_list0);
+       i++) {
+    encode_context->hevc.slice.ref_pic_list0[i] = (VAPictureHEVC){
+        .picture_id = VA_INVALID_ID,
+        .flags = VA_PICTURE_HEVC_INVALID,
+    };
+  }
+
+  for (size_t i = 0; i < LENGTH(encode_context->hevc.slice.ref_pic_list1);
+       i++) {
+    encode_context->hevc.slice.ref_pic_list1[i] = (VAPictureHEVC){
+        .picture_id = VA_INVALID_ID,
+        .flags = VA_PICTURE_HEVC_INVALID,
+    };
+  }
+}
+
+static void PackHevcParameterSets(struct EncodeContextVa* encode_context) {
+  struct Bitstream bitstream = {
+      .data = encode_context->parameter_sets,
+      .size = 0,
+  };
+
+  static const struct MoreVideoParameters mvp = {
+      .vps_max_dec_pic_buffering_minus1 = 1,  // No B-frames
+      .vps_max_num_reorder_pics = 0,          // No B-frames
+  };
+  uint32_t conf_win_right_offset_luma =
+      encode_context->hevc.seq.pic_width_in_luma_samples -
+      encode_context->width;
+  uint32_t conf_win_bottom_offset_luma =
+      encode_context->hevc.seq.pic_height_in_luma_samples -
+      encode_context->height;
+  const struct MoreSeqParameters msp = {
+      .conf_win_left_offset = 0,
+      .conf_win_right_offset = conf_win_right_offset_luma / 2,
+      .conf_win_top_offset = 0,
+      .conf_win_bottom_offset = conf_win_bottom_offset_luma / 2,
+      .sps_max_dec_pic_buffering_minus1 = 1,  // No B-frames
+      .sps_max_num_reorder_pics = 0,          // No B-frames
+      .video_signal_type_present_flag = 1,
+      .video_full_range_flag = encode_context->range == kFullRange,
+      .colour_description_present_flag = 1,
+      .colour_primaries = 2,          // Unsepcified
+      .transfer_characteristics = 2,  // Unspecified
+      .matrix_coeffs =
+          encode_context->colorspace == kItuRec601 ? 6 : 1,  // Table E.5
+  };
+
+  PackVideoParameterSetNalUnit(&bitstream, &encode_context->hevc.seq, &mvp);
+  PackSeqParameterSetNalUnit(&bitstream, &encode_context->hevc.seq, &msp);
+  PackPicParameterSetNalUnit(&bitstream, &encode_context->hevc.pic);
+  encode_context->parameter_sets_size = bitstream.size;
+}
+
+// mburakov: Picks the lowest level from Table A-1 that fits the frame size at
+// the expected frame rate. Bitrate limits are not taken into account.
+static uint8_t H264LevelIdc(uint32_t frame_size_in_mbs) {
+  static const struct {
+    uint8_t level_idc;
+    uint32_t max_mbps;
+    uint32_t max_fs;
+  } kLevels[] = {
+      {31, 108000, 3600},    {32, 216000, 5120},    {40, 245760, 8192},
+      {42, 522240, 8704},    {50, 589824, 22080},   {51, 983040, 36864},
+      {52, 2073600, 36864},  {60, 4177920, 139264}, {61, 8355840, 139264},
+      {62, 16711680, 139264},
+  };
+  for (size_t i = 0; i < LENGTH(kLevels); i++) {
+    if (frame_size_in_mbs <= kLevels[i].max_fs &&
+        frame_size_in_mbs * FRAME_RATE <= kLevels[i].max_mbps)
+      return kLevels[i].level_idc;
+  }
+  return kLevels[LENGTH(kLevels) - 1].level_idc;
+}
+
+static void InitializeH264SeqHeader(struct EncodeContextVa* encode_context,
+                                    uint16_t picture_width,
+                                    uint16_t picture_height) {
+  uint16_t picture_width_in_mbs = picture_width / 16;
+  uint16_t picture_height_in_mbs = picture_height / 16;
+  uint32_t bits_per_second =
+      encode_context->config.rate_control.mode != kRateControlCqp
+          ? encode_context->config.rate_control.bitrate
+          : 0;
+
+  // mburakov: Cropping is specified in units of two luma samples for 4:2:0.
+  uint32_t frame_crop_right_offset =
+      (picture_width - encode_context->width) / 2;
+  uint32_t frame_crop_bottom_offset =
+      (picture_height - encode_context->height) / 2;
+
+  encode_context->h264.seq = (VAEncSequenceParameterBufferH264){
+      .seq_parameter_set_id = 0,  // hardcoded
+      .level_idc = H264LevelIdc((uint32_t)picture_width_in_mbs *
+                                picture_height_in_mbs),
+
+      .intra_period = encode_context->config.idr_period,  // Zero is infinite
+      .intra_idr_period = encode_context->config.idr_period,  // Only IDRs
+      .ip_period = 1,                                         // No B-frames
+      .bits_per_second = bits_per_second,
+      .max_num_ref_frames = 1,  // No B-frames
+
+      .picture_width_in_mbs = picture_width_in_mbs,
+      .picture_height_in_mbs = picture_height_in_mbs,
+
+      .seq_fields.bits =
+          {
+              .chroma_format_idc = 1,                  // 4:2:0
+              .frame_mbs_only_flag = 1,                // Progressive
+              .mb_adaptive_frame_field_flag = 0,       // Progressive
+              .seq_scaling_matrix_present_flag = 0,    // No scaling lists
+              .direct_8x8_inference_flag = 1,          // hardcoded
+              .log2_max_frame_num_minus4 = 4,          // hardcoded
+              .pic_order_cnt_type = 2,                 // No B-frames
+              .log2_max_pic_order_cnt_lsb_minus4 = 0,  // Unused
+              .delta_pic_order_always_zero_flag = 0,   // Unused
+          },
+
+      .bit_depth_luma_minus8 = 0,    // 8 bpp luma
+      .bit_depth_chroma_minus8 = 0,  // 8 bpp chroma
+
+      .frame_cropping_flag =
+          frame_crop_right_offset || frame_crop_bottom_offset,
+      .frame_crop_left_offset = 0,
+      .frame_crop_right_offset = frame_crop_right_offset,
+      .frame_crop_top_offset = 0,
+      .frame_crop_bottom_offset = frame_crop_bottom_offset,
+
+      .vui_parameters_present_flag = 1,
+      .vui_fields.bits =
+          {
+              .aspect_ratio_info_present_flag = 0,           // defaulted
+              .timing_info_present_flag = 0,                 // No timing
+              .bitstream_restriction_flag = 1,               // hardcoded
+              .log2_max_mv_length_horizontal = 15,           // hardcoded
+              .log2_max_mv_length_vertical = 15,             // hardcoded
+              .fixed_frame_rate_flag = 0,                    // No timing
+              .low_delay_hrd_flag = 0,                       // No HRD
+              .motion_vectors_over_pic_boundaries_flag = 1,  // hardcoded
+          },
+  };
+}
+
+static void InitializeH264PicHeader(struct EncodeContextVa* encode_context) {
+  // mburakov: Neither CABAC nor 8x8 transforms are allowed in Constrained
+  // Baseline profile, so these are only enabled for High.
+  bool high_profile = encode_context->va_profile == VAProfileH264High;
+
+  encode_context->h264.pic = (VAEncPictureParameterBufferH264){
+      .CurrPic =
+          {
+              .picture_id = VA_INVALID_ID,       // dynamic
+              .flags = VA_PICTURE_H264_INVALID,  // dynamic
+          },
+
+      // .ReferenceFrames[16],
+
+      .coded_buf = VA_INVALID_ID,  // dynamic
+      .pic_parameter_set_id = 0,   // hardcoded
+      .seq_parameter_set_id = encode_context->h264.seq.seq_parameter_set_id,
+      .last_picture = 0,  // hardcoded
+      .frame_num = 0,     // dynamic
+      .pic_init_qp = INITIAL_QP,
+
+      .num_ref_idx_l0_active_minus1 = 0,   // hardcoded
+      .num_ref_idx_l1_active_minus1 = 0,   // hardcoded
+      .chroma_qp_index_offset = 0,         // hardcoded
+      .second_chroma_qp_index_offset = 0,  // hardcoded
+
+      .pic_fields.bits =
+          {
+              .idr_pic_flag = 0,        // dynamic
+              .reference_pic_flag = 1,  // No B-frames
+              .entropy_coding_mode_flag = high_profile,
+              .weighted_pred_flag = 0,           // defaulted
+              .weighted_bipred_idc = 0,          // defaulted
+              .constrained_intra_pred_flag = 0,  // defaulted
+              .transform_8x8_mode_flag = high_profile,
+              .deblocking_filter_control_present_flag = 1,  // hardcoded
+              .redundant_pic_cnt_present_flag = 0,          // defaulted
+              .pic_order_present_flag = 0,                  // Progressive
+              .pic_scaling_matrix_present_flag = 0,  // No scaling lists
+          },
+  };
+
+  for (size_t i = 0; i < LENGTH(encode_context->h264.pic.ReferenceFrames);
+       i++) {
+    encode_context->h264.pic.ReferenceFrames[i] = (VAPictureH264){
+        .picture_id = VA_INVALID_ID,
+        .flags = VA_PICTURE_H264_INVALID,
+    };
+  }
+}
+
+static void InitializeH264SliceHeader(struct EncodeContextVa* encode_context) {
+  static const uint32_t mb_size = 16;
+  encode_context->height_in_blocks =
+      (encode_context->height + mb_size - 1) / mb_size;
+  encode_context->width_in_blocks =
+      (encode_context->width + mb_size - 1) / mb_size;
+
+  encode_context->h264.slice = (VAEncSliceParameterBufferH264){
+      .macroblock_address = 0,           // dynamic
+      .num_macroblocks = 0,              // dynamic
+      .macroblock_info = VA_INVALID_ID,  // defaulted
+
+      .slice_type = 0,  // dynamic
+      .pic_parameter_set_id = encode_context->h264.pic.pic_parameter_set_id,
+      .idr_pic_id = 0,         // dynamic
+      .pic_order_cnt_lsb = 0,  // Unused
+
+      .direct_spatial_mv_pred_flag = 0,       // No B-frames
+      .num_ref_idx_active_override_flag = 0,  // hardcoded
+      .num_ref_idx_l0_active_minus1 =
+          encode_context->h264.pic.num_ref_idx_l0_active_minus1,
+      .num_ref_idx_l1_active_minus1 =
+          encode_context->h264.pic.num_ref_idx_l1_active_minus1,
+
+      .cabac_init_idc = 0,                 // defaulted
+      .slice_qp_delta = 0,                 // Fixed quality
+      .disable_deblocking_filter_idc = 0,  // defaulted
+      .slice_alpha_c0_offset_div2 = 0,     // defaulted
+      .slice_beta_offset_div2 = 0,         // defaulted
+  };
+
+  for (size_t i = 0; i < LENGTH(encode_context->h264.slice.RefPicList0);
+       i++) {
+    encode_context->h264.slice.RefPicList0[i] = (VAPictureH264){
+        .picture_id = VA_INVALID_ID,
+        .flags = VA_PICTURE_H264_INVALID,
+    };
+  }
+
+  for (size_t i = 0; i < LENGTH(encode_context->h264.slice.RefPicList1);
+       i++) {
+    encode_context->h264.slice.RefPicList1[i] = (VAPictureH264){
+        .picture_id = VA_INVALID_ID,
+        .flags = VA_PICTURE_H264_INVALID,
+    };
+  }
+}
+
+static void PackH264ParameterSets(struct EncodeContextVa* encode_context) {
+  struct Bitstream bitstream = {
+      .data = encode_context->parameter_sets,
+      .size = 0,
+  };
+
+  // mburakov: Constrained Baseline is signalled as Baseline profile with the
+  // constraint_set1_flag telling it is decodable by Main profile decoders.
+  bool baseline_profile =
+      encode_context->va_profile == VAProfileH264ConstrainedBaseline;
+  const struct MoreH264SeqParameters msp = {
+      .profile_idc = baseline_profile ? 66 : 100,
+      .constraint_set0_flag = baseline_profile,
+      .constraint_set1_flag = baseline_profile,
+      .constraint_set2_flag = 0,
+      .video_signal_type_present_flag = 1,
+      .video_full_range_flag = encode_context->range == kFullRange,
+      .colour_description_present_flag = 1,
+      .colour_primaries = 2,          // Unsepcified
+      .transfer_characteristics = 2,  // Unspecified
+      .matrix_coefficients =
+          encode_context->colorspace == kItuRec601 ? 6 : 1,  // Table E.5
+      .max_num_reorder_frames = 0,   // No B-frames
+      .max_dec_frame_buffering = 1,  // No B-frames
+  };
+
+  PackH264SeqParameterSetNalUnit(&bitstream, &encode_context->h264.seq, &msp);
+  PackH264PicParameterSetNalUnit(&bitstream, &encode_context->h264.pic);
+  encode_context->parameter_sets_size = bitstream.size;
+}
+
+// mburakov: Picks the lowest level from Table A.3 that fits the frame size
+// at the expected frame rate. Bitrate limits are not taken into account.
+static uint8_t Av1SeqLevelIdx(uint32_t width, uint32_t height) {
+  static const struct {
+    uint8_t seq_level_idx;
+    uint32_t max_pic_size;
+    uint32_t max_h_size;
+    uint32_t max_v_size;
+    uint64_t max_display_rate;
+  } kLevels[] = {
+      {0, 147456, 2048, 1152, 4423680},
+      {1, 278784, 2816, 1584, 8363520},
+      {4, 665856, 4352, 2448, 19975680},
+      {5, 1065024, 5504, 3096, 31950720},
+      {8, 2359296, 6144, 3456, 70778880},
+      {9, 2359296, 6144, 3456, 141557760},
+      {12, 8912896, 8192, 4352, 267386880},
+      {13, 8912896, 8192, 4352, 534773760},
+      {14, 8912896, 8192, 4352, 1069547520},
+      {16, 35651584, 16384, 8704, 1069547520},
+      {17, 35651584, 16384, 8704, 2139095040},
+      {18, 35651584, 16384, 8704, 4278190080},
+  };
+  uint32_t pic_size = width * height;
+  for (size_t i = 0; i < LENGTH(kLevels); i++) {
+    if (pic_size <= kLevels[i].max_pic_size &&
+        width <= kLevels[i].max_h_size && height <= kLevels[i].max_v_size &&
+        (uint64_t)pic_size * FRAME_RATE <= kLevels[i].max_display_rate)
+      return kLevels[i].seq_level_idx;
+  }
+  return kLevels[LENGTH(kLevels) - 1].seq_level_idx;
+}
+
+static void InitializeAv1SeqHeader(struct EncodeContextVa* encode_context) {
+  const typeof(encode_context->va_av1_features.bits)* features_bits =
+      &encode_context->va_av1_features.bits;
+  uint32_t bits_per_second =
+      encode_context->config.rate_control.mode != kRateControlCqp
+          ? encode_context->config.rate_control.bitrate
+          : 0;
+
+  encode_context->av1.seq = (VAEncSequenceParameterBufferAV1){
+      .seq_profile = 0,  // Main
+      .seq_level_idx =
+          Av1SeqLevelIdx(encode_context->width, encode_context->height),
+      .seq_tier = 0,           // Main
+      .hierarchical_flag = 0,  // No B-frames
+
+      .intra_period = encode_context->config.idr_period,  // Zero is infinite
+      .ip_period = 1,                                     // No B-frames
+      .bits_per_second = bits_per_second,
+
+      .seq_fields.bits =
+          {
+              .still_picture = 0,  // hardcoded
+              .use_128x128_superblock =
+                  features_bits->support_128x128_superblock == 2,
+              .enable_filter_intra = features_bits->support_filter_intra,
+              .enable_intra_edge_filter =
+                  features_bits->support_intra_edge_filter,
+              .enable_interintra_compound = 0,  // defaulted
+              .enable_masked_compound = 0,      // No B-frames
+              .enable_warped_motion = 0,        // defaulted
+              .enable_dual_filter = 0,          // defaulted
+              .enable_order_hint = 1,           // hardcoded
+              .enable_jnt_comp = 0,             // No B-frames
+              .enable_ref_frame_mvs = 0,        // defaulted
+              .enable_superres = 0,             // defaulted
+              .enable_cdef = 1,                 // hardcoded
+              .enable_restoration = 0,          // defaulted
+              .bit_depth_minus8 = 0,            // 8 bpp
+              .subsampling_x = 1,               // 4:2:0
+              .subsampling_y = 1,               // 4:2:0
+              .mono_chrome = 0,                 // 4:2:0
+          },
+
+      .order_hint_bits_minus_1 = 7,  // hardcoded
+  };
+}
+
+static void InitializeAv1PicHeader(struct EncodeContextVa* encode_context) {
+  uint32_t sb_size =
+      encode_context->av1.seq.seq_fields.bits.use_128x128_superblock ? 128
+                                                                     : 64;
+  encode_context->width_in_blocks =
+      (encode_context->width + sb_size - 1) / sb_size;
+  encode_context->height_in_blocks =
+      (encode_context->height + sb_size - 1) / sb_size;
+
+  // mburakov: Supported filters are reported as a bitmask indexed by the
+  // interpolation_filter values, switchable being the last one of those.
+  static const uint8_t switchable = 4;
+  uint8_t interpolation_filter =
+      encode_context->va_av1_features_ext1.bits.interpolation_filter &
+              1u << switchable
+          ? switchable
+          : 0;
+  // mburakov: Supported transform modes are reported as a bitmask as well,
+  // with TX_MODE_SELECT being the last one, and TX_MODE_LARGEST preceding it.
+  static const uint8_t tx_mode_select = 2;
+  uint8_t tx_mode =
+      encode_context->va_av1_features_ext2.bits.tx_mode_support &
+              1u << tx_mode_select
+          ? tx_mode_select
+          : tx_mode_select - 1;
+
+  encode_context->av1.pic = (VAEncPictureParameterBufferAV1){
+      .frame_width_minus_1 = (uint16_t)(encode_context->width - 1),
+      .frame_height_minus_1 = (uint16_t)(encode_context->height - 1),
+      .reconstructed_frame = VA_INVALID_SURFACE,  // dynamic
+      .coded_buf = VA_INVALID_ID,                 // dynamic
+
+      // .reference_frames[8],
+      // .ref_frame_idx[7],
+
+      .hierarchical_level_plus1 = 0,  // No B-frames
+      .primary_ref_frame = 0,         // dynamic
+      .order_hint = 0,                // dynamic
+      .refresh_frame_flags = 0,       // dynamic
+      .ref_frame_ctrl_l0.value = 0,   // dynamic
+      .ref_frame_ctrl_l1.value = 0,   // No B-frames
+
+      .picture_flags.bits =
+          {
+              .frame_type = 0,                    // dynamic
+              .error_resilient_mode = 0,          // defaulted
+              .disable_cdf_update = 0,            // defaulted
+              .use_superres = 0,                  // defaulted
+              .allow_high_precision_mv = 0,       // defaulted
+              .use_ref_frame_mvs = 0,             // defaulted
+              .disable_frame_end_update_cdf = 0,  // defaulted
+              .reduced_tx_set = 0,                // defaulted
+              .enable_frame_obu = 0,              // Separate frame header
+              .long_term_reference = 0,           // defaulted
+              .disable_frame_recon = 0,           // No B-frames
+              .allow_intrabc = 0,                 // defaulted
+              .palette_mode_enable = 0,           // defaulted
+          },
+
+      .seg_id_block_size = 0,      // No segmentation
+      .num_tile_groups_minus1 = 0,  // Single tile
+      .temporal_id = 0,            // hardcoded
+
+      // mburakov: Loop filter and cdef parameters are decided by the driver,
+      // which then patches the packed frame header using reported offsets.
+      .interpolation_filter = interpolation_filter,
+      .base_qindex = INITIAL_QP * 255 / 51,  // Scaled from H.26x range
+      .min_base_qindex = 1,                  // Lossless is not supported
+      .max_base_qindex = 255,
+
+      .mode_control_flags.bits =
+          {
+              .delta_q_present = 0,   // Fixed quality
+              .delta_lf_present = 0,  // defaulted
+              .tx_mode = tx_mode,
+              .reference_select = 0,     // Single reference
+              .reduced_tx_set_used = 0,  // defaulted
+              .skip_mode_present = 0,    // Single reference
+          },
+
+      .tile_cols = 1,  // Single tile
+      .tile_rows = 1,  // Single tile
+      .width_in_sbs_minus_1[0] =
+          (uint16_t)(encode_context->width_in_blocks - 1),
+      .height_in_sbs_minus_1[0] =
+          (uint16_t)(encode_context->height_in_blocks - 1),
+  };
+
+  for (size_t i = 0; i < LENGTH(encode_context->av1.pic.reference_frames);
+       i++) {
+    encode_context->av1.pic.reference_frames[i] = VA_INVALID_SURFACE;
+  }
+
+  encode_context->av1.tile_group = (VAEncTileGroupBufferAV1){
+      .tg_start = 0,  // Single tile
+      .tg_end = 0,    // Single tile
+  };
+}
+
+static void PackAv1SequenceHeader(struct EncodeContextVa* encode_context) {
+  struct Bitstream bitstream = {
+      .data = encode_context->parameter_sets,
+      .size = 0,
+  };
+
+  const struct MoreAv1SeqParameters msp = {
+      .max_frame_width_minus_1 = encode_context->av1.pic.frame_width_minus_1,
+      .max_frame_height_minus_1 = encode_context->av1.pic.frame_height_minus_1,
+      .color_description_present_flag = 1,
+      .color_primaries = 2,           // Unspecified
+      .transfer_characteristics = 2,  // Unspecified
+      .matrix_coefficients =
+          encode_context->colorspace == kItuRec601 ? 6 : 1,  // Section 6.4.2
+      .color_range = encode_context->range == kFullRange,
+  };
+
+  PackAv1SequenceHeaderObu(&bitstream, &encode_context->av1.seq, &msp);
+  encode_context->parameter_sets_size = bitstream.size;
+}
+
+static bool CreateSlot(struct EncodeContextVa* encode_context,
+                       struct EncodeSlot* slot) {
+  for (size_t i = 0; i < LENGTH(slot->buffer_ids); i++) {
+    slot->buffer_ids[i] = VA_INVALID_ID;
+    slot->buffer_shadows[i] = NULL;
+  }
+  VAStatus status = vaCreateSurfaces(
+      encode_context->va_display, VA_RT_FORMAT_YUV420, encode_context->width,
+      encode_context->height, &slot->input_surface_id, 1, NULL, 0);
+  if (status != VA_STATUS_SUCCESS) {
+    LOG("Failed to create va input surface (%s)", VaErrorString(status));
+    return false;
+  }
+
+  slot->gpu_frame =
+      VaSurfaceToGpuFrame(encode_context->va_display, slot->input_surface_id,
+                          encode_context->gpu_context);
+  if (!slot->gpu_frame) {
+    LOG("Failed to convert va surface to gpu frame");
+    goto rollback_input_surface_id;
+  }
+
+  unsigned int max_encoded_size =
+      encode_context->width * encode_context->height * 3 / 2;
+  status =
+      vaCreateBuffer(encode_context->va_display, encode_context->va_context_id,
+                     VAEncCodedBufferType, max_encoded_size, 1, NULL,
+                     &slot->output_buffer_id);
+  if (status != VA_STATUS_SUCCESS) {
+    LOG("Failed to create va output buffer (%s)", VaErrorString(status));
+    goto rollback_gpu_frame;
+  }
+  return true;
+
+rollback_gpu_frame:
+  GpuContextDestroyFrame(encode_context->gpu_context, slot->gpu_frame);
+rollback_input_surface_id:
+  vaDestroySurfaces(encode_context->va_display, &slot->input_surface_id, 1);
+  return false;
+}
+
+static void DestroySlot(struct EncodeContextVa* encode_context,
+                        struct EncodeSlot* slot) {
+  for (size_t i = 0; i < LENGTH(slot->buffer_ids); i++) {
+    if (slot->buffer_ids[i] != VA_INVALID_ID)
+      vaDestroyBuffer(encode_context->va_display, slot->buffer_ids[i]);
+    free(slot->buffer_shadows[i]);
+  }
+  vaDestroyBuffer(encode_context->va_display, slot->output_buffer_id);
+  GpuContextDestroyFrame(encode_context->gpu_context, slot->gpu_frame);
+  vaDestroySurfaces(encode_context->va_display, &slot->input_surface_id, 1);
+}
+
+static int SyncThreadProc(void* arg) {
+  struct EncodeContextVa* encode_context = arg;
+  for (;;) {
+    uint8_t index;
+    ssize_t result = read(encode_context->submitter[0], &index, sizeof(index));
+    if (!result) {
+      // mburakov: Submitter pipe was closed, encode context is going away.
+      return 0;
+    }
+    if (result != sizeof(index)) {
+      if (result < 0 && errno == EINTR) continue;
+      // TODO(mburakov): Then what?..
+      abort();
+    }
+
+    // mburakov: Frames are submitted in order, and sequential frames depend on
+    // each other anyway, so there is no point in syncing out of order.
+    char status = STATUS_OK;
+    unsigned long long trace = TraceBegin();
+    VAStatus va_status = vaSyncBuffer(
+        encode_context->va_display,
+        encode_context->slots[index].output_buffer_id, VA_TIMEOUT_INFINITE);
+    TraceEnd("va_sync", trace);
+    if (va_status != VA_STATUS_SUCCESS) {
+      LOG("Failed to sync va buffer (%s)", VaErrorString(va_status));
+      status = STATUS_ERR;
+    }
+    if (write(encode_context->waker[1], &status, sizeof(status)) !=
+        sizeof(status)) {
+      // TODO(mburakov): Then what?..
+      abort();
+    }
+  }
+}
+
+struct EncodeContextVa* EncodeContextVaCreate(
+    struct GpuContext* gpu_context, uint32_t width, uint32_t height,
+    enum YuvColorspace colorspace, enum YuvRange range,
+    const struct EncodeConfig* config) {
+  struct EncodeContextVa* encode_context =
+      malloc(sizeof(struct EncodeContextVa));
+  if (!encode_context) {
+    LOG("Faield to allocate encode context (%s)", strerror(errno));
+    return NULL;
+  }
+
+  *encode_context = (struct EncodeContextVa){
+      .gpu_context = gpu_context,
+      .width = width,
+      .height = height,
+      .colorspace = colorspace,
+      .range = range,
+      .config = *config,
+  };
+
+  if (config->intra_refresh != kIntraRefreshNone) {
+    // mburakov: Intra refresh exists to avoid periodic IDR frames, so these
+    // are only emitted on client request when it is enabled.
+    encode_context->config.idr_period = 0;
+  }
+
+  encode_context->render_node = open("/dev/dri/renderD128", O_RDWR);
+  if (encode_context->render_node == -1) {
+    LOG("Failed to open render node (%s)", strerror(errno));
+    goto rollback_encode_context;
+  }
+
+  encode_context->va_display = vaGetDisplayDRM(encode_context->render_node);
+  if (!encode_context->va_display) {
+    LOG("Failed to get va display (%s)", strerror(errno));
+    goto rollback_render_node;
+  }
+
+  vaSetErrorCallback(encode_context->va_display, OnVaLogMessage, NULL);
+#ifndef NDEBUG
+  vaSetInfoCallback(encode_context->va_display, OnVaLogMessage, NULL);
+#endif  // NDEBUG
+
+  int major, minor;
+  VAStatus status = vaInitialize(encode_context->va_display, &major, &minor);
+  if (status != VA_STATUS_SUCCESS) {
+    LOG("Failed to initialize va (%s)", VaErrorString(status));
+    goto rollback_va_display;
+  }
+
+  LOG("Initialized VA %d.%d", major, minor);
+  if (!SelectCodec(encode_context)) {
+    LOG("Failed to find a supported codec profile");
+    goto rollback_va_display;
+  }
+
+  if (!InitializeCodecCaps(encode_context) ||
+      (encode_context->config.codec == kEncodeCodecHevc &&
+       !InitializeHevcCaps(encode_context)) ||
+      (encode_context->config.codec == kEncodeCodecAv1 &&
+       !InitializeAv1Caps(encode_context))) {
+    LOG("Failed to initialize codec caps");
+    goto rollback_va_display;
+  }
+
+  static const uint32_t kVaRateControls[] = {
+      [kRateControlCqp] = VA_RC_CQP,
+      [kRateControlCbr] = VA_RC_CBR,
+      [kRateControlVbr] = VA_RC_VBR,
+  };
+  uint32_t va_rate_control = kVaRateControls[config->rate_control.mode];
+  if (config->rate_control.mode != kRateControlCqp &&
+      !(encode_context->va_rate_controls & va_rate_control)) {
+    LOG("Requested rate control mode is not supported");
+    goto rollback_va_display;
+  }
+
+  static const uint32_t kVaIntraRefreshes[] = {
+      [kIntraRefreshNone] = VA_ENC_INTRA_REFRESH_NONE,
+      [kIntraRefreshColumn] = VA_ENC_INTRA_REFRESH_ROLLING_COLUMN,
+      [kIntraRefreshRow] = VA_ENC_INTRA_REFRESH_ROLLING_ROW,
+  };
+  uint32_t va_intra_refresh = kVaIntraRefreshes[config->intra_refresh];
+  if (config->intra_refresh != kIntraRefreshNone &&
+      !(encode_context->va_intra_refresh & va_intra_refresh)) {
+    LOG("Requested intra refresh mode is not supported");
+    goto rollback_va_display;
+  }
+
+  // mburakov: Drivers that do not report rate control capabilities still
+  // default to constant quality, so do not bother them with the attribute.
+  VAConfigAttrib attrib_list[] = {
+      {.type = VAConfigAttribRTFormat, .value = VA_RT_FORMAT_YUV420},
+      {.type = VAConfigAttribRateControl, .value = va_rate_control},
+  };
+  int num_attribs =
+      encode_context->va_rate_controls ? (int)LENGTH(attrib_list) : 1;
+  status = vaCreateConfig(
+      encode_context->va_display, encode_context->va_profile,
+      VAEntrypointEncSlice, attrib_list, num_attribs,
+      &encode_context->va_config_id);
+  if (status != VA_STATUS_SUCCESS) {
+    LOG("Failed to create va config (%s)", VaErrorString(status));
+    goto rollback_va_display;
+  }
+
+  // mburakov: Intel fails badly when min_cb_size value is not set to 16 and
+  // log2_min_luma_coding_block_size_minus3 is not set to zero. Judging from
+  // ffmpeg code, calculating one from another should work on other platforms,
+  // but I hardcoded it instead since AMD is fine with alignment on 16 anyway.
+  // H.264 macroblocks are always 16x16, so this is the right alignment there.
+  static const uint32_t min_cb_size = 16;
+  uint32_t aligned_width =
+      (encode_context->width + min_cb_size - 1) & ~(min_cb_size - 1);
+  uint32_t aligned_height =
+      (encode_context->height + min_cb_size - 1) & ~(min_cb_size - 1);
+
+  status =
+      vaCreateContext(encode_context->va_display, encode_context->va_config_id,
+                      (int)aligned_width, (int)aligned_height, VA_PROGRESSIVE,
+                      NULL, 0, &encode_context->va_context_id);
+  if (status != VA_STATUS_SUCCESS) {
+    LOG("Failed to create va context (%s)", VaErrorString(status));
+    goto rollback_va_config_id;
+  }
+
+  size_t nslots = 0;
+  for (; nslots < LENGTH(encode_context->slots); nslots++) {
+    if (!CreateSlot(encode_context, &encode_context->slots[nslots])) {
+      LOG("Failed to create encode slot");
+      goto rollback_slots;
+    }
+  }
+
+  status = vaCreateSurfaces(encode_context->va_display, VA_RT_FORMAT_YUV420,
+                            aligned_width, aligned_height,
+                            encode_context->recon_surface_ids,
+                            LENGTH(encode_context->recon_surface_ids), NULL, 0);
+  if (status != VA_STATUS_SUCCESS) {
+    LOG("Failed to create va recon surfaces (%s)", VaErrorString(status));
+    goto rollback_slots;
+  }
+
+  if (pipe(encode_context->submitter)) {
+    LOG("Failed to create submitter pipe (%s)", strerror(errno));
+    goto rollback_recon_surface_ids;
+  }
+  if (pipe(encode_context->waker)) {
+    LOG("Failed to create waker pipe (%s)", strerror(errno));
+    goto rollback_submitter;
+  }
+  if (thrd_create(&encode_context->sync_thread, SyncThreadProc,
+                  encode_context) != thrd_success) {
+    LOG("Failed to create sync thread");
+    goto rollback_waker;
+  }
+
+  switch (encode_context->config.codec) {
+    case kEncodeCodecHevc:
+      InitializeHevcSeqHeader(encode_context, (uint16_t)aligned_width,
+                              (uint16_t)aligned_height);
+      InitializeHevcPicHeader(encode_context);
+      InitializeHevcSliceHeader(encode_context);
+      break;
+    case kEncodeCodecH264:
+      InitializeH264SeqHeader(encode_context, (uint16_t)aligned_width,
+                              (uint16_t)aligned_height);
+      InitializeH264PicHeader(encode_context);
+      InitializeH264SliceHeader(encode_context);
+      break;
+    case kEncodeCodecAv1:
+      InitializeAv1SeqHeader(encode_context);
+      InitializeAv1PicHeader(encode_context);
+      break;
+    default:
+      __builtin_unreachable();
+  }
+
+  // mburakov: Slices are made of whole block rows, so there could not be more
+  // of those than there are rows.
+  uint32_t max_slices = MIN(MIN(encode_context->va_max_slices, MAX_SLICES),
+                            encode_context->height_in_blocks);
+  if (!encode_context->config.slices) encode_context->config.slices = 1;
+  if (encode_context->config.slices > max_slices) {
+    LOG("Limiting slices count to %u", max_slices);
+    encode_context->config.slices = max_slices;
+  }
+
+  // mburakov: Parameter sets only depend on resolution, colorspace and rate
+  // control mode, and changing any of these requires a new encode context.
+  // Bitrate is not a part of those, so these are never repacked.
+  switch (encode_context->config.codec) {
+    case kEncodeCodecHevc:
+      PackHevcParameterSets(encode_context);
+      break;
+    case kEncodeCodecH264:
+      PackH264ParameterSets(encode_context);
+      break;
+    case kEncodeCodecAv1:
+      PackAv1SequenceHeader(encode_context);
+      break;
+    default:
+      __builtin_unreachable();
+  }
+  return encode_context;
+
+rollback_waker:
+  close(encode_context->waker[1]);
+  close(encode_context->waker[0]);
+rollback_submitter:
+  close(encode_context->submitter[1]);
+  close(encode_context->submitter[0]);
+rollback_recon_surface_ids:
+  vaDestroySurfaces(encode_context->va_display,
+                    encode_context->recon_surface_ids,
+                    LENGTH(encode_context->recon_surface_ids));
+rollback_slots:
+  for (; nslots; nslots--)
+    DestroySlot(encode_context, &encode_context->slots[nslots - 1]);
+  vaDestroyContext(encode_context->va_display, encode_context->va_context_id);
+rollback_va_config_id:
+  vaDestroyConfig(encode_context->va_display, encode_context->va_config_id);
+rollback_va_display:
+  vaTerminate(encode_context->va_display);
+rollback_render_node:
+  close(encode_context->render_node);
+rollback_encode_context:
+  free(encode_context);
+  return NULL;
+}
+
+int EncodeContextVaGetEventsFd(struct EncodeContextVa* encode_context) {
+  return encode_context->waker[0];
+}
+
+const struct GpuFrame* EncodeContextVaGetFrame(
+    struct EncodeContextVa* encode_context) {
+  size_t in_flight = encode_context->submitted - encode_context->retrieved;
+  if (in_flight == LENGTH(encode_context->slots)) return NULL;
+  size_t index = encode_context->submitted % LENGTH(encode_context->slots);
+  return encode_context->slots[index].gpu_frame;
+}
+
+static void CountVaCalls(struct EncodeContextVa* encode_context, size_t count) {
+#ifndef NDEBUG
+  encode_context->stats_va_calls += count;
+#else   // NDEBUG
+  (void)encode_context;
+  (void)count;
+#endif  // NDEBUG
+}
+
+static bool UploadBuffer(struct EncodeContextVa* encode_context,
+                         struct EncodeSlot* slot, enum SlotBuffer slot_buffer,
+                         VABufferType va_buffer_type, unsigned int size,
+                         const void* data, VABufferID** presult) {
+  VABufferID* buffer_id = &slot->buffer_ids[slot_buffer];
+  unsigned int* buffer_size = &slot->buffer_sizes[slot_buffer];
+  void** buffer_shadow = &slot->buffer_shadows[slot_buffer];
+  unsigned int* shadow_size = &slot->shadow_sizes[slot_buffer];
+  if (*buffer_id != VA_INVALID_ID && *buffer_size < size) {
+    // mburakov: Only packed headers change their size, and this happens
+    // rarely enough to just recreate the buffer.
+    vaDestroyBuffer(encode_context->va_display, *buffer_id);
+    CountVaCalls(encode_context, 1);
+    *buffer_id = VA_INVALID_ID;
+  }
+
+  // mburakov: Parameters that did not change since the last time this slot
+  // uploaded them are not touched at all, because every map and unmap is a
+  // round trip to the driver. Shadow copy is reallocated together with the
+  // buffer, so it is always large enough.
+  if (*buffer_id == VA_INVALID_ID) {
+    void* shadow = realloc(*buffer_shadow, size);
+    if (!shadow) {
+      LOG("Failed to reallocate buffer shadow (%s)", strerror(errno));
+      return false;
+    }
+    *buffer_shadow = shadow;
+    VAStatus status = vaCreateBuffer(
+        encode_context->va_display, encode_context->va_context_id,
+        va_buffer_type, size, 1, (void*)(uintptr_t)data, buffer_id);
+    CountVaCalls(encode_context, 1);
+    if (status != VA_STATUS_SUCCESS) {
+      LOG("Failed to create buffer (%s)", VaErrorString(status));
+      *buffer_id = VA_INVALID_ID;
+      return false;
+    }
+    *buffer_size = size;
+  } else if (*shadow_size != size || memcmp(*buffer_shadow, data, size)) {
+    void* buffer;
+    VAStatus status =
+        vaMapBuffer(encode_context->va_display, *buffer_id, &buffer);
+    CountVaCalls(encode_context, 1);
+    if (status != VA_STATUS_SUCCESS) {
+      LOG("Failed to map buffer (%s)", VaErrorString(status));
+      return false;
+    }
+    memcpy(buffer, data, size);
+    status = vaUnmapBuffer(encode_context->va_display, *buffer_id);
+    CountVaCalls(encode_context, 1);
+    if (status != VA_STATUS_SUCCESS) {
+      LOG("Failed to unmap buffer (%s)", VaErrorString(status));
+      return false;
+    }
+  }
+
+  memcpy(*buffer_shadow, data, size);
+  *shadow_size = size;
+  *(*presult)++ = *buffer_id;
+  return true;
+}
+
+static bool UploadPackedBuffer(struct EncodeContextVa* encode_context,
+                               struct EncodeSlot* slot,
+                               enum SlotBuffer slot_buffer,
+                               VAEncPackedHeaderType packed_header_type,
+                               unsigned int bit_length, const void* data,
+                               VABufferID** presult) {
+  const VAEncPackedHeaderParameterBuffer packed_header = {
+      .type = packed_header_type,
+      .bit_length = bit_length,
+      .has_emulation_bytes = 1,
+  };
+  return UploadBuffer(encode_context, slot, slot_buffer,
+                      VAEncPackedHeaderParameterBufferType,
+                      sizeof(packed_header), &packed_header, presult) &&
+         UploadBuffer(encode_context, slot, slot_buffer + 1,
+                      VAEncPackedHeaderDataBufferType, (bit_length + 7) / 8,
+                      data, presult);
+}
+
+static bool UploadMiscBuffer(struct EncodeContextVa* encode_context,
+                             struct EncodeSlot* slot,
+                             enum SlotBuffer slot_buffer,
+                             VAEncMiscParameterType misc_parameter_type,
+                             unsigned int size, const void* data,
+                             VABufferID** presult) {
+  uint32_t buffer[(sizeof(VAEncMiscParameterBuffer) +
+                   sizeof(union MiscParameter) + sizeof(uint32_t) - 1) /
+                  sizeof(uint32_t)];
+  assert(size <= sizeof(union MiscParameter));
+  VAEncMiscParameterBuffer* misc_parameter_buffer = (void*)buffer;
+  misc_parameter_buffer->type = misc_parameter_type;
+  memcpy(misc_parameter_buffer->data, data, size);
+  return UploadBuffer(encode_context, slot, slot_buffer,
+                      VAEncMiscParameterBufferType,
+                      (unsigned int)sizeof(VAEncMiscParameterBuffer) + size,
+                      buffer, presult);
+}
+
+void FillVaRateControlParameters(const struct RateControl* rate_control,
+                                 bool reset,
+                                 VAEncMiscParameterRateControl* va_rate_control,
+                                 VAEncMiscParameterHRD* va_hrd,
+                                 VAEncMiscParameterFrameRate* va_frame_rate) {
+  bool vbr = rate_control->mode == kRateControlVbr;
+  uint32_t window_size = (uint32_t)((uint64_t)rate_control->vbv_size * 1000 /
+                                    rate_control->bitrate);
+
+  // mburakov: In vbr mode bitrate is the peak value, and the encoder aims for
+  // three quarters of that on average.
+  *va_rate_control = (VAEncMiscParameterRateControl){
+      .bits_per_second = rate_control->bitrate,
+      .target_percentage = vbr ? 75 : 100,
+      .window_size = window_size,
+      .initial_qp = INITIAL_QP,
+      .min_qp = 0,  // defaulted
+      .rc_flags.bits =
+          {
+              .reset = reset,
+              .disable_frame_skip = 1,      // Skipping is done upstream
+              .disable_bit_stuffing = vbr,  // Stuffing is cbr-only
+          },
+  };
+  *va_hrd = (VAEncMiscParameterHRD){
+      .initial_buffer_fullness = rate_control->vbv_size / 4 * 3,
+      .buffer_size = rate_control->vbv_size,
+  };
+  *va_frame_rate = (VAEncMiscParameterFrameRate){
+      .framerate = FRAME_RATE,
+  };
+}
+
+static bool UploadRateControlBuffers(struct EncodeContextVa* encode_context,
+                                     struct EncodeSlot* slot, bool reset,
+                                     VABufferID** presult) {
+  VAEncMiscParameterRateControl va_rate_control;
+  VAEncMiscParameterHRD va_hrd;
+  VAEncMiscParameterFrameRate va_frame_rate;
+  FillVaRateControlParameters(&encode_context->config.rate_control, reset,
+                              &va_rate_control, &va_hrd, &va_frame_rate);
+  return UploadMiscBuffer(encode_context, slot, kSlotBufferRateControl,
+                          VAEncMiscParameterTypeRateControl,
+                          sizeof(va_rate_control), &va_rate_control,
+                          presult) &&
+         UploadMiscBuffer(encode_context, slot, kSlotBufferHrd,
+                          VAEncMiscParameterTypeHRD, sizeof(va_hrd), &va_hrd,
+                          presult) &&
+         UploadMiscBuffer(encode_context, slot, kSlotBufferFrameRate,
+                          VAEncMiscParameterTypeFrameRate,
+                          sizeof(va_frame_rate), &va_frame_rate, presult);
+}
+
+static bool UploadIntraRefreshBuffer(struct EncodeContextVa* encode_context,
+                                     struct EncodeSlot* slot,
+                                     VABufferID** presult) {
+  bool column = encode_context->config.intra_refresh == kIntraRefreshColumn;
+  uint32_t num_blocks = column ? encode_context->width_in_blocks
+                               : encode_context->height_in_blocks;
+
+  // mburakov: Refreshed region moves by a fixed step each frame after IDR,
+  // so that every block is intra coded once within the configured period.
+  uint32_t period = encode_context->config.intra_refresh_period;
+  uint32_t insert_size = (num_blocks + period - 1) / period;
+  size_t step = (encode_context->frame_counter -
+                 encode_context->idr_frame_counter - 1) %
+                period;
+  uint32_t insertion_location =
+      MIN((uint32_t)step * insert_size, num_blocks - insert_size);
+
+  const VAEncMiscParameterRIR va_rir = {
+      .rir_flags.bits =
+          {
+              .enable_rir_column = column,
+              .enable_rir_row = !column,
+          },
+      .intra_insertion_location = (uint16_t)insertion_location,
+      .intra_insert_size = (uint16_t)insert_size,
+      .qp_delta_for_inserted_intra = 0,  // Fixed quality
+  };
+  return UploadMiscBuffer(encode_context, slot, kSlotBufferIntraRefresh,
+                          VAEncMiscParameterTypeRIR, sizeof(va_rir), &va_rir,
+                          presult);
+}
+
+static void UpdateHevcPicHeader(struct EncodeContextVa* encode_context,
+                                bool idr) {
+  // mburakov: Picture order count restarts on every IDR frame, and there are
+  // no B-frames, so it is just the number of frames since the last IDR.
+  size_t pic_order_cnt =
+      encode_context->frame_counter - encode_context->idr_frame_counter;
+  encode_context->hevc.pic.decoded_curr_pic = (VAPictureHEVC){
+      .picture_id =
+          encode_context
+              ->recon_surface_ids[encode_context->frame_counter %
+                                  LENGTH(encode_context->recon_surface_ids)],
+      .pic_order_cnt = (int32_t)pic_order_cnt,
+  };
+
+  if (idr) {
+    encode_context->hevc.pic.reference_frames[0] = (VAPictureHEVC){
+        .picture_id = VA_INVALID_ID,
+        .flags = VA_PICTURE_HEVC_INVALID,
+    };
+    encode_context->hevc.pic.nal_unit_type = IDR_W_RADL;
+    encode_context->hevc.pic.pic_fields.bits.idr_pic_flag = 1;
+    encode_context->hevc.pic.pic_fields.bits.coding_type = 1;
+  } else {
+    encode_context->hevc.pic.reference_frames[0] = (VAPictureHEVC){
+        .picture_id =
+            encode_context
+                ->recon_surface_ids[(encode_context->frame_counter - 1) %
+                                    LENGTH(encode_context->recon_surface_ids)],
+        .pic_order_cnt = (int32_t)(pic_order_cnt - 1),
+    };
+    encode_context->hevc.pic.nal_unit_type = TRAIL_R;
+    encode_context->hevc.pic.pic_fields.bits.idr_pic_flag = 0;
+    encode_context->hevc.pic.pic_fields.bits.coding_type = 2;
+  }
+}
+
+static bool UploadHevcSlice(struct EncodeContextVa* encode_context,
+                            struct EncodeSlot* slot, uint32_t index, bool idr,
+                            VABufferID** presult) {
+  // mburakov: Slices are spread evenly over CTU rows.
+  uint32_t slices = encode_context->config.slices;
+  uint32_t first_row = encode_context->height_in_blocks * index / slices;
+  uint32_t last_row = encode_context->height_in_blocks * (index + 1) / slices;
+  encode_context->hevc.slice.slice_segment_address =
+      first_row * encode_context->width_in_blocks;
+  encode_context->hevc.slice.num_ctu_in_slice =
+      (last_row - first_row) * encode_context->width_in_blocks;
+  encode_context->hevc.slice.slice_fields.bits.last_slice_of_pic_flag =
+      index + 1 == slices;
+
+  enum SlotBuffer slot_buffer = kSlotBufferSlices + index * 3;
+  if (encode_context->va_packed_headers & VA_ENC_PACKED_HEADER_SLICE) {
+    char buffer[256];
+    struct Bitstream bitstream = {
+        .data = buffer,
+        .size = 0,
+    };
+    static const struct NegativePics negative_pics[] = {
+        {
+            .delta_poc_s0_minus1 = 0,
+            .used_by_curr_pic_s0_flag = true,
+        },
+    };
+    const struct MoreSliceParamerters msp = {
+        .first_slice_segment_in_pic_flag = !index,
+        .num_negative_pics = idr ? 0 : LENGTH(negative_pics),
+        .negative_pics = idr ? NULL : negative_pics,
+    };
+    PackSliceSegmentHeaderNalUnit(&bitstream, &encode_context->hevc.seq,
+                                  &encode_context->hevc.pic,
+                                  &encode_context->hevc.slice, &msp);
+    if (!UploadPackedBuffer(encode_context, slot, slot_buffer,
+                            VAEncPackedHeaderSlice,
+                            (unsigned int)bitstream.size, bitstream.data,
+                            presult)) {
+      LOG("Failed to upload packed slice header");
+      return false;
+    }
+  }
+
+  if (!UploadBuffer(encode_context, slot, slot_buffer + 2,
+                    VAEncSliceParameterBufferType,
+                    sizeof(encode_context->hevc.slice),
+                    &encode_context->hevc.slice, presult)) {
+    LOG("Failed to upload slice parameter buffer");
+    return false;
+  }
+  return true;
+}
+
+static bool UploadHevcPicture(struct EncodeContextVa* encode_context,
+                              struct EncodeSlot* slot, bool idr,
+                              VABufferID** presult) {
+  UpdateHevcPicHeader(encode_context, idr);
+  encode_context->hevc.pic.coded_buf = slot->output_buffer_id;
+  if (!UploadBuffer(encode_context, slot, kSlotBufferPic,
+                    VAEncPictureParameterBufferType,
+                    sizeof(encode_context->hevc.pic), &encode_context->hevc.pic,
+                    presult)) {
+    LOG("Failed to upload picture parameter buffer");
+    return false;
+  }
+
+  encode_context->hevc.slice.slice_type = idr ? I : P;
+  encode_context->hevc.slice.ref_pic_list0[0] =
+      encode_context->hevc.pic.reference_frames[0];
+  for (uint32_t i = 0; i < encode_context->config.slices; i++) {
+    if (!UploadHevcSlice(encode_context, slot, i, idr, presult)) {
+      LOG("Failed to upload slice %u", i);
+      return false;
+    }
+  }
+  return true;
+}
+
+static void UpdateH264PicHeader(struct EncodeContextVa* encode_context,
+                                bool idr) {
+  // mburakov: There are no B-frames, so frame_num is just the number of frames
+  // since the last IDR, and picture order count is twice that as of 8.2.1.3.
+  size_t frames_since_idr =
+      encode_context->frame_counter - encode_context->idr_frame_counter;
+  const typeof(encode_context->h264.seq.seq_fields.bits)* seq_bits =
+      &encode_context->h264.seq.seq_fields.bits;
+  uint32_t max_frame_num = 1u << (seq_bits->log2_max_frame_num_minus4 + 4);
+  encode_context->h264.pic.frame_num =
+      (uint16_t)(frames_since_idr % max_frame_num);
+  encode_context->h264.pic.CurrPic = (VAPictureH264){
+      .picture_id =
+          encode_context
+              ->recon_surface_ids[encode_context->frame_counter %
+                                  LENGTH(encode_context->recon_surface_ids)],
+      .frame_idx = encode_context->h264.pic.frame_num,
+      .flags = VA_PICTURE_H264_SHORT_TERM_REFERENCE,
+      .TopFieldOrderCnt = (int32_t)(frames_since_idr * 2),
+      .BottomFieldOrderCnt = (int32_t)(frames_since_idr * 2),
+  };
+
+  if (idr) {
+    encode_context->h264.pic.ReferenceFrames[0] = (VAPictureH264){
+        .picture_id = VA_INVALID_ID,
+        .flags = VA_PICTURE_H264_INVALID,
+    };
+    encode_context->h264.pic.pic_fields.bits.idr_pic_flag = 1;
+    // mburakov: Consecutive IDR pictures must have different idr_pic_id.
+    encode_context->h264.slice.idr_pic_id = encode_context->h264.idr_pic_id++;
+  } else {
+    encode_context->h264.pic.ReferenceFrames[0] = (VAPictureH264){
+        .picture_id =
+            encode_context
+                ->recon_surface_ids[(encode_context->frame_counter - 1) %
+                                    LENGTH(encode_context->recon_surface_ids)],
+        .frame_idx = (uint32_t)((frames_since_idr - 1) % max_frame_num),
+        .flags = VA_PICTURE_H264_SHORT_TERM_REFERENCE,
+        .TopFieldOrderCnt = (int32_t)((frames_since_idr - 1) * 2),
+        .BottomFieldOrderCnt = (int32_t)((frames_since_idr - 1) * 2),
+    };
+    encode_context->h264.pic.pic_fields.bits.idr_pic_flag = 0;
+  }
+}
+
+static bool UploadH264Slice(struct EncodeContextVa* encode_context,
+                            struct EncodeSlot* slot, uint32_t index,
+                            VABufferID** presult) {
+  // mburakov: Slices are spread evenly over macroblock rows.
+  uint32_t slices = encode_context->config.slices;
+  uint32_t first_row = encode_context->height_in_blocks * index / slices;
+  uint32_t last_row = encode_context->height_in_blocks * (index + 1) / slices;
+  encode_context->h264.slice.macroblock_address =
+      first_row * encode_context->width_in_blocks;
+  encode_context->h264.slice.num_macroblocks =
+      (last_row - first_row) * encode_context->width_in_blocks;
+
+  enum SlotBuffer slot_buffer = kSlotBufferSlices + index * 3;
+  if (encode_context->va_packed_headers & VA_ENC_PACKED_HEADER_SLICE) {
+    char buffer[256];
+    struct Bitstream bitstream = {
+        .data = buffer,
+        .size = 0,
+    };
+    PackH264SliceHeaderNalUnit(&bitstream, &encode_context->h264.seq,
+                               &encode_context->h264.pic,
+                               &encode_context->h264.slice);
+    if (!UploadPackedBuffer(encode_context, slot, slot_buffer,
+                            VAEncPackedHeaderSlice,
+                            (unsigned int)bitstream.size, bitstream.data,
+                            presult)) {
+      LOG("Failed to upload packed slice header");
+      return false;
+    }
+  }
+
+  if (!UploadBuffer(encode_context, slot, slot_buffer + 2,
+                    VAEncSliceParameterBufferType,
+                    sizeof(encode_context->h264.slice),
+                    &encode_context->h264.slice, presult)) {
+    LOG("Failed to upload slice parameter buffer");
+    return false;
+  }
+  return true;
+}
+
+static bool UploadH264Picture(struct EncodeContextVa* encode_context,
+                              struct EncodeSlot* slot, bool idr,
+                              VABufferID** presult) {
+  UpdateH264PicHeader(encode_context, idr);
+  encode_context->h264.pic.coded_buf = slot->output_buffer_id;
+  if (!UploadBuffer(encode_context, slot, kSlotBufferPic,
+                    VAEncPictureParameterBufferType,
+                    sizeof(encode_context->h264.pic), &encode_context->h264.pic,
+                    presult)) {
+    LOG("Failed to upload picture parameter buffer");
+    return false;
+  }
+
+  encode_context->h264.slice.slice_type = idr ? H264_SLICE_I : H264_SLICE_P;
+  encode_context->h264.slice.RefPicList0[0] =
+      encode_context->h264.pic.ReferenceFrames[0];
+  for (uint32_t i = 0; i < encode_context->config.slices; i++) {
+    if (!UploadH264Slice(encode_context, slot, i, presult)) {
+      LOG("Failed to upload slice %u", i);
+      return false;
+    }
+  }
+  return true;
+}
+
+static void UpdateAv1PicHeader(struct EncodeContextVa* encode_context,
+                               bool idr) {
+  // mburakov: There are no B-frames, so order hint is just the number of
+  // frames since the last key frame, wrapped to the order hint bits.
+  size_t frames_since_idr =
+      encode_context->frame_counter - encode_context->idr_frame_counter;
+  uint32_t order_hint_bits =
+      encode_context->av1.seq.order_hint_bits_minus_1 + 1u;
+  encode_context->av1.pic.order_hint =
+      (uint8_t)(frames_since_idr & ((1u << order_hint_bits) - 1));
+  encode_context->av1.pic.reconstructed_frame =
+      encode_context
+          ->recon_surface_ids[encode_context->frame_counter %
+                              LENGTH(encode_context->recon_surface_ids)];
+
+  // mburakov: Every inter frame refers to the previous one only, which is
+  // always kept in the first reference slot, and all the seven references of
+  // the frame header point there.
+  static const uint8_t primary_ref_none = 7;
+  static const uint8_t last_frame = 1;
+  if (idr) {
+    encode_context->av1.pic.reference_frames[0] = VA_INVALID_SURFACE;
+    encode_context->av1.pic.picture_flags.bits.frame_type = AV1_KEY_FRAME;
+    encode_context->av1.pic.primary_ref_frame = primary_ref_none;
+    encode_context->av1.pic.refresh_frame_flags = 0xff;
+    encode_context->av1.pic.ref_frame_ctrl_l0.value = 0;
+  } else {
+    encode_context->av1.pic.reference_frames[0] =
+        encode_context
+            ->recon_surface_ids[(encode_context->frame_counter - 1) %
+                                LENGTH(encode_context->recon_surface_ids)];
+    encode_context->av1.pic.picture_flags.bits.frame_type = AV1_INTER_FRAME;
+    encode_context->av1.pic.primary_ref_frame = 0;
+    encode_context->av1.pic.refresh_frame_flags = 0x01;
+    encode_context->av1.pic.ref_frame_ctrl_l0.fields.search_idx0 = last_frame;
+  }
+}
+
+static bool UploadAv1Picture(struct EncodeContextVa* encode_context,
+                             struct EncodeSlot* slot, bool idr,
+                             VABufferID** presult) {
+  UpdateAv1PicHeader(encode_context, idr);
+  encode_context->av1.pic.coded_buf = slot->output_buffer_id;
+
+  // mburakov: Packing the frame header fills the offsets of the fields that
+  // driver patches later, so it has to happen before uploading the picture.
+  char buffer[256];
+  struct Bitstream bitstream = {
+      .data = buffer,
+      .size = 0,
+  };
+  bool packed_picture =
+      encode_context->va_packed_headers & VA_ENC_PACKED_HEADER_PICTURE;
+  if (packed_picture) {
+    const typeof(encode_context->va_av1_features_ext2.bits)* ext2_bits =
+        &encode_context->va_av1_features_ext2.bits;
+    const struct MoreAv1FrameParameters mfp = {
+        .obu_size_length = (uint8_t)(ext2_bits->obu_size_bytes_minus1 + 1),
+    };
+    PackAv1FrameHeaderObu(&bitstream, &encode_context->av1.seq,
+                          &encode_context->av1.pic, &mfp);
+  }
+
+  if (!UploadBuffer(encode_context, slot, kSlotBufferPic,
+                    VAEncPictureParameterBufferType,
+                    sizeof(encode_context->av1.pic), &encode_context->av1.pic,
+                    presult)) {
+    LOG("Failed to upload picture parameter buffer");
+    return false;
+  }
+
+  if (packed_picture &&
+      !UploadPackedBuffer(encode_context, slot, kSlotBufferPackedPicParam,
+                          VAEncPackedHeaderPicture,
+                          (unsigned int)bitstream.size, bitstream.data,
+                          presult)) {
+    LOG("Failed to upload packed frame header");
+    return false;
+  }
+
+  if (!UploadBuffer(encode_context, slot, kSlotBufferSlices + 2,
+                    VAEncSliceParameterBufferType,
+                    sizeof(encode_context->av1.tile_group),
+                    &encode_context->av1.tile_group, presult)) {
+    LOG("Failed to upload tile group buffer");
+    return false;
+  }
+  return true;
+}
+
+static bool UploadSeqBuffer(struct EncodeContextVa* encode_context,
+                            struct EncodeSlot* slot, VABufferID** presult) {
+  switch (encode_context->config.codec) {
+    case kEncodeCodecHevc:
+      return UploadBuffer(encode_context, slot, kSlotBufferSeq,
+                          VAEncSequenceParameterBufferType,
+                          sizeof(encode_context->hevc.seq),
+                          &encode_context->hevc.seq, presult);
+    case kEncodeCodecH264:
+      return UploadBuffer(encode_context, slot, kSlotBufferSeq,
+                          VAEncSequenceParameterBufferType,
+                          sizeof(encode_context->h264.seq),
+                          &encode_context->h264.seq, presult);
+    case kEncodeCodecAv1:
+      return UploadBuffer(encode_context, slot, kSlotBufferSeq,
+                          VAEncSequenceParameterBufferType,
+                          sizeof(encode_context->av1.seq),
+                          &encode_context->av1.seq, presult);
+    default:
+      __builtin_unreachable();
+  }
+}
+
+static bool UploadPicture(struct EncodeContextVa* encode_context,
+                          struct EncodeSlot* slot, bool idr,
+                          VABufferID** presult) {
+  switch (encode_context->config.codec) {
+    case kEncodeCodecHevc:
+      return UploadHevcPicture(encode_context, slot, idr, presult);
+    case kEncodeCodecH264:
+      return UploadH264Picture(encode_context, slot, idr, presult);
+    case kEncodeCodecAv1:
+      return UploadAv1Picture(encode_context, slot, idr, presult);
+    default:
+      __builtin_unreachable();
+  }
+}
+
+bool EncodeContextVaEncodeFrame(struct EncodeContextVa* encode_context,
+                                unsigned long long timestamp) {
+  uint8_t index =
+      (uint8_t)(encode_context->submitted % LENGTH(encode_context->slots));
+  struct EncodeSlot* slot = &encode_context->slots[index];
+  VABufferID buffers[kSlotBufferCount];
+  VABufferID* buffer_ptr = buffers;
+
+  size_t frames_since_idr =
+      encode_context->frame_counter - encode_context->idr_frame_counter;
+  bool idr = !encode_context->frame_counter || encode_context->idr_requested ||
+             (encode_context->config.idr_period &&
+              frames_since_idr >= encode_context->config.idr_period);
+  if (idr) {
+    encode_context->idr_frame_counter = encode_context->frame_counter;
+    encode_context->idr_requested = false;
+  }
+  if (idr && !UploadSeqBuffer(encode_context, slot, &buffer_ptr)) {
+    LOG("Failed to upload sequence parameter buffer");
+    return false;
+  }
+
+  if (idr &&
+      (encode_context->va_packed_headers & VA_ENC_PACKED_HEADER_SEQUENCE) &&
+      !UploadPackedBuffer(encode_context, slot, kSlotBufferPackedSeqParam,
+                          VAEncPackedHeaderSequence,
+                          (unsigned int)encode_context->parameter_sets_size,
+                          encode_context->parameter_sets, &buffer_ptr)) {
+    LOG("Failed to upload packed sequence header");
+    return false;
+  }
+
+  bool reset = encode_context->rate_control_dirty;
+  if (encode_context->config.rate_control.mode != kRateControlCqp &&
+      (idr || reset) &&
+      !UploadRateControlBuffers(encode_context, slot, reset, &buffer_ptr)) {
+    LOG("Failed to upload rate control buffers");
+    return false;
+  }
+
+  if (encode_context->config.intra_refresh != kIntraRefreshNone && !idr &&
+      !UploadIntraRefreshBuffer(encode_context, slot, &buffer_ptr)) {
+    LOG("Failed to upload intra refresh buffer");
+    return false;
+  }
+
+  if (!UploadPicture(encode_context, slot, idr, &buffer_ptr)) {
+    LOG("Failed to upload picture");
+    return false;
+  }
+
+  CountVaCalls(encode_context, 3);
+  unsigned long long trace = TraceBegin();
+  VAStatus status =
+      vaBeginPicture(encode_context->va_display, encode_context->va_context_id,
+                     slot->input_surface_id);
+  TraceEnd("va_begin", trace);
+  if (status != VA_STATUS_SUCCESS) {
+    LOG("Failed to begin va picture (%s)", VaErrorString(status));
+    return false;
+  }
+
+  int num_buffers = (int)(buffer_ptr - buffers);
+  trace = TraceBegin();
+  status = vaRenderPicture(encode_context->va_display,
+                           encode_context->va_context_id, buffers, num_buffers);
+  TraceEnd("va_render", trace);
+  if (status != VA_STATUS_SUCCESS) {
+    LOG("Failed to render va picture (%s)", VaErrorString(status));
+    return false;
+  }
+
+  trace = TraceBegin();
+  status =
+      vaEndPicture(encode_context->va_display, encode_context->va_context_id);
+  TraceEnd("va_end", trace);
+  if (status != VA_STATUS_SUCCESS) {
+    LOG("Failed to end va picture (%s)", VaErrorString(status));
+    return false;
+  }
+
+  slot->timestamp = timestamp;
+  slot->idr = idr;
+  if (write(encode_context->submitter[1], &index, sizeof(index)) !=
+      sizeof(index)) {
+    LOG("Failed to submit frame for syncing (%s)", strerror(errno));
+    return false;
+  }
+
+  encode_context->submitted++;
+  encode_context->frame_counter++;
+  encode_context->rate_control_dirty = false;
+  return true;
+}
+
+enum EncodeCodec EncodeContextVaGetCodec(
+    const struct EncodeContextVa* encode_context) {
+  return encode_context->config.codec;
+}
+
+void EncodeContextVaRequestIdr(struct EncodeContextVa* encode_context) {
+  encode_context->idr_requested = true;
+}
+
+void EncodeContextVaSetBitrate(struct EncodeContextVa* encode_context,
+                               uint32_t bitrate) {
+  if (encode_context->config.rate_control.mode == kRateControlCqp ||
+      encode_context->config.rate_control.bitrate == bitrate) {
+    return;
+  }
+  // mburakov: Keep the same vbv duration, so that latency is not affected.
+  struct RateControl* rate_control = &encode_context->config.rate_control;
+  uint64_t vbv_size = (uint64_t)rate_control->vbv_size * bitrate /
+                      rate_control->bitrate;
+  rate_control->vbv_size = vbv_size ? (uint32_t)vbv_size : 1;
+  rate_control->bitrate = bitrate;
+  encode_context->rate_control_dirty = true;
+  switch (encode_context->config.codec) {
+    case kEncodeCodecHevc:
+      encode_context->hevc.seq.bits_per_second = bitrate;
+      break;
+    case kEncodeCodecH264:
+      encode_context->h264.seq.bits_per_second = bitrate;
+      break;
+    case kEncodeCodecAv1:
+      encode_context->av1.seq.bits_per_second = bitrate;
+      break;
+    default:
+      __builtin_unreachable();
+  }
+}
+
+// mburakov: Checks whether the NAL unit following a start code is a slice,
+// but not the first one of a picture. Both first_slice_segment_in_pic_flag of
+// HEVC and first_mb_in_slice of H.264 being zero are a single leading one bit.
+static bool IsNonFirstSlice(enum EncodeCodec codec, const uint8_t* nal_unit) {
+  switch (codec) {
+    case kEncodeCodecHevc:
+      return (nal_unit[0] >> 1 & 0x3f) <= RSV_IRAP_VCL23 &&
+             !(nal_unit[2] & 0x80);
+    case kEncodeCodecH264:
+      return ((nal_unit[0] & 0x1f) == H264_NAL_SLICE ||
+              (nal_unit[0] & 0x1f) == H264_NAL_IDR_SLICE) &&
+             !(nal_unit[1] & 0x80);
+    case kEncodeCodecAv1:
+      // mburakov: AV1 frames are always coded as a single tile group.
+      return false;
+    default:
+      __builtin_unreachable();
+  }
+}
+
+// mburakov: Returns the offset of the first start code, at or after the given
+// one, that opens a non-first slice segment of a picture, or size if there is
+// none. Start codes are not expected to straddle coded buffer segments.
+static size_t FindNextSlice(enum EncodeCodec codec, const uint8_t* data,
+                            size_t size, size_t from) {
+  for (const uint8_t* it = data + from; it + 3 < data + size; it++) {
+    it = memchr(it, 1, (size_t)(data + size - 3 - it));
+    if (!it) break;
+    if (it - data < 2 || it[-1] || it[-2]) continue;
+    if (!IsNonFirstSlice(codec, it + 1)) continue;
+    size_t offset = (size_t)(it - data) - 2;
+    return offset > from && !data[offset - 1] ? offset - 1 : offset;
+  }
+  return size;
+}
+
+bool EncodeContextVaProcessEvents(struct EncodeContextVa* encode_context,
+                                  struct ProtoQueue* proto_queue) {
+  char status;
+  if (read(encode_context->waker[0], &status, sizeof(status)) !=
+      sizeof(status)) {
+    LOG("Failed to read sync status (%s)", strerror(errno));
+    return false;
+  }
+
+  switch (status) {
+    case STATUS_OK:
+      break;
+    case STATUS_ERR:
+      LOG("Error reported from sync thread");
+      return false;
+    default:
+      __builtin_unreachable();
+  }
+
+  bool result = false;
+  struct EncodeSlot* slot =
+      &encode_context
+           ->slots[encode_context->retrieved % LENGTH(encode_context->slots)];
+  VACodedBufferSegment* segment;
+  unsigned long long trace = TraceBegin();
+  VAStatus va_status = vaMapBuffer(encode_context->va_display,
+                                   slot->output_buffer_id, (void**)&segment);
+  TraceEnd("va_map", trace);
+  if (va_status != VA_STATUS_SUCCESS) {
+    LOG("Failed to map va buffer (%s)", VaErrorString(va_status));
+    return false;
+  }
+
+  // mburakov: Segments are handed over to the socket as is, and only the
+  // leftovers are copied when the socket does not accept everything at once.
+  // With multiple slices, segments are additionally split at slice starts,
+  // and every slice goes out as a separate message.
+  struct {
+    int first;
+    uint32_t size;
+  } messages[MAX_SLICES] = {0};
+  size_t last_message = 0;
+  uint32_t size = 0;
+  int count = 0;
+  struct iovec iovec[PROTO_MAX_IOVEC];
+  for (VACodedBufferSegment* it = segment; it; it = it->next) {
+    const uint8_t* data = it->buf;
+    size_t left = it->size;
+    size_t from = 0;
+    while (left) {
+      size_t piece = encode_context->config.slices > 1
+                         ? FindNextSlice(encode_context->config.codec, data,
+                                         left, from)
+                         : left;
+      if (piece) {
+        if (count == LENGTH(iovec)) {
+          LOG("Too many coded buffer segments");
+          goto rollback_segment;
+        }
+        iovec[count++] = (struct iovec){
+            .iov_base = (void*)data,
+            .iov_len = piece,
+        };
+        messages[last_message].size += (uint32_t)piece;
+        size += (uint32_t)piece;
+      }
+      if (piece == left) break;
+      if (messages[last_message].size) {
+        if (++last_message == LENGTH(messages)) {
+          LOG("Too many slices in coded buffer");
+          goto rollback_segment;
+        }
+        messages[last_message].first = count;
+      }
+      data += piece;
+      left -= piece;
+      from = 4;
+    }
+  }
+#ifndef NDEBUG
+  // mburakov: Running frame size variance, i.e. to compare how intra refresh
+  // smooths out bitrate spikes of periodic IDR frames.
+  double delta = size - encode_context->stats_mean;
+  encode_context->stats_counter++;
+  encode_context->stats_mean += delta / (double)encode_context->stats_counter;
+  encode_context->stats_m2 += delta * (size - encode_context->stats_mean);
+  encode_context->stats_max = size > encode_context->stats_max
+                                  ? size
+                                  : encode_context->stats_max;
+  if (encode_context->stats_counter == STATS_PERIOD) {
+    LOG("Frame size mean %.0f, variance %.0f, max %u, va calls %.1f",
+        encode_context->stats_mean,
+        encode_context->stats_m2 / (double)encode_context->stats_counter,
+        encode_context->stats_max,
+        (double)encode_context->stats_va_calls /
+            (double)encode_context->stats_counter);
+    encode_context->stats_counter = 0;
+    encode_context->stats_va_calls = 0;
+    encode_context->stats_mean = 0;
+    encode_context->stats_m2 = 0;
+    encode_context->stats_max = 0;
+  }
+#endif  // NDEBUG
+
+  uint16_t latency = (uint16_t)(MicrosNow() - slot->timestamp);
+  for (size_t i = 0; i <= last_message; i++) {
+    int next = i < last_message ? messages[i + 1].first : count;
+    struct Proto proto = {
+        .size = messages[i].size,
+        .type = PROTO_TYPE_VIDEO,
+        .flags = (slot->idr ? PROTO_FLAG_KEYFRAME : 0) |
+                 (i < last_message ? PROTO_FLAG_MORE_SLICES : 0),
+        .latency = latency,
+    };
+    if (!ProtoQueueWritev(proto_queue, &proto, iovec + messages[i].first,
+                          next - messages[i].first)) {
+      LOG("Failed to write encoded frame");
+      goto rollback_segment;
+    }
+  }
+
+  encode_context->retrieved++;
+  result = true;
+
+rollback_segment:
+  vaUnmapBuffer(encode_context->va_display, slot->output_buffer_id);
+  return result;
+}
+
+void EncodeContextVaDestroy(struct EncodeContextVa* encode_context) {
+  close(encode_context->submitter[1]);
+  thrd_join(encode_context->sync_thread, NULL);
+  close(encode_context->submitter[0]);
+  close(encode_context->waker[1]);
+  close(encode_context->waker[0]);
+  vaDestroySurfaces(encode_context->va_display,
+                    encode_context->recon_surface_ids,
+                    LENGTH(encode_context->recon_surface_ids));
+  for (size_t i = LENGTH(encode_context->slots); i; i--)
+    DestroySlot(encode_context, &encode_context->slots[i - 1]);
+  vaDestroyContext(encode_context->va_display, encode_context->va_context_id);
+  vaDestroyConfig(encode_context->va_display, encode_context->va_config_id);
+  vaTerminate(encode_context->va_display);
+  close(encode_context->render_node);
+  free(encode_context);
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_ENCODE_VA_H_
+#define STREAMER_ENCODE_VA_H_
+
+#include <stdbool.h>
+#include <va/va.h>
+
+#include "encode.h"
+
+struct EncodeContextVa;
+
+// mburakov: Misc parameters uploaded on IDR and on bitrate changes. This is
+// exposed only to verify the parameters without VA-API.
+void FillVaRateControlParameters(const struct RateControl* rate_control,
+                                 bool reset,
+                                 VAEncMiscParameterRateControl* va_rate_control,
+                                 VAEncMiscParameterHRD* va_hrd,
+                                 VAEncMiscParameterFrameRate* va_frame_rate);
+
+struct EncodeContextVa* EncodeContextVaCreate(
+    struct GpuContext* gpu_context, uint32_t width, uint32_t height,
+    enum YuvColorspace colorspace, enum YuvRange range,
+    const struct EncodeConfig* config);
+int EncodeContextVaGetEventsFd(struct EncodeContextVa* encode_context);
+const struct GpuFrame* EncodeContextVaGetFrame(
+    struct EncodeContextVa* encode_context);
+bool EncodeContextVaEncodeFrame(struct EncodeContextVa* encode_context,
+                                unsigned long long timestamp);
+enum EncodeCodec EncodeContextVaGetCodec(
+    const struct EncodeContextVa* encode_context);
+void EncodeContextVaRequestIdr(struct EncodeContextVa* encode_context);
+void EncodeContextVaSetBitrate(struct EncodeContextVa* encode_context,
+                               uint32_t bitrate);
+bool EncodeContextVaProcessEvents(struct EncodeContextVa* encode_context,
+                                  struct ProtoQueue* proto_queue);
+void EncodeContextVaDestroy(struct EncodeContextVa* encode_context);
+
+#endif  // STREAMER_ENCODE_VA_H_
@@ -0,0 +1,375 @@
+/*
+ * Copyright (C) 2023 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef USE_X264
+
+#include "encode_x264.h"
+
+#include <drm_fourcc.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <x264.h>
+
+#include "gpu.h"
+#include "proto.h"
+#include "toolbox/perf.h"
+#include "toolbox/utils.h"
+#include "trace.h"
+
+// mburakov: This is a fallback for hosts without VA-API, i.e. virtual
+// machines or systems with Nvidia. Gpu is still used for colorspace
+// conversion, and the result is read back into a cpu-side NV12 buffer. Encoding
+// is synchronous, so there is only a single frame in flight, and waker pipe is
+// only used to defer sending to the main loop, same as with the VA encoder.
+
+struct EncodeContextX264 {
+  struct GpuContext* gpu_context;
+  struct GpuFrame* gpu_frame;
+  uint32_t width;
+  uint32_t height;
+  struct EncodeConfig config;
+  bool idr_requested;
+
+  x264_param_t param;
+  x264_t* encoder;
+  x264_picture_t picture;
+  uint8_t* buffer;
+  int waker[2];
+
+  x264_nal_t* nals;
+  int nals_count;
+  bool idr;
+  unsigned long long timestamp;
+  bool pending;
+};
+
+static void SetRateControl(x264_param_t* param,
+                           const struct RateControl* rate_control) {
+  switch (rate_control->mode) {
+    case kRateControlCqp:
+      param->rc.i_rc_method = X264_RC_CQP;
+      param->rc.i_qp_constant = INITIAL_QP;
+      break;
+    case kRateControlCbr:
+    case kRateControlVbr:
+      // mburakov: x264 operates with kilobits. In vbr mode the bitrate is the
+      // peak value, and the average is the same fraction of it as with VA-API.
+      param->rc.i_rc_method = X264_RC_ABR;
+      param->rc.i_vbv_max_bitrate = (int)(rate_control->bitrate / 1000);
+      param->rc.i_bitrate = rate_control->mode == kRateControlVbr
+                                ? param->rc.i_vbv_max_bitrate / 4 * 3
+                                : param->rc.i_vbv_max_bitrate;
+      param->rc.i_vbv_buffer_size = (int)(rate_control->vbv_size / 1000);
+      param->rc.f_vbv_buffer_init = 0.75f;
+      break;
+    default:
+      __builtin_unreachable();
+  }
+}
+
+static bool InitializeParam(struct EncodeContextX264* encode_context,
+                            enum YuvColorspace colorspace,
+                            enum YuvRange range) {
+  x264_param_t* param = &encode_context->param;
+  if (x264_param_default_preset(param, "veryfast", "zerolatency")) {
+    LOG("Failed to apply x264 preset");
+    return false;
+  }
+
+  // mburakov: Zerolatency tune enables sliced threads, so every thread works
+  // on the same frame and there is no extra delay. Thread count is tied to
+  // the number of cores, falling back to x264 autodetection on failure.
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  param->i_threads = cores > 0 ? (int)cores : 0;
+  param->i_width = (int)encode_context->width;
+  param->i_height = (int)encode_context->height;
+  param->i_csp = X264_CSP_NV12;
+  param->i_log_level = X264_LOG_WARNING;
+
+  // mburakov: Same as with VA-API, primaries and transfer are unspecified.
+  param->vui.b_fullrange = range == kFullRange;
+  param->vui.i_colorprim = 2;
+  param->vui.i_transfer = 2;
+  param->vui.i_colmatrix = colorspace == kItuRec601 ? 6 : 1;
+
+  param->b_vfr_input = 0;
+  param->i_fps_num = FRAME_RATE;
+  param->i_fps_den = 1;
+  param->b_aud = 0;
+  param->b_annexb = 1;
+  param->b_repeat_headers = 1;
+  param->i_scenecut_threshold = 0;
+  param->i_keyint_max = encode_context->config.idr_period
+                            ? (int)encode_context->config.idr_period
+                            : X264_KEYINT_MAX_INFINITE;
+
+  switch (encode_context->config.intra_refresh) {
+    case kIntraRefreshNone:
+      break;
+    case kIntraRefreshColumn:
+      // mburakov: x264 refreshes the picture with a moving column, and the
+      // refresh period is derived from the keyframe interval.
+      param->b_intra_refresh = 1;
+      param->i_keyint_max = (int)encode_context->config.intra_refresh_period;
+      break;
+    case kIntraRefreshRow:
+      LOG("Row intra refresh is not supported by x264");
+      return false;
+    default:
+      __builtin_unreachable();
+  }
+
+  SetRateControl(param, &encode_context->config.rate_control);
+
+  // mburakov: Slices are made of whole macroblock rows, so there could not be
+  // more of those than there are rows.
+  uint32_t max_slices = MIN(MAX_SLICES, (encode_context->height + 15) / 16);
+  if (!encode_context->config.slices) encode_context->config.slices = 1;
+  if (encode_context->config.slices > max_slices) {
+    LOG("Limiting slices count to %u", max_slices);
+    encode_context->config.slices = max_slices;
+  }
+  param->i_slice_count = (int)encode_context->config.slices;
+
+  if (x264_param_apply_profile(param, "high")) {
+    LOG("Failed to apply x264 profile");
+    return false;
+  }
+  return true;
+}
+
+struct EncodeContextX264* EncodeContextX264Create(
+    struct GpuContext* gpu_context, uint32_t width, uint32_t height,
+    enum YuvColorspace colorspace, enum YuvRange range,
+    const struct EncodeConfig* config) {
+  if (config->codec != kEncodeCodecAuto && config->codec != kEncodeCodecH264) {
+    LOG("Requested codec is not supported by x264");
+    return NULL;
+  }
+
+  struct EncodeContextX264* encode_context =
+      malloc(sizeof(struct EncodeContextX264));
+  if (!encode_context) {
+    LOG("Failed to allocate encode context (%s)", strerror(errno));
+    return NULL;
+  }
+
+  *encode_context = (struct EncodeContextX264){
+      .gpu_context = gpu_context,
+      .width = width,
+      .height = height,
+      .config = *config,
+  };
+  encode_context->config.codec = kEncodeCodecH264;
+
+  if (!InitializeParam(encode_context, colorspace, range)) {
+    LOG("Failed to initialize x264 parameters");
+    goto rollback_encode_context;
+  }
+
+  encode_context->gpu_frame =
+      GpuContextAllocateFrame(gpu_context, width, height, DRM_FORMAT_NV12);
+  if (!encode_context->gpu_frame) {
+    LOG("Failed to allocate gpu frame");
+    goto rollback_encode_context;
+  }
+
+  size_t luma_size = (size_t)width * height;
+  encode_context->buffer = malloc(luma_size + luma_size / 2);
+  if (!encode_context->buffer) {
+    LOG("Failed to allocate frame buffer (%s)", strerror(errno));
+    goto rollback_gpu_frame;
+  }
+
+  x264_picture_init(&encode_context->picture);
+  encode_context->picture.img.i_csp = X264_CSP_NV12;
+  encode_context->picture.img.i_plane = 2;
+  encode_context->picture.img.i_stride[0] = (int)width;
+  encode_context->picture.img.i_stride[1] = (int)width;
+  encode_context->picture.img.plane[0] = encode_context->buffer;
+  encode_context->picture.img.plane[1] = encode_context->buffer + luma_size;
+
+  encode_context->encoder = x264_encoder_open(&encode_context->param);
+  if (!encode_context->encoder) {
+    LOG("Failed to open x264 encoder");
+    goto rollback_buffer;
+  }
+
+  // mburakov: x264 might have adjusted some of the parameters, i.e. the slices
+  // count when using sliced threads, so read those back.
+  x264_encoder_parameters(encode_context->encoder, &encode_context->param);
+
+  if (pipe(encode_context->waker)) {
+    LOG("Failed to create waker pipe (%s)", strerror(errno));
+    goto rollback_encoder;
+  }
+
+  LOG("Initialized x264 with %d threads", encode_context->param.i_threads);
+  return encode_context;
+
+rollback_encoder:
+  x264_encoder_close(encode_context->encoder);
+rollback_buffer:
+  free(encode_context->buffer);
+rollback_gpu_frame:
+  GpuContextDestroyFrame(gpu_context, encode_context->gpu_frame);
+rollback_encode_context:
+  free(encode_context);
+  return NULL;
+}
+
+int EncodeContextX264GetEventsFd(struct EncodeContextX264* encode_context) {
+  return encode_context->waker[0];
+}
+
+const struct GpuFrame* EncodeContextX264GetFrame(
+    struct EncodeContextX264* encode_context) {
+  return encode_context->pending ? NULL : encode_context->gpu_frame;
+}
+
+bool EncodeContextX264EncodeFrame(struct EncodeContextX264* encode_context,
+                                  unsigned long long timestamp) {
+  unsigned long long trace = TraceBegin();
+  if (!GpuContextReadFrame(encode_context->gpu_context,
+                           encode_context->gpu_frame, encode_context->buffer)) {
+    LOG("Failed to read gpu frame");
+    return false;
+  }
+  TraceEnd("gpu_readback", trace);
+
+  encode_context->picture.i_type =
+      encode_context->idr_requested ? X264_TYPE_IDR : X264_TYPE_AUTO;
+  encode_context->picture.i_pts++;
+  encode_context->idr_requested = false;
+
+  x264_picture_t picture_out;
+  trace = TraceBegin();
+  int frame_size = x264_encoder_encode(
+      encode_context->encoder, &encode_context->nals,
+      &encode_context->nals_count, &encode_context->picture, &picture_out);
+  if (frame_size < 0) {
+    LOG("Failed to encode frame");
+    return false;
+  }
+  TraceEnd("x264_encode", trace);
+
+  encode_context->idr = frame_size && picture_out.b_keyframe;
+  encode_context->timestamp = timestamp;
+  encode_context->pending = true;
+  char status = 0;
+  if (write(encode_context->waker[1], &status, sizeof(status)) !=
+      sizeof(status)) {
+    LOG("Failed to write sync status (%s)", strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+enum EncodeCodec EncodeContextX264GetCodec(
+    const struct EncodeContextX264* encode_context) {
+  return encode_context->config.codec;
+}
+
+void EncodeContextX264RequestIdr(struct EncodeContextX264* encode_context) {
+  encode_context->idr_requested = true;
+}
+
+void EncodeContextX264SetBitrate(struct EncodeContextX264* encode_context,
+                                 uint32_t bitrate) {
+  if (encode_context->config.rate_control.mode == kRateControlCqp ||
+      encode_context->config.rate_control.bitrate == bitrate) {
+    return;
+  }
+  // mburakov: Keep the same vbv duration, so that latency is not affected.
+  struct RateControl* rate_control = &encode_context->config.rate_control;
+  uint64_t vbv_size = (uint64_t)rate_control->vbv_size * bitrate /
+                      rate_control->bitrate;
+  rate_control->vbv_size = vbv_size ? (uint32_t)vbv_size : 1;
+  rate_control->bitrate = bitrate;
+  SetRateControl(&encode_context->param, rate_control);
+  if (x264_encoder_reconfig(encode_context->encoder, &encode_context->param))
+    LOG("Failed to reconfigure x264 bitrate");
+}
+
+bool EncodeContextX264ProcessEvents(struct EncodeContextX264* encode_context,
+                                    struct ProtoQueue* proto_queue) {
+  char status;
+  if (read(encode_context->waker[0], &status, sizeof(status)) !=
+      sizeof(status)) {
+    LOG("Failed to read sync status (%s)", strerror(errno));
+    return false;
+  }
+  encode_context->pending = false;
+
+  // mburakov: With sliced threads x264 might produce more slices than
+  // requested, so those are grouped into the requested number of messages by
+  // the position of the first macroblock. Payloads of all the NAL units of a
+  // frame are guaranteed to be sequential in memory, so every message is a
+  // single contiguous piece. Parameter sets and SEI come first, and always
+  // report zero for the first macroblock.
+  struct {
+    const uint8_t* data;
+    uint32_t size;
+  } messages[MAX_SLICES] = {0};
+  size_t last_message = 0;
+  uint32_t mbs_width = (encode_context->width + 15) / 16;
+  uint32_t mbs_height = (encode_context->height + 15) / 16;
+  uint32_t mbs_total = mbs_width * mbs_height;
+  for (int i = 0; i < encode_context->nals_count; i++) {
+    const x264_nal_t* nal = &encode_context->nals[i];
+    size_t index = (size_t)nal->i_first_mb * encode_context->config.slices /
+                   mbs_total;
+    if (index > last_message && messages[last_message].size)
+      last_message = index;
+    if (!messages[last_message].data)
+      messages[last_message].data = nal->p_payload;
+    messages[last_message].size += (uint32_t)nal->i_payload;
+  }
+  if (!messages[0].size) return true;
+
+  uint16_t latency = (uint16_t)(MicrosNow() - encode_context->timestamp);
+  for (size_t i = 0; i <= last_message; i++) {
+    if (!messages[i].size) continue;
+    struct Proto proto = {
+        .size = messages[i].size,
+        .type = PROTO_TYPE_VIDEO,
+        .flags = (encode_context->idr ? PROTO_FLAG_KEYFRAME : 0) |
+                 (i < last_message ? PROTO_FLAG_MORE_SLICES : 0),
+        .latency = latency,
+    };
+    if (!ProtoQueueWrite(proto_queue, &proto, messages[i].data)) {
+      LOG("Failed to write encoded frame");
+      return false;
+    }
+  }
+  return true;
+}
+
+void EncodeContextX264Destroy(struct EncodeContextX264* encode_context) {
+  close(encode_context->waker[1]);
+  close(encode_context->waker[0]);
+  x264_encoder_close(encode_context->encoder);
+  free(encode_context->buffer);
+  GpuContextDestroyFrame(encode_context->gpu_context,
+                         encode_context->gpu_frame);
+  free(encode_context);
+}
+
+#endif  // USE_X264
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_ENCODE_X264_H_
+#define STREAMER_ENCODE_X264_H_
+
+#include "encode.h"
+
+struct EncodeContextX264;
+
+#ifdef USE_X264
+struct EncodeContextX264* EncodeContextX264Create(
+    struct GpuContext* gpu_context, uint32_t width, uint32_t height,
+    enum YuvColorspace colorspace, enum YuvRange range,
+    const struct EncodeConfig* config);
+int EncodeContextX264GetEventsFd(struct EncodeContextX264* encode_context);
+const struct GpuFrame* EncodeContextX264GetFrame(
+    struct EncodeContextX264* encode_context);
+bool EncodeContextX264EncodeFrame(struct EncodeContextX264* encode_context,
+                                  unsigned long long timestamp);
+enum EncodeCodec EncodeContextX264GetCodec(
+    const struct EncodeContextX264* encode_context);
+void EncodeContextX264RequestIdr(struct EncodeContextX264* encode_context);
+void EncodeContextX264SetBitrate(struct EncodeContextX264* encode_context,
+                                 uint32_t bitrate);
+bool EncodeContextX264ProcessEvents(struct EncodeContextX264* encode_context,
+                                    struct ProtoQueue* proto_queue);
+void EncodeContextX264Destroy(struct EncodeContextX264* encode_context);
+#else  // USE_X264
+#define EncodeContextX264Create(...) NULL
+#define EncodeContextX264GetEventsFd(...) -1
+#define EncodeContextX264GetFrame(...) NULL
+#define EncodeContextX264EncodeFrame(...) false
+#define EncodeContextX264GetCodec(...) kEncodeCodecAuto
+#define EncodeContextX264RequestIdr(...)
+#define EncodeContextX264SetBitrate(...)
+#define EncodeContextX264ProcessEvents(...) false
+#define EncodeContextX264Destroy(...)
+#endif  // USE_X264
+
+#endif  // STREAMER_ENCODE_X264_H_
@@ -35,6 +35,7 @@
 #endif  // USE_EGL_MESA_PLATFORM_SURFACELESS
 
 #include "toolbox/utils.h"
+#include "trace.h"
 
 #define _(...) __VA_ARGS__
 #define LOOKUP_FUNCTION(a, b, c)              \
@@ -58,6 +59,12 @@ extern const char _binary_luma_glsl_end[];
 extern const char _binary_chroma_glsl_start[];
 extern const char _binary_chroma_glsl_end[];
 
+struct GpuDmabufFormat {
+  uint32_t fourcc;
+  uint64_t modifier;
+  bool external_only;
+};
+
 struct GpuContext {
 #ifndef USE_EGL_MESA_PLATFORM_SURFACELESS
   int render_node;
@@ -68,15 +75,20 @@ struct GpuContext {
   PFNEGLQUERYDMABUFFORMATSEXTPROC eglQueryDmaBufFormatsEXT;
   PFNEGLQUERYDMABUFMODIFIERSEXTPROC eglQueryDmaBufModifiersEXT;
   PFNGLEGLIMAGETARGETTEXTURE2DOESPROC glEGLImageTargetTexture2DOES;
+  struct GpuDmabufFormat* dmabuf_formats;
+  size_t dmabuf_formats_count;
   GLuint program_luma;
   GLuint program_chroma;
   GLint sample_offsets;
   GLuint framebuffer;
   GLuint vertices;
+  void* readback_buffer;
+  size_t readback_size;
 };
 
 struct GpuFrameImpl {
   struct GpuFrame size;
+  uint32_t fourcc;
   int dmabuf_fds[4];
   EGLImage images[2];
   GLuint textures[2];
@@ -147,6 +159,115 @@ static bool HasExtension(const char* haystack, const char* needle) {
   return result;
 }
 
+static int CompareDmabufFormats(const void* a, const void* b) {
+  const struct GpuDmabufFormat* lhs = a;
+  const struct GpuDmabufFormat* rhs = b;
+  if (lhs->fourcc != rhs->fourcc) return lhs->fourcc < rhs->fourcc ? -1 : 1;
+  if (lhs->modifier != rhs->modifier)
+    return lhs->modifier < rhs->modifier ? -1 : 1;
+  return 0;
+}
+
+static int CompareDmabufFourccs(const void* a, const void* b) {
+  const struct GpuDmabufFormat* lhs = a;
+  const struct GpuDmabufFormat* rhs = b;
+  if (lhs->fourcc != rhs->fourcc) return lhs->fourcc < rhs->fourcc ? -1 : 1;
+  return 0;
+}
+
+// mburakov: Supported formats and modifiers do not change during the lifetime
+// of egl display, so these are queried once into a table sorted by fourcc and
+// modifier. Formats without any explicit modifiers get a single entry with an
+// invalid modifier, which is never usable for importing.
+static bool QueryDmabufFormats(struct GpuContext* gpu_context) {
+  EGLint num_formats;
+  if (!gpu_context->eglQueryDmaBufFormatsEXT(gpu_context->display, 0, NULL,
+                                             &num_formats)) {
+    LOG("Failed to get number of supported dmabuf formats (%s)",
+        EglErrorString(eglGetError()));
+    return false;
+  }
+  EGLint formats[num_formats];
+  if (!gpu_context->eglQueryDmaBufFormatsEXT(gpu_context->display, num_formats,
+                                             formats, &num_formats)) {
+    LOG("Failed to get supported dmabuf formats (%s)",
+        EglErrorString(eglGetError()));
+    return false;
+  }
+
+  EGLint num_modifiers[num_formats];
+  size_t count = 0;
+  for (EGLint i = 0; i < num_formats; i++) {
+    if (!gpu_context->eglQueryDmaBufModifiersEXT(gpu_context->display,
+                                                 formats[i], 0, NULL, NULL,
+                                                 &num_modifiers[i])) {
+      LOG("Failed to get number of supported dmabuf modifiers (%s)",
+          EglErrorString(eglGetError()));
+      return false;
+    }
+    count += num_modifiers[i] ? (size_t)num_modifiers[i] : 1;
+  }
+
+  struct GpuDmabufFormat* dmabuf_formats =
+      malloc((count ? count : 1) * sizeof(struct GpuDmabufFormat));
+  if (!dmabuf_formats) {
+    LOG("Failed to allocate dmabuf formats (%s)", strerror(errno));
+    return false;
+  }
+
+  struct GpuDmabufFormat* it = dmabuf_formats;
+  for (EGLint i = 0; i < num_formats; i++) {
+    if (!num_modifiers[i]) {
+      *it++ = (struct GpuDmabufFormat){
+          .fourcc = (uint32_t)formats[i],
+          .modifier = DRM_FORMAT_MOD_INVALID,
+          .external_only = true,
+      };
+      continue;
+    }
+    EGLuint64KHR modifiers[num_modifiers[i]];
+    EGLBoolean external_only[num_modifiers[i]];
+    if (!gpu_context->eglQueryDmaBufModifiersEXT(
+            gpu_context->display, formats[i], num_modifiers[i], modifiers,
+            external_only, &num_modifiers[i])) {
+      LOG("Failed to get supported dmabuf modifiers (%s)",
+          EglErrorString(eglGetError()));
+      goto rollback_dmabuf_formats;
+    }
+    for (EGLint j = 0; j < num_modifiers[i]; j++) {
+      *it++ = (struct GpuDmabufFormat){
+          .fourcc = (uint32_t)formats[i],
+          .modifier = modifiers[j],
+          .external_only = !!external_only[j],
+      };
+    }
+  }
+
+  count = (size_t)(it - dmabuf_formats);
+  qsort(dmabuf_formats, count, sizeof(struct GpuDmabufFormat),
+        CompareDmabufFormats);
+  gpu_context->dmabuf_formats = dmabuf_formats;
+  gpu_context->dmabuf_formats_count = count;
+  return true;
+
+rollback_dmabuf_formats:
+  free(dmabuf_formats);
+  return false;
+}
+
+static void DumpDmabufFormats(const struct GpuContext* gpu_context) {
+  const struct GpuDmabufFormat* dmabuf_formats = gpu_context->dmabuf_formats;
+  for (size_t i = 0; i < gpu_context->dmabuf_formats_count; i++) {
+    if (dmabuf_formats[i].modifier == DRM_FORMAT_MOD_INVALID) {
+      LOG("\t%.4s (no modifiers)", (const char*)&dmabuf_formats[i].fourcc);
+      continue;
+    }
+    LOG("\t%.4s 0x%016lx%s", (const char*)&dmabuf_formats[i].fourcc,
+        dmabuf_formats[i].modifier,
+        dmabuf_formats[i].external_only ? " (external only)" : "");
+  }
+}
+
 static GLuint CreateGlProgram(const char* vs_begin, const char* vs_end,
                               const char* fs_begin, const char* fs_end) {
   GLuint program = 0;
@@ -347,10 +468,16 @@ struct GpuContext* GpuContextCreate(enum YuvColorspace colorspace,
                   rollback_display)
   LOOKUP_FUNCTION(PFNEGLQUERYDMABUFMODIFIERSEXTPROC, eglQueryDmaBufModifiersEXT,
                   rollback_display)
+  if (!QueryDmabufFormats(gpu_context)) {
+    LOG("Failed to query dmabuf formats");
+    goto rollback_display;
+  }
 
+  LOG("Supported dmabuf formats are:");
+  DumpDmabufFormats(gpu_context);
   if (!eglBindAPI(EGL_OPENGL_ES_API)) {
     LOG("Failed to bind egl api (%s)", EglErrorString(eglGetError()));
-    goto rollback_display;
+    goto rollback_dmabuf_formats;
   }
 
   static const EGLint context_attribs[] = {
@@ -362,7 +489,7 @@ struct GpuContext* GpuContextCreate(enum YuvColorspace colorspace,
       gpu_context->display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, context_attribs);
   if (gpu_context->context == EGL_NO_CONTEXT) {
     LOG("Failed to create egl context (%s)", EglErrorString(eglGetError()));
-    goto rollback_display;
+    goto rollback_dmabuf_formats;
   }
 
   if (!eglMakeCurrent(gpu_context->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
@@ -435,6 +562,8 @@ rollback_context:
   eglMakeCurrent(gpu_context->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
                  EGL_NO_CONTEXT);
   eglDestroyContext(gpu_context->display, gpu_context->context);
+rollback_dmabuf_formats:
+  free(gpu_context->dmabuf_formats);
 rollback_display:
   eglTerminate(gpu_context->display);
 #ifndef USE_EGL_MESA_PLATFORM_SURFACELESS
@@ -503,60 +632,27 @@ static void DumpEglImageParams(const EGLAttrib* attribs) {
   }
 }
 
-static bool IsFourccSupported(struct GpuContext* gpu_context, uint32_t fourcc) {
-  EGLint num_formats;
-  if (!gpu_context->eglQueryDmaBufFormatsEXT(gpu_context->display, 0, NULL,
-                                             &num_formats)) {
-    LOG("Faield to get number of supported dmabuf formats (%s)",
-        EglErrorString(eglGetError()));
-    return false;
-  }
-  EGLint formats[num_formats];
-  if (!gpu_context->eglQueryDmaBufFormatsEXT(gpu_context->display, num_formats,
-                                             formats, &num_formats)) {
-    LOG("Failed to get supported dmabuf formats (%s)",
-        EglErrorString(eglGetError()));
-    return false;
-  }
-  for (int i = 0; i < num_formats; i++) {
-    if ((uint32_t)formats[i] == fourcc) return true;
-  }
+static bool IsFourccSupported(const struct GpuContext* gpu_context,
+                              uint32_t fourcc) {
+  const struct GpuDmabufFormat key = {.fourcc = fourcc};
+  if (bsearch(&key, gpu_context->dmabuf_formats,
+              gpu_context->dmabuf_formats_count,
+              sizeof(struct GpuDmabufFormat), CompareDmabufFourccs))
+    return true;
   LOG("Format %.4s is unsupported by egl", (const char*)&fourcc);
-  LOG("Supported formats are:");
-  for (int i = 0; i < num_formats; i++) {
-    LOG("\t%.4s", (const char*)&formats[i]);
-  }
   return false;
 }
 
-static bool IsModifierSupported(struct GpuContext* gpu_context, uint32_t fourcc,
-                                uint64_t modifier) {
-  EGLint num_modifiers;
-  if (!gpu_context->eglQueryDmaBufModifiersEXT(
-          gpu_context->display, (GLint)fourcc, 0, NULL, NULL, &num_modifiers)) {
-    LOG("Failed to get number of supported dmabuf modifiers (%s)",
-        EglErrorString(eglGetError()));
-    return false;
-  }
-  EGLuint64KHR modifiers[num_modifiers];
-  EGLBoolean external_only[num_modifiers];
-  if (!gpu_context->eglQueryDmaBufModifiersEXT(
-          gpu_context->display, (GLint)fourcc, num_modifiers, modifiers,
-          external_only, &num_modifiers)) {
-    LOG("Failed to get supported dmabuf modifiers (%s)",
-        EglErrorString(eglGetError()));
-    return false;
-  }
-  for (int i = 0; i < num_modifiers; i++) {
-    if (modifiers[i] == modifier && !external_only[i]) return true;
-  }
+static bool IsModifierSupported(const struct GpuContext* gpu_context,
+                                uint32_t fourcc, uint64_t modifier) {
+  const struct GpuDmabufFormat key = {.fourcc = fourcc, .modifier = modifier};
+  const struct GpuDmabufFormat* dmabuf_format =
+      bsearch(&key, gpu_context->dmabuf_formats,
+              gpu_context->dmabuf_formats_count,
+              sizeof(struct GpuDmabufFormat), CompareDmabufFormats);
+  if (dmabuf_format && !dmabuf_format->external_only) return true;
   LOG("Modifier 0x%016lx for format %.4s is unsupported by egl", modifier,
       (const char*)&fourcc);
-  LOG("Supported modifiers for format %.4s are:", (const char*)&fourcc);
-  for (int i = 0; i < num_modifiers; i++) {
-    LOG("\t0x%016lx%s", modifiers[i],
-        external_only[i] ? " (external only)" : "");
-  }
   return false;
 }
 
@@ -649,10 +745,12 @@ struct GpuFrame* GpuContextCreateFrame(struct GpuContext* gpu_context,
   *gpu_frame_impl = (struct GpuFrameImpl){
       .size.width = width,
       .size.height = height,
+      .fourcc = fourcc,
       .dmabuf_fds = {-1, -1, -1, -1},
       .images = {EGL_NO_IMAGE, EGL_NO_IMAGE},
   };
 
+  unsigned long long trace = TraceBegin();
   if (fourcc == DRM_FORMAT_NV12) {
     gpu_frame_impl->images[0] = CreateEglImage(gpu_context, width, height,
                                                DRM_FORMAT_R8, 1, &planes[0]);
@@ -687,6 +785,7 @@ struct GpuFrame* GpuContextCreateFrame(struct GpuContext* gpu_context,
 
   for (size_t i = 0; i < nplanes; i++)
     gpu_frame_impl->dmabuf_fds[i] = planes[i].dmabuf_fd;
+  TraceEnd("egl_import", trace);
   return (struct GpuFrame*)gpu_frame_impl;
 
 rollback_textures:
@@ -704,6 +803,116 @@ rollback_gpu_frame:
   return NULL;
 }
 
+// mburakov: Allocated frames are backed by textures not shared with anyone,
+// so the only way to access the contents is writing it from or reading it back
+// to the cpu memory. Planes are tightly packed one after another there, and
+// chroma planes are subsampled in both directions.
+static const struct AllocatableFormat {
+  uint32_t fourcc;
+  size_t nplanes;
+  struct {
+    GLenum internal_format;
+    GLenum format;
+    uint32_t cpp;
+    uint32_t shift;
+  } planes[2];
+} kAllocatableFormats[] = {
+    {.fourcc = DRM_FORMAT_NV12,
+     .nplanes = 2,
+     .planes = {{GL_R8, GL_RED, 1, 0}, {GL_RG8, GL_RG, 2, 1}}},
+    {.fourcc = DRM_FORMAT_XBGR8888,
+     .nplanes = 1,
+     .planes = {{GL_RGBA8, GL_RGBA, 4, 0}}},
+    {.fourcc = DRM_FORMAT_BGR888,
+     .nplanes = 1,
+     .planes = {{GL_RGB8, GL_RGB, 3, 0}}},
+};
+
+static const struct AllocatableFormat* GetAllocatableFormat(uint32_t fourcc) {
+  for (size_t i = 0; i < LENGTH(kAllocatableFormats); i++) {
+    if (kAllocatableFormats[i].fourcc == fourcc) return &kAllocatableFormats[i];
+  }
+  return NULL;
+}
+
+struct GpuFrame* GpuContextAllocateFrame(struct GpuContext* gpu_context,
+                                         uint32_t width, uint32_t height,
+                                         uint32_t fourcc) {
+  (void)gpu_context;
+  const struct AllocatableFormat* format = GetAllocatableFormat(fourcc);
+  if (!format) {
+    LOG("Unsupported fourcc for allocated frame (%.4s)", (const char*)&fourcc);
+    return NULL;
+  }
+
+  struct GpuFrameImpl* gpu_frame_impl = malloc(sizeof(struct GpuFrameImpl));
+  if (!gpu_frame_impl) {
+    LOG("Failed to allocate gpu frame (%s)", strerror(errno));
+    return NULL;
+  }
+  *gpu_frame_impl = (struct GpuFrameImpl){
+      .size.width = width,
+      .size.height = height,
+      .fourcc = fourcc,
+      .dmabuf_fds = {-1, -1, -1, -1},
+      .images = {EGL_NO_IMAGE, EGL_NO_IMAGE},
+  };
+
+  glGenTextures((GLsizei)format->nplanes, gpu_frame_impl->textures);
+  for (size_t i = 0; i < format->nplanes; i++) {
+    glBindTexture(GL_TEXTURE_2D, gpu_frame_impl->textures[i]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexStorage2D(GL_TEXTURE_2D, 1, format->planes[i].internal_format,
+                   (GLsizei)(width >> format->planes[i].shift),
+                   (GLsizei)(height >> format->planes[i].shift));
+  }
+
+  GLenum error = glGetError();
+  if (error != GL_NO_ERROR) {
+    LOG("Failed to allocate textures (%s)", GlErrorString(error));
+    goto rollback_textures;
+  }
+  return (struct GpuFrame*)gpu_frame_impl;
+
+rollback_textures:
+  glDeleteTextures((GLsizei)format->nplanes, gpu_frame_impl->textures);
+  free(gpu_frame_impl);
+  return NULL;
+}
+
+bool GpuContextWriteFrame(struct GpuContext* gpu_context,
+                          const struct GpuFrame* gpu_frame,
+                          const void* buffer) {
+  (void)gpu_context;
+  const struct GpuFrameImpl* gpu_frame_impl = (const void*)gpu_frame;
+  const struct AllocatableFormat* format =
+      GetAllocatableFormat(gpu_frame_impl->fourcc);
+  if (!format || gpu_frame_impl->images[0] != EGL_NO_IMAGE) {
+    LOG("Gpu frame was not allocated for writing");
+    return false;
+  }
+
+  const uint8_t* ptr = buffer;
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  for (size_t i = 0; i < format->nplanes; i++) {
+    GLsizei width = (GLsizei)(gpu_frame->width >> format->planes[i].shift);
+    GLsizei height = (GLsizei)(gpu_frame->height >> format->planes[i].shift);
+    glBindTexture(GL_TEXTURE_2D, gpu_frame_impl->textures[i]);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height,
+                    format->planes[i].format, GL_UNSIGNED_BYTE, ptr);
+    GLenum error = glGetError();
+    if (error != GL_NO_ERROR) {
+      LOG("Failed to write plane (%s)", GlErrorString(error));
+      return false;
+    }
+    ptr += (size_t)width * (size_t)height * format->planes[i].cpp;
+  }
+  return true;
+}
+
 static bool GpuFrameConvertImpl(GLuint from, GLuint to) {
   glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
                          to, 0);
@@ -723,18 +932,59 @@ static bool GpuFrameConvertImpl(GLuint from, GLuint to) {
   return true;
 }
 
+static bool GpuFrameCopyImpl(GLuint from, GLuint to, GLsizei width,
+                             GLsizei height) {
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                         from, 0);
+  GLenum framebuffer_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  if (framebuffer_status != GL_FRAMEBUFFER_COMPLETE) {
+    LOG("Framebuffer is incomplete (0x%x)", framebuffer_status);
+    return false;
+  }
+
+  glBindTexture(GL_TEXTURE_2D, to);
+  glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, width, height);
+  GLenum error = glGetError();
+  if (error != GL_NO_ERROR) {
+    LOG("Failed to copy plane (%s)", GlErrorString(error));
+    return false;
+  }
+  return true;
+}
+
 bool GpuContextConvertFrame(struct GpuContext* gpu_context,
                             const struct GpuFrame* from,
                             const struct GpuFrame* to) {
   const struct GpuFrameImpl* from_impl = (const void*)from;
   const struct GpuFrameImpl* to_impl = (const void*)to;
 
+  // mburakov: Draws are only queued here, and the actual gpu time goes into
+  // the fence wait. Frames that are NV12 already, i.e. replayed from a file,
+  // are only copied plane by plane, and there is no scaling in this case.
+  unsigned long long trace = TraceBegin();
+  if (from_impl->fourcc == DRM_FORMAT_NV12) {
+    if (from->width != to->width || from->height != to->height) {
+      LOG("Size mismatch when copying NV12 frame");
+      return false;
+    }
+    if (!GpuFrameCopyImpl(from_impl->textures[0], to_impl->textures[0],
+                          (GLsizei)to->width, (GLsizei)to->height) ||
+        !GpuFrameCopyImpl(from_impl->textures[1], to_impl->textures[1],
+                          (GLsizei)to->width / 2, (GLsizei)to->height / 2)) {
+      LOG("Failed to copy NV12 frame");
+      return false;
+    }
+    TraceEnd("nv12_copy", trace);
+    goto wait_sync;
+  }
+
   glUseProgram(gpu_context->program_luma);
   glViewport(0, 0, (GLsizei)to->width, (GLsizei)to->height);
   if (!GpuFrameConvertImpl(from_impl->textures[0], to_impl->textures[0])) {
     LOG("Failed to convert luma plane");
     return false;
   }
+  TraceEnd("luma_draw", trace);
 
   const GLfloat sample_offsets[] = {
       _(0.f, 0.f),
@@ -743,6 +993,7 @@ bool GpuContextConvertFrame(struct GpuContext* gpu_context,
       _(1.f / (GLfloat)from->width, 1.f / (GLfloat)from->height),
   };
 
+  trace = TraceBegin();
   glUseProgram(gpu_context->program_chroma);
   glUniform2fv(gpu_context->sample_offsets, 4, sample_offsets);
   glViewport(0, 0, (GLsizei)to->width / 2, (GLsizei)to->height / 2);
@@ -750,7 +1001,10 @@ bool GpuContextConvertFrame(struct GpuContext* gpu_context,
     LOG("Failed to convert chroma plane");
     return false;
   }
+  TraceEnd("chroma_draw", trace);
 
+wait_sync:
+  trace = TraceBegin();
   EGLSync sync = eglCreateSync(gpu_context->display, EGL_SYNC_FENCE, NULL);
   if (sync == EGL_NO_SYNC) {
     LOG("Failed to create egl fence sync (%s)", EglErrorString(eglGetError()));
@@ -758,6 +1012,84 @@ bool GpuContextConvertFrame(struct GpuContext* gpu_context,
   }
   eglClientWaitSync(gpu_context->display, sync, 0, EGL_FOREVER);
   eglDestroySync(gpu_context->display, sync);
+  TraceEnd("fence_wait", trace);
+  return true;
+}
+
+static bool ReadPlane(struct GpuContext* gpu_context, GLenum format,
+                      uint32_t cpp, GLsizei width, GLsizei height, void* ptr) {
+  // mburakov: GLES only guarantees RGBA with unsigned bytes, and the other
+  // readable combination is whatever the implementation prefers for the
+  // current framebuffer. Mesa prefers GL_RED and GL_RG for R8 and RG8, but
+  // other drivers might not, and then the plane is repacked on the cpu.
+  GLint read_format = GL_NONE;
+  GLint read_type = GL_NONE;
+  glGetIntegerv(GL_IMPLEMENTATION_COLOR_READ_FORMAT, &read_format);
+  glGetIntegerv(GL_IMPLEMENTATION_COLOR_READ_TYPE, &read_type);
+  if (format == GL_RGBA || ((GLenum)read_format == format &&
+                            (GLenum)read_type == GL_UNSIGNED_BYTE)) {
+    glReadPixels(0, 0, width, height, format, GL_UNSIGNED_BYTE, ptr);
+    return true;
+  }
+
+  size_t pixels = (size_t)width * (size_t)height;
+  if (gpu_context->readback_size < pixels * 4) {
+    void* readback_buffer = realloc(gpu_context->readback_buffer, pixels * 4);
+    if (!readback_buffer) {
+      LOG("Failed to allocate readback buffer (%s)", strerror(errno));
+      return false;
+    }
+    gpu_context->readback_buffer = readback_buffer;
+    gpu_context->readback_size = pixels * 4;
+  }
+
+  glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE,
+               gpu_context->readback_buffer);
+  const uint8_t* source = gpu_context->readback_buffer;
+  uint8_t* target = ptr;
+  for (size_t i = 0; i < pixels; i++) {
+    memcpy(target, source, cpp);
+    source += 4;
+    target += cpp;
+  }
+  return true;
+}
+
+bool GpuContextReadFrame(struct GpuContext* gpu_context,
+                         const struct GpuFrame* gpu_frame, void* buffer) {
+  const struct GpuFrameImpl* gpu_frame_impl = (const void*)gpu_frame;
+  const struct AllocatableFormat* format =
+      GetAllocatableFormat(gpu_frame_impl->fourcc);
+  if (!format || gpu_frame_impl->images[0] != EGL_NO_IMAGE) {
+    LOG("Gpu frame was not allocated for reading");
+    return false;
+  }
+
+  uint8_t* ptr = buffer;
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  for (size_t i = 0; i < format->nplanes; i++) {
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D,
+                           gpu_frame_impl->textures[i], 0);
+    GLenum framebuffer_status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    if (framebuffer_status != GL_FRAMEBUFFER_COMPLETE) {
+      LOG("Framebuffer is incomplete (0x%x)", framebuffer_status);
+      return false;
+    }
+
+    GLsizei width = (GLsizei)(gpu_frame->width >> format->planes[i].shift);
+    GLsizei height = (GLsizei)(gpu_frame->height >> format->planes[i].shift);
+    if (!ReadPlane(gpu_context, format->planes[i].format,
+                   format->planes[i].cpp, width, height, ptr)) {
+      LOG("Failed to read plane %zu", i);
+      return false;
+    }
+    GLenum error = glGetError();
+    if (error != GL_NO_ERROR) {
+      LOG("Failed to read plane (%s)", GlErrorString(error));
+      return false;
+    }
+    ptr += (size_t)width * (size_t)height * format->planes[i].cpp;
+  }
   return true;
 }
 
@@ -784,6 +1116,8 @@ void GpuContextDestroy(struct GpuContext* gpu_context) {
   eglMakeCurrent(gpu_context->display, EGL_NO_SURFACE, EGL_NO_SURFACE,
                  EGL_NO_CONTEXT);
   eglDestroyContext(gpu_context->display, gpu_context->context);
+  free(gpu_context->readback_buffer);
+  free(gpu_context->dmabuf_formats);
   eglTerminate(gpu_context->display);
 #ifndef USE_EGL_MESA_PLATFORM_SURFACELESS
   gbm_device_destroy(gpu_context->device);
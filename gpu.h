@@ -42,9 +42,16 @@ struct GpuFrame* GpuContextCreateFrame(struct GpuContext* gpu_context,
                                        uint32_t width, uint32_t height,
                                        uint32_t fourcc, size_t nplanes,
                                        const struct GpuFramePlane* planes);
+struct GpuFrame* GpuContextAllocateFrame(struct GpuContext* gpu_context,
+                                         uint32_t width, uint32_t height,
+                                         uint32_t fourcc);
+bool GpuContextWriteFrame(struct GpuContext* gpu_context,
+                          const struct GpuFrame* gpu_frame, const void* buffer);
 bool GpuContextConvertFrame(struct GpuContext* gpu_context,
                             const struct GpuFrame* from,
                             const struct GpuFrame* to);
+bool GpuContextReadFrame(struct GpuContext* gpu_context,
+                         const struct GpuFrame* gpu_frame, void* buffer);
 void GpuContextDestroyFrame(struct GpuContext* gpu_context,
                             struct GpuFrame* gpu_frame);
 void GpuContextDestroy(struct GpuContext* gpu_context);
@@ -0,0 +1,387 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "h264.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "bitstream.h"
+
+// mburakov: Below entries are hardcoded by ffmpeg:
+static const bool qpprime_y_zero_transform_bypass_flag = 0;
+static const bool gaps_in_frame_num_value_allowed_flag = 0;
+static const uint8_t video_format = 5;
+static const uint32_t num_slice_groups_minus1 = 0;
+static const int32_t pic_init_qs_minus26 = 0;
+
+// mburakov: Below entries are defaulted by ffmpeg:
+static const bool overscan_info_present_flag = 0;
+static const bool chroma_loc_info_present_flag = 0;
+static const bool nal_hrd_parameters_present_flag = 0;
+static const bool vcl_hrd_parameters_present_flag = 0;
+static const bool pic_struct_present_flag = 0;
+static const uint32_t max_bytes_per_pic_denom = 0;
+static const uint32_t max_bits_per_mb_denom = 0;
+static const bool ref_pic_list_modification_flag_l0 = 0;
+static const bool ref_pic_list_modification_flag_l1 = 0;
+static const bool no_output_of_prior_pics_flag = 0;
+static const bool long_term_reference_flag = 0;
+static const bool adaptive_ref_pic_marking_mode_flag = 0;
+
+// 7.3.1 NAL unit syntax
+static void PackNalUnitHeader(struct Bitstream* bitstream, uint8_t nal_ref_idc,
+                              uint8_t nal_unit_type) {
+  BitstreamAppend(bitstream, 32, 0x00000001);
+  BitstreamAppend(bitstream, 1, 0);  // forbidden_zero_bit
+  BitstreamAppend(bitstream, 2, nal_ref_idc);
+  BitstreamAppend(bitstream, 5, nal_unit_type);
+}
+
+// 7.3.2.11 RBSP trailing bits syntax
+static void PackRbspTrailingBits(struct Bitstream* bitstream) {
+  BitstreamAppend(bitstream, 1, 1);  // rbsp_stop_one_bit
+  BitstreamByteAlign(bitstream);     // rbsp_alignment_zero_bit
+}
+
+// E.1.1 VUI parameters syntax
+static void PackVuiParameters(struct Bitstream* bitstream,
+                              const VAEncSequenceParameterBufferH264* seq,
+                              const struct MoreH264SeqParameters* msp) {
+  const typeof(seq->vui_fields.bits)* vui_bits = &seq->vui_fields.bits;
+
+  BitstreamAppend(bitstream, 1, vui_bits->aspect_ratio_info_present_flag);
+  if (vui_bits->aspect_ratio_info_present_flag) {
+    BitstreamAppend(bitstream, 8, seq->aspect_ratio_idc);
+    if (seq->aspect_ratio_idc == 255) {  // Extended_SAR
+      BitstreamAppend(bitstream, 16, seq->sar_width);
+      BitstreamAppend(bitstream, 16, seq->sar_height);
+    }
+  }
+
+  BitstreamAppend(bitstream, 1, overscan_info_present_flag);
+  if (overscan_info_present_flag) {
+    // TODO(mburakov): Implement this!
+    abort();
+  }
+
+  BitstreamAppend(bitstream, 1, msp->video_signal_type_present_flag);
+  if (msp->video_signal_type_present_flag) {
+    BitstreamAppend(bitstream, 3, video_format);
+    BitstreamAppend(bitstream, 1, msp->video_full_range_flag);
+    BitstreamAppend(bitstream, 1, msp->colour_description_present_flag);
+    if (msp->colour_description_present_flag) {
+      BitstreamAppend(bitstream, 8, msp->colour_primaries);
+      BitstreamAppend(bitstream, 8, msp->transfer_characteristics);
+      BitstreamAppend(bitstream, 8, msp->matrix_coefficients);
+    }
+  }
+
+  BitstreamAppend(bitstream, 1, chroma_loc_info_present_flag);
+  if (chroma_loc_info_present_flag) {
+    // TODO(mburakov): Implement this!
+    abort();
+  }
+
+  BitstreamAppend(bitstream, 1, vui_bits->timing_info_present_flag);
+  if (vui_bits->timing_info_present_flag) {
+    BitstreamAppend(bitstream, 32, seq->num_units_in_tick);
+    BitstreamAppend(bitstream, 32, seq->time_scale);
+    BitstreamAppend(bitstream, 1, vui_bits->fixed_frame_rate_flag);
+  }
+
+  BitstreamAppend(bitstream, 1, nal_hrd_parameters_present_flag);
+  BitstreamAppend(bitstream, 1, vcl_hrd_parameters_present_flag);
+  if (nal_hrd_parameters_present_flag || vcl_hrd_parameters_present_flag) {
+    // TODO(mburakov): Implement this!
+    abort();
+  }
+
+  BitstreamAppend(bitstream, 1, pic_struct_present_flag);
+  BitstreamAppend(bitstream, 1, vui_bits->bitstream_restriction_flag);
+  if (vui_bits->bitstream_restriction_flag) {
+    BitstreamAppend(bitstream, 1,
+                    vui_bits->motion_vectors_over_pic_boundaries_flag);
+    BitstreamAppendUE(bitstream, max_bytes_per_pic_denom);
+    BitstreamAppendUE(bitstream, max_bits_per_mb_denom);
+    BitstreamAppendUE(bitstream, vui_bits->log2_max_mv_length_horizontal);
+    BitstreamAppendUE(bitstream, vui_bits->log2_max_mv_length_vertical);
+    BitstreamAppendUE(bitstream, msp->max_num_reorder_frames);
+    BitstreamAppendUE(bitstream, msp->max_dec_frame_buffering);
+  }
+}
+
+// 7.3.2.1.1 Sequence parameter set data syntax
+void PackH264SeqParameterSetNalUnit(struct Bitstream* bitstream,
+                                    const VAEncSequenceParameterBufferH264* seq,
+                                    const struct MoreH264SeqParameters* msp) {
+  const typeof(seq->seq_fields.bits)* seq_bits = &seq->seq_fields.bits;
+
+  PackNalUnitHeader(bitstream, 3, H264_NAL_SPS);
+
+  char buffer_on_the_stack[64];
+  struct Bitstream sps_rbsp = {
+      .data = buffer_on_the_stack,
+      .size = 0,
+  };
+
+  BitstreamAppend(&sps_rbsp, 8, msp->profile_idc);
+  BitstreamAppend(&sps_rbsp, 1, msp->constraint_set0_flag);
+  BitstreamAppend(&sps_rbsp, 1, msp->constraint_set1_flag);
+  BitstreamAppend(&sps_rbsp, 1, msp->constraint_set2_flag);
+  BitstreamAppend(&sps_rbsp, 1, 0);  // constraint_set3_flag
+  BitstreamAppend(&sps_rbsp, 1, 0);  // constraint_set4_flag
+  BitstreamAppend(&sps_rbsp, 1, 0);  // constraint_set5_flag
+  BitstreamAppend(&sps_rbsp, 2, 0);  // reserved_zero_2bits
+  BitstreamAppend(&sps_rbsp, 8, seq->level_idc);
+  BitstreamAppendUE(&sps_rbsp, seq->seq_parameter_set_id);
+
+  switch (msp->profile_idc) {
+    case 100:
+    case 110:
+    case 122:
+    case 244:
+    case 44:
+    case 83:
+    case 86:
+    case 118:
+    case 128:
+    case 138:
+    case 139:
+    case 134:
+    case 135:
+      BitstreamAppendUE(&sps_rbsp, seq_bits->chroma_format_idc);
+      if (seq_bits->chroma_format_idc == 3) {
+        // TODO(mburakov): Implement this!
+        abort();
+      }
+      BitstreamAppendUE(&sps_rbsp, seq->bit_depth_luma_minus8);
+      BitstreamAppendUE(&sps_rbsp, seq->bit_depth_chroma_minus8);
+      BitstreamAppend(&sps_rbsp, 1, qpprime_y_zero_transform_bypass_flag);
+      BitstreamAppend(&sps_rbsp, 1, seq_bits->seq_scaling_matrix_present_flag);
+      if (seq_bits->seq_scaling_matrix_present_flag) {
+        // TODO(mburakov): Implement this!
+        abort();
+      }
+      break;
+    default:
+      break;
+  }
+
+  BitstreamAppendUE(&sps_rbsp, seq_bits->log2_max_frame_num_minus4);
+  BitstreamAppendUE(&sps_rbsp, seq_bits->pic_order_cnt_type);
+  if (seq_bits->pic_order_cnt_type == 0) {
+    BitstreamAppendUE(&sps_rbsp, seq_bits->log2_max_pic_order_cnt_lsb_minus4);
+  } else if (seq_bits->pic_order_cnt_type == 1) {
+    // TODO(mburakov): Implement this!
+    abort();
+  }
+
+  BitstreamAppendUE(&sps_rbsp, seq->max_num_ref_frames);
+  BitstreamAppend(&sps_rbsp, 1, gaps_in_frame_num_value_allowed_flag);
+  BitstreamAppendUE(&sps_rbsp, seq->picture_width_in_mbs - 1u);
+  BitstreamAppendUE(&sps_rbsp, seq->picture_height_in_mbs - 1u);
+  BitstreamAppend(&sps_rbsp, 1, seq_bits->frame_mbs_only_flag);
+  if (!seq_bits->frame_mbs_only_flag)
+    BitstreamAppend(&sps_rbsp, 1, seq_bits->mb_adaptive_frame_field_flag);
+  BitstreamAppend(&sps_rbsp, 1, seq_bits->direct_8x8_inference_flag);
+
+  BitstreamAppend(&sps_rbsp, 1, seq->frame_cropping_flag);
+  if (seq->frame_cropping_flag) {
+    BitstreamAppendUE(&sps_rbsp, seq->frame_crop_left_offset);
+    BitstreamAppendUE(&sps_rbsp, seq->frame_crop_right_offset);
+    BitstreamAppendUE(&sps_rbsp, seq->frame_crop_top_offset);
+    BitstreamAppendUE(&sps_rbsp, seq->frame_crop_bottom_offset);
+  }
+
+  BitstreamAppend(&sps_rbsp, 1, seq->vui_parameters_present_flag);
+  if (seq->vui_parameters_present_flag) PackVuiParameters(&sps_rbsp, seq, msp);
+
+  PackRbspTrailingBits(&sps_rbsp);
+  BitstreamInflate(bitstream, &sps_rbsp);
+}
+
+// 7.3.2.2 Picture parameter set RBSP syntax
+void PackH264PicParameterSetNalUnit(
+    struct Bitstream* bitstream, const VAEncPictureParameterBufferH264* pic) {
+  const typeof(pic->pic_fields.bits)* pic_bits = &pic->pic_fields.bits;
+
+  PackNalUnitHeader(bitstream, 3, H264_NAL_PPS);
+
+  char buffer_on_the_stack[64];
+  struct Bitstream pps_rbsp = {
+      .data = buffer_on_the_stack,
+      .size = 0,
+  };
+
+  BitstreamAppendUE(&pps_rbsp, pic->pic_parameter_set_id);
+  BitstreamAppendUE(&pps_rbsp, pic->seq_parameter_set_id);
+  BitstreamAppend(&pps_rbsp, 1, pic_bits->entropy_coding_mode_flag);
+  BitstreamAppend(&pps_rbsp, 1, pic_bits->pic_order_present_flag);
+  BitstreamAppendUE(&pps_rbsp, num_slice_groups_minus1);
+  if (num_slice_groups_minus1 > 0) {
+    // TODO(mburakov): Implement this!
+    abort();
+  }
+
+  BitstreamAppendUE(&pps_rbsp, pic->num_ref_idx_l0_active_minus1);
+  BitstreamAppendUE(&pps_rbsp, pic->num_ref_idx_l1_active_minus1);
+  BitstreamAppend(&pps_rbsp, 1, pic_bits->weighted_pred_flag);
+  BitstreamAppend(&pps_rbsp, 2, pic_bits->weighted_bipred_idc);
+  BitstreamAppendSE(&pps_rbsp, pic->pic_init_qp - 26);
+  BitstreamAppendSE(&pps_rbsp, pic_init_qs_minus26);
+  BitstreamAppendSE(&pps_rbsp, pic->chroma_qp_index_offset);
+  BitstreamAppend(&pps_rbsp, 1,
+                  pic_bits->deblocking_filter_control_present_flag);
+  BitstreamAppend(&pps_rbsp, 1, pic_bits->constrained_intra_pred_flag);
+  BitstreamAppend(&pps_rbsp, 1, pic_bits->redundant_pic_cnt_present_flag);
+
+  // mburakov: Trailing fields are only allowed in High profiles, so these are
+  // only emitted when something there differs from the inferred values.
+  if (pic_bits->transform_8x8_mode_flag ||
+      pic_bits->pic_scaling_matrix_present_flag ||
+      pic->second_chroma_qp_index_offset != pic->chroma_qp_index_offset) {
+    BitstreamAppend(&pps_rbsp, 1, pic_bits->transform_8x8_mode_flag);
+    BitstreamAppend(&pps_rbsp, 1, pic_bits->pic_scaling_matrix_present_flag);
+    if (pic_bits->pic_scaling_matrix_present_flag) {
+      // TODO(mburakov): Implement this!
+      abort();
+    }
+    BitstreamAppendSE(&pps_rbsp, pic->second_chroma_qp_index_offset);
+  }
+
+  PackRbspTrailingBits(&pps_rbsp);
+  BitstreamInflate(bitstream, &pps_rbsp);
+}
+
+// 7.3.3.3 Decoded reference picture marking syntax
+static void PackDecRefPicMarking(struct Bitstream* bitstream, bool idr) {
+  if (idr) {
+    BitstreamAppend(bitstream, 1, no_output_of_prior_pics_flag);
+    BitstreamAppend(bitstream, 1, long_term_reference_flag);
+  } else {
+    BitstreamAppend(bitstream, 1, adaptive_ref_pic_marking_mode_flag);
+    if (adaptive_ref_pic_marking_mode_flag) {
+      // TODO(mburakov): Implement this!
+      abort();
+    }
+  }
+}
+
+// 7.3.3 Slice header syntax
+void PackH264SliceHeaderNalUnit(struct Bitstream* bitstream,
+                                const VAEncSequenceParameterBufferH264* seq,
+                                const VAEncPictureParameterBufferH264* pic,
+                                const VAEncSliceParameterBufferH264* slice) {
+  const typeof(seq->seq_fields.bits)* seq_bits = &seq->seq_fields.bits;
+  const typeof(pic->pic_fields.bits)* pic_bits = &pic->pic_fields.bits;
+
+  uint8_t nal_ref_idc = pic_bits->reference_pic_flag ? 3 : 0;
+  PackNalUnitHeader(bitstream, nal_ref_idc,
+                    pic_bits->idr_pic_flag ? H264_NAL_IDR_SLICE
+                                           : H264_NAL_SLICE);
+
+  char buffer_on_the_stack[64];
+  struct Bitstream slice_rbsp = {
+      .data = buffer_on_the_stack,
+      .size = 0,
+  };
+
+  BitstreamAppendUE(&slice_rbsp, slice->macroblock_address);
+  BitstreamAppendUE(&slice_rbsp, slice->slice_type);
+  BitstreamAppendUE(&slice_rbsp, slice->pic_parameter_set_id);
+  BitstreamAppend(&slice_rbsp, seq_bits->log2_max_frame_num_minus4 + 4,
+                  pic->frame_num);
+  if (!seq_bits->frame_mbs_only_flag) {
+    // TODO(mburakov): Implement this!
+    abort();
+  }
+  if (pic_bits->idr_pic_flag)
+    BitstreamAppendUE(&slice_rbsp, slice->idr_pic_id);
+  if (seq_bits->pic_order_cnt_type == 0) {
+    BitstreamAppend(&slice_rbsp,
+                    seq_bits->log2_max_pic_order_cnt_lsb_minus4 + 4,
+                    slice->pic_order_cnt_lsb);
+    if (pic_bits->pic_order_present_flag)
+      BitstreamAppendSE(&slice_rbsp, slice->delta_pic_order_cnt_bottom);
+  } else if (seq_bits->pic_order_cnt_type == 1 &&
+             !seq_bits->delta_pic_order_always_zero_flag) {
+    // TODO(mburakov): Implement this!
+    abort();
+  }
+  if (pic_bits->redundant_pic_cnt_present_flag) {
+    // TODO(mburakov): Implement this!
+    abort();
+  }
+  if (slice->slice_type == H264_SLICE_B)
+    BitstreamAppend(&slice_rbsp, 1, slice->direct_spatial_mv_pred_flag);
+  if (slice->slice_type == H264_SLICE_P || slice->slice_type == H264_SLICE_B) {
+    BitstreamAppend(&slice_rbsp, 1, slice->num_ref_idx_active_override_flag);
+    if (slice->num_ref_idx_active_override_flag) {
+      BitstreamAppendUE(&slice_rbsp, slice->num_ref_idx_l0_active_minus1);
+      if (slice->slice_type == H264_SLICE_B)
+        BitstreamAppendUE(&slice_rbsp, slice->num_ref_idx_l1_active_minus1);
+    }
+  }
+
+  // 7.3.3.1 Reference picture list modification syntax
+  if (slice->slice_type != H264_SLICE_I) {
+    BitstreamAppend(&slice_rbsp, 1, ref_pic_list_modification_flag_l0);
+    if (ref_pic_list_modification_flag_l0) {
+      // TODO(mburakov): Implement this!
+      abort();
+    }
+  }
+  if (slice->slice_type == H264_SLICE_B) {
+    BitstreamAppend(&slice_rbsp, 1, ref_pic_list_modification_flag_l1);
+    if (ref_pic_list_modification_flag_l1) {
+      // TODO(mburakov): Implement this!
+      abort();
+    }
+  }
+
+  if ((pic_bits->weighted_pred_flag && slice->slice_type == H264_SLICE_P) ||
+      (pic_bits->weighted_bipred_idc == 1 &&
+       slice->slice_type == H264_SLICE_B)) {
+    // TODO(mburakov): Implement this!
+    abort();
+  }
+  if (nal_ref_idc) PackDecRefPicMarking(&slice_rbsp, pic_bits->idr_pic_flag);
+  if (pic_bits->entropy_coding_mode_flag && slice->slice_type != H264_SLICE_I)
+    BitstreamAppendUE(&slice_rbsp, slice->cabac_init_idc);
+  BitstreamAppendSE(&slice_rbsp, slice->slice_qp_delta);
+  if (pic_bits->deblocking_filter_control_present_flag) {
+    BitstreamAppendUE(&slice_rbsp, slice->disable_deblocking_filter_idc);
+    if (slice->disable_deblocking_filter_idc != 1) {
+      BitstreamAppendSE(&slice_rbsp, slice->slice_alpha_c0_offset_div2);
+      BitstreamAppendSE(&slice_rbsp, slice->slice_beta_offset_div2);
+    }
+  }
+
+  // mburakov: Unlike HEVC, slice data follows the header without any byte
+  // alignment. Emulation prevention is applied to the whole bytes, and the
+  // remaining bits are appended as is, with the bit length of the packed
+  // header telling the driver where to continue from.
+  size_t tail_size = slice_rbsp.size % 8;
+  slice_rbsp.size -= tail_size;
+  BitstreamInflate(bitstream, &slice_rbsp);
+  if (tail_size) {
+    uint8_t tail = ((const uint8_t*)slice_rbsp.data)[slice_rbsp.size / 8];
+    BitstreamAppend(bitstream, tail_size, tail >> (8 - tail_size));
+  }
+}
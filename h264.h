@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_H264_H_
+#define STREAMER_H264_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <va/va.h>
+
+// Table 7-1
+enum H264NalUnitType {
+  H264_NAL_SLICE = 1,
+  H264_NAL_IDR_SLICE = 5,
+  H264_NAL_SPS = 7,
+  H264_NAL_PPS = 8,
+};
+
+// Table 7-6
+enum H264SliceType {
+  H264_SLICE_P = 0,
+  H264_SLICE_B = 1,
+  H264_SLICE_I = 2,
+};
+
+struct Bitstream;
+
+struct MoreH264SeqParameters {
+  uint8_t profile_idc;
+  bool constraint_set0_flag;
+  bool constraint_set1_flag;
+  bool constraint_set2_flag;
+  bool video_signal_type_present_flag;
+  bool video_full_range_flag;
+  bool colour_description_present_flag;
+  uint8_t colour_primaries;
+  uint8_t transfer_characteristics;
+  uint8_t matrix_coefficients;
+  uint32_t max_num_reorder_frames;
+  uint32_t max_dec_frame_buffering;
+};
+
+void PackH264SeqParameterSetNalUnit(struct Bitstream* bitstream,
+                                    const VAEncSequenceParameterBufferH264* seq,
+                                    const struct MoreH264SeqParameters* msp);
+void PackH264PicParameterSetNalUnit(struct Bitstream* bitstream,
+                                    const VAEncPictureParameterBufferH264* pic);
+void PackH264SliceHeaderNalUnit(struct Bitstream* bitstream,
+                                const VAEncSequenceParameterBufferH264* seq,
+                                const VAEncPictureParameterBufferH264* pic,
+                                const VAEncSliceParameterBufferH264* slice);
+
+#endif  // STREAMER_H264_H_
@@ -0,0 +1,403 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "h264_parse.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bitstream.h"
+#include "toolbox/utils.h"
+
+#define UNSUPPORTED(what)                \
+  do {                                   \
+    LOG("Unsupported syntax: %s", what); \
+    return false;                        \
+  } while (0)
+
+static struct BitstreamReader RbspReader(const struct H264NalUnit* nal_unit) {
+  return (struct BitstreamReader){
+      .data = nal_unit->rbsp,
+      .size = nal_unit->rbsp_size,
+      .offset = 0,
+      .overflow = false,
+  };
+}
+
+// 7.2 Specification of syntax functions, categories, and descriptors
+static bool MoreRbspData(const struct BitstreamReader* reader) {
+  // mburakov: Find the rbsp_stop_one_bit, which is the last bit set.
+  const uint8_t* data = reader->data;
+  size_t size = reader->size;
+  while (size && !(data[(size - 1) / 8] >> (7 - (size - 1) % 8) & 1)) size--;
+  return size && reader->offset < size - 1;
+}
+
+// 7.3.2.11 RBSP trailing bits syntax
+static bool ReadRbspTrailingBits(struct BitstreamReader* reader) {
+  if (!BitstreamRead(reader, 1)) return false;  // rbsp_stop_one_bit
+  while (!BitstreamIsByteAligned(reader)) {
+    if (BitstreamRead(reader, 1)) return false;  // rbsp_alignment_zero_bit
+  }
+  return !reader->overflow && reader->offset == reader->size;
+}
+
+// B.1.1 Byte stream NAL unit syntax
+bool ParseH264NalUnit(const void** data, size_t* size,
+                      struct H264NalUnit* nal_unit) {
+  const uint8_t* begin = *data;
+  const uint8_t* end = begin + *size;
+  while (begin < end && !*begin) begin++;  // zero_byte
+  if (end - begin < 2 || *begin++ != 1) {
+    LOG("Missing start_code_prefix_one_3bytes");
+    return false;
+  }
+
+  const uint8_t* next = begin;
+  for (; end - next >= 3; next++) {
+    if (!next[0] && !next[1] && next[2] <= 1) break;
+  }
+  if (end - next < 3) next = end;
+
+  // 7.3.1 NAL unit syntax
+  if (begin[0] & 0x80) {
+    LOG("Invalid forbidden_zero_bit");
+    return false;
+  }
+  nal_unit->nal_ref_idc = begin[0] >> 5 & 0x3;
+  nal_unit->nal_unit_type = begin[0] & 0x1f;
+  if (nal_unit->nal_unit_type == 14 || nal_unit->nal_unit_type == 20 ||
+      nal_unit->nal_unit_type == 21)
+    UNSUPPORTED("nal_unit_header_extension");
+  begin += 1;
+
+  size_t rbsp_size = (size_t)(next - begin);
+  if (rbsp_size > sizeof(nal_unit->rbsp)) {
+    LOG("NAL unit is too large (%zu)", rbsp_size);
+    return false;
+  }
+
+  struct Bitstream rbsp = {.data = nal_unit->rbsp, .size = 0};
+  const struct Bitstream source = {.data = (void*)begin, .size = rbsp_size * 8};
+  BitstreamDeflate(&rbsp, &source);
+  nal_unit->rbsp_size = rbsp.size;
+
+  *size = (size_t)(end - next);
+  *data = next;
+  return true;
+}
+
+// E.1.1 VUI parameters syntax
+static bool ReadVuiParameters(struct BitstreamReader* reader,
+                              struct H264VuiParameters* vui) {
+  vui->aspect_ratio_info_present_flag = BitstreamRead(reader, 1);
+  if (vui->aspect_ratio_info_present_flag) {
+    vui->aspect_ratio_idc = (uint8_t)BitstreamRead(reader, 8);
+    if (vui->aspect_ratio_idc == 255) {  // Extended_SAR
+      vui->sar_width = (uint16_t)BitstreamRead(reader, 16);
+      vui->sar_height = (uint16_t)BitstreamRead(reader, 16);
+    }
+  }
+
+  vui->overscan_info_present_flag = BitstreamRead(reader, 1);
+  if (vui->overscan_info_present_flag)
+    BitstreamRead(reader, 1);  // overscan_appropriate_flag
+
+  vui->video_signal_type_present_flag = BitstreamRead(reader, 1);
+  if (vui->video_signal_type_present_flag) {
+    vui->video_format = (uint8_t)BitstreamRead(reader, 3);
+    vui->video_full_range_flag = BitstreamRead(reader, 1);
+    vui->colour_description_present_flag = BitstreamRead(reader, 1);
+    if (vui->colour_description_present_flag) {
+      vui->colour_primaries = (uint8_t)BitstreamRead(reader, 8);
+      vui->transfer_characteristics = (uint8_t)BitstreamRead(reader, 8);
+      vui->matrix_coefficients = (uint8_t)BitstreamRead(reader, 8);
+    }
+  }
+
+  vui->chroma_loc_info_present_flag = BitstreamRead(reader, 1);
+  if (vui->chroma_loc_info_present_flag) {
+    BitstreamReadUE(reader);  // chroma_sample_loc_type_top_field
+    BitstreamReadUE(reader);  // chroma_sample_loc_type_bottom_field
+  }
+
+  vui->timing_info_present_flag = BitstreamRead(reader, 1);
+  if (vui->timing_info_present_flag) {
+    vui->num_units_in_tick = BitstreamRead(reader, 32);
+    vui->time_scale = BitstreamRead(reader, 32);
+    vui->fixed_frame_rate_flag = BitstreamRead(reader, 1);
+  }
+
+  if (BitstreamRead(reader, 1))
+    UNSUPPORTED("nal_hrd_parameters_present_flag");
+  if (BitstreamRead(reader, 1))
+    UNSUPPORTED("vcl_hrd_parameters_present_flag");
+
+  vui->pic_struct_present_flag = BitstreamRead(reader, 1);
+  vui->bitstream_restriction_flag = BitstreamRead(reader, 1);
+  if (vui->bitstream_restriction_flag) {
+    vui->motion_vectors_over_pic_boundaries_flag = BitstreamRead(reader, 1);
+    vui->max_bytes_per_pic_denom = BitstreamReadUE(reader);
+    vui->max_bits_per_mb_denom = BitstreamReadUE(reader);
+    vui->log2_max_mv_length_horizontal = BitstreamReadUE(reader);
+    vui->log2_max_mv_length_vertical = BitstreamReadUE(reader);
+    vui->max_num_reorder_frames = BitstreamReadUE(reader);
+    vui->max_dec_frame_buffering = BitstreamReadUE(reader);
+  }
+  return !reader->overflow;
+}
+
+// 7.3.2.1.1 Sequence parameter set data syntax
+bool ParseH264SeqParameterSet(const struct H264NalUnit* nal_unit,
+                              struct H264SeqParameterSet* sps) {
+  if (nal_unit->nal_unit_type != H264_NAL_SPS) {
+    LOG("Unexpected nal_unit_type %u", nal_unit->nal_unit_type);
+    return false;
+  }
+
+  struct BitstreamReader reader = RbspReader(nal_unit);
+  memset(sps, 0, sizeof(*sps));
+  sps->profile_idc = (uint8_t)BitstreamRead(&reader, 8);
+  sps->constraint_set0_flag = BitstreamRead(&reader, 1);
+  sps->constraint_set1_flag = BitstreamRead(&reader, 1);
+  sps->constraint_set2_flag = BitstreamRead(&reader, 1);
+  sps->constraint_set3_flag = BitstreamRead(&reader, 1);
+  sps->constraint_set4_flag = BitstreamRead(&reader, 1);
+  sps->constraint_set5_flag = BitstreamRead(&reader, 1);
+  if (BitstreamRead(&reader, 2)) {
+    LOG("Invalid reserved_zero_2bits");
+    return false;
+  }
+  sps->level_idc = (uint8_t)BitstreamRead(&reader, 8);
+  sps->seq_parameter_set_id = BitstreamReadUE(&reader);
+
+  // mburakov: Inferred values, unless overridden below.
+  sps->chroma_format_idc = 1;
+  switch (sps->profile_idc) {
+    case 100:
+    case 110:
+    case 122:
+    case 244:
+    case 44:
+    case 83:
+    case 86:
+    case 118:
+    case 128:
+    case 138:
+    case 139:
+    case 134:
+    case 135:
+      sps->chroma_format_idc = BitstreamReadUE(&reader);
+      if (sps->chroma_format_idc == 3)
+        sps->separate_colour_plane_flag = BitstreamRead(&reader, 1);
+      sps->bit_depth_luma_minus8 = BitstreamReadUE(&reader);
+      sps->bit_depth_chroma_minus8 = BitstreamReadUE(&reader);
+      sps->qpprime_y_zero_transform_bypass_flag = BitstreamRead(&reader, 1);
+      sps->seq_scaling_matrix_present_flag = BitstreamRead(&reader, 1);
+      if (sps->seq_scaling_matrix_present_flag)
+        UNSUPPORTED("seq_scaling_matrix_present_flag");
+      break;
+    default:
+      break;
+  }
+
+  sps->log2_max_frame_num_minus4 = BitstreamReadUE(&reader);
+  if (sps->log2_max_frame_num_minus4 > 12) {
+    LOG("Invalid log2_max_frame_num_minus4");
+    return false;
+  }
+  sps->pic_order_cnt_type = BitstreamReadUE(&reader);
+  if (sps->pic_order_cnt_type == 0) {
+    sps->log2_max_pic_order_cnt_lsb_minus4 = BitstreamReadUE(&reader);
+    if (sps->log2_max_pic_order_cnt_lsb_minus4 > 12) {
+      LOG("Invalid log2_max_pic_order_cnt_lsb_minus4");
+      return false;
+    }
+  } else if (sps->pic_order_cnt_type == 1) {
+    UNSUPPORTED("pic_order_cnt_type");
+  } else if (sps->pic_order_cnt_type != 2) {
+    LOG("Invalid pic_order_cnt_type %u", sps->pic_order_cnt_type);
+    return false;
+  }
+
+  sps->max_num_ref_frames = BitstreamReadUE(&reader);
+  sps->gaps_in_frame_num_value_allowed_flag = BitstreamRead(&reader, 1);
+  sps->pic_width_in_mbs_minus1 = BitstreamReadUE(&reader);
+  sps->pic_height_in_map_units_minus1 = BitstreamReadUE(&reader);
+  sps->frame_mbs_only_flag = BitstreamRead(&reader, 1);
+  if (!sps->frame_mbs_only_flag)
+    sps->mb_adaptive_frame_field_flag = BitstreamRead(&reader, 1);
+  sps->direct_8x8_inference_flag = BitstreamRead(&reader, 1);
+
+  sps->frame_cropping_flag = BitstreamRead(&reader, 1);
+  if (sps->frame_cropping_flag) {
+    sps->frame_crop_left_offset = BitstreamReadUE(&reader);
+    sps->frame_crop_right_offset = BitstreamReadUE(&reader);
+    sps->frame_crop_top_offset = BitstreamReadUE(&reader);
+    sps->frame_crop_bottom_offset = BitstreamReadUE(&reader);
+  }
+
+  sps->vui_parameters_present_flag = BitstreamRead(&reader, 1);
+  if (sps->vui_parameters_present_flag &&
+      !ReadVuiParameters(&reader, &sps->vui_parameters))
+    return false;
+
+  return ReadRbspTrailingBits(&reader);
+}
+
+// 7.3.2.2 Picture parameter set RBSP syntax
+bool ParseH264PicParameterSet(const struct H264NalUnit* nal_unit,
+                              struct H264PicParameterSet* pps) {
+  if (nal_unit->nal_unit_type != H264_NAL_PPS) {
+    LOG("Unexpected nal_unit_type %u", nal_unit->nal_unit_type);
+    return false;
+  }
+
+  struct BitstreamReader reader = RbspReader(nal_unit);
+  memset(pps, 0, sizeof(*pps));
+  pps->pic_parameter_set_id = BitstreamReadUE(&reader);
+  pps->seq_parameter_set_id = BitstreamReadUE(&reader);
+  pps->entropy_coding_mode_flag = BitstreamRead(&reader, 1);
+  pps->bottom_field_pic_order_in_frame_present_flag =
+      BitstreamRead(&reader, 1);
+  pps->num_slice_groups_minus1 = BitstreamReadUE(&reader);
+  if (pps->num_slice_groups_minus1 > 0)
+    UNSUPPORTED("num_slice_groups_minus1");
+
+  pps->num_ref_idx_l0_default_active_minus1 = BitstreamReadUE(&reader);
+  pps->num_ref_idx_l1_default_active_minus1 = BitstreamReadUE(&reader);
+  pps->weighted_pred_flag = BitstreamRead(&reader, 1);
+  pps->weighted_bipred_idc = (uint8_t)BitstreamRead(&reader, 2);
+  pps->pic_init_qp_minus26 = BitstreamReadSE(&reader);
+  pps->pic_init_qs_minus26 = BitstreamReadSE(&reader);
+  pps->chroma_qp_index_offset = BitstreamReadSE(&reader);
+  pps->deblocking_filter_control_present_flag = BitstreamRead(&reader, 1);
+  pps->constrained_intra_pred_flag = BitstreamRead(&reader, 1);
+  pps->redundant_pic_cnt_present_flag = BitstreamRead(&reader, 1);
+
+  // mburakov: Inferred values, unless overridden below.
+  pps->second_chroma_qp_index_offset = pps->chroma_qp_index_offset;
+  if (MoreRbspData(&reader)) {
+    pps->transform_8x8_mode_flag = BitstreamRead(&reader, 1);
+    pps->pic_scaling_matrix_present_flag = BitstreamRead(&reader, 1);
+    if (pps->pic_scaling_matrix_present_flag)
+      UNSUPPORTED("pic_scaling_matrix_present_flag");
+    pps->second_chroma_qp_index_offset = BitstreamReadSE(&reader);
+  }
+
+  return ReadRbspTrailingBits(&reader);
+}
+
+// 7.3.3.3 Decoded reference picture marking syntax
+static bool ReadDecRefPicMarking(struct BitstreamReader* reader, bool idr,
+                                 struct H264SliceHeader* sh) {
+  if (idr) {
+    sh->no_output_of_prior_pics_flag = BitstreamRead(reader, 1);
+    sh->long_term_reference_flag = BitstreamRead(reader, 1);
+  } else {
+    sh->adaptive_ref_pic_marking_mode_flag = BitstreamRead(reader, 1);
+    if (sh->adaptive_ref_pic_marking_mode_flag)
+      UNSUPPORTED("adaptive_ref_pic_marking_mode_flag");
+  }
+  return !reader->overflow;
+}
+
+// 7.3.3 Slice header syntax
+bool ParseH264SliceHeader(const struct H264NalUnit* nal_unit,
+                          const struct H264SeqParameterSet* sps,
+                          const struct H264PicParameterSet* pps,
+                          struct H264SliceHeader* sh) {
+  uint8_t nal_unit_type = nal_unit->nal_unit_type;
+  if (nal_unit_type != H264_NAL_SLICE && nal_unit_type != H264_NAL_IDR_SLICE) {
+    LOG("Unexpected nal_unit_type %u", nal_unit_type);
+    return false;
+  }
+
+  struct BitstreamReader reader = RbspReader(nal_unit);
+  memset(sh, 0, sizeof(*sh));
+  bool idr = nal_unit_type == H264_NAL_IDR_SLICE;
+  sh->first_mb_in_slice = BitstreamReadUE(&reader);
+  sh->slice_type = BitstreamReadUE(&reader);
+  if (sh->slice_type > 9) {
+    LOG("Invalid slice_type %u", sh->slice_type);
+    return false;
+  }
+  uint32_t slice_type = sh->slice_type % 5;
+  if (slice_type > H264_SLICE_I) UNSUPPORTED("slice_type");
+
+  sh->pic_parameter_set_id = BitstreamReadUE(&reader);
+  if (sps->separate_colour_plane_flag)
+    BitstreamRead(&reader, 2);  // colour_plane_id
+  sh->frame_num = BitstreamRead(&reader, sps->log2_max_frame_num_minus4 + 4);
+  if (!sps->frame_mbs_only_flag && BitstreamRead(&reader, 1))
+    UNSUPPORTED("field_pic_flag");
+  if (idr) sh->idr_pic_id = BitstreamReadUE(&reader);
+  if (sps->pic_order_cnt_type == 0) {
+    sh->pic_order_cnt_lsb = BitstreamRead(
+        &reader, sps->log2_max_pic_order_cnt_lsb_minus4 + 4);
+    if (pps->bottom_field_pic_order_in_frame_present_flag)
+      sh->delta_pic_order_cnt_bottom = BitstreamReadSE(&reader);
+  }
+  if (pps->redundant_pic_cnt_present_flag)
+    UNSUPPORTED("redundant_pic_cnt_present_flag");
+
+  // mburakov: Inferred values, unless overridden below.
+  sh->num_ref_idx_l0_active_minus1 = pps->num_ref_idx_l0_default_active_minus1;
+  sh->num_ref_idx_l1_active_minus1 = pps->num_ref_idx_l1_default_active_minus1;
+
+  if (slice_type == H264_SLICE_B)
+    sh->direct_spatial_mv_pred_flag = BitstreamRead(&reader, 1);
+  if (slice_type == H264_SLICE_P || slice_type == H264_SLICE_B) {
+    sh->num_ref_idx_active_override_flag = BitstreamRead(&reader, 1);
+    if (sh->num_ref_idx_active_override_flag) {
+      sh->num_ref_idx_l0_active_minus1 = BitstreamReadUE(&reader);
+      if (slice_type == H264_SLICE_B)
+        sh->num_ref_idx_l1_active_minus1 = BitstreamReadUE(&reader);
+    }
+  }
+
+  // 7.3.3.1 Reference picture list modification syntax
+  if (slice_type != H264_SLICE_I) {
+    sh->ref_pic_list_modification_flag_l0 = BitstreamRead(&reader, 1);
+    if (sh->ref_pic_list_modification_flag_l0)
+      UNSUPPORTED("ref_pic_list_modification_flag_l0");
+  }
+  if (slice_type == H264_SLICE_B) {
+    sh->ref_pic_list_modification_flag_l1 = BitstreamRead(&reader, 1);
+    if (sh->ref_pic_list_modification_flag_l1)
+      UNSUPPORTED("ref_pic_list_modification_flag_l1");
+  }
+
+  if ((pps->weighted_pred_flag && slice_type == H264_SLICE_P) ||
+      (pps->weighted_bipred_idc == 1 && slice_type == H264_SLICE_B))
+    UNSUPPORTED("pred_weight_table");
+  if (nal_unit->nal_ref_idc && !ReadDecRefPicMarking(&reader, idr, sh))
+    return false;
+  if (pps->entropy_coding_mode_flag && slice_type != H264_SLICE_I)
+    sh->cabac_init_idc = BitstreamReadUE(&reader);
+  sh->slice_qp_delta = BitstreamReadSE(&reader);
+  if (pps->deblocking_filter_control_present_flag) {
+    sh->disable_deblocking_filter_idc = BitstreamReadUE(&reader);
+    if (sh->disable_deblocking_filter_idc != 1) {
+      sh->slice_alpha_c0_offset_div2 = BitstreamReadSE(&reader);
+      sh->slice_beta_offset_div2 = BitstreamReadSE(&reader);
+    }
+  }
+
+  sh->slice_header_size = reader.offset;
+  return !reader.overflow;
+}
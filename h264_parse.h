@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_H264_PARSE_H_
+#define STREAMER_H264_PARSE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "h264.h"
+
+// mburakov: Same as hevc_parse.h, parsed syntax only covers what the writers
+// in h264.c are able to produce, and everything else is rejected.
+
+struct H264NalUnit {
+  uint8_t nal_ref_idc;
+  uint8_t nal_unit_type;
+  uint8_t rbsp[256];
+  size_t rbsp_size;
+};
+
+struct H264VuiParameters {
+  bool aspect_ratio_info_present_flag;
+  uint8_t aspect_ratio_idc;
+  uint16_t sar_width;
+  uint16_t sar_height;
+  bool overscan_info_present_flag;
+  bool video_signal_type_present_flag;
+  uint8_t video_format;
+  bool video_full_range_flag;
+  bool colour_description_present_flag;
+  uint8_t colour_primaries;
+  uint8_t transfer_characteristics;
+  uint8_t matrix_coefficients;
+  bool chroma_loc_info_present_flag;
+  bool timing_info_present_flag;
+  uint32_t num_units_in_tick;
+  uint32_t time_scale;
+  bool fixed_frame_rate_flag;
+  bool pic_struct_present_flag;
+  bool bitstream_restriction_flag;
+  bool motion_vectors_over_pic_boundaries_flag;
+  uint32_t max_bytes_per_pic_denom;
+  uint32_t max_bits_per_mb_denom;
+  uint32_t log2_max_mv_length_horizontal;
+  uint32_t log2_max_mv_length_vertical;
+  uint32_t max_num_reorder_frames;
+  uint32_t max_dec_frame_buffering;
+};
+
+struct H264SeqParameterSet {
+  uint8_t profile_idc;
+  bool constraint_set0_flag;
+  bool constraint_set1_flag;
+  bool constraint_set2_flag;
+  bool constraint_set3_flag;
+  bool constraint_set4_flag;
+  bool constraint_set5_flag;
+  uint8_t level_idc;
+  uint32_t seq_parameter_set_id;
+  uint32_t chroma_format_idc;
+  bool separate_colour_plane_flag;
+  uint32_t bit_depth_luma_minus8;
+  uint32_t bit_depth_chroma_minus8;
+  bool qpprime_y_zero_transform_bypass_flag;
+  bool seq_scaling_matrix_present_flag;
+  uint32_t log2_max_frame_num_minus4;
+  uint32_t pic_order_cnt_type;
+  uint32_t log2_max_pic_order_cnt_lsb_minus4;
+  uint32_t max_num_ref_frames;
+  bool gaps_in_frame_num_value_allowed_flag;
+  uint32_t pic_width_in_mbs_minus1;
+  uint32_t pic_height_in_map_units_minus1;
+  bool frame_mbs_only_flag;
+  bool mb_adaptive_frame_field_flag;
+  bool direct_8x8_inference_flag;
+  bool frame_cropping_flag;
+  uint32_t frame_crop_left_offset;
+  uint32_t frame_crop_right_offset;
+  uint32_t frame_crop_top_offset;
+  uint32_t frame_crop_bottom_offset;
+  bool vui_parameters_present_flag;
+  struct H264VuiParameters vui_parameters;
+};
+
+struct H264PicParameterSet {
+  uint32_t pic_parameter_set_id;
+  uint32_t seq_parameter_set_id;
+  bool entropy_coding_mode_flag;
+  bool bottom_field_pic_order_in_frame_present_flag;
+  uint32_t num_slice_groups_minus1;
+  uint32_t num_ref_idx_l0_default_active_minus1;
+  uint32_t num_ref_idx_l1_default_active_minus1;
+  bool weighted_pred_flag;
+  uint8_t weighted_bipred_idc;
+  int32_t pic_init_qp_minus26;
+  int32_t pic_init_qs_minus26;
+  int32_t chroma_qp_index_offset;
+  bool deblocking_filter_control_present_flag;
+  bool constrained_intra_pred_flag;
+  bool redundant_pic_cnt_present_flag;
+  bool transform_8x8_mode_flag;
+  bool pic_scaling_matrix_present_flag;
+  int32_t second_chroma_qp_index_offset;
+};
+
+struct H264SliceHeader {
+  uint32_t first_mb_in_slice;
+  uint32_t slice_type;
+  uint32_t pic_parameter_set_id;
+  uint32_t frame_num;
+  uint32_t idr_pic_id;
+  uint32_t pic_order_cnt_lsb;
+  int32_t delta_pic_order_cnt_bottom;
+  bool direct_spatial_mv_pred_flag;
+  bool num_ref_idx_active_override_flag;
+  uint32_t num_ref_idx_l0_active_minus1;
+  uint32_t num_ref_idx_l1_active_minus1;
+  bool ref_pic_list_modification_flag_l0;
+  bool ref_pic_list_modification_flag_l1;
+  bool no_output_of_prior_pics_flag;
+  bool long_term_reference_flag;
+  bool adaptive_ref_pic_marking_mode_flag;
+  uint32_t cabac_init_idc;
+  int32_t slice_qp_delta;
+  uint32_t disable_deblocking_filter_idc;
+  int32_t slice_alpha_c0_offset_div2;
+  int32_t slice_beta_offset_div2;
+  // mburakov: Slice data follows the header without any alignment, so this
+  // is the number of rbsp bits taken by the header itself.
+  size_t slice_header_size;
+};
+
+bool ParseH264NalUnit(const void** data, size_t* size,
+                      struct H264NalUnit* nal_unit);
+bool ParseH264SeqParameterSet(const struct H264NalUnit* nal_unit,
+                              struct H264SeqParameterSet* sps);
+bool ParseH264PicParameterSet(const struct H264NalUnit* nal_unit,
+                              struct H264PicParameterSet* pps);
+bool ParseH264SliceHeader(const struct H264NalUnit* nal_unit,
+                          const struct H264SeqParameterSet* sps,
+                          const struct H264PicParameterSet* pps,
+                          struct H264SliceHeader* sh);
+
+#endif  // STREAMER_H264_PARSE_H_
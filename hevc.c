@@ -52,7 +52,6 @@ static const bool sps_sub_layer_ordering_info_present_flag =
 static const uint32_t sps_max_latency_increase_plus1 =
     vps_max_latency_increase_plus1;
 static const uint32_t num_short_term_ref_pic_sets = 0;
-static const bool long_term_ref_pics_present_flag = 0;
 static const uint8_t video_format = 5;
 static const bool vui_poc_proportional_to_timing_flag =
     vps_poc_proportional_to_timing_flag;
@@ -83,6 +82,12 @@ static const bool deblocking_filter_override_enabled_flag = 0;
 static const bool deblocking_filter_override_flag = 0;
 static const uint32_t num_entry_point_offsets = 0;
 static const bool inter_ref_pic_set_prediction_flag = 0;
+static const uint32_t num_long_term_ref_pics_sps = 0;
+static const uint32_t num_long_term_sps = 0;
+
+static uint32_t CeilLog2(uint32_t value) {
+  return value > 1 ? 32 - (uint32_t)__builtin_clz(value - 1) : 0;
+}
 
 // 7.3.1.2 NAL unit header syntax
 static void PackNalUnitHeader(struct Bitstream* bitstream,
@@ -434,10 +439,10 @@ void PackSeqParameterSetNalUnit(struct Bitstream* bitstream,
     abort();
   }
 
-  BitstreamAppend(&sps_rbsp, 1, long_term_ref_pics_present_flag);
-  if (long_term_ref_pics_present_flag) {
-    // TODO(mburakov): Implement this!
-    abort();
+  BitstreamAppend(&sps_rbsp, 1, msp->long_term_ref_pics_present_flag);
+  if (msp->long_term_ref_pics_present_flag) {
+    // mburakov: Long-term pictures are always signalled in slice headers.
+    BitstreamAppendUE(&sps_rbsp, num_long_term_ref_pics_sps);
   }
 
   BitstreamAppend(&sps_rbsp, 1, seq_bits->sps_temporal_mvp_enabled_flag);
@@ -576,20 +581,23 @@ void PackSliceSegmentHeaderNalUnit(struct Bitstream* bitstream,
   if (!msp->first_slice_segment_in_pic_flag) {
     if (pic_bits->dependent_slice_segments_enabled_flag)
       BitstreamAppend(&slice_rbsp, 1, slice_bits->dependent_slice_segment_flag);
-    // TODO(mburakov): Implement this!!!
-    abort();
+    uint32_t CtbLog2SizeY = seq->log2_min_luma_coding_block_size_minus3 + 3 +
+                            seq->log2_diff_max_min_luma_coding_block_size;
+    uint32_t CtbSizeY = 1u << CtbLog2SizeY;
+    uint32_t PicWidthInCtbsY =
+        (seq->pic_width_in_luma_samples + CtbSizeY - 1) / CtbSizeY;
+    uint32_t PicHeightInCtbsY =
+        (seq->pic_height_in_luma_samples + CtbSizeY - 1) / CtbSizeY;
+    BitstreamAppend(&slice_rbsp, CeilLog2(PicWidthInCtbsY * PicHeightInCtbsY),
+                    slice->slice_segment_address);
   }
 
   if (!slice_bits->dependent_slice_segment_flag) {
-    for (uint32_t i = 0; i < num_extra_slice_header_bits; i++) {
-      // TODO(mburakov): Implement this!!!
-      abort();
-    }
+    for (uint32_t i = 0; i < num_extra_slice_header_bits; i++)
+      BitstreamAppend(&slice_rbsp, 1, 0);  // slice_reserved_flag
     BitstreamAppendUE(&slice_rbsp, slice->slice_type);
-    if (output_flag_present_flag) {
-      // TODO(mburakov): Implement this!!!
-      abort();
-    }
+    if (output_flag_present_flag)
+      BitstreamAppend(&slice_rbsp, 1, 1);  // pic_output_flag
     if (seq_bits->separate_colour_plane_flag) {
       // TODO(mburakov): Implement this!!!
       abort();
@@ -604,12 +612,26 @@ void PackSliceSegmentHeaderNalUnit(struct Bitstream* bitstream,
       if (!short_term_ref_pic_set_sps_flag)
         PackStRefPicSet(&slice_rbsp, num_short_term_ref_pic_sets, msp);
       else if (num_short_term_ref_pic_sets > 1) {
-        // TODO(mburakov): Implement this!!!
-        abort();
+        BitstreamAppend(&slice_rbsp, CeilLog2(num_short_term_ref_pic_sets),
+                        msp->short_term_ref_pic_set_idx);
       }
-      if (long_term_ref_pics_present_flag) {
-        // TODO(mburakov): Implement this!!!
-        abort();
+      if (msp->long_term_ref_pics_present_flag) {
+        if (num_long_term_ref_pics_sps > 0)
+          BitstreamAppendUE(&slice_rbsp, num_long_term_sps);
+        BitstreamAppendUE(&slice_rbsp, msp->num_long_term_pics);
+        for (uint32_t i = 0; i < msp->num_long_term_pics; i++) {
+          const struct LongTermPics* long_term_pic = &msp->long_term_pics[i];
+          BitstreamAppend(&slice_rbsp, log2_max_pic_order_cnt_lsb_minus4 + 4,
+                          long_term_pic->poc_lsb_lt);
+          BitstreamAppend(&slice_rbsp, 1,
+                          long_term_pic->used_by_curr_pic_lt_flag);
+          BitstreamAppend(&slice_rbsp, 1,
+                          long_term_pic->delta_poc_msb_present_flag);
+          if (long_term_pic->delta_poc_msb_present_flag) {
+            BitstreamAppendUE(&slice_rbsp,
+                              long_term_pic->delta_poc_msb_cycle_lt);
+          }
+        }
       }
       if (seq_bits->sps_temporal_mvp_enabled_flag) {
         BitstreamAppend(&slice_rbsp, 1,
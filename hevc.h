@@ -63,6 +63,7 @@ struct MoreSeqParameters {
   bool chroma_loc_info_present_flag;
   uint32_t chroma_sample_loc_type_top_field;
   uint32_t chroma_sample_loc_type_bottom_field;
+  bool long_term_ref_pics_present_flag;
 };
 
 struct MoreSliceParamerters {
@@ -78,6 +79,17 @@ struct MoreSliceParamerters {
     uint32_t delta_poc_s1_minus1;
     bool used_by_curr_pic_s1_flag;
   } const* positive_pics;
+  // mburakov: Only used when short_term_ref_pic_set_sps_flag is set.
+  uint32_t short_term_ref_pic_set_idx;
+  // mburakov: Must match the one in the sequence parameter set.
+  bool long_term_ref_pics_present_flag;
+  uint32_t num_long_term_pics;
+  struct LongTermPics {
+    uint32_t poc_lsb_lt;
+    bool used_by_curr_pic_lt_flag;
+    bool delta_poc_msb_present_flag;
+    uint32_t delta_poc_msb_cycle_lt;
+  } const* long_term_pics;
 };
 
 void PackVideoParameterSetNalUnit(struct Bitstream* bitstream,
@@ -0,0 +1,625 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "hevc_parse.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "bitstream.h"
+#include "toolbox/utils.h"
+
+#define UNSUPPORTED(what)                \
+  do {                                   \
+    LOG("Unsupported syntax: %s", what); \
+    return false;                        \
+  } while (0)
+
+static uint32_t CeilLog2(uint32_t value) {
+  return value > 1 ? 32 - (uint32_t)__builtin_clz(value - 1) : 0;
+}
+
+static struct BitstreamReader RbspReader(const struct NalUnit* nal_unit) {
+  return (struct BitstreamReader){
+      .data = nal_unit->rbsp,
+      .size = nal_unit->rbsp_size,
+      .offset = 0,
+      .overflow = false,
+  };
+}
+
+// 7.3.2.11 RBSP trailing bits syntax
+static bool ReadRbspTrailingBits(struct BitstreamReader* reader) {
+  if (!BitstreamRead(reader, 1)) return false;  // rbsp_stop_one_bit
+  while (!BitstreamIsByteAligned(reader)) {
+    if (BitstreamRead(reader, 1)) return false;  // rbsp_alignment_zero_bit
+  }
+  return !reader->overflow && reader->offset == reader->size;
+}
+
+// B.2.1 Byte stream NAL unit syntax
+bool ParseNalUnit(const void** data, size_t* size, struct NalUnit* nal_unit) {
+  const uint8_t* begin = *data;
+  const uint8_t* end = begin + *size;
+  while (begin < end && !*begin) begin++;  // zero_byte
+  if (end - begin < 3 || *begin++ != 1) {
+    LOG("Missing start_code_prefix_one_3bytes");
+    return false;
+  }
+
+  const uint8_t* next = begin;
+  for (; end - next >= 3; next++) {
+    if (!next[0] && !next[1] && next[2] <= 1) break;
+  }
+  if (end - next < 3) next = end;
+
+  // 7.3.1.2 NAL unit header syntax
+  if (begin[0] & 0x80) {
+    LOG("Invalid forbidden_zero_bit");
+    return false;
+  }
+  nal_unit->nal_unit_type = begin[0] >> 1 & 0x3f;
+  nal_unit->nuh_layer_id = (uint8_t)((begin[0] & 1) << 5 | begin[1] >> 3);
+  nal_unit->nuh_temporal_id_plus1 = begin[1] & 0x7;
+  begin += 2;
+
+  size_t rbsp_size = (size_t)(next - begin);
+  if (rbsp_size > sizeof(nal_unit->rbsp)) {
+    LOG("NAL unit is too large (%zu)", rbsp_size);
+    return false;
+  }
+
+  struct Bitstream rbsp = {.data = nal_unit->rbsp, .size = 0};
+  const struct Bitstream source = {.data = (void*)begin, .size = rbsp_size * 8};
+  BitstreamDeflate(&rbsp, &source);
+  nal_unit->rbsp_size = rbsp.size;
+
+  *size = (size_t)(end - next);
+  *data = next;
+  return true;
+}
+
+// 7.3.3 Profile, tier and level syntax
+static bool ReadProfileTierLevel(struct BitstreamReader* reader,
+                                 bool profilePresentFlag,
+                                 uint8_t maxNumSubLayersMinus1,
+                                 struct ProfileTierLevel* ptl) {
+  if (profilePresentFlag) {
+    ptl->general_profile_space = (uint8_t)BitstreamRead(reader, 2);
+    ptl->general_tier_flag = BitstreamRead(reader, 1);
+    ptl->general_profile_idc = (uint8_t)BitstreamRead(reader, 5);
+    ptl->general_profile_compatibility_flags = BitstreamRead(reader, 32);
+    ptl->general_progressive_source_flag = BitstreamRead(reader, 1);
+    ptl->general_interlaced_source_flag = BitstreamRead(reader, 1);
+    ptl->general_non_packed_constraint_flag = BitstreamRead(reader, 1);
+    ptl->general_frame_only_constraint_flag = BitstreamRead(reader, 1);
+    BitstreamRead(reader, 24);  // general_reserved_zero_43bits
+    BitstreamRead(reader, 19);  // general_reserved_zero_43bits
+    BitstreamRead(reader, 1);   // general_inbld_flag
+  }
+
+  ptl->general_level_idc = (uint8_t)BitstreamRead(reader, 8);
+  bool sub_layer_profile_present_flag[8] = {0};
+  bool sub_layer_level_present_flag[8] = {0};
+  for (uint8_t i = 0; i < maxNumSubLayersMinus1; i++) {
+    sub_layer_profile_present_flag[i] = BitstreamRead(reader, 1);
+    sub_layer_level_present_flag[i] = BitstreamRead(reader, 1);
+  }
+  if (maxNumSubLayersMinus1 > 0) {
+    for (uint8_t i = maxNumSubLayersMinus1; i < 8; i++)
+      BitstreamRead(reader, 2);  // reserved_zero_2bits
+  }
+  for (uint8_t i = 0; i < maxNumSubLayersMinus1; i++) {
+    if (sub_layer_profile_present_flag[i]) {
+      for (size_t j = 0; j < 88 / 22; j++) BitstreamRead(reader, 22);
+    }
+    if (sub_layer_level_present_flag[i])
+      BitstreamRead(reader, 8);  // sub_layer_level_idc
+  }
+  return !reader->overflow;
+}
+
+// 7.3.2.1 Video parameter set RBSP syntax
+bool ParseVideoParameterSet(const struct NalUnit* nal_unit,
+                            struct VideoParameterSet* vps) {
+  if (nal_unit->nal_unit_type != VPS_NUT) {
+    LOG("Unexpected nal_unit_type %u", nal_unit->nal_unit_type);
+    return false;
+  }
+
+  struct BitstreamReader reader = RbspReader(nal_unit);
+  memset(vps, 0, sizeof(*vps));
+  vps->vps_video_parameter_set_id = (uint8_t)BitstreamRead(&reader, 4);
+  BitstreamRead(&reader, 1);  // vps_base_layer_internal_flag
+  BitstreamRead(&reader, 1);  // vps_base_layer_available_flag
+  if (BitstreamRead(&reader, 6)) UNSUPPORTED("vps_max_layers_minus1");
+  vps->vps_max_sub_layers_minus1 = (uint8_t)BitstreamRead(&reader, 3);
+  vps->vps_temporal_id_nesting_flag = BitstreamRead(&reader, 1);
+  if (BitstreamRead(&reader, 16) != 0xffff) {
+    LOG("Invalid vps_reserved_0xffff_16bits");
+    return false;
+  }
+
+  if (!ReadProfileTierLevel(&reader, 1, vps->vps_max_sub_layers_minus1,
+                            &vps->profile_tier_level))
+    return false;
+
+  bool vps_sub_layer_ordering_info_present_flag = BitstreamRead(&reader, 1);
+  for (uint8_t i = (vps_sub_layer_ordering_info_present_flag
+                        ? 0
+                        : vps->vps_max_sub_layers_minus1);
+       i <= vps->vps_max_sub_layers_minus1; i++) {
+    // mburakov: Only the highest sub-layer values are kept.
+    vps->vps_max_dec_pic_buffering_minus1 = BitstreamReadUE(&reader);
+    vps->vps_max_num_reorder_pics = BitstreamReadUE(&reader);
+    vps->vps_max_latency_increase_plus1 = BitstreamReadUE(&reader);
+  }
+
+  uint8_t vps_max_layer_id = (uint8_t)BitstreamRead(&reader, 6);
+  uint32_t vps_num_layer_sets_minus1 = BitstreamReadUE(&reader);
+  if (vps_num_layer_sets_minus1 > 1023) UNSUPPORTED("vps_num_layer_sets");
+  for (uint32_t i = 1; i <= vps_num_layer_sets_minus1; i++) {
+    for (uint8_t j = 0; j <= vps_max_layer_id; j++)
+      BitstreamRead(&reader, 1);  // layer_id_included_flag
+  }
+
+  vps->vps_timing_info_present_flag = BitstreamRead(&reader, 1);
+  if (vps->vps_timing_info_present_flag) {
+    vps->vps_num_units_in_tick = BitstreamRead(&reader, 32);
+    vps->vps_time_scale = BitstreamRead(&reader, 32);
+    if (BitstreamRead(&reader, 1))  // vps_poc_proportional_to_timing_flag
+      BitstreamReadUE(&reader);     // vps_num_ticks_poc_diff_one_minus1
+    if (BitstreamReadUE(&reader)) UNSUPPORTED("vps_num_hrd_parameters");
+  }
+
+  if (BitstreamRead(&reader, 1)) UNSUPPORTED("vps_extension_flag");
+  return ReadRbspTrailingBits(&reader);
+}
+
+// E.2.1 VUI parameters syntax
+static bool ReadVuiParameters(struct BitstreamReader* reader,
+                              struct VuiParameters* vui) {
+  if (BitstreamRead(reader, 1)) {  // aspect_ratio_info_present_flag
+    if (BitstreamRead(reader, 8) == 255) {  // aspect_ratio_idc
+      BitstreamRead(reader, 16);            // sar_width
+      BitstreamRead(reader, 16);            // sar_height
+    }
+  }
+
+  if (BitstreamRead(reader, 1))  // overscan_info_present_flag
+    BitstreamRead(reader, 1);    // overscan_appropriate_flag
+
+  vui->video_signal_type_present_flag = BitstreamRead(reader, 1);
+  if (vui->video_signal_type_present_flag) {
+    vui->video_format = (uint8_t)BitstreamRead(reader, 3);
+    vui->video_full_range_flag = BitstreamRead(reader, 1);
+    vui->colour_description_present_flag = BitstreamRead(reader, 1);
+    if (vui->colour_description_present_flag) {
+      vui->colour_primaries = (uint8_t)BitstreamRead(reader, 8);
+      vui->transfer_characteristics = (uint8_t)BitstreamRead(reader, 8);
+      vui->matrix_coeffs = (uint8_t)BitstreamRead(reader, 8);
+    }
+  }
+
+  vui->chroma_loc_info_present_flag = BitstreamRead(reader, 1);
+  if (vui->chroma_loc_info_present_flag) {
+    vui->chroma_sample_loc_type_top_field = BitstreamReadUE(reader);
+    vui->chroma_sample_loc_type_bottom_field = BitstreamReadUE(reader);
+  }
+
+  BitstreamRead(reader, 1);  // neutral_chroma_indication_flag
+  vui->field_seq_flag = BitstreamRead(reader, 1);
+  BitstreamRead(reader, 1);  // frame_field_info_present_flag
+  if (BitstreamRead(reader, 1)) {  // default_display_window_flag
+    BitstreamReadUE(reader);       // def_disp_win_left_offset
+    BitstreamReadUE(reader);       // def_disp_win_right_offset
+    BitstreamReadUE(reader);       // def_disp_win_top_offset
+    BitstreamReadUE(reader);       // def_disp_win_bottom_offset
+  }
+
+  vui->vui_timing_info_present_flag = BitstreamRead(reader, 1);
+  if (vui->vui_timing_info_present_flag) {
+    vui->vui_num_units_in_tick = BitstreamRead(reader, 32);
+    vui->vui_time_scale = BitstreamRead(reader, 32);
+    if (BitstreamRead(reader, 1))  // vui_poc_proportional_to_timing_flag
+      BitstreamReadUE(reader);     // vui_num_ticks_poc_diff_one_minus1
+    if (BitstreamRead(reader, 1))
+      UNSUPPORTED("vui_hrd_parameters_present_flag");
+  }
+
+  vui->bitstream_restriction_flag = BitstreamRead(reader, 1);
+  if (vui->bitstream_restriction_flag) {
+    BitstreamRead(reader, 1);  // tiles_fixed_structure_flag
+    BitstreamRead(reader, 1);  // motion_vectors_over_pic_boundaries_flag
+    BitstreamRead(reader, 1);  // restricted_ref_pic_lists_flag
+    vui->min_spatial_segmentation_idc = BitstreamReadUE(reader);
+    vui->max_bytes_per_pic_denom = BitstreamReadUE(reader);
+    vui->max_bits_per_min_cu_denom = BitstreamReadUE(reader);
+    vui->log2_max_mv_length_horizontal = BitstreamReadUE(reader);
+    vui->log2_max_mv_length_vertical = BitstreamReadUE(reader);
+  }
+  return !reader->overflow;
+}
+
+// 7.3.2.2.1 General sequence parameter set RBSP syntax
+bool ParseSeqParameterSet(const struct NalUnit* nal_unit,
+                          struct SeqParameterSet* sps) {
+  if (nal_unit->nal_unit_type != SPS_NUT) {
+    LOG("Unexpected nal_unit_type %u", nal_unit->nal_unit_type);
+    return false;
+  }
+
+  struct BitstreamReader reader = RbspReader(nal_unit);
+  memset(sps, 0, sizeof(*sps));
+  sps->sps_video_parameter_set_id = (uint8_t)BitstreamRead(&reader, 4);
+  sps->sps_max_sub_layers_minus1 = (uint8_t)BitstreamRead(&reader, 3);
+  BitstreamRead(&reader, 1);  // sps_temporal_id_nesting_flag
+
+  if (!ReadProfileTierLevel(&reader, 1, sps->sps_max_sub_layers_minus1,
+                            &sps->profile_tier_level))
+    return false;
+
+  sps->sps_seq_parameter_set_id = BitstreamReadUE(&reader);
+  sps->chroma_format_idc = BitstreamReadUE(&reader);
+  if (sps->chroma_format_idc == 3)
+    sps->separate_colour_plane_flag = BitstreamRead(&reader, 1);
+  sps->pic_width_in_luma_samples = BitstreamReadUE(&reader);
+  sps->pic_height_in_luma_samples = BitstreamReadUE(&reader);
+
+  if (BitstreamRead(&reader, 1)) {  // conformance_window_flag
+    sps->conf_win_left_offset = BitstreamReadUE(&reader);
+    sps->conf_win_right_offset = BitstreamReadUE(&reader);
+    sps->conf_win_top_offset = BitstreamReadUE(&reader);
+    sps->conf_win_bottom_offset = BitstreamReadUE(&reader);
+  }
+
+  sps->bit_depth_luma_minus8 = BitstreamReadUE(&reader);
+  sps->bit_depth_chroma_minus8 = BitstreamReadUE(&reader);
+  sps->log2_max_pic_order_cnt_lsb_minus4 = BitstreamReadUE(&reader);
+  if (sps->log2_max_pic_order_cnt_lsb_minus4 > 12) {
+    LOG("Invalid log2_max_pic_order_cnt_lsb_minus4");
+    return false;
+  }
+
+  bool sps_sub_layer_ordering_info_present_flag = BitstreamRead(&reader, 1);
+  for (uint8_t i = (sps_sub_layer_ordering_info_present_flag
+                        ? 0
+                        : sps->sps_max_sub_layers_minus1);
+       i <= sps->sps_max_sub_layers_minus1; i++) {
+    // mburakov: Only the highest sub-layer values are kept.
+    sps->sps_max_dec_pic_buffering_minus1 = BitstreamReadUE(&reader);
+    sps->sps_max_num_reorder_pics = BitstreamReadUE(&reader);
+    sps->sps_max_latency_increase_plus1 = BitstreamReadUE(&reader);
+  }
+
+  sps->log2_min_luma_coding_block_size_minus3 = BitstreamReadUE(&reader);
+  sps->log2_diff_max_min_luma_coding_block_size = BitstreamReadUE(&reader);
+  sps->log2_min_luma_transform_block_size_minus2 = BitstreamReadUE(&reader);
+  sps->log2_diff_max_min_luma_transform_block_size = BitstreamReadUE(&reader);
+  sps->max_transform_hierarchy_depth_inter = BitstreamReadUE(&reader);
+  sps->max_transform_hierarchy_depth_intra = BitstreamReadUE(&reader);
+  if (sps->log2_min_luma_coding_block_size_minus3 +
+          sps->log2_diff_max_min_luma_coding_block_size >
+      3) {
+    LOG("Invalid coding block size");
+    return false;
+  }
+
+  if (BitstreamRead(&reader, 1)) {  // scaling_list_enabled_flag
+    if (BitstreamRead(&reader, 1))
+      UNSUPPORTED("sps_scaling_list_data_present_flag");
+  }
+
+  sps->amp_enabled_flag = BitstreamRead(&reader, 1);
+  sps->sample_adaptive_offset_enabled_flag = BitstreamRead(&reader, 1);
+  sps->pcm_enabled_flag = BitstreamRead(&reader, 1);
+  if (sps->pcm_enabled_flag) {
+    BitstreamRead(&reader, 4);  // pcm_sample_bit_depth_luma_minus1
+    BitstreamRead(&reader, 4);  // pcm_sample_bit_depth_chroma_minus1
+    BitstreamReadUE(&reader);   // log2_min_pcm_luma_coding_block_size_minus3
+    BitstreamReadUE(&reader);   // log2_diff_max_min_pcm_luma_coding_block_size
+    BitstreamRead(&reader, 1);  // pcm_loop_filter_disabled_flag
+  }
+
+  sps->num_short_term_ref_pic_sets = BitstreamReadUE(&reader);
+  if (sps->num_short_term_ref_pic_sets)
+    UNSUPPORTED("num_short_term_ref_pic_sets");
+  sps->long_term_ref_pics_present_flag = BitstreamRead(&reader, 1);
+  if (sps->long_term_ref_pics_present_flag) {
+    sps->num_long_term_ref_pics_sps = BitstreamReadUE(&reader);
+    if (sps->num_long_term_ref_pics_sps > 32) {
+      LOG("Invalid num_long_term_ref_pics_sps");
+      return false;
+    }
+    for (uint32_t i = 0; i < sps->num_long_term_ref_pics_sps; i++) {
+      BitstreamRead(&reader, sps->log2_max_pic_order_cnt_lsb_minus4 +
+                                 4);  // lt_ref_pic_poc_lsb_sps
+      BitstreamRead(&reader, 1);      // used_by_curr_pic_lt_sps_flag
+    }
+  }
+
+  sps->sps_temporal_mvp_enabled_flag = BitstreamRead(&reader, 1);
+  sps->strong_intra_smoothing_enabled_flag = BitstreamRead(&reader, 1);
+  sps->vui_parameters_present_flag = BitstreamRead(&reader, 1);
+  if (sps->vui_parameters_present_flag &&
+      !ReadVuiParameters(&reader, &sps->vui_parameters))
+    return false;
+
+  if (BitstreamRead(&reader, 1)) UNSUPPORTED("sps_extension_present_flag");
+  return ReadRbspTrailingBits(&reader);
+}
+
+// 7.3.2.3.1 General picture parameter set RBSP syntax
+bool ParsePicParameterSet(const struct NalUnit* nal_unit,
+                          struct PicParameterSet* pps) {
+  if (nal_unit->nal_unit_type != PPS_NUT) {
+    LOG("Unexpected nal_unit_type %u", nal_unit->nal_unit_type);
+    return false;
+  }
+
+  struct BitstreamReader reader = RbspReader(nal_unit);
+  memset(pps, 0, sizeof(*pps));
+  pps->pps_pic_parameter_set_id = BitstreamReadUE(&reader);
+  pps->pps_seq_parameter_set_id = BitstreamReadUE(&reader);
+  pps->dependent_slice_segments_enabled_flag = BitstreamRead(&reader, 1);
+  pps->output_flag_present_flag = BitstreamRead(&reader, 1);
+  pps->num_extra_slice_header_bits = (uint8_t)BitstreamRead(&reader, 3);
+  pps->sign_data_hiding_enabled_flag = BitstreamRead(&reader, 1);
+  pps->cabac_init_present_flag = BitstreamRead(&reader, 1);
+  pps->num_ref_idx_l0_default_active_minus1 = BitstreamReadUE(&reader);
+  pps->num_ref_idx_l1_default_active_minus1 = BitstreamReadUE(&reader);
+  pps->init_qp_minus26 = BitstreamReadSE(&reader);
+  pps->constrained_intra_pred_flag = BitstreamRead(&reader, 1);
+  pps->transform_skip_enabled_flag = BitstreamRead(&reader, 1);
+  pps->cu_qp_delta_enabled_flag = BitstreamRead(&reader, 1);
+  if (pps->cu_qp_delta_enabled_flag)
+    pps->diff_cu_qp_delta_depth = BitstreamReadUE(&reader);
+  pps->pps_cb_qp_offset = BitstreamReadSE(&reader);
+  pps->pps_cr_qp_offset = BitstreamReadSE(&reader);
+  pps->pps_slice_chroma_qp_offsets_present_flag = BitstreamRead(&reader, 1);
+  pps->weighted_pred_flag = BitstreamRead(&reader, 1);
+  pps->weighted_bipred_flag = BitstreamRead(&reader, 1);
+  pps->transquant_bypass_enabled_flag = BitstreamRead(&reader, 1);
+  pps->tiles_enabled_flag = BitstreamRead(&reader, 1);
+  pps->entropy_coding_sync_enabled_flag = BitstreamRead(&reader, 1);
+  if (pps->tiles_enabled_flag) UNSUPPORTED("tiles_enabled_flag");
+
+  pps->pps_loop_filter_across_slices_enabled_flag = BitstreamRead(&reader, 1);
+  pps->deblocking_filter_control_present_flag = BitstreamRead(&reader, 1);
+  if (pps->deblocking_filter_control_present_flag) {
+    pps->deblocking_filter_override_enabled_flag = BitstreamRead(&reader, 1);
+    pps->pps_deblocking_filter_disabled_flag = BitstreamRead(&reader, 1);
+    if (!pps->pps_deblocking_filter_disabled_flag) {
+      pps->pps_beta_offset_div2 = BitstreamReadSE(&reader);
+      pps->pps_tc_offset_div2 = BitstreamReadSE(&reader);
+    }
+  }
+
+  if (BitstreamRead(&reader, 1))
+    UNSUPPORTED("pps_scaling_list_data_present_flag");
+  pps->lists_modification_present_flag = BitstreamRead(&reader, 1);
+  pps->log2_parallel_merge_level_minus2 = BitstreamReadUE(&reader);
+  pps->slice_segment_header_extension_present_flag =
+      BitstreamRead(&reader, 1);
+  if (BitstreamRead(&reader, 1)) UNSUPPORTED("pps_extension_present_flag");
+  return ReadRbspTrailingBits(&reader);
+}
+
+// 7.3.7 Short-term reference picture set syntax
+static bool ReadStRefPicSet(struct BitstreamReader* reader, uint32_t stRpsIdx,
+                            struct SliceSegmentHeader* ssh) {
+  if (stRpsIdx != 0 && BitstreamRead(reader, 1))
+    UNSUPPORTED("inter_ref_pic_set_prediction_flag");
+  ssh->num_negative_pics = BitstreamReadUE(reader);
+  ssh->num_positive_pics = BitstreamReadUE(reader);
+  if (ssh->num_negative_pics > LENGTH(ssh->negative_pics) ||
+      ssh->num_positive_pics > LENGTH(ssh->positive_pics)) {
+    LOG("Invalid number of reference pictures");
+    return false;
+  }
+  for (uint32_t i = 0; i < ssh->num_negative_pics; i++) {
+    ssh->negative_pics[i].delta_poc_s0_minus1 = BitstreamReadUE(reader);
+    ssh->negative_pics[i].used_by_curr_pic_s0_flag = BitstreamRead(reader, 1);
+  }
+  for (uint32_t i = 0; i < ssh->num_positive_pics; i++) {
+    ssh->positive_pics[i].delta_poc_s1_minus1 = BitstreamReadUE(reader);
+    ssh->positive_pics[i].used_by_curr_pic_s1_flag = BitstreamRead(reader, 1);
+  }
+  return !reader->overflow;
+}
+
+static bool ReadLongTermPics(struct BitstreamReader* reader,
+                             const struct SeqParameterSet* sps,
+                             struct SliceSegmentHeader* ssh) {
+  if (sps->num_long_term_ref_pics_sps > 0)
+    ssh->num_long_term_sps = BitstreamReadUE(reader);
+  ssh->num_long_term_pics = BitstreamReadUE(reader);
+  if (ssh->num_long_term_sps > LENGTH(ssh->lt_idx_sps) ||
+      ssh->num_long_term_pics > LENGTH(ssh->long_term_pics)) {
+    LOG("Invalid number of long-term pictures");
+    return false;
+  }
+  // mburakov: Entries taken from the sequence parameter set always precede
+  // the ones signalled explicitly, so these are read in two passes.
+  for (uint32_t i = 0; i < ssh->num_long_term_sps; i++) {
+    if (sps->num_long_term_ref_pics_sps > 1) {
+      ssh->lt_idx_sps[i] =
+          BitstreamRead(reader, CeilLog2(sps->num_long_term_ref_pics_sps));
+    }
+    if (BitstreamRead(reader, 1))  // delta_poc_msb_present_flag
+      BitstreamReadUE(reader);     // delta_poc_msb_cycle_lt
+  }
+  for (uint32_t i = 0; i < ssh->num_long_term_pics; i++) {
+    struct LongTermPics* long_term_pic = &ssh->long_term_pics[i];
+    long_term_pic->poc_lsb_lt =
+        BitstreamRead(reader, sps->log2_max_pic_order_cnt_lsb_minus4 + 4);
+    long_term_pic->used_by_curr_pic_lt_flag = BitstreamRead(reader, 1);
+    long_term_pic->delta_poc_msb_present_flag = BitstreamRead(reader, 1);
+    if (long_term_pic->delta_poc_msb_present_flag)
+      long_term_pic->delta_poc_msb_cycle_lt = BitstreamReadUE(reader);
+  }
+  return !reader->overflow;
+}
+
+// 7.3.6.1 General slice segment header syntax
+bool ParseSliceSegmentHeader(const struct NalUnit* nal_unit,
+                             const struct SeqParameterSet* sps,
+                             const struct PicParameterSet* pps,
+                             struct SliceSegmentHeader* ssh) {
+  uint8_t nal_unit_type = nal_unit->nal_unit_type;
+  if (nal_unit_type > RSV_IRAP_VCL23) {
+    LOG("Unexpected nal_unit_type %u", nal_unit_type);
+    return false;
+  }
+
+  struct BitstreamReader reader = RbspReader(nal_unit);
+  memset(ssh, 0, sizeof(*ssh));
+  ssh->first_slice_segment_in_pic_flag = BitstreamRead(&reader, 1);
+  if (nal_unit_type >= BLA_W_LP && nal_unit_type <= RSV_IRAP_VCL23)
+    ssh->no_output_of_prior_pics_flag = BitstreamRead(&reader, 1);
+  ssh->slice_pic_parameter_set_id = BitstreamReadUE(&reader);
+  if (!ssh->first_slice_segment_in_pic_flag) {
+    if (pps->dependent_slice_segments_enabled_flag)
+      ssh->dependent_slice_segment_flag = BitstreamRead(&reader, 1);
+    uint32_t CtbLog2SizeY = sps->log2_min_luma_coding_block_size_minus3 + 3 +
+                            sps->log2_diff_max_min_luma_coding_block_size;
+    uint32_t CtbSizeY = 1u << CtbLog2SizeY;
+    uint32_t PicWidthInCtbsY =
+        (sps->pic_width_in_luma_samples + CtbSizeY - 1) / CtbSizeY;
+    uint32_t PicHeightInCtbsY =
+        (sps->pic_height_in_luma_samples + CtbSizeY - 1) / CtbSizeY;
+    ssh->slice_segment_address = BitstreamRead(
+        &reader, CeilLog2(PicWidthInCtbsY * PicHeightInCtbsY));
+  }
+
+  // mburakov: Inferred values, unless overridden below.
+  ssh->pic_output_flag = 1;
+  ssh->num_ref_idx_l0_active_minus1 = pps->num_ref_idx_l0_default_active_minus1;
+  ssh->num_ref_idx_l1_active_minus1 = pps->num_ref_idx_l1_default_active_minus1;
+  ssh->collocated_from_l0_flag = 1;
+  ssh->slice_deblocking_filter_disabled_flag =
+      pps->pps_deblocking_filter_disabled_flag;
+  ssh->slice_beta_offset_div2 = pps->pps_beta_offset_div2;
+  ssh->slice_tc_offset_div2 = pps->pps_tc_offset_div2;
+  ssh->slice_loop_filter_across_slices_enabled_flag =
+      pps->pps_loop_filter_across_slices_enabled_flag;
+
+  if (!ssh->dependent_slice_segment_flag) {
+    for (uint32_t i = 0; i < pps->num_extra_slice_header_bits; i++)
+      BitstreamRead(&reader, 1);  // slice_reserved_flag
+    ssh->slice_type = BitstreamReadUE(&reader);
+    if (ssh->slice_type > I) {
+      LOG("Invalid slice_type %u", ssh->slice_type);
+      return false;
+    }
+    if (pps->output_flag_present_flag)
+      ssh->pic_output_flag = BitstreamRead(&reader, 1);
+    if (sps->separate_colour_plane_flag)
+      BitstreamRead(&reader, 2);  // colour_plane_id
+    if (nal_unit_type != IDR_W_RADL && nal_unit_type != IDR_N_LP) {
+      ssh->slice_pic_order_cnt_lsb = BitstreamRead(
+          &reader, sps->log2_max_pic_order_cnt_lsb_minus4 + 4);
+      ssh->short_term_ref_pic_set_sps_flag = BitstreamRead(&reader, 1);
+      if (!ssh->short_term_ref_pic_set_sps_flag) {
+        if (!ReadStRefPicSet(&reader, sps->num_short_term_ref_pic_sets, ssh))
+          return false;
+      } else if (sps->num_short_term_ref_pic_sets > 1) {
+        ssh->short_term_ref_pic_set_idx = BitstreamRead(
+            &reader, CeilLog2(sps->num_short_term_ref_pic_sets));
+      }
+      if (sps->long_term_ref_pics_present_flag &&
+          !ReadLongTermPics(&reader, sps, ssh))
+        return false;
+      if (sps->sps_temporal_mvp_enabled_flag)
+        ssh->slice_temporal_mvp_enabled_flag = BitstreamRead(&reader, 1);
+    }
+    if (sps->sample_adaptive_offset_enabled_flag) {
+      ssh->slice_sao_luma_flag = BitstreamRead(&reader, 1);
+      uint32_t ChromaArrayType =
+          !sps->separate_colour_plane_flag ? sps->chroma_format_idc : 0;
+      if (ChromaArrayType != 0)
+        ssh->slice_sao_chroma_flag = BitstreamRead(&reader, 1);
+    }
+    if (ssh->slice_type == P || ssh->slice_type == B) {
+      ssh->num_ref_idx_active_override_flag = BitstreamRead(&reader, 1);
+      if (ssh->num_ref_idx_active_override_flag) {
+        ssh->num_ref_idx_l0_active_minus1 = BitstreamReadUE(&reader);
+        if (ssh->slice_type == B)
+          ssh->num_ref_idx_l1_active_minus1 = BitstreamReadUE(&reader);
+      }
+      if (pps->lists_modification_present_flag)
+        UNSUPPORTED("lists_modification_present_flag");
+      if (ssh->slice_type == B)
+        ssh->mvd_l1_zero_flag = BitstreamRead(&reader, 1);
+      if (pps->cabac_init_present_flag)
+        ssh->cabac_init_flag = BitstreamRead(&reader, 1);
+      if (ssh->slice_temporal_mvp_enabled_flag) {
+        if (ssh->slice_type == B)
+          ssh->collocated_from_l0_flag = BitstreamRead(&reader, 1);
+        if ((ssh->collocated_from_l0_flag &&
+             ssh->num_ref_idx_l0_active_minus1 > 0) ||
+            (!ssh->collocated_from_l0_flag &&
+             ssh->num_ref_idx_l1_active_minus1 > 0))
+          ssh->collocated_ref_idx = BitstreamReadUE(&reader);
+      }
+      if ((pps->weighted_pred_flag && ssh->slice_type == P) ||
+          (pps->weighted_bipred_flag && ssh->slice_type == B))
+        UNSUPPORTED("pred_weight_table");
+      ssh->five_minus_max_num_merge_cand = BitstreamReadUE(&reader);
+    }
+    ssh->slice_qp_delta = BitstreamReadSE(&reader);
+    if (pps->pps_slice_chroma_qp_offsets_present_flag) {
+      ssh->slice_cb_qp_offset = BitstreamReadSE(&reader);
+      ssh->slice_cr_qp_offset = BitstreamReadSE(&reader);
+    }
+    if (pps->deblocking_filter_override_enabled_flag)
+      ssh->deblocking_filter_override_flag = BitstreamRead(&reader, 1);
+    if (ssh->deblocking_filter_override_flag) {
+      ssh->slice_deblocking_filter_disabled_flag = BitstreamRead(&reader, 1);
+      if (!ssh->slice_deblocking_filter_disabled_flag) {
+        ssh->slice_beta_offset_div2 = BitstreamReadSE(&reader);
+        ssh->slice_tc_offset_div2 = BitstreamReadSE(&reader);
+      }
+    }
+    if (pps->pps_loop_filter_across_slices_enabled_flag &&
+        (ssh->slice_sao_luma_flag || ssh->slice_sao_chroma_flag ||
+         !ssh->slice_deblocking_filter_disabled_flag)) {
+      ssh->slice_loop_filter_across_slices_enabled_flag =
+          BitstreamRead(&reader, 1);
+    }
+  }
+  if (pps->tiles_enabled_flag || pps->entropy_coding_sync_enabled_flag) {
+    ssh->num_entry_point_offsets = BitstreamReadUE(&reader);
+    if (ssh->num_entry_point_offsets > 0) {
+      uint32_t offset_len_minus1 = BitstreamReadUE(&reader);
+      if (offset_len_minus1 > 31) {
+        LOG("Invalid offset_len_minus1");
+        return false;
+      }
+      for (uint32_t i = 0; i < ssh->num_entry_point_offsets; i++)
+        BitstreamRead(&reader, offset_len_minus1 + 1);  // entry_point_offset
+    }
+  }
+  if (pps->slice_segment_header_extension_present_flag) {
+    uint32_t slice_segment_header_extension_length = BitstreamReadUE(&reader);
+    for (uint32_t i = 0; i < slice_segment_header_extension_length; i++)
+      BitstreamRead(&reader, 8);  // slice_segment_header_extension_data_byte
+  }
+
+  // 7.3.2.12 Byte alignment syntax
+  return ReadRbspTrailingBits(&reader);
+}
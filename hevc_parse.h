@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_HEVC_PARSE_H_
+#define STREAMER_HEVC_PARSE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hevc.h"
+
+// mburakov: Parsed syntax only covers what the writers in hevc.c are able to
+// produce. Everything else is rejected, so that an unexpected branch taken by
+// a writer is detected instead of being silently skipped.
+
+struct NalUnit {
+  uint8_t nal_unit_type;
+  uint8_t nuh_layer_id;
+  uint8_t nuh_temporal_id_plus1;
+  uint8_t rbsp[256];
+  size_t rbsp_size;
+};
+
+struct ProfileTierLevel {
+  uint8_t general_profile_space;
+  bool general_tier_flag;
+  uint8_t general_profile_idc;
+  uint32_t general_profile_compatibility_flags;
+  bool general_progressive_source_flag;
+  bool general_interlaced_source_flag;
+  bool general_non_packed_constraint_flag;
+  bool general_frame_only_constraint_flag;
+  uint8_t general_level_idc;
+};
+
+struct VideoParameterSet {
+  uint8_t vps_video_parameter_set_id;
+  uint8_t vps_max_sub_layers_minus1;
+  bool vps_temporal_id_nesting_flag;
+  struct ProfileTierLevel profile_tier_level;
+  uint32_t vps_max_dec_pic_buffering_minus1;
+  uint32_t vps_max_num_reorder_pics;
+  uint32_t vps_max_latency_increase_plus1;
+  bool vps_timing_info_present_flag;
+  uint32_t vps_num_units_in_tick;
+  uint32_t vps_time_scale;
+};
+
+struct VuiParameters {
+  bool video_signal_type_present_flag;
+  uint8_t video_format;
+  bool video_full_range_flag;
+  bool colour_description_present_flag;
+  uint8_t colour_primaries;
+  uint8_t transfer_characteristics;
+  uint8_t matrix_coeffs;
+  bool chroma_loc_info_present_flag;
+  uint32_t chroma_sample_loc_type_top_field;
+  uint32_t chroma_sample_loc_type_bottom_field;
+  bool field_seq_flag;
+  bool vui_timing_info_present_flag;
+  uint32_t vui_num_units_in_tick;
+  uint32_t vui_time_scale;
+  bool bitstream_restriction_flag;
+  uint32_t min_spatial_segmentation_idc;
+  uint32_t max_bytes_per_pic_denom;
+  uint32_t max_bits_per_min_cu_denom;
+  uint32_t log2_max_mv_length_horizontal;
+  uint32_t log2_max_mv_length_vertical;
+};
+
+struct SeqParameterSet {
+  uint8_t sps_video_parameter_set_id;
+  uint8_t sps_max_sub_layers_minus1;
+  struct ProfileTierLevel profile_tier_level;
+  uint32_t sps_seq_parameter_set_id;
+  uint32_t chroma_format_idc;
+  bool separate_colour_plane_flag;
+  uint32_t pic_width_in_luma_samples;
+  uint32_t pic_height_in_luma_samples;
+  uint32_t conf_win_left_offset;
+  uint32_t conf_win_right_offset;
+  uint32_t conf_win_top_offset;
+  uint32_t conf_win_bottom_offset;
+  uint32_t bit_depth_luma_minus8;
+  uint32_t bit_depth_chroma_minus8;
+  uint32_t log2_max_pic_order_cnt_lsb_minus4;
+  uint32_t sps_max_dec_pic_buffering_minus1;
+  uint32_t sps_max_num_reorder_pics;
+  uint32_t sps_max_latency_increase_plus1;
+  uint32_t log2_min_luma_coding_block_size_minus3;
+  uint32_t log2_diff_max_min_luma_coding_block_size;
+  uint32_t log2_min_luma_transform_block_size_minus2;
+  uint32_t log2_diff_max_min_luma_transform_block_size;
+  uint32_t max_transform_hierarchy_depth_inter;
+  uint32_t max_transform_hierarchy_depth_intra;
+  bool amp_enabled_flag;
+  bool sample_adaptive_offset_enabled_flag;
+  bool pcm_enabled_flag;
+  uint32_t num_short_term_ref_pic_sets;
+  bool long_term_ref_pics_present_flag;
+  uint32_t num_long_term_ref_pics_sps;
+  bool sps_temporal_mvp_enabled_flag;
+  bool strong_intra_smoothing_enabled_flag;
+  bool vui_parameters_present_flag;
+  struct VuiParameters vui_parameters;
+};
+
+struct PicParameterSet {
+  uint32_t pps_pic_parameter_set_id;
+  uint32_t pps_seq_parameter_set_id;
+  bool dependent_slice_segments_enabled_flag;
+  bool output_flag_present_flag;
+  uint8_t num_extra_slice_header_bits;
+  bool sign_data_hiding_enabled_flag;
+  bool cabac_init_present_flag;
+  uint32_t num_ref_idx_l0_default_active_minus1;
+  uint32_t num_ref_idx_l1_default_active_minus1;
+  int32_t init_qp_minus26;
+  bool constrained_intra_pred_flag;
+  bool transform_skip_enabled_flag;
+  bool cu_qp_delta_enabled_flag;
+  uint32_t diff_cu_qp_delta_depth;
+  int32_t pps_cb_qp_offset;
+  int32_t pps_cr_qp_offset;
+  bool pps_slice_chroma_qp_offsets_present_flag;
+  bool weighted_pred_flag;
+  bool weighted_bipred_flag;
+  bool transquant_bypass_enabled_flag;
+  bool tiles_enabled_flag;
+  bool entropy_coding_sync_enabled_flag;
+  bool pps_loop_filter_across_slices_enabled_flag;
+  bool deblocking_filter_control_present_flag;
+  bool deblocking_filter_override_enabled_flag;
+  bool pps_deblocking_filter_disabled_flag;
+  int32_t pps_beta_offset_div2;
+  int32_t pps_tc_offset_div2;
+  bool lists_modification_present_flag;
+  uint32_t log2_parallel_merge_level_minus2;
+  bool slice_segment_header_extension_present_flag;
+};
+
+struct SliceSegmentHeader {
+  bool first_slice_segment_in_pic_flag;
+  bool no_output_of_prior_pics_flag;
+  uint32_t slice_pic_parameter_set_id;
+  bool dependent_slice_segment_flag;
+  uint32_t slice_segment_address;
+  uint32_t slice_type;
+  bool pic_output_flag;
+  uint32_t slice_pic_order_cnt_lsb;
+  bool short_term_ref_pic_set_sps_flag;
+  uint32_t short_term_ref_pic_set_idx;
+  uint32_t num_negative_pics;
+  uint32_t num_positive_pics;
+  struct NegativePics negative_pics[16];
+  struct PositivePics positive_pics[16];
+  uint32_t num_long_term_sps;
+  uint32_t num_long_term_pics;
+  uint32_t lt_idx_sps[16];
+  struct LongTermPics long_term_pics[16];
+  bool slice_temporal_mvp_enabled_flag;
+  bool slice_sao_luma_flag;
+  bool slice_sao_chroma_flag;
+  bool num_ref_idx_active_override_flag;
+  uint32_t num_ref_idx_l0_active_minus1;
+  uint32_t num_ref_idx_l1_active_minus1;
+  bool mvd_l1_zero_flag;
+  bool cabac_init_flag;
+  bool collocated_from_l0_flag;
+  uint32_t collocated_ref_idx;
+  uint32_t five_minus_max_num_merge_cand;
+  int32_t slice_qp_delta;
+  int32_t slice_cb_qp_offset;
+  int32_t slice_cr_qp_offset;
+  bool deblocking_filter_override_flag;
+  bool slice_deblocking_filter_disabled_flag;
+  int32_t slice_beta_offset_div2;
+  int32_t slice_tc_offset_div2;
+  bool slice_loop_filter_across_slices_enabled_flag;
+  uint32_t num_entry_point_offsets;
+};
+
+bool ParseNalUnit(const void** data, size_t* size, struct NalUnit* nal_unit);
+bool ParseVideoParameterSet(const struct NalUnit* nal_unit,
+                            struct VideoParameterSet* vps);
+bool ParseSeqParameterSet(const struct NalUnit* nal_unit,
+                          struct SeqParameterSet* sps);
+bool ParsePicParameterSet(const struct NalUnit* nal_unit,
+                          struct PicParameterSet* pps);
+bool ParseSliceSegmentHeader(const struct NalUnit* nal_unit,
+                             const struct SeqParameterSet* sps,
+                             const struct PicParameterSet* pps,
+                             struct SliceSegmentHeader* ssh);
+
+#endif  // STREAMER_HEVC_PARSE_H_
@@ -32,17 +32,23 @@
 #include "toolbox/utils.h"
 
 struct InputHandler {
+  const struct InputHandlerCallbacks* callbacks;
+  void* user;
   struct Buffer buffer;
   int uhid_fd;
 };
 
-struct InputHandler* InputHandlerCreate(bool disable_uhid) {
+struct InputHandler* InputHandlerCreate(
+    bool disable_uhid, const struct InputHandlerCallbacks* callbacks,
+    void* user) {
   struct InputHandler* input_handler = malloc(sizeof(struct InputHandler));
   if (!input_handler) {
     LOG("Failed to allocate input handler (%s)", strerror(errno));
     return NULL;
   }
   *input_handler = (struct InputHandler){
+      .callbacks = callbacks,
+      .user = user,
       .uhid_fd = -1,
   };
 
@@ -74,7 +80,8 @@ bool InputHandlerProcessEvents(struct InputHandler* input_handler) {
   return true;
 }
 
-bool InputHandlerHandle(struct InputHandler* input_handler, int fd) {
+bool InputHandlerHandle(struct InputHandler* input_handler, int fd,
+                        struct ProtoQueue* proto_queue) {
   switch (BufferAppendFrom(&input_handler->buffer, fd)) {
     case -1:
       LOG("Failed to append input data to buffer (%s)", strerror(errno));
@@ -104,14 +111,21 @@ bool InputHandlerHandle(struct InputHandler* input_handler, int fd) {
           .size = sizeof(uint64_t),
           .type = PROTO_TYPE_MISC,
       };
-      if (!WriteProto(fd, &proto, &event->u)) {
-        LOG("Failed to write pong message (%s)", strerror(errno));
+      if (!ProtoQueueWrite(proto_queue, &proto, &event->u)) {
+        LOG("Failed to write pong message");
         return false;
       }
       BufferDiscard(&input_handler->buffer, size);
       continue;
     }
 
+    if (event->type == ~1u) {
+      // mburakov: Special case, an idr request, i.e. after a decoder error.
+      input_handler->callbacks->OnIdrRequested(input_handler->user);
+      BufferDiscard(&input_handler->buffer, sizeof(event->type));
+      continue;
+    }
+
     size_t size;
     switch (event->type) {
       case UHID_CREATE2:
@@ -21,11 +21,19 @@
 #include <stdbool.h>
 
 struct InputHandler;
+struct ProtoQueue;
 
-struct InputHandler* InputHandlerCreate(bool disable_uhid);
+struct InputHandlerCallbacks {
+  void (*OnIdrRequested)(void* user);
+};
+
+struct InputHandler* InputHandlerCreate(
+    bool disable_uhid, const struct InputHandlerCallbacks* callbacks,
+    void* user);
 int InputHandlerGetEventsFd(struct InputHandler* input_handler);
 bool InputHandlerProcessEvents(struct InputHandler* input_handler);
-bool InputHandlerHandle(struct InputHandler* input_handler, int fd);
+bool InputHandlerHandle(struct InputHandler* input_handler, int fd,
+                        struct ProtoQueue* proto_queue);
 void InputHandlerDestroy(struct InputHandler* input_handler);
 
 #endif  // STREAMER_INPUT_H_
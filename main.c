@@ -16,6 +16,7 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <signal.h>
@@ -27,6 +28,8 @@
 #include <unistd.h>
 
 #include "audio.h"
+#include "bench.h"
+#include "bitrate.h"
 #include "capture.h"
 #include "colorspace.h"
 #include "encode.h"
@@ -36,6 +39,7 @@
 #include "toolbox/io_muxer.h"
 #include "toolbox/perf.h"
 #include "toolbox/utils.h"
+#include "trace.h"
 
 // TODO(mburakov): Currently zwp_linux_dmabuf_v1 has no way to provide
 // colorspace and range information to the compositor. Maybe this would change
@@ -47,8 +51,18 @@ static const enum YuvRange range = kNarrowRange;
 static volatile sig_atomic_t g_signal;
 static void OnSignal(int status) { g_signal = status; }
 
+static volatile sig_atomic_t g_dump_trace;
+static void OnDumpTrace(int status) {
+  (void)status;
+  g_dump_trace = 1;
+}
+
 struct Contexts {
   bool disable_uhid;
+  struct EncodeConfig encode_config;
+  bool adaptive_bitrate;
+  struct CaptureConfig capture_config;
+  struct Bench* bench;
   const char* audio_config;
   struct AudioContext* audio_context;
   struct GpuContext* gpu_context;
@@ -56,6 +70,9 @@ struct Contexts {
   int server_fd;
 
   int client_fd;
+  struct ProtoQueue* proto_queue;
+  bool client_flushing;
+  struct BitrateController* bitrate_controller;
   struct InputHandler* input_handler;
   struct CaptureContext* capture_context;
   struct EncodeContext* encode_context;
@@ -96,8 +113,100 @@ rollback_sock:
   return -1;
 }
 
+// mburakov: Upper bound of data buffered for a client that does not keep up
+// with the stream. Going over it drops audio frames, and drops the client on
+// anything else.
+static const size_t kMaxProtoQueueSize = 16 << 20;
+
+static bool ParseBitrateConfig(const char* arg,
+                               struct RateControl* rate_control) {
+  static const struct {
+    const char* name;
+    enum RateControlMode mode;
+  } kModes[] = {
+      {"cbr", kRateControlCbr},
+      {"vbr", kRateControlVbr},
+  };
+  const char* bitrate = strchr(arg, ':');
+  if (!bitrate) {
+    LOG("Invalid bitrate config requested");
+    return false;
+  }
+
+  size_t mode = 0;
+  size_t length = (size_t)(bitrate - arg);
+  for (; mode < LENGTH(kModes); mode++) {
+    if (strlen(kModes[mode].name) == length &&
+        !strncmp(kModes[mode].name, arg, length))
+      break;
+  }
+  if (mode == LENGTH(kModes)) {
+    LOG("Invalid rate control mode requested");
+    return false;
+  }
+
+  // mburakov: Default vbv size of one second mirrors what ffmpeg does.
+  char* end;
+  unsigned long value = strtoul(bitrate + 1, &end, 10);
+  unsigned long vbv_size = value;
+  if (*end == ':') vbv_size = strtoul(end + 1, &end, 10);
+  if (*end || !value || value > UINT32_MAX || !vbv_size ||
+      vbv_size > UINT32_MAX) {
+    LOG("Invalid bitrate value requested");
+    return false;
+  }
+
+  *rate_control = (struct RateControl){
+      .mode = kModes[mode].mode,
+      .bitrate = (uint32_t)value,
+      .vbv_size = (uint32_t)vbv_size,
+  };
+  return true;
+}
+
+static bool ParseIntraRefreshConfig(const char* arg,
+                                    struct EncodeConfig* encode_config) {
+  static const struct {
+    const char* name;
+    enum IntraRefreshMode mode;
+  } kModes[] = {
+      {"column", kIntraRefreshColumn},
+      {"row", kIntraRefreshRow},
+  };
+  const char* period = strchr(arg, ':');
+  if (!period) {
+    LOG("Invalid intra refresh config requested");
+    return false;
+  }
+
+  size_t mode = 0;
+  size_t length = (size_t)(period - arg);
+  for (; mode < LENGTH(kModes); mode++) {
+    if (strlen(kModes[mode].name) == length &&
+        !strncmp(kModes[mode].name, arg, length))
+      break;
+  }
+  if (mode == LENGTH(kModes)) {
+    LOG("Invalid intra refresh mode requested");
+    return false;
+  }
+
+  char* end;
+  unsigned long value = strtoul(period + 1, &end, 10);
+  if (*end || !value || value > UINT16_MAX) {
+    LOG("Invalid intra refresh period requested");
+    return false;
+  }
+
+  encode_config->intra_refresh = kModes[mode].mode;
+  encode_config->intra_refresh_period = (uint32_t)value;
+  return true;
+}
+
 static void MaybeDropClient(struct Contexts* contexts) {
   if (contexts->encode_context) {
+    IoMuxerForget(&contexts->io_muxer,
+                  EncodeContextGetEventsFd(contexts->encode_context));
     EncodeContextDestroy(contexts->encode_context);
     contexts->encode_context = NULL;
   }
@@ -113,17 +222,56 @@ static void MaybeDropClient(struct Contexts* contexts) {
     InputHandlerDestroy(contexts->input_handler);
     contexts->input_handler = NULL;
   }
+  if (contexts->bitrate_controller) {
+    BitrateControllerDestroy(contexts->bitrate_controller);
+    contexts->bitrate_controller = NULL;
+  }
+  if (contexts->proto_queue) {
+    ProtoQueueDestroy(contexts->proto_queue);
+    contexts->proto_queue = NULL;
+  }
   if (contexts->client_fd != -1) {
     IoMuxerForget(&contexts->io_muxer, contexts->client_fd);
+    contexts->client_flushing = false;
     close(contexts->client_fd);
     contexts->client_fd = -1;
   }
 }
 
+static void OnClientFlushing(void* user);
+
+static bool MaybeScheduleFlushing(struct Contexts* contexts) {
+  if (contexts->client_flushing ||
+      !ProtoQueueGetDepth(contexts->proto_queue)) {
+    return true;
+  }
+  if (!IoMuxerOnWrite(&contexts->io_muxer, contexts->client_fd,
+                      &OnClientFlushing, contexts)) {
+    LOG("Failed to schedule client flushing (%s)", strerror(errno));
+    return false;
+  }
+  contexts->client_flushing = true;
+  return true;
+}
+
+static void OnClientFlushing(void* user) {
+  struct Contexts* contexts = user;
+  contexts->client_flushing = false;
+  if (!ProtoQueueFlush(contexts->proto_queue)) {
+    LOG("Failed to flush client queue");
+    goto drop_client;
+  }
+  if (!MaybeScheduleFlushing(contexts)) goto drop_client;
+  return;
+
+drop_client:
+  MaybeDropClient(contexts);
+}
+
 static void OnAudioContextAudioReady(void* user, const void* buffer,
                                      size_t size, size_t latency) {
   struct Contexts* contexts = user;
-  if (contexts->client_fd == -1) return;
+  if (!contexts->proto_queue) return;
 
   struct Proto proto = {
       .size = (uint32_t)size,
@@ -131,43 +279,120 @@ static void OnAudioContextAudioReady(void* user, const void* buffer,
       .flags = 0,
       .latency = (uint16_t)MIN(latency, UINT16_MAX),
   };
-  if (!WriteProto(contexts->client_fd, &proto, buffer)) {
+  if (!ProtoQueueWrite(contexts->proto_queue, &proto, buffer)) {
     LOG("Failed to write audio frame");
-    MaybeDropClient(contexts);
+    goto drop_client;
+  }
+  if (!MaybeScheduleFlushing(contexts)) goto drop_client;
+  return;
+
+drop_client:
+  MaybeDropClient(contexts);
+}
+
+static void OnEncodeContextEvents(void* user) {
+  struct Contexts* contexts = user;
+  if (!IoMuxerOnRead(&contexts->io_muxer,
+                     EncodeContextGetEventsFd(contexts->encode_context),
+                     &OnEncodeContextEvents, user)) {
+    LOG("Failed to reschedule encode events reading (%s)", strerror(errno));
+    goto drop_client;
   }
+  if (!EncodeContextProcessEvents(contexts->encode_context,
+                                  contexts->proto_queue)) {
+    LOG("Failed to process encode events");
+    goto drop_client;
+  }
+  if (contexts->bench && !BenchFrameEncoded(contexts->bench)) {
+    LOG("Failed to track encoded frame");
+    goto drop_client;
+  }
+  if (!MaybeScheduleFlushing(contexts)) goto drop_client;
+  return;
+
+drop_client:
+  MaybeDropClient(contexts);
 }
 
 static void OnCaptureContextFrameReady(void* user,
                                        const struct GpuFrame* captured_frame) {
   struct Contexts* contexts = user;
   unsigned long long timestamp = MicrosNow();
+  TraceMark("capture_ready");
+  if (contexts->bench) BenchFrameCaptured(contexts->bench);
+  if (contexts->bitrate_controller && contexts->encode_context) {
+    uint32_t bitrate;
+    if (!BitrateControllerUpdate(contexts->bitrate_controller,
+                                 ProtoQueueGetSize(contexts->proto_queue),
+                                 &bitrate)) {
+      LOG("Failed to update bitrate controller");
+      goto drop_client;
+    }
+    EncodeContextSetBitrate(contexts->encode_context, bitrate);
+  }
+  if (ProtoQueueGetDepth(contexts->proto_queue)) {
+    // mburakov: Client socket is saturated, and encoding more frames would only
+    // pile up latency. Skip this frame, the reference chain stays intact.
+    return;
+  }
 
   if (!contexts->encode_context) {
-    contexts->encode_context =
-        EncodeContextCreate(contexts->gpu_context, captured_frame->width,
-                            captured_frame->height, colorspace, range);
+    contexts->encode_context = EncodeContextCreate(
+        contexts->gpu_context, captured_frame->width, captured_frame->height,
+        colorspace, range, &contexts->encode_config);
     if (!contexts->encode_context) {
       LOG("Failed to create encode context");
       goto drop_client;
     }
+    if (!IoMuxerOnRead(&contexts->io_muxer,
+                       EncodeContextGetEventsFd(contexts->encode_context),
+                       &OnEncodeContextEvents, user)) {
+      LOG("Failed to schedule encode events reading (%s)", strerror(errno));
+      goto drop_client;
+    }
+
+    // mburakov: Codec is only known after the encode context is created, so
+    // it is advertised right before the first encoded frame.
+    static const char* const kCodecNames[] = {
+        [kEncodeCodecHevc] = "hevc",
+        [kEncodeCodecH264] = "h264",
+        [kEncodeCodecAv1] = "av1",
+    };
+    const char* codec_name =
+        kCodecNames[EncodeContextGetCodec(contexts->encode_context)];
+    struct Proto proto = {
+        .size = (uint32_t)strlen(codec_name) + 1,
+        .type = PROTO_TYPE_VIDEO,
+        .flags = PROTO_FLAG_CONFIG,
+        .latency = 0,
+    };
+    if (!ProtoQueueWrite(contexts->proto_queue, &proto, codec_name)) {
+      LOG("Failed to write video configuration");
+      goto drop_client;
+    }
   }
 
   const struct GpuFrame* encoded_frame =
       EncodeContextGetFrame(contexts->encode_context);
   if (!encoded_frame) {
-    LOG("Failed to get encoded frame");
-    goto drop_client;
+    // mburakov: All the encoder slots are still in flight, so the encoder can
+    // not keep up with capturing. Skip this frame, next one will make it.
+    return;
   }
   if (!GpuContextConvertFrame(contexts->gpu_context, captured_frame,
                               encoded_frame)) {
     LOG("Failed to convert frame");
     goto drop_client;
   }
-  if (!EncodeContextEncodeFrame(contexts->encode_context, contexts->client_fd,
-                                timestamp)) {
+  if (contexts->bench) BenchFrameConverted(contexts->bench);
+  if (!EncodeContextEncodeFrame(contexts->encode_context, timestamp)) {
     LOG("Failed to encode frame");
     goto drop_client;
   }
+  if (contexts->bench && !BenchFrameSubmitted(contexts->bench)) {
+    LOG("Failed to track submitted frame");
+    goto drop_client;
+  }
   return;
 
 drop_client:
@@ -177,6 +402,14 @@ drop_client:
   contexts->drop_client = true;
 }
 
+static void OnInputHandlerIdrRequested(void* user) {
+  struct Contexts* contexts = user;
+  // mburakov: Encode context is created on the first captured frame, which is
+  // encoded as an IDR anyway.
+  if (contexts->encode_context)
+    EncodeContextRequestIdr(contexts->encode_context);
+}
+
 static void OnClientWriting(void* user) {
   struct Contexts* contexts = user;
   if (!IoMuxerOnRead(&contexts->io_muxer, contexts->client_fd, &OnClientWriting,
@@ -184,10 +417,12 @@ static void OnClientWriting(void* user) {
     LOG("Failed to reschedule client reading (%s)", strerror(errno));
     goto drop_client;
   }
-  if (!InputHandlerHandle(contexts->input_handler, contexts->client_fd)) {
+  if (!InputHandlerHandle(contexts->input_handler, contexts->client_fd,
+                          contexts->proto_queue)) {
     LOG("Failed to handle client input");
     goto drop_client;
   }
+  if (!MaybeScheduleFlushing(contexts)) goto drop_client;
   return;
 
 drop_client:
@@ -230,22 +465,58 @@ static void OnAudioContextEvents(void* user) {
 
 static void OnCaptureContextEvents(void* user) {
   struct Contexts* contexts = user;
-  if (!IoMuxerOnRead(&contexts->io_muxer,
-                     CaptureContextGetEventsFd(contexts->capture_context),
-                     &OnCaptureContextEvents, user)) {
+  int events_fd = CaptureContextGetEventsFd(contexts->capture_context);
+  if (!IoMuxerOnRead(&contexts->io_muxer, events_fd, &OnCaptureContextEvents,
+                     user)) {
     LOG("Failed to reschedule capture events reading (%s)", strerror(errno));
     goto drop_client;
   }
+  if (contexts->bench) BenchCaptureStarted(contexts->bench);
   if (!CaptureContextProcessEvents(contexts->capture_context)) {
     LOG("Failed to process capture events");
     goto drop_client;
   }
+
+  // mburakov: Capture context might switch to another events fd, i.e. when
+  // kms capturing falls back from vblank events to a timer. It also might
+  // be gone already if the client was dropped from the frame callback.
+  if (contexts->capture_context &&
+      CaptureContextGetEventsFd(contexts->capture_context) != events_fd) {
+    IoMuxerForget(&contexts->io_muxer, events_fd);
+    if (!IoMuxerOnRead(&contexts->io_muxer,
+                       CaptureContextGetEventsFd(contexts->capture_context),
+                       &OnCaptureContextEvents, user)) {
+      LOG("Failed to reschedule capture events reading (%s)", strerror(errno));
+      goto drop_client;
+    }
+  }
   return;
 
 drop_client:
   MaybeDropClient(contexts);
 }
 
+static void OnBenchEvents(void* user) {
+  struct Contexts* contexts = user;
+  if (!IoMuxerOnRead(&contexts->io_muxer, BenchGetEventsFd(contexts->bench),
+                     &OnBenchEvents, user)) {
+    LOG("Failed to reschedule bench events reading (%s)", strerror(errno));
+    g_signal = SIGABRT;
+    return;
+  }
+  // mburakov: Sink is the only client, so dropping it means the benchmark
+  // would never complete.
+  if (!BenchProcessEvents(contexts->bench)) {
+    LOG("Failed to process bench events");
+    g_signal = SIGABRT;
+    return;
+  }
+  if (BenchIsComplete(contexts->bench)) {
+    BenchDump(contexts->bench);
+    g_signal = SIGTERM;
+  }
+}
+
 static void OnClientConnecting(void* user) {
   struct Contexts* contexts = user;
   if (!IoMuxerOnRead(&contexts->io_muxer, contexts->server_fd,
@@ -269,16 +540,41 @@ static void OnClientConnecting(void* user) {
 
   if (setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &(int){1}, sizeof(int))) {
     LOG("Failed to set TCP_NODELAY (%s)", strerror(errno));
-    goto drop_client;
+    close(client_fd);
+    return;
+  }
+  int flags = fcntl(client_fd, F_GETFL);
+  if (flags == -1 || fcntl(client_fd, F_SETFL, flags | O_NONBLOCK)) {
+    LOG("Failed to make client socket nonblocking (%s)", strerror(errno));
+    close(client_fd);
+    return;
   }
 
   contexts->client_fd = client_fd;
+  contexts->proto_queue = ProtoQueueCreate(client_fd, kMaxProtoQueueSize);
+  if (!contexts->proto_queue) {
+    LOG("Failed to create proto queue");
+    goto drop_client;
+  }
+  if (contexts->adaptive_bitrate) {
+    contexts->bitrate_controller =
+        BitrateControllerCreate(client_fd,
+                                contexts->encode_config.rate_control.bitrate);
+    if (!contexts->bitrate_controller) {
+      LOG("Failed to create bitrate controller");
+      goto drop_client;
+    }
+  }
   if (!IoMuxerOnRead(&contexts->io_muxer, contexts->client_fd, &OnClientWriting,
                      user)) {
     LOG("Failed to schedule client reading (%s)", strerror(errno));
     goto drop_client;
   }
-  contexts->input_handler = InputHandlerCreate(contexts->disable_uhid);
+  static const struct InputHandlerCallbacks kInputHandlerCallbacks = {
+      .OnIdrRequested = OnInputHandlerIdrRequested,
+  };
+  contexts->input_handler = InputHandlerCreate(
+      contexts->disable_uhid, &kInputHandlerCallbacks, user);
   if (!contexts->input_handler) {
     LOG("Failed to create input handler");
     goto drop_client;
@@ -292,8 +588,9 @@ static void OnClientConnecting(void* user) {
   static const struct CaptureContextCallbacks kCaptureContextCallbacks = {
       .OnFrameReady = OnCaptureContextFrameReady,
   };
-  contexts->capture_context = CaptureContextCreate(
-      contexts->gpu_context, &kCaptureContextCallbacks, user);
+  contexts->capture_context =
+      CaptureContextCreate(contexts->gpu_context, &contexts->capture_config,
+                           &kCaptureContextCallbacks, user);
   if (!contexts->capture_context) {
     LOG("Failed to create capture context");
     goto drop_client;
@@ -312,10 +609,12 @@ static void OnClientConnecting(void* user) {
         .flags = PROTO_FLAG_KEYFRAME,
         .latency = 0,
     };
-    if (!WriteProto(contexts->client_fd, &proto, contexts->audio_config)) {
+    if (!ProtoQueueWrite(contexts->proto_queue, &proto,
+                         contexts->audio_config)) {
       LOG("Failed to write audio configuration");
       goto drop_client;
     }
+    if (!MaybeScheduleFlushing(contexts)) goto drop_client;
   }
   return;
 
@@ -325,7 +624,15 @@ drop_client:
 
 int main(int argc, char* argv[]) {
   if (argc < 2) {
-    LOG("Usage: %s <port> [--disable-uhid] [--audio <rate:channels>]", argv[0]);
+    LOG("Usage: %s <port> [--disable-uhid] [--encoder <va|x264>] "
+        "[--codec <hevc|h264|av1>] "
+        "[--bitrate <mode:bitrate[:vbv]>] "
+        "[--adaptive-bitrate] [--idr-period <frames>] "
+        "[--intra-refresh <mode:frames>] [--slices <count>] "
+        "[--synthetic <source:WxH@fps[:file]>] [--bench <frames>] "
+        "[--trace <file>] [--vblank <divisor>] [--skip-unchanged] "
+        "[--audio <rate:channels>] [--opus <bitrate:duration>]",
+        argv[0]);
     return EXIT_FAILURE;
   }
   if (signal(SIGINT, OnSignal) == SIG_ERR ||
@@ -338,8 +645,13 @@ int main(int argc, char* argv[]) {
   struct Contexts contexts = {
       .server_fd = -1,
       .client_fd = -1,
+      .encode_config.idr_period = 120,
+      .encode_config.slices = 1,
   };
   const char* audio_config = NULL;
+  const char* opus_config = NULL;
+  unsigned long bench_frames = 0;
+  const char* trace_path = NULL;
   for (int i = 2; i < argc; i++) {
     if (!strcmp(argv[i], "--disable-uhid")) {
       contexts.disable_uhid = true;
@@ -349,16 +661,159 @@ int main(int argc, char* argv[]) {
         LOG("Audio argument requires a value");
         return EXIT_FAILURE;
       }
+    } else if (!strcmp(argv[i], "--encoder")) {
+      if (++i == argc) {
+        LOG("Encoder argument requires a value");
+        return EXIT_FAILURE;
+      }
+      if (!strcmp(argv[i], "va")) {
+        contexts.encode_config.backend = kEncodeBackendVa;
+      } else if (!strcmp(argv[i], "x264")) {
+        contexts.encode_config.backend = kEncodeBackendX264;
+      } else {
+        LOG("Invalid encoder requested");
+        return EXIT_FAILURE;
+      }
+    } else if (!strcmp(argv[i], "--codec")) {
+      if (++i == argc) {
+        LOG("Codec argument requires a value");
+        return EXIT_FAILURE;
+      }
+      if (!strcmp(argv[i], "hevc")) {
+        contexts.encode_config.codec = kEncodeCodecHevc;
+      } else if (!strcmp(argv[i], "h264")) {
+        contexts.encode_config.codec = kEncodeCodecH264;
+      } else if (!strcmp(argv[i], "av1")) {
+        contexts.encode_config.codec = kEncodeCodecAv1;
+      } else {
+        LOG("Invalid codec requested");
+        return EXIT_FAILURE;
+      }
+    } else if (!strcmp(argv[i], "--bitrate")) {
+      if (++i == argc) {
+        LOG("Bitrate argument requires a value");
+        return EXIT_FAILURE;
+      }
+      if (!ParseBitrateConfig(argv[i],
+                              &contexts.encode_config.rate_control)) {
+        LOG("Failed to parse bitrate argument");
+        return EXIT_FAILURE;
+      }
+    } else if (!strcmp(argv[i], "--idr-period")) {
+      if (++i == argc) {
+        LOG("Idr period argument requires a value");
+        return EXIT_FAILURE;
+      }
+      char* end;
+      unsigned long idr_period = strtoul(argv[i], &end, 10);
+      if (*end || idr_period > UINT32_MAX) {
+        LOG("Invalid idr period requested");
+        return EXIT_FAILURE;
+      }
+      contexts.encode_config.idr_period = (uint32_t)idr_period;
+    } else if (!strcmp(argv[i], "--slices")) {
+      if (++i == argc) {
+        LOG("Slices argument requires a value");
+        return EXIT_FAILURE;
+      }
+      char* end;
+      unsigned long slices = strtoul(argv[i], &end, 10);
+      if (*end || !slices || slices > UINT32_MAX) {
+        LOG("Invalid slices count requested");
+        return EXIT_FAILURE;
+      }
+      contexts.encode_config.slices = (uint32_t)slices;
+    } else if (!strcmp(argv[i], "--intra-refresh")) {
+      if (++i == argc) {
+        LOG("Intra refresh argument requires a value");
+        return EXIT_FAILURE;
+      }
+      if (!ParseIntraRefreshConfig(argv[i], &contexts.encode_config)) {
+        LOG("Failed to parse intra refresh argument");
+        return EXIT_FAILURE;
+      }
+    } else if (!strcmp(argv[i], "--adaptive-bitrate")) {
+      contexts.adaptive_bitrate = true;
+    } else if (!strcmp(argv[i], "--synthetic")) {
+      if (++i == argc) {
+        LOG("Synthetic argument requires a value");
+        return EXIT_FAILURE;
+      }
+      contexts.capture_config.synth_config = argv[i];
+    } else if (!strcmp(argv[i], "--skip-unchanged")) {
+      contexts.capture_config.skip_unchanged = true;
+    } else if (!strcmp(argv[i], "--vblank")) {
+      if (++i == argc) {
+        LOG("Vblank argument requires a value");
+        return EXIT_FAILURE;
+      }
+      char* end;
+      unsigned long divisor = strtoul(argv[i], &end, 10);
+      if (*end || !divisor || divisor > UINT8_MAX) {
+        LOG("Invalid vblank divisor requested");
+        return EXIT_FAILURE;
+      }
+      contexts.capture_config.vblank_divisor = (uint32_t)divisor;
+    } else if (!strcmp(argv[i], "--trace")) {
+      if (++i == argc) {
+        LOG("Trace argument requires a value");
+        return EXIT_FAILURE;
+      }
+      trace_path = argv[i];
+    } else if (!strcmp(argv[i], "--bench")) {
+      if (++i == argc) {
+        LOG("Bench argument requires a value");
+        return EXIT_FAILURE;
+      }
+      char* end;
+      bench_frames = strtoul(argv[i], &end, 10);
+      if (*end || !bench_frames || bench_frames > UINT32_MAX) {
+        LOG("Invalid bench frames count requested");
+        return EXIT_FAILURE;
+      }
+    } else if (!strcmp(argv[i], "--opus")) {
+      opus_config = argv[++i];
+      if (i == argc) {
+        LOG("Opus argument requires a value");
+        return EXIT_FAILURE;
+      }
     }
   }
 
+  if (contexts.adaptive_bitrate &&
+      contexts.encode_config.rate_control.mode == kRateControlCqp) {
+    LOG("Adaptive bitrate requires bitrate argument");
+    return EXIT_FAILURE;
+  }
+
+  // mburakov: Trace is dumped on exit, and additionally on SIGUSR1, i.e. to
+  // catch a stutter right after it happened.
+  if (trace_path) {
+    if (signal(SIGUSR1, OnDumpTrace) == SIG_ERR) {
+      LOG("Failed to set trace signal handler (%s)", strerror(errno));
+      return EXIT_FAILURE;
+    }
+    TraceEnable();
+  }
+
   static struct AudioContextCallbacks kAudioContextCallbacks = {
       .OnAudioReady = OnAudioContextAudioReady,
   };
+  // mburakov: Client learns about compressed audio from the configuration
+  // message, which gets an extra suffix in this case.
+  char audio_config_buffer[256];
+  if (audio_config && opus_config) {
+    int result = snprintf(audio_config_buffer, sizeof(audio_config_buffer),
+                          "%s:opus", audio_config);
+    if (result < 0 || (size_t)result >= sizeof(audio_config_buffer)) {
+      LOG("Audio argument is too long");
+      return EXIT_FAILURE;
+    }
+  }
   if (audio_config) {
-    contexts.audio_config = audio_config;
-    contexts.audio_context =
-        AudioContextCreate(audio_config, &kAudioContextCallbacks, &contexts);
+    contexts.audio_config = opus_config ? audio_config_buffer : audio_config;
+    contexts.audio_context = AudioContextCreate(
+        audio_config, opus_config, &kAudioContextCallbacks, &contexts);
     if (!contexts.audio_context) {
       LOG("Failed to create audio context");
       return EXIT_FAILURE;
@@ -390,6 +845,18 @@ int main(int argc, char* argv[]) {
     LOG("Failed to schedule accept (%s)", strerror(errno));
     goto rollback_server_fd;
   }
+  if (bench_frames) {
+    contexts.bench = BenchCreate(contexts.server_fd, bench_frames);
+    if (!contexts.bench) {
+      LOG("Failed to create bench");
+      goto rollback_server_fd;
+    }
+    if (!IoMuxerOnRead(&contexts.io_muxer, BenchGetEventsFd(contexts.bench),
+                       &OnBenchEvents, &contexts)) {
+      LOG("Failed to schedule bench events reading (%s)", strerror(errno));
+      goto rollback_bench;
+    }
+  }
 
   while (!g_signal) {
     if (IoMuxerIterate(&contexts.io_muxer, -1) && errno != EINTR) {
@@ -400,9 +867,16 @@ int main(int argc, char* argv[]) {
       MaybeDropClient(&contexts);
       contexts.drop_client = false;
     }
+    if (g_dump_trace) {
+      if (!TraceDump(trace_path)) LOG("Failed to dump trace");
+      g_dump_trace = 0;
+    }
   }
   MaybeDropClient(&contexts);
+  if (trace_path && !TraceDump(trace_path)) LOG("Failed to dump trace");
 
+rollback_bench:
+  if (contexts.bench) BenchDestroy(contexts.bench);
 rollback_server_fd:
   close(contexts.server_fd);
 rollback_io_muxer:
@@ -19,40 +19,239 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
 #include "toolbox/utils.h"
+#include "trace.h"
 
 #define UNCONST(x) ((void*)(uintptr_t)(x))
 
-static bool DrainBuffers(int fd, struct iovec* iovec, int count) {
+struct ProtoMessage {
+  size_t size;
+  uint8_t data[];
+};
+
+// mburakov: Queue is only bounded by the total size of queued messages. The
+// ring of messages grows on demand, since short audio frames pile up much
+// faster than video frames while the socket is saturated.
+struct ProtoQueue {
+  int fd;
+  size_t max_size;
+  struct ProtoMessage** messages;
+  size_t capacity;
+  size_t head;
+  size_t depth;
+  size_t offset;
+  size_t size;
+  size_t dropped;
+};
+
+static struct ProtoMessage* CreateMessage(const struct iovec* iovec, int count,
+                                          size_t skip) {
+  size_t size = 0;
+  for (int i = 0; i < count; i++) size += iovec[i].iov_len;
+  struct ProtoMessage* proto_message =
+      malloc(sizeof(struct ProtoMessage) + size - skip);
+  if (!proto_message) return NULL;
+  proto_message->size = size - skip;
+
+  uint8_t* ptr = proto_message->data;
+  for (int i = 0; i < count; i++) {
+    size_t delta = MIN(skip, iovec[i].iov_len);
+    memcpy(ptr, (const uint8_t*)iovec[i].iov_base + delta,
+           iovec[i].iov_len - delta);
+    ptr += iovec[i].iov_len - delta;
+    skip -= delta;
+  }
+  return proto_message;
+}
+
+static ssize_t WriteBuffers(int fd, const struct iovec* iovec, int count) {
   for (;;) {
+    unsigned long long trace = TraceBegin();
     ssize_t result = writev(fd, iovec, count);
-    if (result < 0) {
-      if (errno == EINTR) continue;
-      LOG("Failed to write (%s)", strerror(errno));
-      return false;
-    }
-    for (int i = 0; i < count; i++) {
-      size_t delta = MIN((size_t)result, iovec[i].iov_len);
-      iovec[i].iov_base = (uint8_t*)iovec[i].iov_base + delta;
-      iovec[i].iov_len -= delta;
-      result -= delta;
+    TraceEnd("socket_write", trace);
+    if (result >= 0) return result;
+    if (errno == EINTR) continue;
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+    LOG("Failed to write (%s)", strerror(errno));
+    return -1;
+  }
+}
+
+static bool GrowQueue(struct ProtoQueue* proto_queue) {
+  size_t capacity = proto_queue->capacity ? proto_queue->capacity * 2 : 64;
+  struct ProtoMessage** messages =
+      realloc(proto_queue->messages, capacity * sizeof(struct ProtoMessage*));
+  if (!messages) {
+    LOG("Failed to reallocate proto queue (%s)", strerror(errno));
+    return false;
+  }
+
+  // mburakov: Capacity is doubled, so the wrapped around part of the ring
+  // always fits right after the old end.
+  size_t wrapped = proto_queue->head + proto_queue->depth;
+  if (wrapped > proto_queue->capacity) {
+    memcpy(messages + proto_queue->capacity, messages,
+           (wrapped - proto_queue->capacity) * sizeof(struct ProtoMessage*));
+  }
+  proto_queue->messages = messages;
+  proto_queue->capacity = capacity;
+  return true;
+}
+
+// mburakov: Audio frames are short and frequent, and losing one is better
+// than losing the client, so these are dropped when the queue is full.
+// Everything else is either a part of a reference chain, or a configuration.
+static bool IsDroppable(const struct Proto* proto) {
+  return proto->type == PROTO_TYPE_AUDIO && !proto->flags;
+}
+
+static bool QueueMessage(struct ProtoQueue* proto_queue,
+                         struct ProtoMessage* proto_message, size_t offset,
+                         bool droppable) {
+  size_t size = proto_message->size - offset;
+  if (proto_queue->size + size > proto_queue->max_size) {
+    if (droppable) {
+      if (!proto_queue->dropped++) LOG("Proto queue full, dropping messages");
+      free(proto_message);
+      return true;
     }
-    if (!result) return true;
+    LOG("Proto queue overflow (%zu messages, %zu bytes)", proto_queue->depth,
+        proto_queue->size);
+    goto rollback_proto_message;
   }
+  if (proto_queue->depth == proto_queue->capacity && !GrowQueue(proto_queue)) {
+    LOG("Failed to grow proto queue");
+    goto rollback_proto_message;
+  }
+  if (proto_queue->dropped) {
+    LOG("Dropped %zu messages on proto queue overflow", proto_queue->dropped);
+    proto_queue->dropped = 0;
+  }
+
+  // mburakov: Offset is only meaningful for the head message, which is the
+  // case when the message was partially written into an idle socket.
+  if (!proto_queue->depth) proto_queue->offset = offset;
+  size_t tail =
+      (proto_queue->head + proto_queue->depth) % proto_queue->capacity;
+  proto_queue->messages[tail] = proto_message;
+  proto_queue->depth++;
+  proto_queue->size += size;
+  return true;
+
+rollback_proto_message:
+  free(proto_message);
+  return false;
 }
 
-bool WriteProto(int fd, const struct Proto* proto, const void* data) {
-  struct iovec iovec[] = {
+struct ProtoQueue* ProtoQueueCreate(int fd, size_t max_size) {
+  struct ProtoQueue* proto_queue = calloc(1, sizeof(struct ProtoQueue));
+  if (!proto_queue) {
+    LOG("Failed to allocate proto queue (%s)", strerror(errno));
+    return NULL;
+  }
+  proto_queue->fd = fd;
+  proto_queue->max_size = max_size;
+  return proto_queue;
+}
+
+bool ProtoQueueWrite(struct ProtoQueue* proto_queue, const struct Proto* proto,
+                     const void* data) {
+  const struct iovec iovec = {
+      .iov_base = UNCONST(data),
+      .iov_len = proto->size,
+  };
+  return ProtoQueueWritev(proto_queue, proto, &iovec, 1);
+}
+
+bool ProtoQueueWritev(struct ProtoQueue* proto_queue, const struct Proto* proto,
+                      const struct iovec* iovec, int count) {
+  if (count < 0 || count > PROTO_MAX_IOVEC) {
+    LOG("Too many buffers in proto message (%d)", count);
+    return false;
+  }
+  struct iovec buffers[PROTO_MAX_IOVEC + 1] = {
       {.iov_base = UNCONST(proto), .iov_len = sizeof(struct Proto)},
-      {.iov_base = UNCONST(data), .iov_len = proto->size},
   };
-  if (!DrainBuffers(fd, iovec, LENGTH(iovec))) {
-    LOG("Failed to drain buffers");
+  memcpy(buffers + 1, iovec, sizeof(struct iovec) * (size_t)count);
+  count++;
+
+  // mburakov: Write directly from the caller buffers when nothing is queued,
+  // and only copy whatever the socket did not accept right away.
+  ssize_t written = 0;
+  if (!proto_queue->depth) {
+    written = WriteBuffers(proto_queue->fd, buffers, count);
+    if (written < 0) return false;
+    if ((size_t)written == sizeof(struct Proto) + proto->size) return true;
+  }
+
+  struct ProtoMessage* proto_message =
+      CreateMessage(buffers, count, (size_t)written);
+  if (!proto_message) {
+    LOG("Failed to allocate proto message (%s)", strerror(errno));
     return false;
   }
+  // mburakov: Partially written message must be completed no matter what,
+  // otherwise the stream would get out of sync.
+  return QueueMessage(proto_queue, proto_message, 0,
+                      !written && IsDroppable(proto));
+}
+
+bool ProtoQueueFlush(struct ProtoQueue* proto_queue) {
+  while (proto_queue->depth) {
+    struct iovec iovec[16];
+    size_t count = MIN(proto_queue->depth, LENGTH(iovec));
+    for (size_t i = 0; i < count; i++) {
+      size_t index = (proto_queue->head + i) % proto_queue->capacity;
+      const struct ProtoMessage* proto_message = proto_queue->messages[index];
+      size_t offset = i ? 0 : proto_queue->offset;
+      iovec[i] = (struct iovec){
+          .iov_base = UNCONST(proto_message->data + offset),
+          .iov_len = proto_message->size - offset,
+      };
+    }
+
+    ssize_t result = WriteBuffers(proto_queue->fd, iovec, (int)count);
+    if (result < 0) return false;
+    if (!result) return true;
+
+    size_t written = (size_t)result;
+    proto_queue->size -= written;
+    while (written) {
+      struct ProtoMessage* proto_message =
+          proto_queue->messages[proto_queue->head];
+      size_t remaining = proto_message->size - proto_queue->offset;
+      if (written < remaining) {
+        proto_queue->offset += written;
+        break;
+      }
+      written -= remaining;
+      free(proto_message);
+      proto_queue->head = (proto_queue->head + 1) % proto_queue->capacity;
+      proto_queue->depth--;
+      proto_queue->offset = 0;
+    }
+  }
   return true;
 }
+
+size_t ProtoQueueGetDepth(const struct ProtoQueue* proto_queue) {
+  return proto_queue->depth;
+}
+
+size_t ProtoQueueGetSize(const struct ProtoQueue* proto_queue) {
+  return proto_queue->size;
+}
+
+void ProtoQueueDestroy(struct ProtoQueue* proto_queue) {
+  for (; proto_queue->depth; proto_queue->depth--) {
+    free(proto_queue->messages[proto_queue->head]);
+    proto_queue->head = (proto_queue->head + 1) % proto_queue->capacity;
+  }
+  free(proto_queue->messages);
+  free(proto_queue);
+}
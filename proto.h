@@ -19,14 +19,20 @@
 #define STREAMER_PROTO_H_
 
 #include <assert.h>
-#include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
 
 #define PROTO_TYPE_MISC 0
 #define PROTO_TYPE_VIDEO 1
 #define PROTO_TYPE_AUDIO 2
 
 #define PROTO_FLAG_KEYFRAME 1
+#define PROTO_FLAG_MORE_SLICES 2
+#define PROTO_FLAG_CONFIG 4
+
+#define PROTO_MAX_IOVEC 16
 
 struct Proto {
   uint32_t size;
@@ -39,6 +45,16 @@ struct Proto {
 static_assert(sizeof(struct Proto) == 8 * sizeof(uint8_t),
               "Suspicious proto struct size");
 
-bool WriteProto(int fd, const struct Proto* proto, const void* data);
+struct ProtoQueue;
+
+struct ProtoQueue* ProtoQueueCreate(int fd, size_t max_size);
+bool ProtoQueueWrite(struct ProtoQueue* proto_queue, const struct Proto* proto,
+                     const void* data);
+bool ProtoQueueWritev(struct ProtoQueue* proto_queue, const struct Proto* proto,
+                      const struct iovec* iovec, int count);
+bool ProtoQueueFlush(struct ProtoQueue* proto_queue);
+size_t ProtoQueueGetDepth(const struct ProtoQueue* proto_queue);
+size_t ProtoQueueGetSize(const struct ProtoQueue* proto_queue);
+void ProtoQueueDestroy(struct ProtoQueue* proto_queue);
 
 #endif  // STREAMER_PROTO_H_
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "ring_buffer.h"
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "toolbox/utils.h"
+
+#define CACHE_LINE_SIZE 64
+
+// mburakov: Head and tail are free-running, and only wrapped when accessing
+// data. Both live on their own cache lines to avoid false sharing between
+// producer and consumer threads.
+struct RingBuffer {
+  alignas(CACHE_LINE_SIZE) atomic_size_t head;
+  alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+  alignas(CACHE_LINE_SIZE) size_t capacity;
+  uint8_t data[];
+};
+
+struct RingBuffer* RingBufferCreate(size_t capacity) {
+  size_t aligned_capacity = CACHE_LINE_SIZE;
+  while (aligned_capacity < capacity) aligned_capacity <<= 1;
+  struct RingBuffer* ring_buffer = aligned_alloc(
+      CACHE_LINE_SIZE, sizeof(struct RingBuffer) + aligned_capacity);
+  if (!ring_buffer) return NULL;
+  atomic_init(&ring_buffer->head, 0);
+  atomic_init(&ring_buffer->tail, 0);
+  ring_buffer->capacity = aligned_capacity;
+  return ring_buffer;
+}
+
+bool RingBufferWrite(struct RingBuffer* ring_buffer, const void* data,
+                     size_t size) {
+  size_t head = atomic_load_explicit(&ring_buffer->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring_buffer->tail, memory_order_acquire);
+  if (ring_buffer->capacity - (head - tail) < size) return false;
+
+  size_t offset = head & (ring_buffer->capacity - 1);
+  size_t chunk = MIN(size, ring_buffer->capacity - offset);
+  memcpy(ring_buffer->data + offset, data, chunk);
+  memcpy(ring_buffer->data, (const uint8_t*)data + chunk, size - chunk);
+  atomic_store_explicit(&ring_buffer->head, head + size, memory_order_release);
+  return true;
+}
+
+size_t RingBufferRead(struct RingBuffer* ring_buffer, void* data, size_t size) {
+  size_t tail = atomic_load_explicit(&ring_buffer->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&ring_buffer->head, memory_order_acquire);
+  size = MIN(size, head - tail);
+
+  size_t offset = tail & (ring_buffer->capacity - 1);
+  size_t chunk = MIN(size, ring_buffer->capacity - offset);
+  memcpy(data, ring_buffer->data + offset, chunk);
+  memcpy((uint8_t*)data + chunk, ring_buffer->data, size - chunk);
+  atomic_store_explicit(&ring_buffer->tail, tail + size, memory_order_release);
+  return size;
+}
+
+size_t RingBufferGetCapacity(const struct RingBuffer* ring_buffer) {
+  return ring_buffer->capacity;
+}
+
+void RingBufferDestroy(struct RingBuffer* ring_buffer) { free(ring_buffer); }
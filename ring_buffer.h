@@ -0,0 +1,35 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_RING_BUFFER_H_
+#define STREAMER_RING_BUFFER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// mburakov: Single producer single consumer byte ring. Producer and consumer
+// are allowed to run on different threads without any extra locking.
+struct RingBuffer;
+
+struct RingBuffer* RingBufferCreate(size_t capacity);
+bool RingBufferWrite(struct RingBuffer* ring_buffer, const void* data,
+                     size_t size);
+size_t RingBufferRead(struct RingBuffer* ring_buffer, void* data, size_t size);
+size_t RingBufferGetCapacity(const struct RingBuffer* ring_buffer);
+void RingBufferDestroy(struct RingBuffer* ring_buffer);
+
+#endif  // STREAMER_RING_BUFFER_H_
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+#include "audio_encode.h"
+#include "toolbox/utils.h"
+
+// mburakov: Encodes generated audio for every supported frame duration and a
+// few common channel layouts, and reports cpu time spent per second of audio.
+// Every channel gets a tone of its own with some noise on top, so that the
+// encoder has something to work with.
+
+#define SAMPLE_RATE 48000
+#define DURATION_SEC 10
+
+static unsigned long long CpuMicrosNow(void) {
+  struct rusage rusage;
+  getrusage(RUSAGE_SELF, &rusage);
+  return (unsigned long long)(rusage.ru_utime.tv_sec +
+                              rusage.ru_stime.tv_sec) *
+             1000000 +
+         (unsigned long long)(rusage.ru_utime.tv_usec +
+                              rusage.ru_stime.tv_usec);
+}
+
+static int16_t* GeneratePcm(uint32_t channels) {
+  int16_t* pcm = malloc(SAMPLE_RATE * channels * sizeof(int16_t));
+  if (!pcm) return NULL;
+  uint32_t state = 1;
+  for (size_t i = 0; i < SAMPLE_RATE; i++) {
+    for (uint32_t j = 0; j < channels; j++) {
+      state = state * 1664525 + 1013904223;
+      double tone = sin(2 * M_PI * 220 * (j + 1) * (double)i / SAMPLE_RATE);
+      double noise = (double)(state >> 16) / 65536 - 0.5;
+      pcm[i * channels + j] = (int16_t)(tone * 8192 + noise * 1024);
+    }
+  }
+  return pcm;
+}
+
+static bool RunLayout(const char* layout, uint32_t channels,
+                      uint32_t bitrate, bool* first) {
+  static const char* const kDurations[] = {"2.5", "5", "10", "20"};
+  int16_t* pcm = GeneratePcm(channels);
+  if (!pcm) {
+    LOG("Failed to generate pcm");
+    return false;
+  }
+
+  bool result = false;
+  for (size_t i = 0; i < LENGTH(kDurations); i++) {
+    char opus_config[32];
+    snprintf(opus_config, sizeof(opus_config), "%u:%s", bitrate,
+             kDurations[i]);
+    struct AudioEncoder* audio_encoder =
+        AudioEncoderCreate(opus_config, SAMPLE_RATE, channels);
+    if (!audio_encoder) {
+      LOG("Failed to create audio encoder");
+      goto rollback_pcm;
+    }
+
+    size_t frame_size = AudioEncoderGetFrameSize(audio_encoder);
+    size_t frames_per_second = SAMPLE_RATE * channels * sizeof(int16_t) /
+                               frame_size;
+    size_t packets_size = 0;
+    unsigned long long begin = CpuMicrosNow();
+    for (size_t j = 0; j < frames_per_second * DURATION_SEC; j++) {
+      const uint8_t* frame = (const uint8_t*)pcm +
+                             j % frames_per_second * frame_size;
+      size_t size;
+      if (!AudioEncoderEncode(audio_encoder, frame, &size)) {
+        LOG("Failed to encode audio frame");
+        AudioEncoderDestroy(audio_encoder);
+        goto rollback_pcm;
+      }
+      packets_size += size;
+    }
+    unsigned long long cpu_time = CpuMicrosNow() - begin;
+    AudioEncoderDestroy(audio_encoder);
+
+    printf("%s{\"layout\": \"%s\", \"frame_ms\": %s, ", *first ? "" : ", ",
+           layout, kDurations[i]);
+    printf("\"cpu_us_per_sec\": %llu, \"bitrate_bps\": %zu}",
+           cpu_time / DURATION_SEC, packets_size * 8 / DURATION_SEC);
+    *first = false;
+  }
+  result = true;
+
+rollback_pcm:
+  free(pcm);
+  return result;
+}
+
+int main(void) {
+  static const struct {
+    const char* name;
+    uint32_t channels;
+    uint32_t bitrate;
+  } kLayouts[] = {
+      {"2.0", 2, 128000},
+      {"5.1", 6, 320000},
+      {"7.1", 8, 448000},
+  };
+
+  bool first = true;
+  printf("{\"bench\": \"audio_encode\", \"duration_sec\": %d, \"results\": [",
+         DURATION_SEC);
+  for (size_t i = 0; i < LENGTH(kLayouts); i++) {
+    if (!RunLayout(kLayouts[i].name, kLayouts[i].channels,
+                   kLayouts[i].bitrate, &first)) {
+      LOG("Failed to run %s layout", kLayouts[i].name);
+      return EXIT_FAILURE;
+    }
+  }
+  printf("]}\n");
+  return EXIT_SUCCESS;
+}
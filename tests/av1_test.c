@@ -0,0 +1,414 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <va/va.h>
+
+#include "av1.h"
+#include "av1_parse.h"
+#include "bitstream.h"
+#include "toolbox/utils.h"
+
+// mburakov: Same as hevc_test.c, va buffers are filled the way encode_va.c
+// does for a range of stream configurations, and every field parsed back from
+// packed headers must match either va buffers, or the value hardcoded in
+// av1.c. Drivers patch the frame header in place, so the reported offsets must
+// also point at the right bits, including the padded obu_size field.
+
+#define VALIDATE(expected, actual)                                        \
+  do {                                                                    \
+    if ((int64_t)(expected) != (int64_t)(actual)) {                       \
+      LOG("Mismatching " #actual " (%jd vs %jd)", (intmax_t)(expected), \
+          (intmax_t)(actual));                                            \
+      result = false;                                                     \
+    }                                                                     \
+  } while (0)
+
+#define FRAMES_COUNT 600
+#define IDR_PERIOD 293
+
+struct TestCase {
+  uint32_t width;
+  uint32_t height;
+  uint8_t seq_level_idx;
+  bool use_128x128_superblock;
+  bool order_hint;
+  bool cdef;
+  bool coding_tools;
+  bool tx_mode_select;
+  bool rec601;
+  bool full_range;
+  uint8_t obu_size_length;
+};
+
+struct Headers {
+  VAEncSequenceParameterBufferAV1 seq;
+  VAEncPictureParameterBufferAV1 pic;
+  struct MoreAv1SeqParameters msp;
+  struct MoreAv1FrameParameters mfp;
+  struct Av1SequenceHeader sh;
+};
+
+static const struct TestCase kTestCases[] = {
+    {1920, 1080, 8, false, true, true, false, true, false, false, 4},
+    {1920, 1080, 8, true, true, true, false, false, true, true, 1},
+    {3840, 2160, 12, true, true, false, true, true, false, true, 2},
+    {1366, 768, 5, false, false, true, true, true, true, false, 3},
+    {640, 360, 0, false, false, false, false, false, false, false, 1},
+};
+
+// mburakov: Mirrors InitializeAv1SeqHeader, InitializeAv1PicHeader and
+// PackAv1SequenceHeader in encode_va.c. Disabled order hint and the coding
+// tools that are defaulted there cover the remaining branches of the writers.
+static void InitializeHeaders(const struct TestCase* test_case,
+                              struct Headers* headers) {
+  bool coding_tools = test_case->coding_tools;
+  headers->seq = (VAEncSequenceParameterBufferAV1){
+      .seq_profile = 0,
+      .seq_level_idx = test_case->seq_level_idx,
+      .seq_tier = test_case->seq_level_idx > 7,
+      .intra_period = IDR_PERIOD,
+      .ip_period = 1,
+      .seq_fields.bits =
+          {
+              .use_128x128_superblock = test_case->use_128x128_superblock,
+              .enable_filter_intra = !coding_tools,
+              .enable_intra_edge_filter = coding_tools,
+              .enable_interintra_compound = coding_tools,
+              .enable_masked_compound = coding_tools,
+              .enable_warped_motion = coding_tools,
+              .enable_dual_filter = coding_tools,
+              .enable_order_hint = test_case->order_hint,
+              .enable_jnt_comp = test_case->order_hint && coding_tools,
+              .enable_ref_frame_mvs = test_case->order_hint && coding_tools,
+              .enable_superres = coding_tools,
+              .enable_cdef = test_case->cdef,
+              .subsampling_x = 1,
+              .subsampling_y = 1,
+          },
+      .order_hint_bits_minus_1 = test_case->order_hint ? 7 : 0,
+  };
+
+  headers->pic = (VAEncPictureParameterBufferAV1){
+      .frame_width_minus_1 = (uint16_t)(test_case->width - 1),
+      .frame_height_minus_1 = (uint16_t)(test_case->height - 1),
+      .reconstructed_frame = VA_INVALID_SURFACE,
+      .coded_buf = VA_INVALID_ID,
+      .base_qindex = 26 * 255 / 51,
+      .mode_control_flags.bits.tx_mode = test_case->tx_mode_select ? 2 : 1,
+      .tile_cols = 1,
+      .tile_rows = 1,
+  };
+
+  headers->msp = (struct MoreAv1SeqParameters){
+      .max_frame_width_minus_1 = headers->pic.frame_width_minus_1,
+      .max_frame_height_minus_1 = headers->pic.frame_height_minus_1,
+      .color_description_present_flag = 1,
+      .color_primaries = 2,
+      .transfer_characteristics = 2,
+      .matrix_coefficients = test_case->rec601 ? 6 : 1,
+      .color_range = test_case->full_range,
+  };
+
+  headers->mfp = (struct MoreAv1FrameParameters){
+      .obu_size_length = test_case->obu_size_length,
+  };
+}
+
+static bool ValidateSequenceHeader(struct Headers* headers) {
+  uint8_t buffer[256];
+  struct Bitstream bitstream = {.data = buffer};
+  PackAv1SequenceHeaderObu(&bitstream, &headers->seq, &headers->msp);
+
+  const void* data = buffer;
+  size_t size = bitstream.size / 8;
+  struct Av1SequenceHeader* sh = &headers->sh;
+  struct Av1Obu obu;
+  if (!ParseAv1Obu(&data, &size, &obu) ||
+      !ParseAv1SequenceHeader(&obu, sh) || size) {
+    LOG("Failed to parse sequence header");
+    return false;
+  }
+
+  const VAEncSequenceParameterBufferAV1* seq = &headers->seq;
+  const struct MoreAv1SeqParameters* msp = &headers->msp;
+  const typeof(seq->seq_fields.bits)* seq_bits = &seq->seq_fields.bits;
+  bool order_hint = seq_bits->enable_order_hint;
+  uint32_t frame_width_bits =
+      32 - (uint32_t)__builtin_clz(msp->max_frame_width_minus_1 | 1u);
+  uint32_t frame_height_bits =
+      32 - (uint32_t)__builtin_clz(msp->max_frame_height_minus_1 | 1u);
+
+  bool result = true;
+  VALIDATE(1, obu.obu_size_length);
+  VALIDATE(seq->seq_profile, sh->seq_profile);
+  VALIDATE(seq_bits->still_picture, sh->still_picture);
+  VALIDATE(0, sh->reduced_still_picture_header);
+  VALIDATE(0, sh->timing_info_present_flag);
+  VALIDATE(0, sh->initial_display_delay_present_flag);
+  VALIDATE(0, sh->operating_points_cnt_minus_1);
+  VALIDATE(0, sh->operating_point_idc[0]);
+  VALIDATE(seq->seq_level_idx, sh->seq_level_idx[0]);
+  VALIDATE(seq->seq_level_idx > 7 && seq->seq_tier, sh->seq_tier[0]);
+  VALIDATE(frame_width_bits - 1, sh->frame_width_bits_minus_1);
+  VALIDATE(frame_height_bits - 1, sh->frame_height_bits_minus_1);
+  VALIDATE(msp->max_frame_width_minus_1, sh->max_frame_width_minus_1);
+  VALIDATE(msp->max_frame_height_minus_1, sh->max_frame_height_minus_1);
+  VALIDATE(0, sh->frame_id_numbers_present_flag);
+  VALIDATE(seq_bits->use_128x128_superblock, sh->use_128x128_superblock);
+  VALIDATE(seq_bits->enable_filter_intra, sh->enable_filter_intra);
+  VALIDATE(seq_bits->enable_intra_edge_filter, sh->enable_intra_edge_filter);
+  VALIDATE(seq_bits->enable_interintra_compound,
+           sh->enable_interintra_compound);
+  VALIDATE(seq_bits->enable_masked_compound, sh->enable_masked_compound);
+  VALIDATE(seq_bits->enable_warped_motion, sh->enable_warped_motion);
+  VALIDATE(seq_bits->enable_dual_filter, sh->enable_dual_filter);
+  VALIDATE(order_hint, sh->enable_order_hint);
+  VALIDATE(order_hint && seq_bits->enable_jnt_comp, sh->enable_jnt_comp);
+  VALIDATE(order_hint && seq_bits->enable_ref_frame_mvs,
+           sh->enable_ref_frame_mvs);
+  VALIDATE(0, sh->seq_choose_screen_content_tools);
+  VALIDATE(0, sh->seq_force_screen_content_tools);
+  VALIDATE(order_hint ? seq->order_hint_bits_minus_1 : 0,
+           sh->order_hint_bits_minus_1);
+  VALIDATE(seq_bits->enable_superres, sh->enable_superres);
+  VALIDATE(seq_bits->enable_cdef, sh->enable_cdef);
+  VALIDATE(seq_bits->enable_restoration, sh->enable_restoration);
+  VALIDATE(seq_bits->bit_depth_minus8 > 0, sh->high_bitdepth);
+  VALIDATE(seq_bits->mono_chrome, sh->mono_chrome);
+  VALIDATE(msp->color_description_present_flag,
+           sh->color_description_present_flag);
+  VALIDATE(msp->color_primaries, sh->color_primaries);
+  VALIDATE(msp->transfer_characteristics, sh->transfer_characteristics);
+  VALIDATE(msp->matrix_coefficients, sh->matrix_coefficients);
+  VALIDATE(msp->color_range, sh->color_range);
+  VALIDATE(seq_bits->subsampling_x, sh->subsampling_x);
+  VALIDATE(seq_bits->subsampling_y, sh->subsampling_y);
+  VALIDATE(0, sh->chroma_sample_position);
+  VALIDATE(0, sh->separate_uv_delta_q);
+  VALIDATE(0, sh->film_grain_params_present);
+  return result;
+}
+
+// mburakov: Key frames are preceded by the sequence header in the same
+// bitstream, same as encode_va.c submits these, so that the frame header does
+// not start at the beginning of the buffer, and byte_offset_frame_hdr_obu_size
+// has to account for that.
+static bool ValidateFrameHeader(struct Headers* headers) {
+  uint8_t buffer[256];
+  struct Bitstream bitstream = {.data = buffer};
+  bool key_frame =
+      headers->pic.picture_flags.bits.frame_type == AV1_KEY_FRAME;
+  if (key_frame)
+    PackAv1SequenceHeaderObu(&bitstream, &headers->seq, &headers->msp);
+  size_t frame_header_offset = bitstream.size / 8;
+  PackAv1FrameHeaderObu(&bitstream, &headers->seq, &headers->pic,
+                        &headers->mfp);
+
+  const void* data = buffer + frame_header_offset;
+  size_t size = bitstream.size / 8 - frame_header_offset;
+  struct Av1FrameHeader fh;
+  struct Av1Obu obu;
+  if (!ParseAv1Obu(&data, &size, &obu) ||
+      !ParseAv1FrameHeader(&obu, &headers->sh, &fh) || size) {
+    LOG("Failed to parse frame header");
+    return false;
+  }
+
+  const VAEncSequenceParameterBufferAV1* seq = &headers->seq;
+  const VAEncPictureParameterBufferAV1* pic = &headers->pic;
+  const typeof(seq->seq_fields.bits)* seq_bits = &seq->seq_fields.bits;
+  const typeof(pic->picture_flags.bits)* pic_bits = &pic->picture_flags.bits;
+  const typeof(pic->mode_control_flags.bits)* mode_bits =
+      &pic->mode_control_flags.bits;
+  const typeof(pic->loop_filter_flags.bits)* lf_bits =
+      &pic->loop_filter_flags.bits;
+  bool inter = !key_frame;
+  bool error_resilient = key_frame || pic_bits->error_resilient_mode;
+  bool delta_q = pic->base_qindex && mode_bits->delta_q_present;
+  bool delta_lf = delta_q && mode_bits->delta_lf_present;
+  bool lossless = !pic->base_qindex && !pic->y_dc_delta_q &&
+                  !pic->u_dc_delta_q && !pic->u_ac_delta_q;
+  bool chroma_lf = !lossless && (pic->filter_level[0] || pic->filter_level[1]);
+  bool lf_delta = !lossless && lf_bits->mode_ref_delta_enabled;
+  bool cdef = !lossless && seq_bits->enable_cdef;
+  size_t header_size = 8 + headers->mfp.obu_size_length * 8u;
+
+  bool result = true;
+  VALIDATE(headers->mfp.obu_size_length, obu.obu_size_length);
+  VALIDATE(frame_header_offset + 1, pic->byte_offset_frame_hdr_obu_size);
+  VALIDATE(header_size + obu.obu_size * 8, pic->size_in_bits_frame_hdr_obu);
+  VALIDATE(0, fh.show_existing_frame);
+  VALIDATE(pic_bits->frame_type, fh.frame_type);
+  VALIDATE(1, fh.show_frame);
+  VALIDATE(error_resilient, fh.error_resilient_mode);
+  VALIDATE(pic_bits->disable_cdf_update, fh.disable_cdf_update);
+  VALIDATE(0, fh.frame_size_override_flag);
+  VALIDATE(seq_bits->enable_order_hint ? pic->order_hint : 0, fh.order_hint);
+  VALIDATE(error_resilient ? 7 : pic->primary_ref_frame,
+           fh.primary_ref_frame);
+  VALIDATE(key_frame ? 0xff : pic->refresh_frame_flags,
+           fh.refresh_frame_flags);
+  VALIDATE(0, fh.frame_refs_short_signaling);
+  for (size_t i = 0; i < LENGTH(fh.ref_frame_idx); i++)
+    VALIDATE(inter ? pic->ref_frame_idx[i] : 0, fh.ref_frame_idx[i]);
+  VALIDATE(seq_bits->enable_superres && pic_bits->use_superres,
+           fh.use_superres);
+  VALIDATE(0, fh.render_and_frame_size_different);
+  VALIDATE(inter && pic_bits->allow_high_precision_mv,
+           fh.allow_high_precision_mv);
+  VALIDATE(inter ? pic->interpolation_filter : 0, fh.interpolation_filter);
+  VALIDATE(inter, fh.is_motion_mode_switchable);
+  VALIDATE(!error_resilient && seq_bits->enable_ref_frame_mvs &&
+               pic_bits->use_ref_frame_mvs,
+           fh.use_ref_frame_mvs);
+  VALIDATE(pic_bits->disable_cdf_update ||
+               pic_bits->disable_frame_end_update_cdf,
+           fh.disable_frame_end_update_cdf);
+  VALIDATE(1, fh.uniform_tile_spacing_flag);
+  VALIDATE(0, fh.tile_cols_log2);
+  VALIDATE(0, fh.tile_rows_log2);
+  VALIDATE(pic->base_qindex, fh.base_q_idx);
+  VALIDATE(pic->y_dc_delta_q, fh.delta_q_y_dc);
+  VALIDATE(pic->u_dc_delta_q, fh.delta_q_u_dc);
+  VALIDATE(pic->u_ac_delta_q, fh.delta_q_u_ac);
+  VALIDATE(0, fh.using_qmatrix);
+  VALIDATE(0, fh.segmentation_enabled);
+  VALIDATE(delta_q, fh.delta_q_present);
+  VALIDATE(delta_q ? mode_bits->delta_q_res : 0, fh.delta_q_res);
+  VALIDATE(delta_lf, fh.delta_lf_present);
+  VALIDATE(delta_lf ? mode_bits->delta_lf_res : 0, fh.delta_lf_res);
+  VALIDATE(delta_lf && mode_bits->delta_lf_multi, fh.delta_lf_multi);
+  VALIDATE(lossless ? 0 : pic->filter_level[0], fh.loop_filter_level[0]);
+  VALIDATE(lossless ? 0 : pic->filter_level[1], fh.loop_filter_level[1]);
+  VALIDATE(chroma_lf ? pic->filter_level_u : 0, fh.loop_filter_level[2]);
+  VALIDATE(chroma_lf ? pic->filter_level_v : 0, fh.loop_filter_level[3]);
+  VALIDATE(lossless ? 0 : lf_bits->sharpness_level, fh.loop_filter_sharpness);
+  VALIDATE(lf_delta, fh.loop_filter_delta_enabled);
+  VALIDATE(lf_delta && lf_bits->mode_ref_delta_update,
+           fh.loop_filter_delta_update);
+  VALIDATE(cdef ? pic->cdef_damping_minus_3 : 0, fh.cdef_damping_minus_3);
+  VALIDATE(cdef ? pic->cdef_bits : 0, fh.cdef_bits);
+  for (size_t i = 0; i < LENGTH(fh.cdef_y_pri_strength); i++) {
+    bool present = cdef && i < 1u << pic->cdef_bits;
+    uint8_t y_strength = present ? pic->cdef_y_strengths[i] : 0;
+    uint8_t uv_strength = present ? pic->cdef_uv_strengths[i] : 0;
+    VALIDATE(y_strength >> 2, fh.cdef_y_pri_strength[i]);
+    VALIDATE(y_strength & 3, fh.cdef_y_sec_strength[i]);
+    VALIDATE(uv_strength >> 2, fh.cdef_uv_pri_strength[i]);
+    VALIDATE(uv_strength & 3, fh.cdef_uv_sec_strength[i]);
+  }
+  VALIDATE(lossless ? 0 : mode_bits->tx_mode, fh.tx_mode);
+  VALIDATE(0, fh.reference_select);
+  VALIDATE(0, fh.allow_warped_motion);
+  VALIDATE(pic_bits->reduced_tx_set, fh.reduced_tx_set);
+  for (size_t i = 0; i < LENGTH(fh.is_global); i++)
+    VALIDATE(0, fh.is_global[i]);
+  VALIDATE(pic->bit_offset_qindex, fh.qindex_offset);
+  VALIDATE(pic->bit_offset_segmentation, fh.segmentation_offset);
+  VALIDATE(pic->bit_offset_loopfilter_params, fh.loop_filter_params_offset);
+  VALIDATE(pic->bit_offset_cdef_params, fh.cdef_params_offset);
+  VALIDATE(pic->size_in_bits_cdef_params, fh.cdef_params_size);
+  return result;
+}
+
+// mburakov: Mirrors UpdateAv1PicHeader and UploadAv1Picture in encode_va.c,
+// with key frames spaced further apart than the order hint wraps around. The
+// fields that are either constant in encode_va.c or decided by the driver are
+// varied here, so that each of them lands on different bit offsets, and some
+// frames end up coded lossless.
+static bool TestFrames(struct Headers* headers) {
+  VAEncPictureParameterBufferAV1* pic = &headers->pic;
+  typeof(pic->picture_flags.bits)* pic_bits = &pic->picture_flags.bits;
+  typeof(pic->mode_control_flags.bits)* mode_bits =
+      &pic->mode_control_flags.bits;
+  bool order_hint = headers->seq.seq_fields.bits.enable_order_hint;
+  uint32_t order_hint_bits = headers->seq.order_hint_bits_minus_1 + 1u;
+
+  for (uint32_t i = 0; i < FRAMES_COUNT; i++) {
+    bool idr = !(i % IDR_PERIOD);
+    uint32_t frames_since_idr = i % IDR_PERIOD;
+    pic->order_hint =
+        (uint8_t)(frames_since_idr & ((1u << order_hint_bits) - 1));
+    pic_bits->frame_type = idr ? AV1_KEY_FRAME : AV1_INTER_FRAME;
+    pic->primary_ref_frame = idr ? 7 : 0;
+    pic->refresh_frame_flags = idr ? 0xff : 0x01;
+
+    // mburakov: Error resilient inter frames carry ref_order_hint with order
+    // hint enabled, which the writer does not support.
+    pic_bits->error_resilient_mode = !idr && !order_hint && i % 4 == 1;
+    pic_bits->disable_cdf_update = i % 5 == 2;
+    pic_bits->use_superres = i % 2;
+    pic_bits->allow_high_precision_mv = i % 3 == 0;
+    pic_bits->use_ref_frame_mvs = i % 3 == 1;
+    pic_bits->disable_frame_end_update_cdf = i % 7 == 3;
+    pic_bits->reduced_tx_set = i % 4 == 3;
+    for (size_t j = 0; j < LENGTH(pic->ref_frame_idx); j++)
+      pic->ref_frame_idx[j] = (uint8_t)((i + j) % 8);
+    pic->interpolation_filter = (uint8_t)(i % 5);
+
+    bool zero_deltas = i % 3 == 0;
+    pic->base_qindex = (uint8_t)(i % 11 ? i * 37 % 256 : 0);
+    pic->y_dc_delta_q = (int8_t)(zero_deltas ? 0 : (int)(i % 128) - 64);
+    pic->u_dc_delta_q = (int8_t)(zero_deltas ? 0 : 63 - (int)(i * 5 % 128));
+    pic->u_ac_delta_q = (int8_t)(zero_deltas || i % 2 ? 0 : (int)(i % 17));
+    mode_bits->delta_q_present = i % 4 < 2;
+    mode_bits->delta_q_res = (uint8_t)(i % 4);
+    mode_bits->delta_lf_present = i % 2;
+    mode_bits->delta_lf_res = (uint8_t)(i * 3 % 4);
+    mode_bits->delta_lf_multi = i % 6 < 3;
+
+    pic->filter_level[0] = (uint8_t)(i % 9 ? i % 64 : 0);
+    pic->filter_level[1] = (uint8_t)(i % 9 ? (i * 7) % 64 : 0);
+    pic->filter_level_u = (uint8_t)(i * 11 % 64);
+    pic->filter_level_v = (uint8_t)(i * 13 % 64);
+    pic->loop_filter_flags.bits.sharpness_level = i % 8;
+    pic->loop_filter_flags.bits.mode_ref_delta_enabled = i % 5 < 2;
+    pic->cdef_damping_minus_3 = (uint8_t)(i % 4);
+    pic->cdef_bits = (uint8_t)(i * 3 % 4);
+    for (size_t j = 0; j < LENGTH(pic->cdef_y_strengths); j++) {
+      pic->cdef_y_strengths[j] = (uint8_t)((i + j * 19) % 64);
+      pic->cdef_uv_strengths[j] = (uint8_t)((i * 5 + j * 23) % 64);
+    }
+
+    if (!ValidateFrameHeader(headers)) {
+      LOG("Frame %u does not match", i);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(void) {
+  for (size_t i = 0; i < LENGTH(kTestCases); i++) {
+    struct Headers headers;
+    InitializeHeaders(&kTestCases[i], &headers);
+    if (!ValidateSequenceHeader(&headers)) {
+      LOG("Sequence header of test case %zu does not match", i);
+      return EXIT_FAILURE;
+    }
+    if (!TestFrames(&headers)) {
+      LOG("Frames of test case %zu do not match", i);
+      return EXIT_FAILURE;
+    }
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,297 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <threads.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bitrate.h"
+#include "proto.h"
+#include "toolbox/perf.h"
+#include "toolbox/utils.h"
+
+// mburakov: Streams fake frames sized after the controlled bitrate over a
+// loopback connection, the same way main does, while the reading side drains
+// the socket no faster than the configured rate. Socket buffers are kept
+// small, so that throttling is visible to the sender soon enough.
+
+#define FRAME_INTERVAL_US (1000000 / 60)
+#define MAX_BITRATE 8000000
+#define THROTTLED_BITRATE 2000000
+#define SOCKET_BUFFER_SIZE 16384
+
+struct Reader {
+  int fd;
+  atomic_uint_fast32_t bitrate;
+};
+
+static int ReaderThread(void* arg) {
+  struct Reader* reader = arg;
+  static uint8_t buffer[65536];
+  unsigned long long last = MicrosNow();
+  double budget = 0;
+  for (;;) {
+    unsigned long long now = MicrosNow();
+    uint32_t bitrate = (uint32_t)atomic_load(&reader->bitrate);
+    budget += (double)bitrate / 8 * (double)(now - last) / 1e6;
+    budget = MIN(budget, (double)bitrate / 8 / 10);
+    last = now;
+
+    size_t size = bitrate ? (size_t)budget : sizeof(buffer);
+    if (!size) {
+      nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+      continue;
+    }
+    ssize_t result = read(reader->fd, buffer, MIN(size, sizeof(buffer)));
+    if (result <= 0) return 0;
+    budget -= (double)result;
+  }
+}
+
+static bool CreateConnection(int* sender_fd, int* receiver_fd) {
+  int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (server_fd < 0) {
+    LOG("Failed to create server socket (%s)", strerror(errno));
+    return false;
+  }
+  struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  socklen_t addr_size = sizeof(addr);
+  if (bind(server_fd, (const struct sockaddr*)&addr, sizeof(addr)) ||
+      listen(server_fd, 1) ||
+      getsockname(server_fd, (struct sockaddr*)&addr, &addr_size)) {
+    LOG("Failed to listen server socket (%s)", strerror(errno));
+    goto rollback_server_fd;
+  }
+
+  *receiver_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (*receiver_fd < 0) {
+    LOG("Failed to create receiver socket (%s)", strerror(errno));
+    goto rollback_server_fd;
+  }
+  if (setsockopt(*receiver_fd, SOL_SOCKET, SO_RCVBUF,
+                 &(int){SOCKET_BUFFER_SIZE}, sizeof(int)) ||
+      connect(*receiver_fd, (const struct sockaddr*)&addr, sizeof(addr))) {
+    LOG("Failed to connect receiver socket (%s)", strerror(errno));
+    goto rollback_receiver_fd;
+  }
+
+  *sender_fd = accept(server_fd, NULL, NULL);
+  if (*sender_fd < 0) {
+    LOG("Failed to accept sender socket (%s)", strerror(errno));
+    goto rollback_receiver_fd;
+  }
+  int flags = fcntl(*sender_fd, F_GETFL);
+  if (setsockopt(*sender_fd, SOL_SOCKET, SO_SNDBUF,
+                 &(int){SOCKET_BUFFER_SIZE}, sizeof(int)) ||
+      setsockopt(*sender_fd, IPPROTO_TCP, TCP_NODELAY, &(int){1},
+                 sizeof(int)) ||
+      flags == -1 || fcntl(*sender_fd, F_SETFL, flags | O_NONBLOCK)) {
+    LOG("Failed to configure sender socket (%s)", strerror(errno));
+    goto rollback_sender_fd;
+  }
+  close(server_fd);
+  return true;
+
+rollback_sender_fd:
+  close(*sender_fd);
+rollback_receiver_fd:
+  close(*receiver_fd);
+rollback_server_fd:
+  close(server_fd);
+  return false;
+}
+
+// mburakov: Mirrors OnCaptureContextFrameReady, including skipping frames
+// while the client socket is saturated. Returns once the predicate holds for
+// the controlled bitrate, or fails after the timeout.
+static bool StreamUntil(struct BitrateController* bitrate_controller,
+                        struct ProtoQueue* proto_queue,
+                        bool (*predicate)(uint32_t), unsigned long long timeout,
+                        uint32_t* out_bitrate) {
+  static uint8_t frame[MAX_BITRATE / 8 / 60];
+  unsigned long long deadline = MicrosNow() + timeout;
+  for (unsigned long long now; (now = MicrosNow()) < deadline;) {
+    if (!ProtoQueueFlush(proto_queue)) {
+      LOG("Failed to flush proto queue");
+      return false;
+    }
+    uint32_t bitrate;
+    if (!BitrateControllerUpdate(bitrate_controller,
+                                 ProtoQueueGetSize(proto_queue), &bitrate)) {
+      LOG("Failed to update bitrate controller");
+      return false;
+    }
+    if (!bitrate) {
+      LOG("Bitrate dropped to zero");
+      return false;
+    }
+    *out_bitrate = bitrate;
+    if (predicate(bitrate)) return true;
+
+    if (!ProtoQueueGetDepth(proto_queue)) {
+      struct Proto proto = {
+          .size = (uint32_t)MIN(bitrate / 8 / 60, sizeof(frame)),
+          .type = PROTO_TYPE_VIDEO,
+      };
+      if (!ProtoQueueWrite(proto_queue, &proto, frame)) {
+        LOG("Failed to write frame");
+        return false;
+      }
+    }
+    unsigned long long next = now + FRAME_INTERVAL_US;
+    unsigned long long delay = next - MIN(next, MicrosNow());
+    nanosleep(&(struct timespec){.tv_nsec = (long)delay * 1000}, NULL);
+  }
+  LOG("Timed out with bitrate %u", *out_bitrate);
+  return false;
+}
+
+static bool IsThrottled(uint32_t bitrate) {
+  return bitrate <= THROTTLED_BITRATE;
+}
+
+static bool IsRecovered(uint32_t bitrate) { return bitrate == MAX_BITRATE; }
+
+static bool TestTinyBitrate(void) {
+  int sender_fd, receiver_fd;
+  if (!CreateConnection(&sender_fd, &receiver_fd)) {
+    LOG("Failed to create connection");
+    return false;
+  }
+  bool result = false;
+  struct BitrateController* bitrate_controller =
+      BitrateControllerCreate(sender_fd, 5);
+  if (!bitrate_controller) {
+    LOG("Failed to create bitrate controller");
+    goto rollback_connection;
+  }
+
+  // mburakov: Data stuck in the socket is way more than a tiny bitrate could
+  // drain, so every update lowers the bitrate down to the minimum.
+  static const uint8_t data[4096];
+  if (write(sender_fd, data, sizeof(data)) <= 0) {
+    LOG("Failed to write data (%s)", strerror(errno));
+    goto rollback_bitrate_controller;
+  }
+  for (int i = 0; i < 4; i++) {
+    uint32_t bitrate;
+    nanosleep(&(struct timespec){.tv_nsec = 300000000}, NULL);
+    if (!BitrateControllerUpdate(bitrate_controller, sizeof(data), &bitrate)) {
+      LOG("Failed to update bitrate controller");
+      goto rollback_bitrate_controller;
+    }
+    if (!bitrate) {
+      LOG("Bitrate dropped to zero");
+      goto rollback_bitrate_controller;
+    }
+  }
+  result = true;
+
+rollback_bitrate_controller:
+  BitrateControllerDestroy(bitrate_controller);
+rollback_connection:
+  close(sender_fd);
+  close(receiver_fd);
+  return result;
+}
+
+static bool TestThrottledReader(void) {
+  struct Reader reader;
+  int sender_fd;
+  if (!CreateConnection(&sender_fd, &reader.fd)) {
+    LOG("Failed to create connection");
+    return false;
+  }
+  atomic_init(&reader.bitrate, 0);
+
+  bool result = false;
+  struct ProtoQueue* proto_queue = ProtoQueueCreate(sender_fd, 16 << 20);
+  if (!proto_queue) {
+    LOG("Failed to create proto queue");
+    goto rollback_connection;
+  }
+  struct BitrateController* bitrate_controller =
+      BitrateControllerCreate(sender_fd, MAX_BITRATE);
+  if (!bitrate_controller) {
+    LOG("Failed to create bitrate controller");
+    goto rollback_proto_queue;
+  }
+  thrd_t thread;
+  if (thrd_create(&thread, ReaderThread, &reader) != thrd_success) {
+    LOG("Failed to create reader thread");
+    goto rollback_bitrate_controller;
+  }
+
+  uint32_t bitrate = MAX_BITRATE;
+  unsigned long long begin = MicrosNow();
+  atomic_store(&reader.bitrate, THROTTLED_BITRATE);
+  if (!StreamUntil(bitrate_controller, proto_queue, IsThrottled, 10000000,
+                   &bitrate)) {
+    LOG("Bitrate did not follow throttled reader");
+    goto rollback_thread;
+  }
+  printf("{\"throttled_after_us\": %llu, ", MicrosNow() - begin);
+
+  begin = MicrosNow();
+  atomic_store(&reader.bitrate, 0);
+  if (!StreamUntil(bitrate_controller, proto_queue, IsRecovered, 10000000,
+                   &bitrate)) {
+    LOG("Bitrate did not recover after throttling");
+    goto rollback_thread;
+  }
+  printf("\"recovered_after_us\": %llu}\n", MicrosNow() - begin);
+  result = true;
+
+rollback_thread:
+  atomic_store(&reader.bitrate, 0);
+  shutdown(sender_fd, SHUT_RDWR);
+  thrd_join(thread, NULL);
+rollback_bitrate_controller:
+  BitrateControllerDestroy(bitrate_controller);
+rollback_proto_queue:
+  ProtoQueueDestroy(proto_queue);
+rollback_connection:
+  close(sender_fd);
+  close(reader.fd);
+  return result;
+}
+
+int main(void) {
+  if (!TestTinyBitrate()) {
+    LOG("Tiny bitrate test failed");
+    return EXIT_FAILURE;
+  }
+  if (!TestThrottledReader()) {
+    LOG("Throttled reader test failed");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
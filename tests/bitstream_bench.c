@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bitstream.h"
+#include "tests/bitstream_legacy.h"
+#include "toolbox/perf.h"
+#include "toolbox/utils.h"
+
+// mburakov: Packs the same sequence of appends that hevc.c does for a P slice
+// segment of a 1080p frame split into several slices, with both the current
+// and the legacy writer. Reported times are per slice header, including the
+// emulation prevention pass.
+
+#define HEADERS_COUNT 4000000
+
+struct Writer {
+  void (*append)(struct Bitstream*, size_t, uint32_t);
+  void (*append_ue)(struct Bitstream*, uint32_t);
+  void (*append_se)(struct Bitstream*, int32_t);
+  void (*byte_align)(struct Bitstream*);
+  void (*inflate)(struct Bitstream*, const struct Bitstream*);
+};
+
+static const struct Writer kCurrentWriter = {
+    .append = BitstreamAppend,
+    .append_ue = BitstreamAppendUE,
+    .append_se = BitstreamAppendSE,
+    .byte_align = BitstreamByteAlign,
+    .inflate = BitstreamInflate,
+};
+
+static const struct Writer kLegacyWriter = {
+    .append = BitstreamLegacyAppend,
+    .append_ue = BitstreamLegacyAppendUE,
+    .append_se = BitstreamLegacyAppendSE,
+    .byte_align = BitstreamLegacyByteAlign,
+    .inflate = BitstreamLegacyInflate,
+};
+
+static size_t PackSliceHeader(const struct Writer* writer, uint8_t* output,
+                              uint32_t index) {
+  struct Bitstream bitstream = {.data = output};
+  writer->append(&bitstream, 32, 0x00000001);
+  writer->append(&bitstream, 1, 0);  // forbidden_zero_bit
+  writer->append(&bitstream, 6, 1);  // nal_unit_type
+  writer->append(&bitstream, 6, 0);  // nuh_layer_id
+  writer->append(&bitstream, 3, 1);  // nuh_temporal_id_plus1
+
+  uint8_t rbsp[64];
+  struct Bitstream slice_rbsp = {.data = rbsp};
+  uint32_t slice = index % 4;
+  writer->append(&slice_rbsp, 1, !slice);  // first_slice_segment_in_pic_flag
+  writer->append_ue(&slice_rbsp, 0);       // slice_pic_parameter_set_id
+  if (slice) writer->append(&slice_rbsp, 9, slice * 128);
+  writer->append_ue(&slice_rbsp, 1);                 // slice_type
+  writer->append(&slice_rbsp, 8, index / 4 & 0xff);  // slice_pic_order_cnt_lsb
+  writer->append(&slice_rbsp, 1, 0);  // short_term_ref_pic_set_sps_flag
+  writer->append_ue(&slice_rbsp, 1);  // num_negative_pics
+  writer->append_ue(&slice_rbsp, 0);  // num_positive_pics
+  writer->append_ue(&slice_rbsp, 0);  // delta_poc_s0_minus1
+  writer->append(&slice_rbsp, 1, 1);  // used_by_curr_pic_s0_flag
+  writer->append(&slice_rbsp, 1, 0);  // slice_temporal_mvp_enabled_flag
+  writer->append(&slice_rbsp, 1, 0);  // slice_sao_luma_flag
+  writer->append(&slice_rbsp, 1, 0);  // slice_sao_chroma_flag
+  writer->append(&slice_rbsp, 1, 0);  // num_ref_idx_active_override_flag
+  writer->append_ue(&slice_rbsp, 5 - 5);  // five_minus_max_num_merge_cand
+  writer->append_se(&slice_rbsp, (int32_t)(index % 7) - 3);  // slice_qp_delta
+  writer->append(&slice_rbsp, 1, 1);  // slice_loop_filter_across_slices_...
+  writer->append(&slice_rbsp, 1, 1);  // alignment_bit_equal_to_one
+  writer->byte_align(&slice_rbsp);
+
+  writer->inflate(&bitstream, &slice_rbsp);
+  return bitstream.size / 8;
+}
+
+static double Run(const struct Writer* writer, uint32_t* checksum) {
+  uint8_t output[128];
+  unsigned long long begin = MicrosNow();
+  for (uint32_t i = 0; i < HEADERS_COUNT; i++) {
+    size_t size = PackSliceHeader(writer, output, i);
+    for (size_t j = 0; j < size; j++) *checksum = *checksum * 31 + output[j];
+  }
+  return (double)(MicrosNow() - begin) * 1000 / HEADERS_COUNT;
+}
+
+int main(void) {
+  uint32_t current_checksum = 0;
+  uint32_t legacy_checksum = 0;
+  double current_ns = Run(&kCurrentWriter, &current_checksum);
+  double legacy_ns = Run(&kLegacyWriter, &legacy_checksum);
+  if (current_checksum != legacy_checksum) {
+    LOG("Packed slice headers do not match");
+    return EXIT_FAILURE;
+  }
+  printf("{\"bench\": \"bitstream\", \"headers\": %d, ", HEADERS_COUNT);
+  printf("\"current_ns\": %.1f, \"legacy_ns\": %.1f}\n", current_ns,
+         legacy_ns);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_TESTS_BITSTREAM_LEGACY_H_
+#define STREAMER_TESTS_BITSTREAM_LEGACY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct Bitstream;
+
+// mburakov: Bitwise writer that bitstream.c used to have, kept as a golden
+// reference for the current one.
+void BitstreamLegacyAppend(struct Bitstream* bitstream, size_t size,
+                           uint32_t bits);
+void BitstreamLegacyAppendUE(struct Bitstream* bitstream, uint32_t bits);
+void BitstreamLegacyAppendSE(struct Bitstream* bitstream, int32_t bits);
+void BitstreamLegacyByteAlign(struct Bitstream* bitstream);
+void BitstreamLegacyInflate(struct Bitstream* bitstream,
+                            const struct Bitstream* source);
+
+#endif  // STREAMER_TESTS_BITSTREAM_LEGACY_H_
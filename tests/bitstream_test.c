@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitstream.h"
+#include "tests/bitstream_legacy.h"
+#include "toolbox/utils.h"
+
+// mburakov: Current writer is fed the same pseudo-random sequences of appends
+// as the legacy one, on top of identical garbage, and the written bytes must
+// match. Legacy writer used to clear the byte following the written bits on
+// zero-sized appends, current one must not touch anything past those.
+
+#define SEQUENCES_COUNT 100000
+#define MAX_SEQUENCE_LENGTH 64
+#define BUFFER_SIZE 1024
+
+static uint32_t Random(uint32_t* state) {
+  *state = *state * 1664525 + 1013904223;
+  return *state >> 8;
+}
+
+// mburakov: Mostly small values, just like in real headers, but every now and
+// then something that spans the whole range.
+static uint32_t RandomValue(uint32_t* state, size_t size) {
+  uint32_t value = Random(state) << 8 ^ Random(state);
+  if (Random(state) % 4) {
+    size_t small_size = Random(state) % 9;
+    size = MIN(size, small_size);
+  }
+  return size < 32 ? value & ((UINT32_C(1) << size) - 1) : value;
+}
+
+static bool TestKnownCodes(void) {
+  // mburakov: Table 9-2, ue(v) of 0..8 followed by se(v) of -2..2.
+  static const uint8_t kExpected[] = {0xa6, 0x42, 0x98, 0xe2,
+                                      0x04, 0x95, 0xd1, 0x00};
+  uint8_t buffer[sizeof(kExpected)];
+  memset(buffer, 0xff, sizeof(buffer));
+  struct Bitstream bitstream = {.data = buffer};
+  for (uint32_t i = 0; i <= 8; i++) BitstreamAppendUE(&bitstream, i);
+  for (int32_t i = -2; i <= 2; i++) BitstreamAppendSE(&bitstream, i);
+  BitstreamByteAlign(&bitstream);
+  if (bitstream.size != sizeof(kExpected) * 8 ||
+      memcmp(buffer, kExpected, sizeof(kExpected))) {
+    LOG("Exp-golomb codes do not match (%zu bits)", bitstream.size);
+    return false;
+  }
+  return true;
+}
+
+static bool TestRandomAppends(void) {
+  static uint8_t garbage[BUFFER_SIZE];
+  static uint8_t expected[BUFFER_SIZE];
+  static uint8_t actual[BUFFER_SIZE];
+  uint32_t state = 1;
+  for (size_t i = 0; i < SEQUENCES_COUNT; i++) {
+    for (size_t j = 0; j < sizeof(garbage); j++)
+      garbage[j] = expected[j] = actual[j] = (uint8_t)Random(&state);
+    struct Bitstream legacy = {.data = expected};
+    struct Bitstream bitstream = {.data = actual};
+
+    size_t length = Random(&state) % MAX_SEQUENCE_LENGTH + 1;
+    for (size_t j = 0; j < length; j++) {
+      switch (Random(&state) % 8) {
+        case 0:
+        case 1:
+        case 2: {
+          size_t size = Random(&state) % 33;
+          uint32_t bits = RandomValue(&state, size);
+          BitstreamLegacyAppend(&legacy, size, bits);
+          BitstreamAppend(&bitstream, size, bits);
+          break;
+        }
+        case 3:
+        case 4: {
+          // mburakov: UINT32_MAX has no exp-golomb code that fits 32 bits.
+          uint32_t bits = RandomValue(&state, 32);
+          if (bits == UINT32_MAX) bits--;
+          BitstreamLegacyAppendUE(&legacy, bits);
+          BitstreamAppendUE(&bitstream, bits);
+          break;
+        }
+        case 5:
+        case 6: {
+          uint32_t bits = RandomValue(&state, 31);
+          int32_t value =
+              Random(&state) & 1 ? (int32_t)(bits / 2) : -(int32_t)(bits / 2);
+          BitstreamLegacyAppendSE(&legacy, value);
+          BitstreamAppendSE(&bitstream, value);
+          break;
+        }
+        default:
+          BitstreamLegacyByteAlign(&legacy);
+          BitstreamByteAlign(&bitstream);
+          break;
+      }
+      if (bitstream.size != legacy.size) {
+        LOG("Sequence %zu: size mismatch at append %zu (%zu vs %zu bits)", i,
+            j, legacy.size, bitstream.size);
+        return false;
+      }
+    }
+    size_t size = (bitstream.size + 7) / 8;
+    if (memcmp(actual, expected, size)) {
+      LOG("Sequence %zu: data mismatch after %zu appends", i, length);
+      return false;
+    }
+    if (memcmp(actual + size, garbage + size, sizeof(actual) - size)) {
+      LOG("Sequence %zu: data written past %zu bytes", i, size);
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool TestRandomInflate(void) {
+  static uint8_t source[BUFFER_SIZE / 2];
+  static uint8_t expected[BUFFER_SIZE];
+  static uint8_t actual[BUFFER_SIZE];
+  static uint8_t deflated[BUFFER_SIZE];
+  uint32_t state = 2;
+  for (size_t i = 0; i < SEQUENCES_COUNT; i++) {
+    // mburakov: Zeros are frequent, and the rest of bytes are biased towards
+    // the values that need escaping.
+    size_t size = Random(&state) % sizeof(source);
+    for (size_t j = 0; j < size; j++) {
+      uint32_t value = Random(&state);
+      source[j] = value % 2 ? 0 : (uint8_t)(value % 4 ? value % 5 : value >> 8);
+    }
+
+    // mburakov: Inflate appends to whatever was already there, so start with
+    // some unaligned prefix, that gets rounded up to a whole byte.
+    size_t prefix = Random(&state) % 24;
+    memset(expected, 0xaa, sizeof(expected));
+    memset(actual, 0xaa, sizeof(actual));
+    struct Bitstream legacy = {.data = expected, .size = prefix};
+    struct Bitstream bitstream = {.data = actual, .size = prefix};
+    const struct Bitstream input = {.data = source, .size = size * 8};
+    BitstreamLegacyInflate(&legacy, &input);
+    BitstreamInflate(&bitstream, &input);
+    if (bitstream.size != legacy.size ||
+        memcmp(actual, expected, sizeof(expected))) {
+      LOG("Sequence %zu: inflated data mismatch (%zu vs %zu bits)", i,
+          legacy.size, bitstream.size);
+      return false;
+    }
+
+    size_t offset = (prefix + 7) / 8;
+    struct Bitstream output = {.data = deflated};
+    const struct Bitstream escaped = {
+        .data = actual + offset,
+        .size = bitstream.size - offset * 8,
+    };
+    BitstreamDeflate(&output, &escaped);
+    if (output.size != input.size || memcmp(deflated, source, size)) {
+      LOG("Sequence %zu: deflated data mismatch (%zu vs %zu bits)", i,
+          input.size, output.size);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(void) {
+  if (!TestKnownCodes()) {
+    LOG("Known codes test failed");
+    return EXIT_FAILURE;
+  }
+  if (!TestRandomAppends()) {
+    LOG("Random appends test failed");
+    return EXIT_FAILURE;
+  }
+  if (!TestRandomInflate()) {
+    LOG("Random inflate test failed");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
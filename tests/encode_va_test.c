@@ -0,0 +1,703 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <threads.h>
+#include <unistd.h>
+#include <va/va.h>
+#include <va/va_drm.h>
+#include <va/va_drmcommon.h>
+
+#include "encode_va.h"
+#include "gpu.h"
+#include "proto.h"
+#include "toolbox/utils.h"
+
+// mburakov: VA-API and gpu entry points used by encode_va.c are stubbed at
+// link time with a fake driver that keeps buffers in memory, so that the slot
+// ring could be exercised on a host without any gpu. Every frame encoded by
+// the fake driver is just its sequence number, and syncing a frame blocks
+// until the test explicitly releases it. The render node is wrapped as well,
+// and is substituted with /dev/null.
+
+#define MAX_BUFFERS 512
+#define MAX_FRAMES 1024
+#define FRAMES_COUNT 256
+
+struct FakeBuffer {
+  bool used;
+  VABufferType type;
+  unsigned int size;
+  uint8_t* data;
+  VACodedBufferSegment segment;
+  size_t frame;
+  bool busy;
+};
+
+static struct FakeDriver {
+  mtx_t mutex;
+  cnd_t cond;
+  struct FakeBuffer buffers[MAX_BUFFERS];
+  VABufferID coded_buf;
+  uint32_t misc_types;
+  VAEncMiscParameterRateControl rate_control;
+  VAEncMiscParameterHRD hrd;
+  size_t ended;
+  size_t consumed;
+  size_t max_in_flight;
+  bool released[MAX_FRAMES];
+  bool overwritten;
+} g_driver;
+
+int __real_open(const char* path, int flags, ...);
+
+int __wrap_open(const char* path, int flags, ...) {
+  mode_t mode = 0;
+  if (flags & O_CREAT) {
+    va_list args;
+    va_start(args, flags);
+    mode = va_arg(args, mode_t);
+    va_end(args);
+  }
+  if (!strcmp(path, "/dev/dri/renderD128")) path = "/dev/null";
+  return __real_open(path, flags, mode);
+}
+
+struct GpuFrame* GpuContextCreateFrame(struct GpuContext* gpu_context,
+                                       uint32_t width, uint32_t height,
+                                       uint32_t fourcc, size_t nplanes,
+                                       const struct GpuFramePlane* planes) {
+  (void)gpu_context;
+  (void)fourcc;
+  (void)nplanes;
+  (void)planes;
+  struct GpuFrame* gpu_frame = malloc(sizeof(struct GpuFrame));
+  if (!gpu_frame) return NULL;
+  *gpu_frame = (struct GpuFrame){.width = width, .height = height};
+  return gpu_frame;
+}
+
+void GpuContextDestroyFrame(struct GpuContext* gpu_context,
+                            struct GpuFrame* gpu_frame) {
+  (void)gpu_context;
+  free(gpu_frame);
+}
+
+void CloseUniqueFds(int fds[4]) { (void)fds; }
+
+VADisplay vaGetDisplayDRM(int fd) {
+  (void)fd;
+  return &g_driver;
+}
+
+VAMessageCallback vaSetErrorCallback(VADisplay dpy, VAMessageCallback callback,
+                                     void* user_context) {
+  (void)dpy;
+  (void)callback;
+  (void)user_context;
+  return NULL;
+}
+
+VAMessageCallback vaSetInfoCallback(VADisplay dpy, VAMessageCallback callback,
+                                    void* user_context) {
+  (void)dpy;
+  (void)callback;
+  (void)user_context;
+  return NULL;
+}
+
+VAStatus vaInitialize(VADisplay dpy, int* major_version, int* minor_version) {
+  (void)dpy;
+  *major_version = 1;
+  *minor_version = 20;
+  return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaTerminate(VADisplay dpy) {
+  (void)dpy;
+  return VA_STATUS_SUCCESS;
+}
+
+int vaMaxNumEntrypoints(VADisplay dpy) {
+  (void)dpy;
+  return 1;
+}
+
+VAStatus vaQueryConfigEntrypoints(VADisplay dpy, VAProfile profile,
+                                  VAEntrypoint* entrypoint_list,
+                                  int* num_entrypoints) {
+  (void)dpy;
+  *num_entrypoints = profile == VAProfileHEVCMain;
+  if (*num_entrypoints) entrypoint_list[0] = VAEntrypointEncSlice;
+  return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaGetConfigAttributes(VADisplay dpy, VAProfile profile,
+                               VAEntrypoint entrypoint,
+                               VAConfigAttrib* attrib_list, int num_attribs) {
+  (void)dpy;
+  (void)profile;
+  (void)entrypoint;
+  for (int i = 0; i < num_attribs; i++) {
+    switch (attrib_list[i].type) {
+      case VAConfigAttribEncPackedHeaders:
+        attrib_list[i].value = VA_ENC_PACKED_HEADER_SEQUENCE;
+        break;
+      case VAConfigAttribRateControl:
+        attrib_list[i].value = VA_RC_CQP | VA_RC_CBR | VA_RC_VBR;
+        break;
+      default:
+        attrib_list[i].value = VA_ATTRIB_NOT_SUPPORTED;
+        break;
+    }
+  }
+  return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaCreateConfig(VADisplay dpy, VAProfile profile,
+                        VAEntrypoint entrypoint, VAConfigAttrib* attrib_list,
+                        int num_attribs, VAConfigID* config_id) {
+  (void)dpy;
+  (void)profile;
+  (void)entrypoint;
+  (void)attrib_list;
+  (void)num_attribs;
+  *config_id = 1;
+  return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaDestroyConfig(VADisplay dpy, VAConfigID config_id) {
+  (void)dpy;
+  (void)config_id;
+  return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaCreateSurfaces(VADisplay dpy, unsigned int format,
+                          unsigned int width, unsigned int height,
+                          VASurfaceID* surfaces, unsigned int num_surfaces,
+                          VASurfaceAttrib* attrib_list,
+                          unsigned int num_attribs) {
+  (void)dpy;
+  (void)format;
+  (void)width;
+  (void)height;
+  (void)attrib_list;
+  (void)num_attribs;
+  static VASurfaceID next_surface_id = 1;
+  for (unsigned int i = 0; i < num_surfaces; i++)
+    surfaces[i] = next_surface_id++;
+  return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaDestroySurfaces(VADisplay dpy, VASurfaceID* surfaces,
+                           int num_surfaces) {
+  (void)dpy;
+  (void)surfaces;
+  (void)num_surfaces;
+  return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaExportSurfaceHandle(VADisplay dpy, VASurfaceID surface_id,
+                               uint32_t mem_type, uint32_t flags,
+                               void* descriptor) {
+  (void)dpy;
+  (void)surface_id;
+  (void)mem_type;
+  (void)flags;
+  VADRMPRIMESurfaceDescriptor* prime = descriptor;
+  *prime = (VADRMPRIMESurfaceDescriptor){
+      .width = 64,
+      .height = 64,
+      .num_objects = 1,
+      .objects[0].fd = -1,
+      .num_layers = 1,
+      .layers[0].num_planes = 2,
+  };
+  return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaCreateContext(VADisplay dpy, VAConfigID config_id, int picture_width,
+                         int picture_height, int flag,
+                         VASurfaceID* render_targets, int num_render_targets,
+                         VAContextID* context) {
+  (void)dpy;
+  (void)config_id;
+  (void)picture_width;
+  (void)picture_height;
+  (void)flag;
+  (void)render_targets;
+  (void)num_render_targets;
+  *context = 1;
+  return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaDestroyContext(VADisplay dpy, VAContextID context) {
+  (void)dpy;
+  (void)context;
+  return VA_STATUS_SUCCESS;
+}
+
+static struct FakeBuffer* LookupBuffer(VABufferID buf_id) {
+  if (!buf_id || buf_id > MAX_BUFFERS) return NULL;
+  struct FakeBuffer* buffer = &g_driver.buffers[buf_id - 1];
+  return buffer->used ? buffer : NULL;
+}
+
+VAStatus vaCreateBuffer(VADisplay dpy, VAContextID context, VABufferType type,
+                        unsigned int size, unsigned int num_elements,
+                        void* data, VABufferID* buf_id) {
+  (void)dpy;
+  (void)context;
+  for (size_t i = 0; i < MAX_BUFFERS; i++) {
+    struct FakeBuffer* buffer = &g_driver.buffers[i];
+    if (buffer->used) continue;
+    *buffer = (struct FakeBuffer){
+        .used = true,
+        .type = type,
+        .size = size * num_elements,
+        .data = calloc(1, size * num_elements),
+    };
+    if (!buffer->data) return VA_STATUS_ERROR_OPERATION_FAILED;
+    if (data) memcpy(buffer->data, data, buffer->size);
+    *buf_id = (VABufferID)i + 1;
+    return VA_STATUS_SUCCESS;
+  }
+  return VA_STATUS_ERROR_OPERATION_FAILED;
+}
+
+VAStatus vaMapBuffer(VADisplay dpy, VABufferID buf_id, void** pbuf) {
+  (void)dpy;
+  struct FakeBuffer* buffer = LookupBuffer(buf_id);
+  if (!buffer) return VA_STATUS_ERROR_INVALID_BUFFER;
+  if (buffer->type != VAEncCodedBufferType) {
+    *pbuf = buffer->data;
+    return VA_STATUS_SUCCESS;
+  }
+  buffer->segment = (VACodedBufferSegment){
+      .size = sizeof(uint32_t),
+      .buf = buffer->data,
+  };
+  *pbuf = &buffer->segment;
+  return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaUnmapBuffer(VADisplay dpy, VABufferID buf_id) {
+  (void)dpy;
+  struct FakeBuffer* buffer = LookupBuffer(buf_id);
+  if (!buffer) return VA_STATUS_ERROR_INVALID_BUFFER;
+  if (buffer->type == VAEncCodedBufferType && buffer->busy) {
+    buffer->busy = false;
+    g_driver.consumed++;
+  }
+  return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaDestroyBuffer(VADisplay dpy, VABufferID buffer_id) {
+  (void)dpy;
+  struct FakeBuffer* buffer = LookupBuffer(buffer_id);
+  if (!buffer) return VA_STATUS_ERROR_INVALID_BUFFER;
+  free(buffer->data);
+  buffer->used = false;
+  return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaBeginPicture(VADisplay dpy, VAContextID context,
+                        VASurfaceID render_target) {
+  (void)dpy;
+  (void)context;
+  (void)render_target;
+  g_driver.coded_buf = VA_INVALID_ID;
+  g_driver.misc_types = 0;
+  return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaRenderPicture(VADisplay dpy, VAContextID context,
+                         VABufferID* buffers, int num_buffers) {
+  (void)dpy;
+  (void)context;
+  for (int i = 0; i < num_buffers; i++) {
+    struct FakeBuffer* buffer = LookupBuffer(buffers[i]);
+    if (!buffer) return VA_STATUS_ERROR_INVALID_BUFFER;
+    if (buffer->type == VAEncPictureParameterBufferType) {
+      const VAEncPictureParameterBufferHEVC* pic = (void*)buffer->data;
+      g_driver.coded_buf = pic->coded_buf;
+    }
+    if (buffer->type == VAEncMiscParameterBufferType) {
+      const VAEncMiscParameterBuffer* misc = (void*)buffer->data;
+      g_driver.misc_types |= 1u << misc->type;
+      if (misc->type == VAEncMiscParameterTypeRateControl) {
+        memcpy(&g_driver.rate_control, misc->data,
+               sizeof(g_driver.rate_control));
+      }
+      if (misc->type == VAEncMiscParameterTypeHRD)
+        memcpy(&g_driver.hrd, misc->data, sizeof(g_driver.hrd));
+    }
+  }
+  return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaEndPicture(VADisplay dpy, VAContextID context) {
+  (void)dpy;
+  (void)context;
+  struct FakeBuffer* buffer = LookupBuffer(g_driver.coded_buf);
+  if (!buffer || buffer->type != VAEncCodedBufferType)
+    return VA_STATUS_ERROR_INVALID_BUFFER;
+
+  // mburakov: Coded buffer must not be reused before its previous contents
+  // were read out by the encoder.
+  if (buffer->busy) g_driver.overwritten = true;
+  mtx_lock(&g_driver.mutex);
+  uint32_t frame = (uint32_t)g_driver.ended++;
+  size_t in_flight = g_driver.ended - g_driver.consumed;
+  g_driver.max_in_flight = MAX(g_driver.max_in_flight, in_flight);
+  mtx_unlock(&g_driver.mutex);
+  memcpy(buffer->data, &frame, sizeof(frame));
+  buffer->frame = frame;
+  buffer->busy = true;
+  return VA_STATUS_SUCCESS;
+}
+
+VAStatus vaSyncBuffer(VADisplay dpy, VABufferID buf_id, uint64_t timeout_ns) {
+  (void)dpy;
+  (void)timeout_ns;
+  struct FakeBuffer* buffer = LookupBuffer(buf_id);
+  if (!buffer) return VA_STATUS_ERROR_INVALID_BUFFER;
+  mtx_lock(&g_driver.mutex);
+  while (!g_driver.released[buffer->frame % MAX_FRAMES])
+    cnd_wait(&g_driver.cond, &g_driver.mutex);
+  g_driver.released[buffer->frame % MAX_FRAMES] = false;
+  mtx_unlock(&g_driver.mutex);
+  return VA_STATUS_SUCCESS;
+}
+
+static uint32_t Random(uint32_t* state) {
+  *state = *state * 1664525 + 1013904223;
+  return *state >> 8;
+}
+
+static void ReleaseFrame(size_t frame) {
+  mtx_lock(&g_driver.mutex);
+  g_driver.released[frame % MAX_FRAMES] = true;
+  cnd_broadcast(&g_driver.cond);
+  mtx_unlock(&g_driver.mutex);
+}
+
+static void ResetDriver(void) {
+  mtx_lock(&g_driver.mutex);
+  g_driver.ended = 0;
+  g_driver.consumed = 0;
+  g_driver.max_in_flight = 0;
+  memset(g_driver.released, 0, sizeof(g_driver.released));
+  g_driver.overwritten = false;
+  mtx_unlock(&g_driver.mutex);
+}
+
+static bool IsReadable(int fd, int timeout) {
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  return poll(&pfd, 1, timeout) == 1 && pfd.revents & POLLIN;
+}
+
+static bool TestRateControlParameters(void) {
+  VAEncMiscParameterRateControl va_rate_control;
+  VAEncMiscParameterHRD va_hrd;
+  VAEncMiscParameterFrameRate va_frame_rate;
+  struct RateControl rate_control = {
+      .mode = kRateControlCbr,
+      .bitrate = 8000000,
+      .vbv_size = 8000000 / FRAME_RATE,
+  };
+  FillVaRateControlParameters(&rate_control, false, &va_rate_control, &va_hrd,
+                              &va_frame_rate);
+  if (va_rate_control.bits_per_second != 8000000 ||
+      va_rate_control.target_percentage != 100 ||
+      va_rate_control.window_size != 1000 / FRAME_RATE ||
+      va_rate_control.rc_flags.bits.reset ||
+      va_rate_control.rc_flags.bits.disable_bit_stuffing) {
+    LOG("Unexpected cbr rate control parameters");
+    return false;
+  }
+  if (va_hrd.buffer_size != rate_control.vbv_size ||
+      va_hrd.initial_buffer_fullness != rate_control.vbv_size / 4 * 3 ||
+      va_frame_rate.framerate != FRAME_RATE) {
+    LOG("Unexpected cbr hrd parameters");
+    return false;
+  }
+
+  // mburakov: In vbr mode the bitrate is a peak one, and the buffer size is
+  // still passed as is.
+  rate_control.mode = kRateControlVbr;
+  rate_control.vbv_size = 4000000;
+  FillVaRateControlParameters(&rate_control, true, &va_rate_control, &va_hrd,
+                              &va_frame_rate);
+  if (va_rate_control.bits_per_second != 8000000 ||
+      va_rate_control.target_percentage != 75 ||
+      va_rate_control.window_size != 500 ||
+      !va_rate_control.rc_flags.bits.reset ||
+      !va_rate_control.rc_flags.bits.disable_bit_stuffing) {
+    LOG("Unexpected vbr rate control parameters");
+    return false;
+  }
+  if (va_hrd.buffer_size != 4000000 ||
+      va_hrd.initial_buffer_fullness != 3000000) {
+    LOG("Unexpected vbr hrd parameters");
+    return false;
+  }
+  return true;
+}
+
+static struct EncodeContextVa* CreateEncodeContext(void) {
+  static const struct EncodeConfig kEncodeConfig = {
+      .backend = kEncodeBackendVa,
+      .codec = kEncodeCodecHevc,
+      .rate_control =
+          {
+              .mode = kRateControlCbr,
+              .bitrate = 8000000,
+              .vbv_size = 8000000 / FRAME_RATE,
+          },
+      .idr_period = 0,
+      .slices = 1,
+  };
+  ResetDriver();
+  return EncodeContextVaCreate(NULL, 64, 64, kItuRec709, kNarrowRange,
+                               &kEncodeConfig);
+}
+
+static bool TestBackPressure(void) {
+  struct EncodeContextVa* encode_context = CreateEncodeContext();
+  if (!encode_context) {
+    LOG("Failed to create encode context");
+    return false;
+  }
+
+  int fds[2];
+  bool result = false;
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+    LOG("Failed to create socketpair (%s)", strerror(errno));
+    goto rollback_encode_context;
+  }
+  struct ProtoQueue* proto_queue = ProtoQueueCreate(fds[0], 1 << 20);
+  if (!proto_queue) {
+    LOG("Failed to create proto queue");
+    goto rollback_fds;
+  }
+
+  // mburakov: Nothing is released, so the slot ring fills up, and then
+  // encoder refuses to provide any more frames.
+  for (size_t i = 0; i < 3; i++) {
+    if (!EncodeContextVaGetFrame(encode_context) ||
+        !EncodeContextVaEncodeFrame(encode_context, 0)) {
+      LOG("Failed to encode frame %zu", i);
+      goto rollback_proto_queue;
+    }
+  }
+  int events_fd = EncodeContextVaGetEventsFd(encode_context);
+  if (EncodeContextVaGetFrame(encode_context) || IsReadable(events_fd, 10)) {
+    LOG("Blocked slots did not push back");
+    goto rollback_proto_queue;
+  }
+
+  // mburakov: Releasing a frame frees exactly one slot, and only after the
+  // encoded frame was read out.
+  ReleaseFrame(0);
+  if (!IsReadable(events_fd, 1000) ||
+      EncodeContextVaGetFrame(encode_context)) {
+    LOG("Released slot was reused before being processed");
+    goto rollback_proto_queue;
+  }
+  if (!EncodeContextVaProcessEvents(encode_context, proto_queue) ||
+      !EncodeContextVaGetFrame(encode_context) ||
+      IsReadable(events_fd, 10)) {
+    LOG("Failed to reuse released slot");
+    goto rollback_proto_queue;
+  }
+  if (!EncodeContextVaEncodeFrame(encode_context, 0) ||
+      EncodeContextVaGetFrame(encode_context)) {
+    LOG("Slot ring was not full again");
+    goto rollback_proto_queue;
+  }
+  result = g_driver.max_in_flight == 3;
+  if (!result) LOG("Unexpected frames in flight (%zu)", g_driver.max_in_flight);
+
+rollback_proto_queue:
+  // mburakov: Sync thread has to be unblocked before destroying the encoder.
+  for (size_t i = 0; i < g_driver.ended; i++) ReleaseFrame(i);
+  ProtoQueueDestroy(proto_queue);
+rollback_fds:
+  close(fds[1]);
+  close(fds[0]);
+rollback_encode_context:
+  EncodeContextVaDestroy(encode_context);
+  return result;
+}
+
+static bool TestSubmissionOrder(void) {
+  struct EncodeContextVa* encode_context = CreateEncodeContext();
+  if (!encode_context) {
+    LOG("Failed to create encode context");
+    return false;
+  }
+
+  int fds[2];
+  bool result = false;
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+    LOG("Failed to create socketpair (%s)", strerror(errno));
+    goto rollback_encode_context;
+  }
+  struct ProtoQueue* proto_queue = ProtoQueueCreate(fds[0], 1 << 20);
+  if (!proto_queue) {
+    LOG("Failed to create proto queue");
+    goto rollback_fds;
+  }
+
+  // mburakov: Frames in flight are released in random order, but encoded
+  // frames must still come out in the order these were submitted.
+  uint32_t state = 42;
+  size_t encoded = 0;
+  size_t processed = 0;
+  int events_fd = EncodeContextVaGetEventsFd(encode_context);
+  while (processed < FRAMES_COUNT) {
+    if (encoded < FRAMES_COUNT && EncodeContextVaGetFrame(encode_context)) {
+      if (!EncodeContextVaEncodeFrame(encode_context, 0)) {
+        LOG("Failed to encode frame %zu", encoded);
+        goto rollback_proto_queue;
+      }
+      encoded++;
+    }
+    if (encoded > processed && Random(&state) % 2)
+      ReleaseFrame(processed + Random(&state) % (encoded - processed));
+    if (encoded == FRAMES_COUNT || !EncodeContextVaGetFrame(encode_context)) {
+      for (size_t i = processed; i < encoded; i++) ReleaseFrame(i);
+    }
+    if (!IsReadable(events_fd, 0)) continue;
+    if (!EncodeContextVaProcessEvents(encode_context, proto_queue)) {
+      LOG("Failed to process encoder events");
+      goto rollback_proto_queue;
+    }
+
+    // mburakov: Messages are read out right away, so that the socket never
+    // fills up and the proto queue never has to buffer anything.
+    struct Proto proto;
+    uint32_t frame;
+    if (read(fds[1], &proto, sizeof(proto)) != sizeof(proto) ||
+        proto.size != sizeof(frame) ||
+        read(fds[1], &frame, sizeof(frame)) != sizeof(frame)) {
+      LOG("Failed to read encoded frame %zu", processed);
+      goto rollback_proto_queue;
+    }
+    if (frame != processed) {
+      LOG("Unexpected frame %u instead of %zu", frame, processed);
+      goto rollback_proto_queue;
+    }
+    processed++;
+  }
+  if (g_driver.max_in_flight > 3 || g_driver.overwritten) {
+    LOG("Too many frames in flight (%zu)", g_driver.max_in_flight);
+    goto rollback_proto_queue;
+  }
+  result = true;
+
+rollback_proto_queue:
+  for (size_t i = 0; i < g_driver.ended; i++) ReleaseFrame(i);
+  ProtoQueueDestroy(proto_queue);
+rollback_fds:
+  close(fds[1]);
+  close(fds[0]);
+rollback_encode_context:
+  EncodeContextVaDestroy(encode_context);
+  return result;
+}
+
+static bool TestSetBitrate(void) {
+  struct EncodeContextVa* encode_context = CreateEncodeContext();
+  if (!encode_context) {
+    LOG("Failed to create encode context");
+    return false;
+  }
+
+  // mburakov: Rate control parameters go with the first frame only, and then
+  // once more with the first frame after a bitrate change.
+  static const uint32_t kRateControlTypes =
+      1u << VAEncMiscParameterTypeRateControl |
+      1u << VAEncMiscParameterTypeHRD | 1u << VAEncMiscParameterTypeFrameRate;
+  bool result = false;
+  uint32_t vbv_size = 8000000 / FRAME_RATE;
+  if (!EncodeContextVaEncodeFrame(encode_context, 0) ||
+      g_driver.misc_types != kRateControlTypes ||
+      g_driver.rate_control.bits_per_second != 8000000 ||
+      g_driver.rate_control.rc_flags.bits.reset ||
+      g_driver.hrd.buffer_size != vbv_size) {
+    LOG("Unexpected rate control parameters on first frame");
+    goto rollback_encode_context;
+  }
+  if (!EncodeContextVaEncodeFrame(encode_context, 0) || g_driver.misc_types) {
+    LOG("Unexpected rate control parameters on second frame");
+    goto rollback_encode_context;
+  }
+
+  // mburakov: Buffer size is scaled together with bitrate, so that its
+  // duration, and therefore the latency, stays the same.
+  EncodeContextVaSetBitrate(encode_context, 4000000);
+  if (!EncodeContextVaEncodeFrame(encode_context, 0) ||
+      g_driver.misc_types != kRateControlTypes ||
+      g_driver.rate_control.bits_per_second != 4000000 ||
+      !g_driver.rate_control.rc_flags.bits.reset ||
+      g_driver.hrd.buffer_size != vbv_size / 2) {
+    LOG("Unexpected rate control parameters after bitrate change");
+    goto rollback_encode_context;
+  }
+  result = true;
+
+rollback_encode_context:
+  for (size_t i = 0; i < g_driver.ended; i++) ReleaseFrame(i);
+  EncodeContextVaDestroy(encode_context);
+  return result;
+}
+
+int main(void) {
+  if (mtx_init(&g_driver.mutex, mtx_plain) != thrd_success ||
+      cnd_init(&g_driver.cond) != thrd_success) {
+    LOG("Failed to initialize fake driver");
+    return EXIT_FAILURE;
+  }
+  if (!TestRateControlParameters()) {
+    LOG("Rate control parameters test failed");
+    return EXIT_FAILURE;
+  }
+  if (!TestBackPressure()) {
+    LOG("Back pressure test failed");
+    return EXIT_FAILURE;
+  }
+  if (!TestSubmissionOrder()) {
+    LOG("Submission order test failed");
+    return EXIT_FAILURE;
+  }
+  if (!TestSetBitrate()) {
+    LOG("Set bitrate test failed");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
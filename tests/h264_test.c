@@ -0,0 +1,446 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <va/va.h>
+
+#include "bitstream.h"
+#include "h264.h"
+#include "h264_parse.h"
+#include "toolbox/utils.h"
+
+// mburakov: Same as hevc_test.c, va buffers are filled the way encode_va.c
+// does for a range of stream configurations, and every field parsed back from
+// packed headers must match either va buffers, or the value hardcoded in
+// h264.c. Slice headers are not byte aligned, so the parsed header size must
+// also match the bit length of the packed header.
+
+#define VALIDATE(expected, actual)                                        \
+  do {                                                                    \
+    if ((int64_t)(expected) != (int64_t)(actual)) {                       \
+      LOG("Mismatching " #actual " (%jd vs %jd)", (intmax_t)(expected), \
+          (intmax_t)(actual));                                            \
+      result = false;                                                     \
+    }                                                                     \
+  } while (0)
+
+#define FRAMES_COUNT 600
+#define IDR_PERIOD 293
+
+struct TestCase {
+  uint32_t width;
+  uint32_t height;
+  bool high_profile;
+  bool pic_order_cnt_lsb;
+  bool chroma_qp_offsets;
+  bool timing;
+  bool rec601;
+  bool full_range;
+  uint32_t slices;
+};
+
+struct Headers {
+  VAEncSequenceParameterBufferH264 seq;
+  VAEncPictureParameterBufferH264 pic;
+  VAEncSliceParameterBufferH264 slice;
+  struct MoreH264SeqParameters msp;
+  struct H264SeqParameterSet sps;
+  struct H264PicParameterSet pps;
+};
+
+static const struct TestCase kTestCases[] = {
+    {1920, 1080, false, false, false, false, false, false, 1},
+    {1920, 1080, true, false, false, false, true, true, 4},
+    {3840, 2160, true, true, true, true, false, true, 8},
+    {1366, 768, false, true, false, true, true, false, 3},
+    {640, 360, true, false, true, false, false, false, 23},
+};
+
+// mburakov: Mirrors InitializeH264SeqHeader, InitializeH264PicHeader,
+// InitializeH264SliceHeader and PackH264ParameterSets in encode_va.c. Picture
+// order count lsb, chroma qp offsets and timing are not used there, but these
+// cover the remaining branches of the writers.
+static void InitializeHeaders(const struct TestCase* test_case,
+                              struct Headers* headers) {
+  static const uint32_t mb_size = 16;
+  uint32_t aligned_width = (test_case->width + mb_size - 1) & ~(mb_size - 1);
+  uint32_t aligned_height =
+      (test_case->height + mb_size - 1) & ~(mb_size - 1);
+  uint32_t frame_crop_right_offset = (aligned_width - test_case->width) / 2;
+  uint32_t frame_crop_bottom_offset = (aligned_height - test_case->height) / 2;
+
+  headers->seq = (VAEncSequenceParameterBufferH264){
+      .seq_parameter_set_id = 0,
+      .level_idc = 51,
+      .intra_period = IDR_PERIOD,
+      .intra_idr_period = IDR_PERIOD,
+      .ip_period = 1,
+      .max_num_ref_frames = 1,
+      .picture_width_in_mbs = (uint16_t)(aligned_width / mb_size),
+      .picture_height_in_mbs = (uint16_t)(aligned_height / mb_size),
+      .seq_fields.bits =
+          {
+              .chroma_format_idc = 1,
+              .frame_mbs_only_flag = 1,
+              .direct_8x8_inference_flag = 1,
+              .log2_max_frame_num_minus4 = 4,
+              .pic_order_cnt_type = test_case->pic_order_cnt_lsb ? 0 : 2,
+              .log2_max_pic_order_cnt_lsb_minus4 =
+                  test_case->pic_order_cnt_lsb ? 2 : 0,
+          },
+      .frame_cropping_flag =
+          frame_crop_right_offset || frame_crop_bottom_offset,
+      .frame_crop_right_offset = frame_crop_right_offset,
+      .frame_crop_bottom_offset = frame_crop_bottom_offset,
+      .vui_parameters_present_flag = 1,
+      .vui_fields.bits =
+          {
+              .aspect_ratio_info_present_flag = test_case->timing,
+              .timing_info_present_flag = test_case->timing,
+              .bitstream_restriction_flag = 1,
+              .log2_max_mv_length_horizontal = 15,
+              .log2_max_mv_length_vertical = 15,
+              .fixed_frame_rate_flag = test_case->timing,
+              .motion_vectors_over_pic_boundaries_flag = 1,
+          },
+      .aspect_ratio_idc = test_case->timing ? 255 : 0,
+      .sar_width = test_case->timing ? 4 : 0,
+      .sar_height = test_case->timing ? 3 : 0,
+      .num_units_in_tick = test_case->timing ? 1 : 0,
+      .time_scale = test_case->timing ? 120 : 0,
+  };
+
+  headers->pic = (VAEncPictureParameterBufferH264){
+      .pic_parameter_set_id = 0,
+      .seq_parameter_set_id = headers->seq.seq_parameter_set_id,
+      .pic_init_qp = 26,
+      .chroma_qp_index_offset =
+          (int8_t)(test_case->chroma_qp_offsets ? -2 : 0),
+      .second_chroma_qp_index_offset =
+          (int8_t)(test_case->chroma_qp_offsets ? 3 : 0),
+      .pic_fields.bits =
+          {
+              .reference_pic_flag = 1,
+              .entropy_coding_mode_flag = test_case->high_profile,
+              .transform_8x8_mode_flag = test_case->high_profile,
+              .deblocking_filter_control_present_flag = 1,
+          },
+  };
+
+  headers->slice = (VAEncSliceParameterBufferH264){
+      .macroblock_info = VA_INVALID_ID,
+      .pic_parameter_set_id = headers->pic.pic_parameter_set_id,
+      .num_ref_idx_l0_active_minus1 =
+          headers->pic.num_ref_idx_l0_active_minus1,
+      .num_ref_idx_l1_active_minus1 =
+          headers->pic.num_ref_idx_l1_active_minus1,
+  };
+
+  headers->msp = (struct MoreH264SeqParameters){
+      .profile_idc = test_case->high_profile ? 100 : 66,
+      .constraint_set0_flag = !test_case->high_profile,
+      .constraint_set1_flag = !test_case->high_profile,
+      .constraint_set2_flag = 0,
+      .video_signal_type_present_flag = 1,
+      .video_full_range_flag = test_case->full_range,
+      .colour_description_present_flag = 1,
+      .colour_primaries = 2,
+      .transfer_characteristics = 2,
+      .matrix_coefficients = test_case->rec601 ? 6 : 1,
+      .max_num_reorder_frames = 0,
+      .max_dec_frame_buffering = 1,
+  };
+}
+
+static bool ValidateVuiParameters(const VAEncSequenceParameterBufferH264* seq,
+                                  const struct MoreH264SeqParameters* msp,
+                                  const struct H264VuiParameters* vui) {
+  const typeof(seq->vui_fields.bits)* vui_bits = &seq->vui_fields.bits;
+  bool aspect_ratio = vui_bits->aspect_ratio_info_present_flag;
+  bool extended_sar = aspect_ratio && seq->aspect_ratio_idc == 255;
+  bool timing = vui_bits->timing_info_present_flag;
+  bool restriction = vui_bits->bitstream_restriction_flag;
+
+  bool result = true;
+  VALIDATE(aspect_ratio, vui->aspect_ratio_info_present_flag);
+  VALIDATE(aspect_ratio ? seq->aspect_ratio_idc : 0, vui->aspect_ratio_idc);
+  VALIDATE(extended_sar ? seq->sar_width : 0, vui->sar_width);
+  VALIDATE(extended_sar ? seq->sar_height : 0, vui->sar_height);
+  VALIDATE(0, vui->overscan_info_present_flag);
+  VALIDATE(msp->video_signal_type_present_flag,
+           vui->video_signal_type_present_flag);
+  VALIDATE(5, vui->video_format);
+  VALIDATE(msp->video_full_range_flag, vui->video_full_range_flag);
+  VALIDATE(msp->colour_description_present_flag,
+           vui->colour_description_present_flag);
+  VALIDATE(msp->colour_primaries, vui->colour_primaries);
+  VALIDATE(msp->transfer_characteristics, vui->transfer_characteristics);
+  VALIDATE(msp->matrix_coefficients, vui->matrix_coefficients);
+  VALIDATE(0, vui->chroma_loc_info_present_flag);
+  VALIDATE(timing, vui->timing_info_present_flag);
+  VALIDATE(timing ? seq->num_units_in_tick : 0, vui->num_units_in_tick);
+  VALIDATE(timing ? seq->time_scale : 0, vui->time_scale);
+  VALIDATE(timing && vui_bits->fixed_frame_rate_flag,
+           vui->fixed_frame_rate_flag);
+  VALIDATE(0, vui->pic_struct_present_flag);
+  VALIDATE(restriction, vui->bitstream_restriction_flag);
+  VALIDATE(restriction && vui_bits->motion_vectors_over_pic_boundaries_flag,
+           vui->motion_vectors_over_pic_boundaries_flag);
+  VALIDATE(0, vui->max_bytes_per_pic_denom);
+  VALIDATE(0, vui->max_bits_per_mb_denom);
+  VALIDATE(restriction ? vui_bits->log2_max_mv_length_horizontal : 0,
+           vui->log2_max_mv_length_horizontal);
+  VALIDATE(restriction ? vui_bits->log2_max_mv_length_vertical : 0,
+           vui->log2_max_mv_length_vertical);
+  VALIDATE(restriction ? msp->max_num_reorder_frames : 0,
+           vui->max_num_reorder_frames);
+  VALIDATE(restriction ? msp->max_dec_frame_buffering : 0,
+           vui->max_dec_frame_buffering);
+  return result;
+}
+
+static bool ValidateParameterSets(struct Headers* headers) {
+  uint8_t buffer[256];
+  struct Bitstream bitstream = {.data = buffer};
+  PackH264SeqParameterSetNalUnit(&bitstream, &headers->seq, &headers->msp);
+  PackH264PicParameterSetNalUnit(&bitstream, &headers->pic);
+
+  const void* data = buffer;
+  size_t size = (bitstream.size + 7) / 8;
+  struct H264SeqParameterSet* sps = &headers->sps;
+  struct H264PicParameterSet* pps = &headers->pps;
+  struct H264NalUnit sps_nal_unit;
+  struct H264NalUnit pps_nal_unit;
+  if (!ParseH264NalUnit(&data, &size, &sps_nal_unit) ||
+      !ParseH264SeqParameterSet(&sps_nal_unit, sps) ||
+      !ParseH264NalUnit(&data, &size, &pps_nal_unit) ||
+      !ParseH264PicParameterSet(&pps_nal_unit, pps) || size) {
+    LOG("Failed to parse parameter sets");
+    return false;
+  }
+
+  const VAEncSequenceParameterBufferH264* seq = &headers->seq;
+  const VAEncPictureParameterBufferH264* pic = &headers->pic;
+  const struct MoreH264SeqParameters* msp = &headers->msp;
+  const typeof(seq->seq_fields.bits)* seq_bits = &seq->seq_fields.bits;
+  const typeof(pic->pic_fields.bits)* pic_bits = &pic->pic_fields.bits;
+  bool high_profile = msp->profile_idc == 100;
+  bool poc_type0 = seq_bits->pic_order_cnt_type == 0;
+  bool cropping = seq->frame_cropping_flag;
+  bool result = ValidateVuiParameters(seq, msp, &sps->vui_parameters);
+
+  VALIDATE(3, sps_nal_unit.nal_ref_idc);
+  VALIDATE(msp->profile_idc, sps->profile_idc);
+  VALIDATE(msp->constraint_set0_flag, sps->constraint_set0_flag);
+  VALIDATE(msp->constraint_set1_flag, sps->constraint_set1_flag);
+  VALIDATE(msp->constraint_set2_flag, sps->constraint_set2_flag);
+  VALIDATE(0, sps->constraint_set3_flag);
+  VALIDATE(0, sps->constraint_set4_flag);
+  VALIDATE(0, sps->constraint_set5_flag);
+  VALIDATE(seq->level_idc, sps->level_idc);
+  VALIDATE(seq->seq_parameter_set_id, sps->seq_parameter_set_id);
+  VALIDATE(high_profile ? seq_bits->chroma_format_idc : 1,
+           sps->chroma_format_idc);
+  VALIDATE(0, sps->separate_colour_plane_flag);
+  VALIDATE(high_profile ? seq->bit_depth_luma_minus8 : 0,
+           sps->bit_depth_luma_minus8);
+  VALIDATE(high_profile ? seq->bit_depth_chroma_minus8 : 0,
+           sps->bit_depth_chroma_minus8);
+  VALIDATE(0, sps->qpprime_y_zero_transform_bypass_flag);
+  VALIDATE(0, sps->seq_scaling_matrix_present_flag);
+  VALIDATE(seq_bits->log2_max_frame_num_minus4,
+           sps->log2_max_frame_num_minus4);
+  VALIDATE(seq_bits->pic_order_cnt_type, sps->pic_order_cnt_type);
+  VALIDATE(poc_type0 ? seq_bits->log2_max_pic_order_cnt_lsb_minus4 : 0,
+           sps->log2_max_pic_order_cnt_lsb_minus4);
+  VALIDATE(seq->max_num_ref_frames, sps->max_num_ref_frames);
+  VALIDATE(0, sps->gaps_in_frame_num_value_allowed_flag);
+  VALIDATE(seq->picture_width_in_mbs - 1, sps->pic_width_in_mbs_minus1);
+  VALIDATE(seq->picture_height_in_mbs - 1,
+           sps->pic_height_in_map_units_minus1);
+  VALIDATE(seq_bits->frame_mbs_only_flag, sps->frame_mbs_only_flag);
+  VALIDATE(0, sps->mb_adaptive_frame_field_flag);
+  VALIDATE(seq_bits->direct_8x8_inference_flag,
+           sps->direct_8x8_inference_flag);
+  VALIDATE(cropping, sps->frame_cropping_flag);
+  VALIDATE(cropping ? seq->frame_crop_left_offset : 0,
+           sps->frame_crop_left_offset);
+  VALIDATE(cropping ? seq->frame_crop_right_offset : 0,
+           sps->frame_crop_right_offset);
+  VALIDATE(cropping ? seq->frame_crop_top_offset : 0,
+           sps->frame_crop_top_offset);
+  VALIDATE(cropping ? seq->frame_crop_bottom_offset : 0,
+           sps->frame_crop_bottom_offset);
+  VALIDATE(seq->vui_parameters_present_flag, sps->vui_parameters_present_flag);
+
+  VALIDATE(3, pps_nal_unit.nal_ref_idc);
+  VALIDATE(pic->pic_parameter_set_id, pps->pic_parameter_set_id);
+  VALIDATE(pic->seq_parameter_set_id, pps->seq_parameter_set_id);
+  VALIDATE(pic_bits->entropy_coding_mode_flag, pps->entropy_coding_mode_flag);
+  VALIDATE(pic_bits->pic_order_present_flag,
+           pps->bottom_field_pic_order_in_frame_present_flag);
+  VALIDATE(0, pps->num_slice_groups_minus1);
+  VALIDATE(pic->num_ref_idx_l0_active_minus1,
+           pps->num_ref_idx_l0_default_active_minus1);
+  VALIDATE(pic->num_ref_idx_l1_active_minus1,
+           pps->num_ref_idx_l1_default_active_minus1);
+  VALIDATE(pic_bits->weighted_pred_flag, pps->weighted_pred_flag);
+  VALIDATE(pic_bits->weighted_bipred_idc, pps->weighted_bipred_idc);
+  VALIDATE(pic->pic_init_qp - 26, pps->pic_init_qp_minus26);
+  VALIDATE(0, pps->pic_init_qs_minus26);
+  VALIDATE(pic->chroma_qp_index_offset, pps->chroma_qp_index_offset);
+  VALIDATE(pic_bits->deblocking_filter_control_present_flag,
+           pps->deblocking_filter_control_present_flag);
+  VALIDATE(pic_bits->constrained_intra_pred_flag,
+           pps->constrained_intra_pred_flag);
+  VALIDATE(pic_bits->redundant_pic_cnt_present_flag,
+           pps->redundant_pic_cnt_present_flag);
+  VALIDATE(pic_bits->transform_8x8_mode_flag, pps->transform_8x8_mode_flag);
+  VALIDATE(pic_bits->pic_scaling_matrix_present_flag,
+           pps->pic_scaling_matrix_present_flag);
+  VALIDATE(pic->second_chroma_qp_index_offset,
+           pps->second_chroma_qp_index_offset);
+  return result;
+}
+
+static bool ValidateSliceHeader(const struct Headers* headers) {
+  uint8_t buffer[256] = {0};
+  struct Bitstream bitstream = {.data = buffer};
+  PackH264SliceHeaderNalUnit(&bitstream, &headers->seq, &headers->pic,
+                             &headers->slice);
+
+  const void* data = buffer;
+  size_t size = (bitstream.size + 7) / 8;
+  struct H264SliceHeader sh;
+  struct H264NalUnit nal_unit;
+  if (!ParseH264NalUnit(&data, &size, &nal_unit) ||
+      !ParseH264SliceHeader(&nal_unit, &headers->sps, &headers->pps, &sh) ||
+      size) {
+    LOG("Failed to parse slice header");
+    return false;
+  }
+
+  const VAEncSequenceParameterBufferH264* seq = &headers->seq;
+  const VAEncPictureParameterBufferH264* pic = &headers->pic;
+  const VAEncSliceParameterBufferH264* slice = &headers->slice;
+  const typeof(pic->pic_fields.bits)* pic_bits = &pic->pic_fields.bits;
+  bool idr = pic_bits->idr_pic_flag;
+  bool inter = slice->slice_type != H264_SLICE_I;
+  bool poc_type0 = seq->seq_fields.bits.pic_order_cnt_type == 0;
+  bool deblocking_offsets = slice->disable_deblocking_filter_idc != 1;
+  size_t padding_size = (8 - bitstream.size % 8) % 8;
+
+  bool result = true;
+  VALIDATE(pic_bits->reference_pic_flag ? 3 : 0, nal_unit.nal_ref_idc);
+  VALIDATE(idr ? H264_NAL_IDR_SLICE : H264_NAL_SLICE, nal_unit.nal_unit_type);
+  VALIDATE(slice->macroblock_address, sh.first_mb_in_slice);
+  VALIDATE(slice->slice_type, sh.slice_type);
+  VALIDATE(slice->pic_parameter_set_id, sh.pic_parameter_set_id);
+  VALIDATE(pic->frame_num, sh.frame_num);
+  VALIDATE(idr ? slice->idr_pic_id : 0, sh.idr_pic_id);
+  VALIDATE(poc_type0 ? slice->pic_order_cnt_lsb : 0, sh.pic_order_cnt_lsb);
+  VALIDATE(0, sh.delta_pic_order_cnt_bottom);
+  VALIDATE(0, sh.direct_spatial_mv_pred_flag);
+  VALIDATE(inter && slice->num_ref_idx_active_override_flag,
+           sh.num_ref_idx_active_override_flag);
+  VALIDATE(slice->num_ref_idx_l0_active_minus1,
+           sh.num_ref_idx_l0_active_minus1);
+  VALIDATE(slice->num_ref_idx_l1_active_minus1,
+           sh.num_ref_idx_l1_active_minus1);
+  VALIDATE(0, sh.ref_pic_list_modification_flag_l0);
+  VALIDATE(0, sh.ref_pic_list_modification_flag_l1);
+  VALIDATE(0, sh.no_output_of_prior_pics_flag);
+  VALIDATE(0, sh.long_term_reference_flag);
+  VALIDATE(0, sh.adaptive_ref_pic_marking_mode_flag);
+  VALIDATE(pic_bits->entropy_coding_mode_flag && inter ? slice->cabac_init_idc
+                                                       : 0,
+           sh.cabac_init_idc);
+  VALIDATE(slice->slice_qp_delta, sh.slice_qp_delta);
+  VALIDATE(slice->disable_deblocking_filter_idc,
+           sh.disable_deblocking_filter_idc);
+  VALIDATE(deblocking_offsets ? slice->slice_alpha_c0_offset_div2 : 0,
+           sh.slice_alpha_c0_offset_div2);
+  VALIDATE(deblocking_offsets ? slice->slice_beta_offset_div2 : 0,
+           sh.slice_beta_offset_div2);
+  VALIDATE(nal_unit.rbsp_size - padding_size, sh.slice_header_size);
+  return result;
+}
+
+// mburakov: Mirrors UpdateH264PicHeader, UploadH264Slice and
+// UploadH264Picture in encode_va.c, with IDR frames spaced further apart than
+// the maximum frame_num, so that it wraps around within a single period. The
+// per-slice fields that encode_va.c keeps constant are varied here, so that
+// each of them lands on different bit offsets.
+static bool TestFrames(const struct TestCase* test_case,
+                       struct Headers* headers) {
+  const typeof(headers->seq.seq_fields.bits)* seq_bits =
+      &headers->seq.seq_fields.bits;
+  uint32_t max_frame_num = 1u << (seq_bits->log2_max_frame_num_minus4 + 4);
+  uint32_t max_pic_order_cnt_lsb =
+      1u << (seq_bits->log2_max_pic_order_cnt_lsb_minus4 + 4);
+  uint32_t width_in_mbs = headers->seq.picture_width_in_mbs;
+  uint32_t height_in_mbs = headers->seq.picture_height_in_mbs;
+  uint16_t idr_pic_id = 0;
+
+  for (uint32_t i = 0; i < FRAMES_COUNT; i++) {
+    bool idr = !(i % IDR_PERIOD);
+    uint32_t frames_since_idr = i % IDR_PERIOD;
+    headers->pic.frame_num = (uint16_t)(frames_since_idr % max_frame_num);
+    headers->pic.pic_fields.bits.idr_pic_flag = idr;
+    if (idr) headers->slice.idr_pic_id = idr_pic_id++;
+    headers->slice.slice_type = idr ? H264_SLICE_I : H264_SLICE_P;
+    headers->slice.pic_order_cnt_lsb =
+        (uint16_t)(frames_since_idr * 2 % max_pic_order_cnt_lsb);
+    headers->slice.cabac_init_idc = (uint8_t)(i % 3);
+    headers->slice.slice_qp_delta = (int8_t)(i % 13) - 6;
+    headers->slice.disable_deblocking_filter_idc = (uint8_t)(i % 3);
+    headers->slice.slice_alpha_c0_offset_div2 = (int8_t)(i % 7) - 3;
+    headers->slice.slice_beta_offset_div2 = 3 - (int8_t)(i % 7);
+
+    for (uint32_t j = 0; j < test_case->slices; j++) {
+      uint32_t first_row = height_in_mbs * j / test_case->slices;
+      uint32_t last_row = height_in_mbs * (j + 1) / test_case->slices;
+      headers->slice.macroblock_address = first_row * width_in_mbs;
+      headers->slice.num_macroblocks = (last_row - first_row) * width_in_mbs;
+      if (!ValidateSliceHeader(headers)) {
+        LOG("Slice %u of frame %u does not match", j, i);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+int main(void) {
+  for (size_t i = 0; i < LENGTH(kTestCases); i++) {
+    struct Headers headers;
+    InitializeHeaders(&kTestCases[i], &headers);
+    if (!ValidateParameterSets(&headers)) {
+      LOG("Parameter sets of test case %zu do not match", i);
+      return EXIT_FAILURE;
+    }
+    if (!TestFrames(&kTestCases[i], &headers)) {
+      LOG("Frames of test case %zu do not match", i);
+      return EXIT_FAILURE;
+    }
+  }
+  return EXIT_SUCCESS;
+}
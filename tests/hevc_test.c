@@ -0,0 +1,575 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <va/va.h>
+
+#include "bitstream.h"
+#include "hevc.h"
+#include "hevc_parse.h"
+#include "toolbox/utils.h"
+
+// mburakov: Va buffers are filled the same way encode_va.c does for a range
+// of encoder capabilities and stream configurations. Parameter sets and slice
+// headers packed from those are parsed back, and every parsed field must match
+// either what va buffers claim, or the value hardcoded in hevc.c.
+
+#define VALIDATE(expected, actual)                                        \
+  do {                                                                    \
+    if ((int64_t)(expected) != (int64_t)(actual)) {                       \
+      LOG("Mismatching " #actual " (%jd vs %jd)", (intmax_t)(expected), \
+          (intmax_t)(actual));                                            \
+      result = false;                                                     \
+    }                                                                     \
+  } while (0)
+
+#define FRAMES_COUNT 300
+#define POC_STEP 29
+
+struct TestCase {
+  uint32_t width;
+  uint32_t height;
+  uint8_t log2_ctb_size;
+  bool amp;
+  bool sao;
+  bool temporal_mvp;
+  bool transform_skip;
+  bool cqp;
+  bool rec601;
+  bool full_range;
+  uint32_t slices;
+  bool long_term;
+};
+
+struct Headers {
+  VAEncSequenceParameterBufferHEVC seq;
+  VAEncPictureParameterBufferHEVC pic;
+  VAEncSliceParameterBufferHEVC slice;
+  struct MoreVideoParameters mvp;
+  struct MoreSeqParameters msp;
+  struct SeqParameterSet sps;
+  struct PicParameterSet pps;
+};
+
+static const struct TestCase kTestCases[] = {
+    {1920, 1080, 5, true, true, true, true, false, false, false, 1, false},
+    {1920, 1080, 6, false, true, false, false, false, true, true, 4, false},
+    {3840, 2160, 6, true, false, true, false, true, false, true, 8, true},
+    {1366, 768, 5, false, false, false, true, true, true, false, 3, true},
+    {640, 360, 4, true, true, false, false, false, false, false, 23, true},
+};
+
+// mburakov: Mirrors InitializeHevcSeqHeader, InitializeHevcPicHeader and
+// InitializeHevcSliceHeader in encode_va.c with a typical block sizes caps.
+static void InitializeHeaders(const struct TestCase* test_case,
+                              struct Headers* headers) {
+  static const uint32_t min_cb_size = 16;
+  uint32_t aligned_width =
+      (test_case->width + min_cb_size - 1) & ~(min_cb_size - 1);
+  uint32_t aligned_height =
+      (test_case->height + min_cb_size - 1) & ~(min_cb_size - 1);
+
+  headers->seq = (VAEncSequenceParameterBufferHEVC){
+      .general_profile_idc = 1,
+      .general_level_idc = 120,
+      .general_tier_flag = 0,
+      .intra_period = 0,
+      .intra_idr_period = 0,
+      .ip_period = 1,
+      .bits_per_second = test_case->cqp ? 0 : 8000000,
+      .pic_width_in_luma_samples = (uint16_t)aligned_width,
+      .pic_height_in_luma_samples = (uint16_t)aligned_height,
+      .seq_fields.bits =
+          {
+              .chroma_format_idc = 1,
+              .amp_enabled_flag = test_case->amp,
+              .sample_adaptive_offset_enabled_flag = test_case->sao,
+              .sps_temporal_mvp_enabled_flag = test_case->temporal_mvp,
+              .low_delay_seq = 1,
+          },
+      .log2_min_luma_coding_block_size_minus3 = 0,
+      .log2_diff_max_min_luma_coding_block_size =
+          (uint8_t)(test_case->log2_ctb_size - 3),
+      .log2_min_transform_block_size_minus2 = 0,
+      .log2_diff_max_min_transform_block_size = 3,
+      .max_transform_hierarchy_depth_inter = 2,
+      .max_transform_hierarchy_depth_intra = 1,
+      .vui_parameters_present_flag = 1,
+      .vui_fields.bits =
+          {
+              .bitstream_restriction_flag = 1,
+              .motion_vectors_over_pic_boundaries_flag = 1,
+              .restricted_ref_pic_lists_flag = 1,
+              .log2_max_mv_length_horizontal = 15,
+              .log2_max_mv_length_vertical = 15,
+          },
+  };
+
+  headers->pic = (VAEncPictureParameterBufferHEVC){
+      .decoded_curr_pic =
+          {
+              .picture_id = VA_INVALID_ID,
+              .flags = VA_PICTURE_HEVC_INVALID,
+          },
+      .coded_buf = VA_INVALID_ID,
+      .collocated_ref_pic_index = test_case->temporal_mvp ? 0 : 0xff,
+      .pic_init_qp = 26,
+      .pic_fields.bits =
+          {
+              .reference_pic_flag = 1,
+              .transform_skip_enabled_flag = test_case->transform_skip,
+              .cu_qp_delta_enabled_flag = !test_case->cqp,
+              .pps_loop_filter_across_slices_enabled_flag = 1,
+          },
+  };
+
+  headers->slice = (VAEncSliceParameterBufferHEVC){
+      .max_num_merge_cand = 5,
+      .slice_fields.bits =
+          {
+              .slice_temporal_mvp_enabled_flag = test_case->temporal_mvp,
+              .slice_sao_luma_flag = test_case->sao,
+              .slice_sao_chroma_flag = test_case->sao,
+          },
+  };
+
+  // mburakov: Mirrors PackHevcParameterSets in encode_va.c.
+  headers->mvp = (struct MoreVideoParameters){
+      .vps_max_dec_pic_buffering_minus1 = 1,
+      .vps_max_num_reorder_pics = 0,
+  };
+  headers->msp = (struct MoreSeqParameters){
+      .conf_win_right_offset = (aligned_width - test_case->width) / 2,
+      .conf_win_bottom_offset = (aligned_height - test_case->height) / 2,
+      .sps_max_dec_pic_buffering_minus1 = 1,
+      .sps_max_num_reorder_pics = 0,
+      .video_signal_type_present_flag = 1,
+      .video_full_range_flag = test_case->full_range,
+      .colour_description_present_flag = 1,
+      .colour_primaries = 2,
+      .transfer_characteristics = 2,
+      .matrix_coeffs = test_case->rec601 ? 6 : 1,
+      .long_term_ref_pics_present_flag = test_case->long_term,
+  };
+}
+
+static bool ValidateProfileTierLevel(const VAEncSequenceParameterBufferHEVC* seq,
+                                     const struct ProfileTierLevel* ptl) {
+  // mburakov: Main profile is also compatible with Main 10 profile.
+  uint32_t general_profile_compatibility_flags =
+      1u << (31 - seq->general_profile_idc) | 1u << 29;
+
+  bool result = true;
+  VALIDATE(0, ptl->general_profile_space);
+  VALIDATE(seq->general_tier_flag, ptl->general_tier_flag);
+  VALIDATE(seq->general_profile_idc, ptl->general_profile_idc);
+  VALIDATE(general_profile_compatibility_flags,
+           ptl->general_profile_compatibility_flags);
+  VALIDATE(1, ptl->general_progressive_source_flag);
+  VALIDATE(0, ptl->general_interlaced_source_flag);
+  VALIDATE(1, ptl->general_non_packed_constraint_flag);
+  VALIDATE(1, ptl->general_frame_only_constraint_flag);
+  VALIDATE(seq->general_level_idc, ptl->general_level_idc);
+  return result;
+}
+
+static bool ValidateVuiParameters(const VAEncSequenceParameterBufferHEVC* seq,
+                                  const struct MoreSeqParameters* msp,
+                                  const struct VuiParameters* vui) {
+  const typeof(seq->vui_fields.bits)* vui_bits = &seq->vui_fields.bits;
+  bool timing = vui_bits->vui_timing_info_present_flag;
+  bool restriction = vui_bits->bitstream_restriction_flag;
+
+  bool result = true;
+  VALIDATE(msp->video_signal_type_present_flag,
+           vui->video_signal_type_present_flag);
+  VALIDATE(5, vui->video_format);
+  VALIDATE(msp->video_full_range_flag, vui->video_full_range_flag);
+  VALIDATE(msp->colour_description_present_flag,
+           vui->colour_description_present_flag);
+  VALIDATE(msp->colour_primaries, vui->colour_primaries);
+  VALIDATE(msp->transfer_characteristics, vui->transfer_characteristics);
+  VALIDATE(msp->matrix_coeffs, vui->matrix_coeffs);
+  VALIDATE(msp->chroma_loc_info_present_flag,
+           vui->chroma_loc_info_present_flag);
+  VALIDATE(msp->chroma_sample_loc_type_top_field,
+           vui->chroma_sample_loc_type_top_field);
+  VALIDATE(msp->chroma_sample_loc_type_bottom_field,
+           vui->chroma_sample_loc_type_bottom_field);
+  VALIDATE(vui_bits->field_seq_flag, vui->field_seq_flag);
+  VALIDATE(timing, vui->vui_timing_info_present_flag);
+  VALIDATE(timing ? seq->vui_num_units_in_tick : 0,
+           vui->vui_num_units_in_tick);
+  VALIDATE(timing ? seq->vui_time_scale : 0, vui->vui_time_scale);
+  VALIDATE(restriction, vui->bitstream_restriction_flag);
+  VALIDATE(restriction ? seq->min_spatial_segmentation_idc : 0,
+           vui->min_spatial_segmentation_idc);
+  VALIDATE(restriction ? seq->max_bytes_per_pic_denom : 0,
+           vui->max_bytes_per_pic_denom);
+  VALIDATE(restriction ? seq->max_bits_per_min_cu_denom : 0,
+           vui->max_bits_per_min_cu_denom);
+  VALIDATE(restriction ? vui_bits->log2_max_mv_length_horizontal : 0,
+           vui->log2_max_mv_length_horizontal);
+  VALIDATE(restriction ? vui_bits->log2_max_mv_length_vertical : 0,
+           vui->log2_max_mv_length_vertical);
+  return result;
+}
+
+static bool ValidateParameterSets(struct Headers* headers) {
+  uint8_t buffer[256];
+  struct Bitstream bitstream = {.data = buffer};
+  PackVideoParameterSetNalUnit(&bitstream, &headers->seq, &headers->mvp);
+  PackSeqParameterSetNalUnit(&bitstream, &headers->seq, &headers->msp);
+  PackPicParameterSetNalUnit(&bitstream, &headers->pic);
+
+  const void* data = buffer;
+  size_t size = (bitstream.size + 7) / 8;
+  struct VideoParameterSet vps;
+  struct SeqParameterSet* sps = &headers->sps;
+  struct PicParameterSet* pps = &headers->pps;
+  struct NalUnit nal_unit;
+  if (!ParseNalUnit(&data, &size, &nal_unit) ||
+      !ParseVideoParameterSet(&nal_unit, &vps) ||
+      !ParseNalUnit(&data, &size, &nal_unit) ||
+      !ParseSeqParameterSet(&nal_unit, sps) ||
+      !ParseNalUnit(&data, &size, &nal_unit) ||
+      !ParsePicParameterSet(&nal_unit, pps) || size) {
+    LOG("Failed to parse parameter sets");
+    return false;
+  }
+
+  const VAEncSequenceParameterBufferHEVC* seq = &headers->seq;
+  const VAEncPictureParameterBufferHEVC* pic = &headers->pic;
+  const struct MoreVideoParameters* mvp = &headers->mvp;
+  const struct MoreSeqParameters* msp = &headers->msp;
+  const typeof(seq->seq_fields.bits)* seq_bits = &seq->seq_fields.bits;
+  const typeof(pic->pic_fields.bits)* pic_bits = &pic->pic_fields.bits;
+  bool timing = seq->vui_fields.bits.vui_timing_info_present_flag;
+  bool result = ValidateProfileTierLevel(seq, &vps.profile_tier_level) &&
+                ValidateProfileTierLevel(seq, &sps->profile_tier_level) &&
+                ValidateVuiParameters(seq, msp, &sps->vui_parameters);
+
+  VALIDATE(0, vps.vps_video_parameter_set_id);
+  VALIDATE(0, vps.vps_max_sub_layers_minus1);
+  VALIDATE(1, vps.vps_temporal_id_nesting_flag);
+  VALIDATE(mvp->vps_max_dec_pic_buffering_minus1,
+           vps.vps_max_dec_pic_buffering_minus1);
+  VALIDATE(mvp->vps_max_num_reorder_pics, vps.vps_max_num_reorder_pics);
+  VALIDATE(0, vps.vps_max_latency_increase_plus1);
+  VALIDATE(timing, vps.vps_timing_info_present_flag);
+  VALIDATE(timing ? seq->vui_num_units_in_tick : 0,
+           vps.vps_num_units_in_tick);
+  VALIDATE(timing ? seq->vui_time_scale : 0, vps.vps_time_scale);
+
+  VALIDATE(0, sps->sps_video_parameter_set_id);
+  VALIDATE(0, sps->sps_max_sub_layers_minus1);
+  VALIDATE(0, sps->sps_seq_parameter_set_id);
+  VALIDATE(seq_bits->chroma_format_idc, sps->chroma_format_idc);
+  VALIDATE(seq_bits->separate_colour_plane_flag,
+           sps->separate_colour_plane_flag);
+  VALIDATE(seq->pic_width_in_luma_samples, sps->pic_width_in_luma_samples);
+  VALIDATE(seq->pic_height_in_luma_samples, sps->pic_height_in_luma_samples);
+  VALIDATE(msp->conf_win_left_offset, sps->conf_win_left_offset);
+  VALIDATE(msp->conf_win_right_offset, sps->conf_win_right_offset);
+  VALIDATE(msp->conf_win_top_offset, sps->conf_win_top_offset);
+  VALIDATE(msp->conf_win_bottom_offset, sps->conf_win_bottom_offset);
+  VALIDATE(seq_bits->bit_depth_luma_minus8, sps->bit_depth_luma_minus8);
+  VALIDATE(seq_bits->bit_depth_chroma_minus8, sps->bit_depth_chroma_minus8);
+  VALIDATE(8, sps->log2_max_pic_order_cnt_lsb_minus4);
+  VALIDATE(msp->sps_max_dec_pic_buffering_minus1,
+           sps->sps_max_dec_pic_buffering_minus1);
+  VALIDATE(msp->sps_max_num_reorder_pics, sps->sps_max_num_reorder_pics);
+  VALIDATE(0, sps->sps_max_latency_increase_plus1);
+  VALIDATE(seq->log2_min_luma_coding_block_size_minus3,
+           sps->log2_min_luma_coding_block_size_minus3);
+  VALIDATE(seq->log2_diff_max_min_luma_coding_block_size,
+           sps->log2_diff_max_min_luma_coding_block_size);
+  VALIDATE(seq->log2_min_transform_block_size_minus2,
+           sps->log2_min_luma_transform_block_size_minus2);
+  VALIDATE(seq->log2_diff_max_min_transform_block_size,
+           sps->log2_diff_max_min_luma_transform_block_size);
+  VALIDATE(seq->max_transform_hierarchy_depth_inter,
+           sps->max_transform_hierarchy_depth_inter);
+  VALIDATE(seq->max_transform_hierarchy_depth_intra,
+           sps->max_transform_hierarchy_depth_intra);
+  VALIDATE(seq_bits->amp_enabled_flag, sps->amp_enabled_flag);
+  VALIDATE(seq_bits->sample_adaptive_offset_enabled_flag,
+           sps->sample_adaptive_offset_enabled_flag);
+  VALIDATE(seq_bits->pcm_enabled_flag, sps->pcm_enabled_flag);
+  VALIDATE(0, sps->num_short_term_ref_pic_sets);
+  VALIDATE(msp->long_term_ref_pics_present_flag,
+           sps->long_term_ref_pics_present_flag);
+  VALIDATE(0, sps->num_long_term_ref_pics_sps);
+  VALIDATE(seq_bits->sps_temporal_mvp_enabled_flag,
+           sps->sps_temporal_mvp_enabled_flag);
+  VALIDATE(seq_bits->strong_intra_smoothing_enabled_flag,
+           sps->strong_intra_smoothing_enabled_flag);
+  VALIDATE(seq->vui_parameters_present_flag, sps->vui_parameters_present_flag);
+
+  VALIDATE(0, pps->pps_pic_parameter_set_id);
+  VALIDATE(0, pps->pps_seq_parameter_set_id);
+  VALIDATE(pic_bits->dependent_slice_segments_enabled_flag,
+           pps->dependent_slice_segments_enabled_flag);
+  VALIDATE(0, pps->output_flag_present_flag);
+  VALIDATE(0, pps->num_extra_slice_header_bits);
+  VALIDATE(pic_bits->sign_data_hiding_enabled_flag,
+           pps->sign_data_hiding_enabled_flag);
+  VALIDATE(0, pps->cabac_init_present_flag);
+  VALIDATE(pic->num_ref_idx_l0_default_active_minus1,
+           pps->num_ref_idx_l0_default_active_minus1);
+  VALIDATE(pic->num_ref_idx_l1_default_active_minus1,
+           pps->num_ref_idx_l1_default_active_minus1);
+  VALIDATE(pic->pic_init_qp - 26, pps->init_qp_minus26);
+  VALIDATE(pic_bits->constrained_intra_pred_flag,
+           pps->constrained_intra_pred_flag);
+  VALIDATE(pic_bits->transform_skip_enabled_flag,
+           pps->transform_skip_enabled_flag);
+  VALIDATE(pic_bits->cu_qp_delta_enabled_flag, pps->cu_qp_delta_enabled_flag);
+  VALIDATE(pic_bits->cu_qp_delta_enabled_flag ? pic->diff_cu_qp_delta_depth : 0,
+           pps->diff_cu_qp_delta_depth);
+  VALIDATE(pic->pps_cb_qp_offset, pps->pps_cb_qp_offset);
+  VALIDATE(pic->pps_cr_qp_offset, pps->pps_cr_qp_offset);
+  VALIDATE(0, pps->pps_slice_chroma_qp_offsets_present_flag);
+  VALIDATE(pic_bits->weighted_pred_flag, pps->weighted_pred_flag);
+  VALIDATE(pic_bits->weighted_bipred_flag, pps->weighted_bipred_flag);
+  VALIDATE(pic_bits->transquant_bypass_enabled_flag,
+           pps->transquant_bypass_enabled_flag);
+  VALIDATE(pic_bits->tiles_enabled_flag, pps->tiles_enabled_flag);
+  VALIDATE(pic_bits->entropy_coding_sync_enabled_flag,
+           pps->entropy_coding_sync_enabled_flag);
+  VALIDATE(pic_bits->pps_loop_filter_across_slices_enabled_flag,
+           pps->pps_loop_filter_across_slices_enabled_flag);
+  VALIDATE(0, pps->deblocking_filter_control_present_flag);
+  VALIDATE(0, pps->deblocking_filter_override_enabled_flag);
+  VALIDATE(0, pps->pps_deblocking_filter_disabled_flag);
+  VALIDATE(0, pps->pps_beta_offset_div2);
+  VALIDATE(0, pps->pps_tc_offset_div2);
+  VALIDATE(0, pps->lists_modification_present_flag);
+  VALIDATE(pic->log2_parallel_merge_level_minus2,
+           pps->log2_parallel_merge_level_minus2);
+  VALIDATE(0, pps->slice_segment_header_extension_present_flag);
+  return result;
+}
+
+static bool ValidateSliceHeader(const struct Headers* headers,
+                                const struct MoreSliceParamerters* msp) {
+  uint8_t buffer[256];
+  struct Bitstream bitstream = {.data = buffer};
+  PackSliceSegmentHeaderNalUnit(&bitstream, &headers->seq, &headers->pic,
+                                &headers->slice, msp);
+
+  const void* data = buffer;
+  size_t size = (bitstream.size + 7) / 8;
+  struct SliceSegmentHeader ssh;
+  struct NalUnit nal_unit;
+  if (!ParseNalUnit(&data, &size, &nal_unit) ||
+      !ParseSliceSegmentHeader(&nal_unit, &headers->sps, &headers->pps,
+                               &ssh) ||
+      size) {
+    LOG("Failed to parse slice segment header");
+    return false;
+  }
+
+  const VAEncPictureParameterBufferHEVC* pic = &headers->pic;
+  const VAEncSliceParameterBufferHEVC* slice = &headers->slice;
+  const typeof(pic->pic_fields.bits)* pic_bits = &pic->pic_fields.bits;
+  const typeof(slice->slice_fields.bits)* slice_bits =
+      &slice->slice_fields.bits;
+  uint32_t max_pic_order_cnt_lsb =
+      1u << (headers->sps.log2_max_pic_order_cnt_lsb_minus4 + 4);
+  bool idr = pic->nal_unit_type == IDR_W_RADL || pic->nal_unit_type == IDR_N_LP;
+  bool irap =
+      pic->nal_unit_type >= BLA_W_LP && pic->nal_unit_type <= RSV_IRAP_VCL23;
+  bool inter = slice->slice_type != I;
+  bool temporal_mvp = !idr && slice_bits->slice_temporal_mvp_enabled_flag;
+  bool loop_filter_across_slices =
+      slice_bits->slice_sao_luma_flag || slice_bits->slice_sao_chroma_flag ||
+      !slice_bits->slice_deblocking_filter_disabled_flag;
+
+  bool result = true;
+  VALIDATE(pic->nal_unit_type, nal_unit.nal_unit_type);
+  VALIDATE(0, nal_unit.nuh_layer_id);
+  VALIDATE(1, nal_unit.nuh_temporal_id_plus1);
+  VALIDATE(msp->first_slice_segment_in_pic_flag,
+           ssh.first_slice_segment_in_pic_flag);
+  VALIDATE(irap ? pic_bits->no_output_of_prior_pics_flag : 0,
+           ssh.no_output_of_prior_pics_flag);
+  VALIDATE(slice->slice_pic_parameter_set_id, ssh.slice_pic_parameter_set_id);
+  VALIDATE(0, ssh.dependent_slice_segment_flag);
+  VALIDATE(slice->slice_segment_address, ssh.slice_segment_address);
+  VALIDATE(slice->slice_type, ssh.slice_type);
+  VALIDATE(1, ssh.pic_output_flag);
+  VALIDATE(idr ? 0
+               : (uint32_t)pic->decoded_curr_pic.pic_order_cnt &
+                     (max_pic_order_cnt_lsb - 1),
+           ssh.slice_pic_order_cnt_lsb);
+  VALIDATE(0, ssh.short_term_ref_pic_set_sps_flag);
+  VALIDATE(0, ssh.short_term_ref_pic_set_idx);
+  VALIDATE(msp->num_negative_pics, ssh.num_negative_pics);
+  for (uint32_t i = 0; i < msp->num_negative_pics; i++) {
+    VALIDATE(msp->negative_pics[i].delta_poc_s0_minus1,
+             ssh.negative_pics[i].delta_poc_s0_minus1);
+    VALIDATE(msp->negative_pics[i].used_by_curr_pic_s0_flag,
+             ssh.negative_pics[i].used_by_curr_pic_s0_flag);
+  }
+  VALIDATE(msp->num_positive_pics, ssh.num_positive_pics);
+  for (uint32_t i = 0; i < msp->num_positive_pics; i++) {
+    VALIDATE(msp->positive_pics[i].delta_poc_s1_minus1,
+             ssh.positive_pics[i].delta_poc_s1_minus1);
+    VALIDATE(msp->positive_pics[i].used_by_curr_pic_s1_flag,
+             ssh.positive_pics[i].used_by_curr_pic_s1_flag);
+  }
+  VALIDATE(0, ssh.num_long_term_sps);
+  VALIDATE(msp->num_long_term_pics, ssh.num_long_term_pics);
+  for (uint32_t i = 0; i < msp->num_long_term_pics; i++) {
+    const struct LongTermPics* long_term_pic = &msp->long_term_pics[i];
+    VALIDATE(long_term_pic->poc_lsb_lt, ssh.long_term_pics[i].poc_lsb_lt);
+    VALIDATE(long_term_pic->used_by_curr_pic_lt_flag,
+             ssh.long_term_pics[i].used_by_curr_pic_lt_flag);
+    VALIDATE(long_term_pic->delta_poc_msb_present_flag,
+             ssh.long_term_pics[i].delta_poc_msb_present_flag);
+    VALIDATE(long_term_pic->delta_poc_msb_present_flag
+                 ? long_term_pic->delta_poc_msb_cycle_lt
+                 : 0,
+             ssh.long_term_pics[i].delta_poc_msb_cycle_lt);
+  }
+  VALIDATE(temporal_mvp, ssh.slice_temporal_mvp_enabled_flag);
+  VALIDATE(slice_bits->slice_sao_luma_flag, ssh.slice_sao_luma_flag);
+  VALIDATE(slice_bits->slice_sao_chroma_flag, ssh.slice_sao_chroma_flag);
+  VALIDATE(inter && slice_bits->num_ref_idx_active_override_flag,
+           ssh.num_ref_idx_active_override_flag);
+  VALIDATE(slice->num_ref_idx_l0_active_minus1,
+           ssh.num_ref_idx_l0_active_minus1);
+  VALIDATE(slice->num_ref_idx_l1_active_minus1,
+           ssh.num_ref_idx_l1_active_minus1);
+  VALIDATE(0, ssh.mvd_l1_zero_flag);
+  VALIDATE(0, ssh.cabac_init_flag);
+  VALIDATE(1, ssh.collocated_from_l0_flag);
+  VALIDATE(temporal_mvp && inter && slice->num_ref_idx_l0_active_minus1
+               ? pic->collocated_ref_pic_index
+               : 0,
+           ssh.collocated_ref_idx);
+  VALIDATE(inter ? 5 - slice->max_num_merge_cand : 0,
+           ssh.five_minus_max_num_merge_cand);
+  VALIDATE(slice->slice_qp_delta, ssh.slice_qp_delta);
+  VALIDATE(0, ssh.slice_cb_qp_offset);
+  VALIDATE(0, ssh.slice_cr_qp_offset);
+  VALIDATE(0, ssh.deblocking_filter_override_flag);
+  VALIDATE(slice_bits->slice_deblocking_filter_disabled_flag,
+           ssh.slice_deblocking_filter_disabled_flag);
+  VALIDATE(0, ssh.slice_beta_offset_div2);
+  VALIDATE(0, ssh.slice_tc_offset_div2);
+  VALIDATE(loop_filter_across_slices
+               ? slice_bits->slice_loop_filter_across_slices_enabled_flag
+               : pic_bits->pps_loop_filter_across_slices_enabled_flag,
+           ssh.slice_loop_filter_across_slices_enabled_flag);
+  VALIDATE(0, ssh.num_entry_point_offsets);
+  return result;
+}
+
+// mburakov: Mirrors UpdateHevcPicHeader and UploadHevcSlice in encode_va.c,
+// with an IDR followed by P frames. Picture order count advances faster than
+// one per frame, so that its lsb wraps around several times. When long-term
+// references are enabled, every P frame also refers to the IDR frame and to
+// a picture with the same lsb, which requires msb to be signalled.
+static bool TestFrames(const struct TestCase* test_case,
+                       struct Headers* headers) {
+  static const struct NegativePics negative_pics[] = {
+      {
+          .delta_poc_s0_minus1 = POC_STEP - 1,
+          .used_by_curr_pic_s0_flag = true,
+      },
+  };
+  uint32_t ctb_size = 1u << test_case->log2_ctb_size;
+  uint32_t width_in_ctbs =
+      (headers->seq.pic_width_in_luma_samples + ctb_size - 1) / ctb_size;
+  uint32_t height_in_ctbs =
+      (headers->seq.pic_height_in_luma_samples + ctb_size - 1) / ctb_size;
+  uint32_t max_pic_order_cnt_lsb =
+      1u << (headers->sps.log2_max_pic_order_cnt_lsb_minus4 + 4);
+
+  for (uint32_t i = 0; i < FRAMES_COUNT; i++) {
+    bool idr = !i;
+    uint32_t pic_order_cnt = i * POC_STEP;
+    headers->pic.decoded_curr_pic.pic_order_cnt = (int32_t)pic_order_cnt;
+    headers->pic.nal_unit_type = idr ? IDR_W_RADL : TRAIL_R;
+    headers->pic.pic_fields.bits.idr_pic_flag = idr;
+    headers->pic.pic_fields.bits.coding_type = idr ? 1 : 2;
+    headers->slice.slice_type = idr ? I : P;
+    headers->slice.slice_qp_delta = (int8_t)(i % 13) - 6;
+
+    const struct LongTermPics long_term_pics[] = {
+        {
+            .poc_lsb_lt = 0,
+            .used_by_curr_pic_lt_flag = true,
+            .delta_poc_msb_present_flag =
+                pic_order_cnt >= max_pic_order_cnt_lsb,
+            .delta_poc_msb_cycle_lt = pic_order_cnt / max_pic_order_cnt_lsb,
+        },
+        {
+            .poc_lsb_lt = pic_order_cnt & (max_pic_order_cnt_lsb - 1),
+            .used_by_curr_pic_lt_flag = false,
+            .delta_poc_msb_present_flag = true,
+            .delta_poc_msb_cycle_lt = 1,
+        },
+    };
+    bool long_term = !idr && test_case->long_term;
+    size_t num_long_term_pics = pic_order_cnt >= max_pic_order_cnt_lsb ? 2 : 1;
+
+    for (uint32_t j = 0; j < test_case->slices; j++) {
+      uint32_t first_row = height_in_ctbs * j / test_case->slices;
+      uint32_t last_row = height_in_ctbs * (j + 1) / test_case->slices;
+      headers->slice.slice_segment_address = first_row * width_in_ctbs;
+      headers->slice.num_ctu_in_slice = (last_row - first_row) * width_in_ctbs;
+      headers->slice.slice_fields.bits.last_slice_of_pic_flag =
+          j + 1 == test_case->slices;
+      const struct MoreSliceParamerters msp = {
+          .first_slice_segment_in_pic_flag = !j,
+          .num_negative_pics = idr ? 0 : LENGTH(negative_pics),
+          .negative_pics = idr ? NULL : negative_pics,
+          .long_term_ref_pics_present_flag = test_case->long_term,
+          .num_long_term_pics = long_term ? (uint32_t)num_long_term_pics : 0,
+          .long_term_pics = long_term ? long_term_pics : NULL,
+      };
+      if (!ValidateSliceHeader(headers, &msp)) {
+        LOG("Slice %u of frame %u does not match", j, i);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+int main(void) {
+  for (size_t i = 0; i < LENGTH(kTestCases); i++) {
+    struct Headers headers;
+    InitializeHeaders(&kTestCases[i], &headers);
+    if (!ValidateParameterSets(&headers)) {
+      LOG("Parameter sets of test case %zu do not match", i);
+      return EXIT_FAILURE;
+    }
+    if (!TestFrames(&kTestCases[i], &headers)) {
+      LOG("Frames of test case %zu do not match", i);
+      return EXIT_FAILURE;
+    }
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,342 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "proto.h"
+#include "toolbox/utils.h"
+
+// mburakov: Synthetic chains of coded buffer segments of pseudo-random sizes
+// are written into a socketpair with a tiny send buffer, so that messages go
+// out directly, partially, or get queued entirely. Whatever comes out of the
+// other end must be exactly the headers followed by the segments data.
+
+#define MESSAGES_COUNT 4096
+#define MAX_SEGMENT_SIZE 8192
+
+struct Segment {
+  uint32_t size;
+  void* buf;
+  struct Segment* next;
+};
+
+struct Buffer {
+  uint8_t* data;
+  size_t size;
+  size_t alloc;
+};
+
+static uint32_t Random(uint32_t* state) {
+  *state = *state * 1664525 + 1013904223;
+  return *state >> 8;
+}
+
+static bool BufferAppend(struct Buffer* buffer, const void* data,
+                         size_t size) {
+  if (buffer->size + size > buffer->alloc) {
+    size_t alloc = buffer->alloc ? buffer->alloc : 65536;
+    while (alloc < buffer->size + size) alloc *= 2;
+    uint8_t* buffer_data = realloc(buffer->data, alloc);
+    if (!buffer_data) return false;
+    buffer->data = buffer_data;
+    buffer->alloc = alloc;
+  }
+  memcpy(buffer->data + buffer->size, data, size);
+  buffer->size += size;
+  return true;
+}
+
+static bool ReadAvailable(int fd, struct Buffer* buffer) {
+  for (uint8_t chunk[65536];;) {
+    ssize_t result = read(fd, chunk, sizeof(chunk));
+    if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+    if (result <= 0) {
+      LOG("Failed to read socket (%s)", result ? strerror(errno) : "EOF");
+      return false;
+    }
+    if (!BufferAppend(buffer, chunk, (size_t)result)) {
+      LOG("Failed to append received data");
+      return false;
+    }
+  }
+}
+
+static bool CreateSocketPair(int fds[2]) {
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+    LOG("Failed to create socketpair (%s)", strerror(errno));
+    return false;
+  }
+  for (size_t i = 0; i < 2; i++) {
+    int flags = fcntl(fds[i], F_GETFL);
+    if (flags == -1 || fcntl(fds[i], F_SETFL, flags | O_NONBLOCK)) {
+      LOG("Failed to make socket nonblocking (%s)", strerror(errno));
+      goto rollback_fds;
+    }
+  }
+  if (setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &(int){4096}, sizeof(int))) {
+    LOG("Failed to set send buffer size (%s)", strerror(errno));
+    goto rollback_fds;
+  }
+  return true;
+
+rollback_fds:
+  close(fds[1]);
+  close(fds[0]);
+  return false;
+}
+
+// mburakov: Segments are turned into iovecs the same way encode_va.c does.
+static int SegmentsToIovec(const struct Segment* segment,
+                           struct iovec* iovec, uint32_t* size) {
+  int count = 0;
+  *size = 0;
+  for (const struct Segment* it = segment; it; it = it->next) {
+    iovec[count++] = (struct iovec){
+        .iov_base = it->buf,
+        .iov_len = it->size,
+    };
+    *size += it->size;
+  }
+  return count;
+}
+
+static bool TestSegmentChains(void) {
+  int fds[2];
+  if (!CreateSocketPair(fds)) {
+    LOG("Failed to create socketpair");
+    return false;
+  }
+
+  bool result = false;
+  struct Buffer expected = {0};
+  struct Buffer received = {0};
+  static uint8_t pool[PROTO_MAX_IOVEC][MAX_SEGMENT_SIZE];
+  struct ProtoQueue* proto_queue = ProtoQueueCreate(fds[0], 1 << 30);
+  if (!proto_queue) {
+    LOG("Failed to create proto queue");
+    goto rollback_fds;
+  }
+
+  uint32_t state = 1;
+  for (size_t i = 0; i < MESSAGES_COUNT; i++) {
+    struct Segment segments[PROTO_MAX_IOVEC];
+    size_t segments_count = Random(&state) % PROTO_MAX_IOVEC + 1;
+    for (size_t j = 0; j < segments_count; j++) {
+      // mburakov: Empty segments are not emitted by encode_va.c, but there is
+      // no reason for proto queue to choke on those either.
+      segments[j] = (struct Segment){
+          .size = Random(&state) % MAX_SEGMENT_SIZE,
+          .buf = pool[j],
+          .next = j + 1 < segments_count ? &segments[j + 1] : NULL,
+      };
+      for (uint32_t k = 0; k < segments[j].size; k++)
+        pool[j][k] = (uint8_t)Random(&state);
+    }
+
+    struct iovec iovec[PROTO_MAX_IOVEC];
+    uint32_t size;
+    int count = SegmentsToIovec(segments, iovec, &size);
+    struct Proto proto = {
+        .size = size,
+        .type = PROTO_TYPE_VIDEO,
+        .flags = (uint8_t)(i & PROTO_FLAG_KEYFRAME),
+        .latency = (uint16_t)i,
+    };
+    if (!BufferAppend(&expected, &proto, sizeof(proto))) {
+      LOG("Failed to append expected header");
+      goto rollback_buffers;
+    }
+    for (int j = 0; j < count; j++) {
+      if (!BufferAppend(&expected, iovec[j].iov_base, iovec[j].iov_len)) {
+        LOG("Failed to append expected data");
+        goto rollback_buffers;
+      }
+    }
+    if (!ProtoQueueWritev(proto_queue, &proto, iovec, count)) {
+      LOG("Failed to write message %zu", i);
+      goto rollback_buffers;
+    }
+
+    // mburakov: Sometimes let the queue grow, and sometimes drain the socket
+    // completely, so that writes hit both idle and busy queue. Long runs make
+    // the ring of queued messages wrap around and grow.
+    if (Random(&state) % 16 && ProtoQueueGetDepth(proto_queue) < 256) continue;
+    do {
+      if (!ReadAvailable(fds[1], &received) || !ProtoQueueFlush(proto_queue)) {
+        LOG("Failed to exchange data");
+        goto rollback_buffers;
+      }
+    } while (ProtoQueueGetDepth(proto_queue));
+  }
+
+  while (received.size < expected.size) {
+    if (!ProtoQueueFlush(proto_queue) || !ReadAvailable(fds[1], &received)) {
+      LOG("Failed to exchange data");
+      goto rollback_buffers;
+    }
+  }
+  if (ProtoQueueGetDepth(proto_queue) || ProtoQueueGetSize(proto_queue)) {
+    LOG("Proto queue is not empty after draining");
+    goto rollback_buffers;
+  }
+  if (received.size != expected.size ||
+      memcmp(received.data, expected.data, expected.size)) {
+    LOG("Received data does not match (%zu vs %zu bytes)", expected.size,
+        received.size);
+    goto rollback_buffers;
+  }
+  result = true;
+
+rollback_buffers:
+  free(received.data);
+  free(expected.data);
+  ProtoQueueDestroy(proto_queue);
+rollback_fds:
+  close(fds[1]);
+  close(fds[0]);
+  return result;
+}
+
+static bool TestTooManySegments(void) {
+  int fds[2];
+  if (!CreateSocketPair(fds)) {
+    LOG("Failed to create socketpair");
+    return false;
+  }
+
+  bool result = false;
+  struct ProtoQueue* proto_queue = ProtoQueueCreate(fds[0], 1 << 20);
+  if (!proto_queue) {
+    LOG("Failed to create proto queue");
+    goto rollback_fds;
+  }
+
+  static uint8_t data[PROTO_MAX_IOVEC + 1];
+  struct iovec iovec[PROTO_MAX_IOVEC + 1];
+  for (size_t i = 0; i < LENGTH(iovec); i++)
+    iovec[i] = (struct iovec){.iov_base = data + i, .iov_len = 1};
+  struct Proto proto = {
+      .size = LENGTH(iovec),
+      .type = PROTO_TYPE_VIDEO,
+  };
+  if (ProtoQueueWritev(proto_queue, &proto, iovec, LENGTH(iovec))) {
+    LOG("Too many segments were accepted");
+    goto rollback_proto_queue;
+  }
+  struct Buffer received = {0};
+  if (!ReadAvailable(fds[1], &received) || received.size) {
+    LOG("Rejected message was written to socket");
+    free(received.data);
+    goto rollback_proto_queue;
+  }
+  result = true;
+
+rollback_proto_queue:
+  ProtoQueueDestroy(proto_queue);
+rollback_fds:
+  close(fds[1]);
+  close(fds[0]);
+  return result;
+}
+
+static bool TestDroppableOverflow(void) {
+  int fds[2];
+  if (!CreateSocketPair(fds)) {
+    LOG("Failed to create socketpair");
+    return false;
+  }
+
+  // mburakov: Nothing is read from the other end, so the socket saturates
+  // quickly, and then queue fills up to the limit with audio frames.
+  bool result = false;
+  static const size_t kMaxSize = 1 << 20;
+  struct ProtoQueue* proto_queue = ProtoQueueCreate(fds[0], kMaxSize);
+  if (!proto_queue) {
+    LOG("Failed to create proto queue");
+    goto rollback_fds;
+  }
+
+  static uint8_t data[256];
+  struct Proto proto = {
+      .size = sizeof(data),
+      .type = PROTO_TYPE_AUDIO,
+  };
+  size_t limit = kMaxSize / (sizeof(proto) + sizeof(data)) * 2;
+  for (size_t i = 0; i < limit; i++) {
+    if (!ProtoQueueWrite(proto_queue, &proto, data)) {
+      LOG("Failed to write audio frame %zu", i);
+      goto rollback_proto_queue;
+    }
+  }
+  size_t size = ProtoQueueGetSize(proto_queue);
+  if (size > kMaxSize || size + sizeof(proto) + sizeof(data) <= kMaxSize) {
+    LOG("Unexpected queue size after overflow (%zu bytes)", size);
+    goto rollback_proto_queue;
+  }
+
+  // mburakov: Anything that is not an audio frame must not be dropped.
+  proto.flags = PROTO_FLAG_KEYFRAME;
+  if (ProtoQueueWrite(proto_queue, &proto, data)) {
+    LOG("Audio configuration was dropped on overflow");
+    goto rollback_proto_queue;
+  }
+  proto = (struct Proto){
+      .size = sizeof(data),
+      .type = PROTO_TYPE_VIDEO,
+  };
+  if (ProtoQueueWrite(proto_queue, &proto, data)) {
+    LOG("Video frame was dropped on overflow");
+    goto rollback_proto_queue;
+  }
+  if (ProtoQueueGetSize(proto_queue) != size) {
+    LOG("Rejected messages were queued");
+    goto rollback_proto_queue;
+  }
+  result = true;
+
+rollback_proto_queue:
+  ProtoQueueDestroy(proto_queue);
+rollback_fds:
+  close(fds[1]);
+  close(fds[0]);
+  return result;
+}
+
+int main(void) {
+  if (!TestSegmentChains()) {
+    LOG("Segment chains test failed");
+    return EXIT_FAILURE;
+  }
+  if (!TestTooManySegments()) {
+    LOG("Too many segments test failed");
+    return EXIT_FAILURE;
+  }
+  if (!TestDroppableOverflow()) {
+    LOG("Droppable overflow test failed");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
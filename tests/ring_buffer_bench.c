@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+#include "ring_buffer.h"
+#include "toolbox/perf.h"
+#include "toolbox/utils.h"
+
+// mburakov: Compares the ring buffer against the queue it replaced on the
+// audio path. Producer thread plays the role of the pipewire callback, and
+// pushes periods of 5ms of 48kHz stereo audio, while the main thread drains
+// those as fast as it can. Reported times are per period, averaged over the
+// whole run including the consumer side.
+
+#define PERIOD_SIZE (240 * 2 * sizeof(int16_t))
+#define PERIODS_COUNT 1000000
+#define PERIODS_LIMIT 200
+
+// mburakov: This is what used to be in buffer_queue.c.
+struct BufferQueueItem {
+  size_t size;
+  uint8_t data[];
+};
+
+struct BufferQueue {
+  mtx_t mutex;
+  struct BufferQueueItem** items;
+  size_t size;
+  size_t alloc;
+};
+
+static bool BufferQueueQueue(struct BufferQueue* buffer_queue,
+                             const void* data, size_t size) {
+  struct BufferQueueItem* buffer_queue_item =
+      malloc(sizeof(struct BufferQueueItem) + size);
+  if (!buffer_queue_item) return false;
+  buffer_queue_item->size = size;
+  memcpy(buffer_queue_item->data, data, size);
+
+  mtx_lock(&buffer_queue->mutex);
+  if (buffer_queue->size == buffer_queue->alloc) {
+    size_t alloc = buffer_queue->alloc + 1;
+    struct BufferQueueItem** items =
+        realloc(buffer_queue->items, sizeof(struct BufferQueueItem*) * alloc);
+    if (!items) {
+      mtx_unlock(&buffer_queue->mutex);
+      free(buffer_queue_item);
+      return false;
+    }
+    buffer_queue->items = items;
+    buffer_queue->alloc = alloc;
+  }
+  buffer_queue->items[buffer_queue->size++] = buffer_queue_item;
+  mtx_unlock(&buffer_queue->mutex);
+  return true;
+}
+
+static size_t BufferQueueDequeue(struct BufferQueue* buffer_queue,
+                                 void* data) {
+  mtx_lock(&buffer_queue->mutex);
+  if (!buffer_queue->size) {
+    mtx_unlock(&buffer_queue->mutex);
+    return 0;
+  }
+  struct BufferQueueItem* buffer_queue_item = buffer_queue->items[0];
+  buffer_queue->size--;
+  memmove(buffer_queue->items, buffer_queue->items + 1,
+          sizeof(struct BufferQueueItem*) * buffer_queue->size);
+  mtx_unlock(&buffer_queue->mutex);
+
+  size_t size = buffer_queue_item->size;
+  memcpy(data, buffer_queue_item->data, size);
+  free(buffer_queue_item);
+  return size;
+}
+
+struct Context {
+  struct RingBuffer* ring_buffer;
+  struct BufferQueue buffer_queue;
+  atomic_size_t queued;
+  atomic_bool failed;
+};
+
+static int RingBufferProducer(void* arg) {
+  struct Context* context = arg;
+  uint8_t period[PERIOD_SIZE] = {0};
+  for (size_t i = 0; i < PERIODS_COUNT; i++) {
+    while (!RingBufferWrite(context->ring_buffer, period, sizeof(period)))
+      thrd_yield();
+  }
+  return 0;
+}
+
+static int BufferQueueProducer(void* arg) {
+  struct Context* context = arg;
+  uint8_t period[PERIOD_SIZE] = {0};
+  for (size_t i = 0; i < PERIODS_COUNT; i++) {
+    // mburakov: Bounded the same way as the ring buffer. Otherwise the queue
+    // grows without limits, and dequeueing cost is dominated by memmove.
+    while (atomic_load(&context->queued) == PERIODS_LIMIT) thrd_yield();
+    if (!BufferQueueQueue(&context->buffer_queue, period, sizeof(period))) {
+      atomic_store(&context->failed, true);
+      return 0;
+    }
+    atomic_fetch_add(&context->queued, 1);
+  }
+  return 0;
+}
+
+static double RunRingBuffer(struct Context* context) {
+  uint8_t period[PERIOD_SIZE];
+  unsigned long long begin = MicrosNow();
+  thrd_t producer;
+  if (thrd_create(&producer, RingBufferProducer, context) != thrd_success) {
+    LOG("Failed to create producer thread");
+    return -1;
+  }
+  for (size_t size = 0; size < PERIOD_SIZE * PERIODS_COUNT;) {
+    size_t result = RingBufferRead(context->ring_buffer, period, PERIOD_SIZE);
+    if (!result) thrd_yield();
+    size += result;
+  }
+  thrd_join(producer, NULL);
+  return (double)(MicrosNow() - begin) * 1000 / PERIODS_COUNT;
+}
+
+static double RunBufferQueue(struct Context* context) {
+  uint8_t period[PERIOD_SIZE];
+  unsigned long long begin = MicrosNow();
+  thrd_t producer;
+  if (thrd_create(&producer, BufferQueueProducer, context) != thrd_success) {
+    LOG("Failed to create producer thread");
+    return -1;
+  }
+  for (size_t size = 0; size < PERIOD_SIZE * PERIODS_COUNT;) {
+    if (atomic_load(&context->failed)) {
+      LOG("Failed to queue buffer");
+      thrd_join(producer, NULL);
+      return -1;
+    }
+    size_t result = BufferQueueDequeue(&context->buffer_queue, period);
+    if (!result) {
+      thrd_yield();
+      continue;
+    }
+    atomic_fetch_sub(&context->queued, 1);
+    size += result;
+  }
+  thrd_join(producer, NULL);
+  return (double)(MicrosNow() - begin) * 1000 / PERIODS_COUNT;
+}
+
+int main(void) {
+  // mburakov: Audio context sizes the ring to hold one second of audio.
+  struct Context context = {
+      .ring_buffer = RingBufferCreate(PERIOD_SIZE * PERIODS_LIMIT),
+  };
+  if (!context.ring_buffer) {
+    LOG("Failed to create ring buffer");
+    return EXIT_FAILURE;
+  }
+  if (mtx_init(&context.buffer_queue.mutex, mtx_plain) != thrd_success) {
+    LOG("Failed to init buffer queue mutex");
+    goto rollback_ring_buffer;
+  }
+
+  double ring_buffer_ns = RunRingBuffer(&context);
+  double buffer_queue_ns = RunBufferQueue(&context);
+  if (ring_buffer_ns < 0 || buffer_queue_ns < 0) {
+    LOG("Failed to run benchmark");
+    goto rollback_buffer_queue;
+  }
+  printf("{\"bench\": \"ring_buffer\", \"period_bytes\": %zu, ", PERIOD_SIZE);
+  printf("\"ring_buffer_ns\": %.1f, \"buffer_queue_ns\": %.1f}\n",
+         ring_buffer_ns, buffer_queue_ns);
+
+  mtx_destroy(&context.buffer_queue.mutex);
+  free(context.buffer_queue.items);
+  RingBufferDestroy(context.ring_buffer);
+  return EXIT_SUCCESS;
+
+rollback_buffer_queue:
+  mtx_destroy(&context.buffer_queue.mutex);
+  free(context.buffer_queue.items);
+rollback_ring_buffer:
+  RingBufferDestroy(context.ring_buffer);
+  return EXIT_FAILURE;
+}
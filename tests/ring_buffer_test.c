@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <threads.h>
+
+#include "ring_buffer.h"
+#include "toolbox/utils.h"
+
+// mburakov: Producer and consumer push bytes of a known sequence through a
+// small ring in chunks of pseudo-random sizes, so that both the writes and the
+// reads keep crossing the wraparound point at different offsets.
+
+#define TOTAL_SIZE (64 << 20)
+
+struct Context {
+  struct RingBuffer* ring_buffer;
+  size_t capacity;
+};
+
+static uint8_t SequenceByte(size_t position) {
+  return (uint8_t)(position ^ position >> 8 ^ position >> 16);
+}
+
+static size_t NextChunkSize(uint32_t* state, size_t limit) {
+  *state = *state * 1664525 + 1013904223;
+  return *state % limit + 1;
+}
+
+static int ProducerThread(void* arg) {
+  struct Context* context = arg;
+  uint8_t buffer[256];
+  uint32_t state = 1;
+  for (size_t position = 0; position < TOTAL_SIZE;) {
+    size_t size = NextChunkSize(&state, MIN(context->capacity, sizeof(buffer)));
+    size = MIN(size, TOTAL_SIZE - position);
+    for (size_t i = 0; i < size; i++) buffer[i] = SequenceByte(position + i);
+    while (!RingBufferWrite(context->ring_buffer, buffer, size))
+      thrd_yield();
+    position += size;
+  }
+  return 0;
+}
+
+int main(void) {
+  struct Context context = {
+      .ring_buffer = RingBufferCreate(100),
+  };
+  if (!context.ring_buffer) {
+    LOG("Failed to create ring buffer");
+    return EXIT_FAILURE;
+  }
+  context.capacity = RingBufferGetCapacity(context.ring_buffer);
+  if (context.capacity < 100 || context.capacity & (context.capacity - 1)) {
+    LOG("Unexpected ring buffer capacity %zu", context.capacity);
+    goto rollback_ring_buffer;
+  }
+
+  thrd_t producer;
+  if (thrd_create(&producer, ProducerThread, &context) != thrd_success) {
+    LOG("Failed to create producer thread");
+    goto rollback_ring_buffer;
+  }
+
+  uint8_t buffer[256];
+  uint32_t state = 2;
+  for (size_t position = 0; position < TOTAL_SIZE;) {
+    size_t size = NextChunkSize(&state, sizeof(buffer));
+    size = RingBufferRead(context.ring_buffer, buffer, size);
+    if (!size) thrd_yield();
+    for (size_t i = 0; i < size; i++) {
+      // mburakov: Producer might be blocked on a full ring at this point,
+      // returning from main terminates it as well.
+      if (buffer[i] != SequenceByte(position + i)) {
+        LOG("Mismatching byte at %zu (%u vs %u)", position + i,
+            SequenceByte(position + i), buffer[i]);
+        return EXIT_FAILURE;
+      }
+    }
+    position += size;
+  }
+
+  thrd_join(producer, NULL);
+  if (RingBufferRead(context.ring_buffer, buffer, sizeof(buffer))) {
+    LOG("Ring buffer is not empty after reading everything");
+    goto rollback_ring_buffer;
+  }
+  RingBufferDestroy(context.ring_buffer);
+  return EXIT_SUCCESS;
+
+rollback_ring_buffer:
+  RingBufferDestroy(context.ring_buffer);
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "trace.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <threads.h>
+#include <unistd.h>
+
+#include "toolbox/perf.h"
+#include "toolbox/utils.h"
+
+// mburakov: Every thread records events into its own ring, so there is no
+// contention between threads. Rings are allocated on the first event and
+// linked into a global list that is only ever prepended to, and are never
+// freed. Older events are overwritten when a ring wraps around.
+#define TRACE_RING_SIZE 16384
+
+struct TraceEvent {
+  const char* name;
+  unsigned long long begin;
+  unsigned long long end;
+};
+
+struct TraceRing {
+  struct TraceRing* next;
+  long tid;
+  atomic_size_t head;
+  struct TraceEvent events[TRACE_RING_SIZE];
+};
+
+static atomic_bool g_enabled;
+static _Atomic(struct TraceRing*) g_rings;
+static thread_local struct TraceRing* g_ring;
+
+void TraceEnable(void) { atomic_store(&g_enabled, true); }
+
+unsigned long long TraceBegin(void) {
+  if (!atomic_load_explicit(&g_enabled, memory_order_relaxed)) return 0;
+  return MicrosNow();
+}
+
+static struct TraceRing* GetRing(void) {
+  if (g_ring) return g_ring;
+  struct TraceRing* ring = calloc(1, sizeof(struct TraceRing));
+  if (!ring) {
+    LOG("Failed to allocate trace ring (%s)", strerror(errno));
+    return NULL;
+  }
+  ring->tid = syscall(SYS_gettid);
+  ring->next = atomic_load(&g_rings);
+  while (!atomic_compare_exchange_weak(&g_rings, &ring->next, ring));
+  g_ring = ring;
+  return ring;
+}
+
+static void Record(const char* name, unsigned long long begin,
+                   unsigned long long end) {
+  struct TraceRing* ring = GetRing();
+  if (!ring) return;
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  ring->events[head % TRACE_RING_SIZE] = (struct TraceEvent){
+      .name = name,
+      .begin = begin,
+      .end = end,
+  };
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void TraceEnd(const char* name, unsigned long long begin) {
+  if (!begin) return;
+  Record(name, begin, MicrosNow());
+}
+
+void TraceMark(const char* name) {
+  if (!atomic_load_explicit(&g_enabled, memory_order_relaxed)) return;
+  Record(name, MicrosNow(), 0);
+}
+
+static size_t DumpRing(FILE* file, struct TraceRing* ring, size_t count) {
+  // mburakov: Writer might be wrapping around while the ring is dumped, so
+  // after copying events anything that could have been overwritten is
+  // discarded. Copying is what makes this safe, the ring itself is never
+  // locked. The fence keeps the copying from being reordered past the second
+  // head load, and the event at new_head might be half-written already, so
+  // the slot it shares is discarded as well.
+  static struct TraceEvent events[TRACE_RING_SIZE];
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  size_t tail = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+  for (size_t i = tail; i < head; i++)
+    events[i % TRACE_RING_SIZE] = ring->events[i % TRACE_RING_SIZE];
+  atomic_thread_fence(memory_order_acquire);
+  size_t new_head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  if (new_head + 1 - tail > TRACE_RING_SIZE)
+    tail = new_head + 1 - TRACE_RING_SIZE;
+
+  for (size_t i = tail; i < head; i++) {
+    const struct TraceEvent* event = &events[i % TRACE_RING_SIZE];
+    fprintf(file, "%s\n{\"name\":\"%s\",\"pid\":%d,\"tid\":%ld,\"ts\":%llu,",
+            count++ ? "," : "", event->name, getpid(), ring->tid,
+            event->begin);
+    if (!event->end) {
+      fprintf(file, "\"ph\":\"i\",\"s\":\"t\"}");
+    } else {
+      fprintf(file, "\"ph\":\"X\",\"dur\":%llu}", event->end - event->begin);
+    }
+  }
+  return count;
+}
+
+bool TraceDump(const char* path) {
+  FILE* file = fopen(path, "w");
+  if (!file) {
+    LOG("Failed to open %s (%s)", path, strerror(errno));
+    return false;
+  }
+
+  size_t count = 0;
+  fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  for (struct TraceRing* it = atomic_load(&g_rings); it; it = it->next)
+    count = DumpRing(file, it, count);
+  fprintf(file, "\n]}\n");
+
+  if (fclose(file)) {
+    LOG("Failed to write %s (%s)", path, strerror(errno));
+    return false;
+  }
+  LOG("Dumped %zu trace events to %s", count, path);
+  return true;
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2024 Mikhail Burakov. This file is part of streamer.
+ *
+ * streamer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * streamer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with streamer.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef STREAMER_TRACE_H_
+#define STREAMER_TRACE_H_
+
+#include <stdbool.h>
+
+// mburakov: Tracing is disabled until explicitly enabled, and costs a single
+// atomic load per call in this case. Event names must be string literals,
+// since only pointers to those are recorded.
+
+void TraceEnable(void);
+unsigned long long TraceBegin(void);
+void TraceEnd(const char* name, unsigned long long begin);
+void TraceMark(const char* name);
+bool TraceDump(const char* path);
+
+#endif  // STREAMER_TRACE_H_